@@ -11,7 +11,7 @@
 	Dependencies :
 	------------
 
-	scancmdr.dll : scancmdr.c scancmdr.h
+	scancmdr.dll : scancmdr.c scancmdr.h (link with -lpthread)
 
 	Author Information :
 	------------------
@@ -22,19 +22,36 @@
 	Columbia University
    ============================================================================================== */
 
+#define _POSIX_C_SOURCE 200809L		//clock_gettime, the monotonic clock and condattr clocks under -std=c11
+#define _DEFAULT_SOURCE				//glibc: keeps the extensions _POSIX_C_SOURCE alone would hide
+#define _DARWIN_C_SOURCE			//macOS: the same for nanosleep, cfmakeraw and CRTSCTS of the serial link
+#define _FILE_OFFSET_BITS 64		//64-bit ftello/fseeko offsets for archives past 2 GB on 32-bit hosts
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
 #include <math.h>
+#include <limits.h>
+#include <time.h>
 #include <complex.h>
+#include <pthread.h>
+#ifndef __WIN32__
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#endif
 
 #include "scancmdr.h"
 
 #ifdef __WIN32__
 #include <windows.h>
+#include <io.h>
 	BOOL WINAPI DllMain(HANDLE hModule,DWORD dwFunction,LPVOID lpNot){
 	    return TRUE;
 	}
@@ -43,12 +60,137 @@
 #define EXPORT
 #endif
 
+#ifdef __WIN32__
+#define fileTell _ftelli64			//64-bit file offsets, for archives and sources past 2 GB
+#define fileSeek _fseeki64
+#else
+#define fileTell ftello
+#define fileSeek fseeko
+#endif
+
 #ifdef __cplusplus
 extern "C"{
 #endif
 
 /* FUNCTION DEFINITIONS ==========================================================================*/
 
+static enum TrigIn pacedEdge(enum Trigger Trig){
+	//Edge that advances an externally paced protocol to the next target
+	return (Trig == T_PACED_FALLING) ? FALLING : RISING;
+}
+
+EXPORT int64_t moveDistance(struct gCoord* From, struct gCoord* To){
+	//Galvos move independently, so the longer of the two axis moves sets the settle time
+	int64_t dX = llabs(To->X - From->X);
+	int64_t dY = llabs(To->Y - From->Y);
+	return (dX > dY) ? dX : dY;
+}
+
+/* Session metrics (export functions in the METRICS section).  Counters are only ever added to with
+   relaxed atomics, so builders on several threads never contend on a lock. */
+
+#define METRIC_BUCKETS 10			//Latency histogram buckets, 50 us to 13 s in powers of 4
+#define METRIC_DEVICE_CODES 16		//Device status codes counted separately; others share one counter
+
+static const uint64_t MetricBounds[METRIC_BUCKETS] = {50,200,800,3200,12800,51200,204800,819200,3276800,13107200};
+
+typedef struct MetricHist{			//Latency histogram, microseconds
+	uint64_t Buckets[METRIC_BUCKETS+1];	//Per bucket (not cumulative); last is +Inf
+	uint64_t Sum;
+} MetricHist;
+
+static struct{
+	uint64_t Builds;
+	uint64_t BuildFailures;
+	uint64_t CmdsBuilt;
+	uint64_t BytesBuilt;
+	uint64_t TrigInFailures;
+	uint64_t ExposureFailures;
+	uint64_t ExposureDelays;
+	uint64_t RigHits;
+	uint64_t RigMisses;
+	uint64_t ArchiveHits;
+	uint64_t ArchiveMisses;
+	uint64_t Uploads;
+	uint64_t UploadBytes;
+	uint64_t UploadFallbacks;
+	uint64_t LinkErrors;
+	uint64_t DeviceErrors[METRIC_DEVICE_CODES];	//By status code; [0] counts codes out of range
+	MetricHist BuildTime;
+	MetricHist UploadTime;
+} Metrics;
+
+static void metricAdd(uint64_t* pCounter, uint64_t Count){
+	__atomic_fetch_add(pCounter,Count,__ATOMIC_RELAXED);
+}
+
+static void metricObserve(MetricHist* pHist, uint64_t Micros){
+	int b = 0;
+	while(b < METRIC_BUCKETS && Micros > MetricBounds[b]){
+		b++;
+	}
+	metricAdd(&pHist->Buckets[b],1);
+	metricAdd(&pHist->Sum,Micros);
+}
+
+static uint64_t metricClock(){
+	//Monotonic time, microseconds
+#ifdef __WIN32__
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint64_t)(count.QuadPart/(double)freq.QuadPart*1e6);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec*1000000 + (uint64_t)ts.tv_nsec/1000;
+#endif
+}
+
+static int checkBuild(ScanProt* pProt, RigProfile* pRig, int Compact){
+	//Common checks of the builders: trigger waits, exposure limits and optional move compaction.
+	//Returns 0 or -1, and records a failure or the exposure delays in the session metrics.
+	int delays = -1;
+	if(checkTrigIn(pProt) != 0){
+		metricAdd(&Metrics.TrigInFailures,1);
+	}else if((delays = limitExposure(pProt,pRig,NULL)) < 0){
+		metricAdd(&Metrics.ExposureFailures,1);
+	}else if(!Compact || compactMoves(pProt,pRig->MoveResync) >= 0){
+		metricAdd(&Metrics.ExposureDelays,(uint64_t)delays);
+		return 0;
+	}
+	return -1;
+}
+
+static void recordBuild(ScanProt* pProt, size_t Bytes, int Built, uint64_t Start){
+	if(Built){
+		metricAdd(&Metrics.Builds,1);
+		metricAdd(&Metrics.CmdsBuilt,pProt->NumCmds);
+		metricAdd(&Metrics.BytesBuilt,Bytes);
+	}else{
+		metricAdd(&Metrics.BuildFailures,1);
+	}
+	metricObserve(&Metrics.BuildTime,metricClock() - Start);
+}
+
+static char* finishBuild(ScanProt* pProt, RigProfile* pRig, int Compact, uint64_t Start){
+	//Common tail of the builders: checks and serialization.  Frees the protocol and records the
+	//build in the session metrics.
+	char* protocolString = (checkBuild(pProt,pRig,Compact) == 0) ? ProtToString(pProt) : NULL;
+	recordBuild(pProt,(protocolString != NULL) ? strlen(protocolString) : 0,protocolString != NULL,Start);
+	freeProtocol(pProt);
+	return protocolString;
+}
+
+EXPORT char* finishProtocol(ScanProt* pProtocol, struct RigProfile* Rig, int Compact){
+	//finishBuild for a protocol assembled outside the builders (e.g. by scancmdr.hpp): the same
+	//checks and metrics, without freeing it.  The build time recorded covers only this tail.
+	RigProfile rig = (Rig != NULL) ? *Rig : defaultRigProfile();
+	uint64_t start = metricClock();
+	char* protocolString = (checkBuild(pProtocol,&rig,Compact) == 0) ? ProtToString(pProtocol) : NULL;
+	recordBuild(pProtocol,(protocolString != NULL) ? strlen(protocolString) : 0,protocolString != NULL,start);
+	return protocolString;
+}
 
 /* PROTOCOL BUILDING FUNCTIONS */
 
@@ -64,8 +206,27 @@ EXPORT char* buildSpot(uint32_t Baseline,
                 int64_t ScaleFactor,
                 struct Coord* CenterOffset,
                 enum Trigger* Trig){
+	/* Convert time parameters from milliseconds to cycles */
+	return buildSpotCycles(Baseline*CYCLES_PER_MS,TimeOn*CYCLES_PER_MS,NumPulses,ISI*CYCLES_PER_MS,
+			EpisodePeriod*CYCLES_PER_MS,Reps,Pos,ScaleFactor,CenterOffset,Trig,NULL);
+}
 
-    /* Time conversions */
+EXPORT char* buildSpotCycles(uint32_t Baseline,
+                uint32_t TimeOn,
+                uint16_t NumPulses,
+                uint32_t ISI,
+                uint32_t EpisodePeriod,
+                uint16_t Reps,
+                struct Coord* Pos,
+                int64_t ScaleFactor,
+                struct Coord* CenterOffset,
+                enum Trigger* Trig,
+                struct RigProfile* Rig){
+
+	uint64_t buildStart = metricClock();
+	RigProfile rig = (Rig != NULL) ? *Rig : defaultRigProfile();	//Rig timing and channel map
+
+    /* Timing coercion (all times in cycles) */
 	/* Coerce inter-stimulus interval (ISI) to pulse-width if pulse-width > ISI. */
 
     if(ISI < TimeOn){
@@ -78,25 +239,23 @@ EXPORT char* buildSpot(uint32_t Baseline,
 		EpisodePeriod = (Baseline+NumPulses*ISI);
 	}
 
-	/* Convert time parameters from milliseconds to cycles */
-
-	Baseline = Baseline * CYCLES_PER_MS;
-    TimeOn = TimeOn * CYCLES_PER_MS;
-	ISI = ISI * CYCLES_PER_MS;
-	EpisodePeriod = EpisodePeriod * CYCLES_PER_MS;
-
 	uint32_t Time0 = 0;											//Set start time
-    uint32_t EndTime = Time0+(EpisodePeriod*Reps)+PROT_PERIOD;	//Calculate end time
-    uint32_t PulseStart = Time0 + Baseline;						//Calculate pulse start
+	uint32_t EpisodeStart = Time0 + rig.TimeOffset;				//Keeps trigger waits out of cycle 0
+    uint32_t EndTime = EpisodeStart+EpisodePeriod+rig.ProtPeriod;	//End of one episode (loop ends take one iteration)
+    uint32_t PulseStart = EpisodeStart + Baseline;				//Calculate pulse start
 
     /* Coordinate conversions - pixel-space to galvo-space */
 
     gCoord galvoCoord = convertCoord(Pos,ScaleFactor,CenterOffset,0);
 
-    ScanProt* pSpotProt = createProtocol();						//Initialize protocol (linked list)
+    ScanProt* pSpotProt = createProtocol();						//Initialize protocol (command array)
+    if(reserveCmds(pSpotProt,countSpotCmds(NumPulses,Trig)) != 0){	//Single allocation, exact size
+        freeProtocol(pSpotProt);
+        return NULL;
+    }
 
-    appendMove(pSpotProt,X,Time0,galvoCoord.X);					//Move to position (X)
-    appendMove(pSpotProt,Y,Time0,galvoCoord.Y);					//Move to position (Y)
+    appendMove(pSpotProt,rig.ChanX,Time0,galvoCoord.X);					//Move to position (X)
+    appendMove(pSpotProt,rig.ChanY,Time0,galvoCoord.Y);					//Move to position (Y)
 
     /* Start master loop */
 	appendLoop(pSpotProt,START,Time0,Reps);
@@ -105,19 +264,23 @@ EXPORT char* buildSpot(uint32_t Baseline,
         case T_NONE:
             break;												//Do nothing.
         case T_IN:
-            appendTrigIn(pSpotProt,Time0,RISING);				//Wait for rising trigger (at T=0)
+            appendTrigIn(pSpotProt,EpisodeStart,RISING);		//Wait for rising trigger
             break;
         case T_OUT:
-            appendTrigOut(pSpotProt,Time0,TH_DL);				//Send trigger out
-            appendTrigOut(pSpotProt,Time0+TRIG_LEN,TL_DL);
+            appendTrigOut(pSpotProt,EpisodeStart,TH_DL);		//Send trigger out
+            appendTrigOut(pSpotProt,EpisodeStart+rig.TrigLen,TL_DL);
+            break;
+        case T_PACED_RISING:
+        case T_PACED_FALLING:
+            appendTrigIn(pSpotProt,EpisodeStart,pacedEdge(*Trig));	//Wait for selected edge
             break;
     }
 
 	/* Add single pulse or pulse train */
 
     if (NumPulses == 1){
-        appendTrigOut(pSpotProt,Time0+Baseline,TL_DH);
-        appendTrigOut(pSpotProt,Time0+Baseline+TimeOn,TL_DL);
+        appendTrigOut(pSpotProt,PulseStart,TL_DH);
+        appendTrigOut(pSpotProt,PulseStart+TimeOn,TL_DL);
     }else{
         appendLoop(pSpotProt,START,PulseStart,NumPulses);
         appendTrigOut(pSpotProt,PulseStart,TL_DH);
@@ -130,9 +293,7 @@ EXPORT char* buildSpot(uint32_t Baseline,
 
     appendLoop(pSpotProt,END,EndTime,Reps);
 
-    char* protocolString = ProtToString(pSpotProt);
-    clearProtocol(pSpotProt);
-    return protocolString;
+    return finishBuild(pSpotProt,&rig,0,buildStart);
 
 }
 
@@ -152,8 +313,32 @@ EXPORT char* buildGrid(uint32_t Baseline,
                     struct Coord* CenterOffset,
 					enum Trigger* Trig,
 					double RotAngle){
+	/* Convert time parameters from milliseconds to cycles */
+	return buildGridCycles(Baseline*CYCLES_PER_MS,TimeOn*CYCLES_PER_MS,NumPulses,ISI*CYCLES_PER_MS,
+			Iterations,EpisodePeriod*CYCLES_PER_MS,Reps,Dims,StartPos,Spacing,ScaleFactor,CenterOffset,
+			Trig,RotAngle,NULL);
+}
+
+EXPORT char* buildGridCycles(uint32_t Baseline,
+					uint32_t TimeOn,
+					uint16_t NumPulses,
+					uint32_t ISI,
+					uint32_t Iterations,
+					uint32_t EpisodePeriod,
+					uint16_t Reps,
+					struct Coord* Dims,
+					struct Coord* StartPos,
+					struct Coord* Spacing,
+					int64_t ScaleFactor,
+                    struct Coord* CenterOffset,
+					enum Trigger* Trig,
+					double RotAngle,
+					struct RigProfile* Rig){
 
-	/* Time conversions */
+	uint64_t buildStart = metricClock();
+	RigProfile rig = (Rig != NULL) ? *Rig : defaultRigProfile();	//Rig timing and channel map
+
+	/* Timing coercion (all times in cycles) */
     if(ISI < TimeOn){
 		ISI = TimeOn;
 	}
@@ -161,17 +346,15 @@ EXPORT char* buildGrid(uint32_t Baseline,
 		EpisodePeriod = (Baseline+NumPulses*ISI);
 	}
 
-	Baseline = Baseline * CYCLES_PER_MS;
-    TimeOn = TimeOn * CYCLES_PER_MS;
-	ISI = ISI * CYCLES_PER_MS;
-	EpisodePeriod = EpisodePeriod * CYCLES_PER_MS * Iterations;
+	uint32_t SpotPeriod = EpisodePeriod;							//One iteration at a spot
+	EpisodePeriod = EpisodePeriod * Iterations;
 
 	uint32_t Time0 = 0;
-	uint32_t EpisodeStart = Time0 + TIME_OFFSET;
+	uint32_t EpisodeStart = Time0 + rig.TimeOffset;
 	uint32_t PulseStart = EpisodeStart + Baseline;
 	uint32_t XMoveTime = EpisodeStart + EpisodePeriod;
 	uint32_t YMoveTime = EpisodeStart + (Dims->X*EpisodePeriod);
-	uint32_t EndTime = EpisodeStart + Dims->X*Dims->Y*EpisodePeriod + PROT_PERIOD;
+	uint32_t EndTime = EpisodeStart + Dims->X*Dims->Y*EpisodePeriod + rig.ProtPeriod;
 
 	gCoord gStartPos;
 	gCoord gSpacing;
@@ -217,10 +400,14 @@ EXPORT char* buildGrid(uint32_t Baseline,
 	}
 
 	ScanProt* pGridProt = createProtocol();
+	if(reserveCmds(pGridProt,countGridCmds(NumPulses,Iterations,Trig,RotAngle)) != 0){
+		freeProtocol(pGridProt);
+		return NULL;
+	}
 	/*Initialize at T=0, move to start position */								//COMMAND LIST:
 	appendLoop(pGridProt,START,Time0,Reps);										//START MASTER LOOP
-	appendMove(pGridProt,X,Time0,gStartPos.X);									//MOVE START X
-	appendMove(pGridProt,Y,Time0,gStartPos.Y);									//MOVE START Y
+	appendMove(pGridProt,rig.ChanX,Time0,gStartPos.X);									//MOVE START X
+	appendMove(pGridProt,rig.ChanY,Time0,gStartPos.Y);									//MOVE START Y
 
 	appendLoop(pGridProt,START,EpisodeStart,Dims->Y);							//Y LOOP START
 	appendLoop(pGridProt,START,EpisodeStart,Dims->X);							//X LOOP START
@@ -237,7 +424,11 @@ EXPORT char* buildGrid(uint32_t Baseline,
             break;
         case T_OUT:
             appendTrigOut(pGridProt,EpisodeStart,TH_DL);						//TRIGGER OUT START
-			appendTrigOut(pGridProt,EpisodeStart+TRIG_LEN,TL_DL);				//TRIGGER OUT END
+			appendTrigOut(pGridProt,EpisodeStart+rig.TrigLen,TL_DL);				//TRIGGER OUT END
+            break;
+        case T_PACED_RISING:
+        case T_PACED_FALLING:
+            appendTrigIn(pGridProt,EpisodeStart,pacedEdge(*Trig));				//TRIGGER IN (EDGE)
             break;
     }
 
@@ -254,30 +445,28 @@ EXPORT char* buildGrid(uint32_t Baseline,
 	}
 	/* ************************************************************ */
 	if(Iterations > 1){
-		appendLoop(pGridProt,END,EpisodeStart + EpisodePeriod,Iterations);		//CLOSE PULSE LOOP
+		appendLoop(pGridProt,END,EpisodeStart + SpotPeriod,Iterations);		//CLOSE PULSE LOOP
 	}
 
 	if(RotAngle == 0){
-		appendRel(pGridProt,XMoveTime,X,-1*gSpacing.X);							//MOVE X
+		appendRel(pGridProt,XMoveTime,rig.ChanX,-1*gSpacing.X);							//MOVE X
 		appendLoop(pGridProt,END,XMoveTime,Dims->X);							//X LOOP END
-		appendRel(pGridProt,YMoveTime,Y,gSpacing.Y);							//MOVE Y
-		appendRel(pGridProt,YMoveTime,X,gSpacing.X*Dims->X);					//MOVE X BACK
+		appendRel(pGridProt,YMoveTime,rig.ChanY,gSpacing.Y);							//MOVE Y
+		appendRel(pGridProt,YMoveTime,rig.ChanX,gSpacing.X*Dims->X);					//MOVE X BACK
 		appendLoop(pGridProt,END,YMoveTime,Dims->Y);							//MOVE Y
 	}else{
-		appendRel(pGridProt,XMoveTime,X,-1*gDeltaX1);
-		appendRel(pGridProt,XMoveTime,Y,-1*gDeltaX2);
+		appendRel(pGridProt,XMoveTime,rig.ChanX,-1*gDeltaX1);
+		appendRel(pGridProt,XMoveTime,rig.ChanY,-1*gDeltaX2);
 		appendLoop(pGridProt,END,XMoveTime,Dims->X);
-		appendRel(pGridProt,YMoveTime,X,-1*gDeltaY1);
-		appendRel(pGridProt,YMoveTime,Y,gDeltaY2);
-		appendRel(pGridProt,YMoveTime,X,gDeltaX1*Dims->X);
-		appendRel(pGridProt,YMoveTime,Y,gDeltaX2*Dims->X);
+		appendRel(pGridProt,YMoveTime,rig.ChanX,-1*gDeltaY1);
+		appendRel(pGridProt,YMoveTime,rig.ChanY,gDeltaY2);
+		appendRel(pGridProt,YMoveTime,rig.ChanX,gDeltaX1*Dims->X);
+		appendRel(pGridProt,YMoveTime,rig.ChanY,gDeltaX2*Dims->X);
 		appendLoop(pGridProt,END,YMoveTime,Dims->Y);
     }
 	appendLoop(pGridProt,END,EndTime,Reps);										//END MASTER LOOP
 
-	char* protocolString = ProtToString(pGridProt);
-    clearProtocol(pGridProt);
-    return protocolString;
+	return finishBuild(pGridProt,&rig,0,buildStart);
 }
 
 // TARGET ..........................................................................................
@@ -295,90 +484,445 @@ EXPORT char* buildTarget(const char* TargetFile,
                   struct Coord* CenterOffset,
 				  enum Trigger* Trig,
 				  double RotAngle){
+	/* Convert time parameters from milliseconds to cycles */
+	return buildTargetCycles(TargetFile,Baseline*CYCLES_PER_MS,TimeOn*CYCLES_PER_MS,NumPulses,
+			ISI*CYCLES_PER_MS,Iterations,EpisodePeriod*CYCLES_PER_MS,Reps,NumPoints,ScaleFactor,
+			CenterOffset,Trig,RotAngle,NULL);
+}
+
+EXPORT char* buildTargetCycles(const char* TargetFile,
+				  uint32_t Baseline,
+				  uint32_t TimeOn,
+				  uint16_t NumPulses,
+				  uint32_t ISI,
+				  uint32_t Iterations,
+				  uint32_t EpisodePeriod,
+				  uint16_t Reps,
+				  uint16_t NumPoints,
+				  int64_t ScaleFactor,
+                  struct Coord* CenterOffset,
+				  enum Trigger* Trig,
+				  double RotAngle,
+				  struct RigProfile* Rig){
+
+	CoordSource source;
+	if(fileSource(&source,TargetFile,NumPoints) != 0){
+		return NULL;
+	}
+	char* protocolString = buildTargetSourceCycles(&source,Baseline,TimeOn,NumPulses,ISI,Iterations,
+			EpisodePeriod,Reps,ScaleFactor,CenterOffset,Trig,RotAngle,Rig);
+	closeSource(&source);
+	return protocolString;
+}
+
+/* A target protocol is a loop start, one fixed-size block of commands per target, and a loop end.
+   Block k starts at command 1 + k*BlockCmds with the X move, whose cycle is the block's start time.
+   The streaming builder appends blocks as points arrive from a coordinate source; the editable
+   handle (TargetProt) keeps the targets so a single block can be rewritten in place and every later
+   command shifted by the change in duration, without rebuilding the rest of the protocol. */
+
+static void initTargetTiming(TargetProt* pTargets,
+				  uint32_t Baseline,
+				  uint32_t TimeOn,
+				  uint16_t NumPulses,
+				  uint32_t ISI,
+				  uint32_t Iterations,
+				  uint32_t EpisodePeriod,
+				  uint16_t Reps,
+				  enum Trigger* Trig,
+				  struct RigProfile* Rig){
+	//Coerces the timing parameters and stores them with the rig profile
 
-	/* Time conversions */
+	pTargets->Rig = (Rig != NULL) ? *Rig : defaultRigProfile();	//Rig timing and channel map
+
+	/* Timing coercion (all times in cycles) */
 	if(ISI < TimeOn){ ISI = TimeOn; }
     if(EpisodePeriod < (Baseline+NumPulses*ISI)){ EpisodePeriod = (Baseline+NumPulses*ISI); }
-	Baseline = Baseline * CYCLES_PER_MS;
-    TimeOn = TimeOn * CYCLES_PER_MS;
-	ISI = ISI * CYCLES_PER_MS;
-	EpisodePeriod = EpisodePeriod * CYCLES_PER_MS * Iterations;
+	EpisodePeriod = EpisodePeriod * Iterations;
 
+	/* Externally paced: the external edge sets the pace, so each target only needs time to move */
+	if(*Trig == T_PACED_RISING || *Trig == T_PACED_FALLING){
+		EpisodePeriod = (Baseline + NumPulses*ISI) * Iterations;
+	}
 
-	uint32_t Time0 = 0;
-	uint32_t EpisodeStart = Time0 + TIME_OFFSET;
-	uint32_t NextEpisode = 0;
-	uint32_t NextPulse = 0;
-	uint32_t EndTime = EpisodePeriod*NumPoints;
+	pTargets->Baseline = Baseline;
+	pTargets->TimeOn = TimeOn;
+	pTargets->NumPulses = NumPulses;
+	pTargets->ISI = ISI;
+	pTargets->Iterations = Iterations;
+	pTargets->EpisodePeriod = EpisodePeriod;
+	pTargets->Reps = Reps;
+	pTargets->Trig = *Trig;
+	pTargets->BlockCmds = (countTargetCmds(NumPulses,Iterations,1,Trig) - 2);
+}
+
+static uint32_t targetSettle(TargetProt* pTargets, gCoord* pPrev, gCoord* pTarget){
+	//Settle time before a target is triggered (externally paced modes only); pPrev is NULL for the
+	//first target
+	if(pTargets->Trig != T_PACED_RISING && pTargets->Trig != T_PACED_FALLING){
+		return 0;
+	}
+	if(pPrev == NULL){
+		return pTargets->Rig.MoveTime;
+	}
+	return settleCycles(&pTargets->Rig,moveDistance(pPrev,pTarget));
+}
+
+static uint32_t appendTargetBlock(TargetProt* pTargets, ScanProt* pProt, gCoord* pPrev, gCoord* pTarget, uint32_t NextEpisode){
+	//Appends the command block of one target starting at NextEpisode; returns the next start time
+	RigProfile* rig = &pTargets->Rig;
+	uint32_t NextTrig = NextEpisode + targetSettle(pTargets,pPrev,pTarget);
+	uint32_t NextPulse = NextTrig + pTargets->Baseline;
+	appendMove(pProt,rig->ChanX,NextEpisode,pTarget->X);
+	appendMove(pProt,rig->ChanY,NextEpisode,pTarget->Y);
+	if(pTargets->Iterations > 1){
+		appendLoop(pProt,START,NextTrig,pTargets->Iterations);	//Open loop, iterations at spot
+	}
 
-	Coord pCoordArr[NumPoints];
-	gCoord gCoordArr[NumPoints];
+	switch(pTargets->Trig){   //Trigger before episode
+		case T_NONE:
+			break;	//Do nothing.
+		case T_IN:
+			appendTrigIn(pProt,NextEpisode,RISING);
+			break;
+		case T_OUT:
+			appendTrigOut(pProt,NextEpisode,TH_DL);
+			appendTrigOut(pProt,NextEpisode+rig->TrigLen,TL_DL);
+			break;
+		case T_PACED_RISING:
+		case T_PACED_FALLING:
+			appendTrigIn(pProt,NextTrig,pacedEdge(pTargets->Trig));	//Wait for edge once settled
+			break;
+	}
 
-	getCoords(TargetFile,NumPoints,pCoordArr);
+	/* Single pulse or train of pulses *****************************/
+	if(pTargets->NumPulses == 1){
+		appendTrigOut(pProt,NextPulse,TL_DH);
+		appendTrigOut(pProt,NextPulse+pTargets->TimeOn,TL_DL);
+	}else{
+		appendLoop(pProt,START,NextPulse,pTargets->NumPulses);
+		appendTrigOut(pProt,NextPulse,TL_DH);
+		appendTrigOut(pProt,NextPulse+pTargets->TimeOn,TL_DL);
+		appendLoop(pProt,END,NextPulse+pTargets->ISI,pTargets->NumPulses);
+	}
+	/* *************************************************************/
+	if(pTargets->Iterations > 1){
+		appendLoop(pProt,END,NextTrig + pTargets->EpisodePeriod/pTargets->Iterations,pTargets->Iterations);
+		//Close loop after one iteration at spot; the next block starts once all of them have run
+	}
+	return NextTrig + pTargets->EpisodePeriod;
+}
 
+static int nextTarget(CoordSource* pSrc, Coord* pCentroid, int64_t ScaleFactor, struct Coord* CenterOffset,
+				  double RotAngle, gCoord* pTarget){
+	//Next point of a source in galvo coordinates (rotated about pCentroid first); 0 at the end
+	Coord pixel;
+	if(nextCoord(pSrc,&pixel) != 1){
+		return 0;
+	}
 	/*Apply rotation before converting to galvo coordinates*/
 	if (RotAngle != 0){
-		Coord centroid = getCentroid(NumPoints,pCoordArr);
-		int i;
-		for (i=0;i < NumPoints;i++){
-			pCoordArr[i] = rotateCoord(&pCoordArr[i],&centroid,RotAngle);
-		}
+		pixel = rotateCoord(&pixel,pCentroid,RotAngle);
 	}
+	*pTarget = convertCoord(&pixel,ScaleFactor,CenterOffset,0);
+	return 1;
+}
 
-	int j;
-	for(j=0; j < NumPoints; j++){
-		gCoordArr[j] = convertCoord(&pCoordArr[j],ScaleFactor,CenterOffset,0);
+static ScanProt* targetSourceProt(CoordSource* pSrc,
+				  uint32_t Baseline,
+				  uint32_t TimeOn,
+				  uint16_t NumPulses,
+				  uint32_t ISI,
+				  uint32_t Iterations,
+				  uint32_t EpisodePeriod,
+				  uint16_t Reps,
+				  int64_t ScaleFactor,
+                  struct Coord* CenterOffset,
+				  enum Trigger* Trig,
+				  double RotAngle,
+				  struct RigProfile* Rig,
+				  RigProfile* pResolved){
+	//Target protocol from a source, before the checks of finishBuild; pResolved receives the rig
+	//profile the timing was taken from (Rig, or the defaults)
+	TargetProt timing;
+	memset(&timing,0,sizeof(timing));
+	initTargetTiming(&timing,Baseline,TimeOn,NumPulses,ISI,Iterations,EpisodePeriod,Reps,Trig,Rig);
+	Coord centroid = {0,0};
+	if (RotAngle != 0){
+		centroid = sourceCentroid(pSrc);
 	}
 
 	ScanProt* pTargetProt = createProtocol();
+	if(pTargetProt == NULL || reserveCmds(pTargetProt,2 + pSrc->Count*timing.BlockCmds) != 0){
+		freeProtocol(pTargetProt);
+		return NULL;
+	}
+
+	uint32_t Time0 = 0;
+	uint32_t EpisodeStart = Time0 + timing.Rig.TimeOffset;
+	uint32_t NextEpisode = EpisodeStart;
 
 	/* Initialize at T=0 */
 	appendLoop(pTargetProt,START,Time0,Reps);
-	/* Loop through array of coordinates */
-	int k;
-	for(k = 0; k < NumPoints; k++){
-		NextEpisode = EpisodeStart + (k*EpisodePeriod);
-		NextPulse = NextEpisode + Baseline;
-		appendMove(pTargetProt,X,NextEpisode,gCoordArr[k].X);
-		appendMove(pTargetProt,Y,NextEpisode,gCoordArr[k].Y);
-		if(Iterations > 1){
-			appendLoop(pTargetProt,START,NextEpisode,Iterations);	//Open loop, iterations at spot
-		}
-
-		switch(*Trig){   //Trigger before episode
-			case T_NONE:
-				break;	//Do nothing.
-			case T_IN:
-				appendTrigIn(pTargetProt,NextEpisode,RISING);
-				break;
-			case T_OUT:
-				appendTrigOut(pTargetProt,NextEpisode,TH_DL);
-				appendTrigOut(pTargetProt,NextEpisode+TRIG_LEN,TL_DL);
-				break;
-		}
+	/* Stream the coordinates, one block per target */
+	gCoord prev;
+	gCoord target;
+	int k = 0;
+	resetSource(pSrc);
+	while(nextTarget(pSrc,&centroid,ScaleFactor,CenterOffset,RotAngle,&target)){
+		NextEpisode = appendTargetBlock(&timing,pTargetProt,(k > 0) ? &prev : NULL,&target,NextEpisode);
+		prev = target;
+		k++;
+	}
+    appendLoop(pTargetProt,END,NextEpisode,Reps);					//After the last block, settle times included
+	*pResolved = timing.Rig;
+	return pTargetProt;
+}
 
-		/* Single pulse or train of pulses *****************************/
-		if(NumPulses == 1){
-			appendTrigOut(pTargetProt,NextPulse,TL_DH);
-			appendTrigOut(pTargetProt,NextPulse+TimeOn,TL_DL);
-		}else{
-			appendLoop(pTargetProt,START,NextPulse,NumPulses);
-			appendTrigOut(pTargetProt,NextPulse,TL_DH);
-			appendTrigOut(pTargetProt,NextPulse+TimeOn,TL_DL);
-			appendLoop(pTargetProt,END,NextPulse+(NumPulses*ISI),NumPulses);
+EXPORT char* buildTargetSourceCycles(CoordSource* pSrc,
+				  uint32_t Baseline,
+				  uint32_t TimeOn,
+				  uint16_t NumPulses,
+				  uint32_t ISI,
+				  uint32_t Iterations,
+				  uint32_t EpisodePeriod,
+				  uint16_t Reps,
+				  int64_t ScaleFactor,
+                  struct Coord* CenterOffset,
+				  enum Trigger* Trig,
+				  double RotAngle,
+				  struct RigProfile* Rig){
+
+	uint64_t buildStart = metricClock();
+	RigProfile rig;
+	ScanProt* pTargetProt = targetSourceProt(pSrc,Baseline,TimeOn,NumPulses,ISI,Iterations,EpisodePeriod,Reps,
+											 ScaleFactor,CenterOffset,Trig,RotAngle,Rig,&rig);
+	if(pTargetProt == NULL){
+		return NULL;
+	}
+	return finishBuild(pTargetProt,&rig,1,buildStart);
+}
+
+EXPORT TargetProt* buildSourceProt(CoordSource* pSrc,
+				  uint32_t Baseline,
+				  uint32_t TimeOn,
+				  uint16_t NumPulses,
+				  uint32_t ISI,
+				  uint32_t Iterations,
+				  uint32_t EpisodePeriod,
+				  uint16_t Reps,
+				  int64_t ScaleFactor,
+                  struct Coord* CenterOffset,
+				  enum Trigger* Trig,
+				  double RotAngle,
+				  struct RigProfile* Rig){
+	//Editable target protocol from any coordinate source (at most UINT16_MAX targets)
+
+	if(pSrc->Count > UINT16_MAX){
+		fprintf(stderr,"Target protocol is limited to %d targets.\n",UINT16_MAX);
+		return NULL;
+	}
+	TargetProt* pTargets = calloc(1,sizeof(TargetProt));
+	if(pTargets == NULL){
+		perror("Failure to create target protocol (allocation error) - ");
+		return NULL;
+	}
+	initTargetTiming(pTargets,Baseline,TimeOn,NumPulses,ISI,Iterations,EpisodePeriod,Reps,Trig,Rig);
+	pTargets->ScaleFactor = ScaleFactor;
+	pTargets->CenterOffset = *CenterOffset;
+	pTargets->RotAngle = RotAngle;
+	if (RotAngle != 0){
+		pTargets->Centroid = sourceCentroid(pSrc);
+	}
+
+	uint16_t NumPoints = (uint16_t)pSrc->Count;
+	pTargets->pTargets = malloc((NumPoints > 0 ? NumPoints : 1)*sizeof(gCoord));
+	pTargets->pProt = createProtocol();
+	pTargets->pScratch = createProtocol();
+	if(pTargets->pTargets == NULL || pTargets->pProt == NULL || pTargets->pScratch == NULL
+			|| reserveCmds(pTargets->pProt,2 + NumPoints*pTargets->BlockCmds) != 0){
+		freeTargetProt(pTargets);
+		return NULL;
+	}
+	pTargets->MaxTargets = NumPoints;
+
+	uint32_t Time0 = 0;
+	uint32_t EpisodeStart = Time0 + pTargets->Rig.TimeOffset;
+	uint32_t NextEpisode = EpisodeStart;
+	gCoord* pList = pTargets->pTargets;
+
+	/* Initialize at T=0 */
+	appendLoop(pTargets->pProt,START,Time0,Reps);
+	/* Loop through the coordinates, keeping each target for later edits */
+	uint16_t k = 0;
+	resetSource(pSrc);
+	while(k < NumPoints && nextTarget(pSrc,&pTargets->Centroid,ScaleFactor,CenterOffset,RotAngle,&pList[k])){
+		NextEpisode = appendTargetBlock(pTargets,pTargets->pProt,(k > 0) ? &pList[k-1] : NULL,&pList[k],NextEpisode);
+		k++;
+	}
+	pTargets->NumTargets = k;
+    appendLoop(pTargets->pProt,END,NextEpisode,Reps);
+	return pTargets;
+}
+
+EXPORT TargetProt* buildTargetProt(const char* TargetFile,
+				  uint32_t Baseline,
+				  uint32_t TimeOn,
+				  uint16_t NumPulses,
+				  uint32_t ISI,
+				  uint32_t Iterations,
+				  uint32_t EpisodePeriod,
+				  uint16_t Reps,
+				  uint16_t NumPoints,
+				  int64_t ScaleFactor,
+                  struct Coord* CenterOffset,
+				  enum Trigger* Trig,
+				  double RotAngle,
+				  struct RigProfile* Rig){
+
+	CoordSource source;
+	if(fileSource(&source,TargetFile,NumPoints) != 0){
+		return NULL;
+	}
+	TargetProt* pTargets = buildSourceProt(&source,Baseline,TimeOn,NumPulses,ISI,Iterations,
+			EpisodePeriod,Reps,ScaleFactor,CenterOffset,Trig,RotAngle,Rig);
+	closeSource(&source);
+	return pTargets;
+}
+
+static uint32_t blockStart(TargetProt* pTargets, uint16_t k){
+	//Start time of block k; for k == NumTargets, the time after the last block
+	ScanProt* pProt = pTargets->pProt;
+	if(k < pTargets->NumTargets){
+		return cmdCycle(&pProt->pCmds[1 + k*pTargets->BlockCmds]);
+	}
+	return cmdCycle(&pProt->pCmds[pProt->NumCmds-1]);
+}
+
+static int spliceTargets(TargetProt* pTargets, uint16_t first, uint16_t numOld, gCoord* pNew, uint16_t numNew){
+	//Replaces targets [first, first+numOld) by numNew new targets.  The new blocks and the block of
+	//the target that follows them (whose settle time depends on its predecessor) are regenerated;
+	//all later commands are moved and shifted by the change in duration.
+	uint32_t numTargets = pTargets->NumTargets - numOld + numNew;
+	if(numTargets > UINT16_MAX){
+		fprintf(stderr,"Target protocol is limited to %d targets.\n",UINT16_MAX);
+		return -1;
+	}
+	if(numTargets > pTargets->MaxTargets){
+		uint32_t maxTargets = (2*pTargets->MaxTargets > numTargets) ? 2*pTargets->MaxTargets : numTargets;
+		if(maxTargets > UINT16_MAX){ maxTargets = UINT16_MAX; }
+		gCoord* pGrown = realloc(pTargets->pTargets,maxTargets*sizeof(gCoord));
+		if(pGrown == NULL){
+			perror("Failure to grow target list - ");
+			return -1;
 		}
-		/* *************************************************************/
-		if(Iterations > 1){
-			appendLoop(pTargetProt,END,NextEpisode + EpisodePeriod,Iterations);
-			//Close loop, iterations at spot
+		pTargets->pTargets = pGrown;
+		pTargets->MaxTargets = (uint16_t)maxTargets;
+	}
+	if(reserveCmds(pTargets->pProt,2 + numTargets*pTargets->BlockCmds) != 0){
+		return -1;
+	}
+
+	/* Old extent: replaced blocks plus the following one, if any */
+	uint16_t oldEnd = first + numOld + ((first + numOld < pTargets->NumTargets) ? 1 : 0);
+	uint32_t startTime = blockStart(pTargets,first);
+	uint32_t oldEndTime = blockStart(pTargets,oldEnd);
+
+	/* Update target list */
+	gCoord* pList = pTargets->pTargets;
+	memmove(&pList[first+numNew],&pList[first+numOld],(pTargets->NumTargets-first-numOld)*sizeof(gCoord));
+	if(numNew > 0){
+		memcpy(&pList[first],pNew,numNew*sizeof(gCoord));
+	}
+	uint16_t newEnd = first + numNew + ((first + numNew < numTargets) ? 1 : 0);
+
+	/* Regenerate the affected blocks */
+	ScanProt* pScratch = pTargets->pScratch;
+	pScratch->NumCmds = 0;
+	uint32_t NextEpisode = startTime;
+	pTargets->NumTargets = numTargets;
+	uint16_t k;
+	for(k = first; k < newEnd; k++){
+		NextEpisode = appendTargetBlock(pTargets,pScratch,(k > 0) ? &pList[k-1] : NULL,&pList[k],NextEpisode);
+	}
+	int64_t shift = (int64_t)NextEpisode - (int64_t)oldEndTime;
+
+	/* Move the tail (remaining blocks and loop end) and shift its cycles */
+	ScanProt* pProt = pTargets->pProt;
+	uint32_t oldTail = 1 + (uint32_t)oldEnd*pTargets->BlockCmds;
+	uint32_t newTail = 1 + (uint32_t)newEnd*pTargets->BlockCmds;
+	uint32_t tailCmds = pProt->NumCmds - oldTail;
+	memmove(&pProt->pCmds[newTail],&pProt->pCmds[oldTail],tailCmds*sizeof(PackedCmd));
+	memcpy(&pProt->pCmds[1 + first*pTargets->BlockCmds],pScratch->pCmds,pScratch->NumCmds*sizeof(PackedCmd));
+	pProt->NumCmds = newTail + tailCmds;
+	if(shift != 0){
+		uint32_t i;
+		for(i = newTail; i < pProt->NumCmds; i++){
+			PackedCmd* pCmd = &pProt->pCmds[i];
+			pCmd->Head = (pCmd->Head & ~CMD_CYCLE_MASK) | ((uint64_t)(cmdCycle(pCmd) + shift) & CMD_CYCLE_MASK);
 		}
-	} //for loop
-    appendLoop(pTargetProt,END,EndTime,Reps);
+	}
+	return 0;
+}
+
+static gCoord targetCoord(TargetProt* pTargets, struct Coord* Pos){
+	//Converts a new target like those read from the file (same rotation and scaling)
+	Coord pixel = *Pos;
+	if(pTargets->RotAngle != 0){
+		pixel = rotateCoord(&pixel,&pTargets->Centroid,pTargets->RotAngle);
+	}
+	return convertCoord(&pixel,pTargets->ScaleFactor,&pTargets->CenterOffset,0);
+}
+
+EXPORT int insertTarget(TargetProt* pTargets, uint16_t k, struct Coord* Pos){
+	//Inserts a target before target k (k == number of targets appends)
+	if(k > pTargets->NumTargets){
+		fprintf(stderr,"Cannot insert target %d, protocol has %d targets.\n",k,pTargets->NumTargets);
+		return -1;
+	}
+	gCoord target = targetCoord(pTargets,Pos);
+	return spliceTargets(pTargets,k,0,&target,1);
+}
 
+EXPORT int removeTarget(TargetProt* pTargets, uint16_t k){
+	if(k >= pTargets->NumTargets){
+		fprintf(stderr,"Cannot remove target %d, protocol has %d targets.\n",k,pTargets->NumTargets);
+		return -1;
+	}
+	return spliceTargets(pTargets,k,1,NULL,0);
+}
+
+EXPORT int moveTarget(TargetProt* pTargets, uint16_t k, struct Coord* Pos){
+	if(k >= pTargets->NumTargets){
+		fprintf(stderr,"Cannot move target %d, protocol has %d targets.\n",k,pTargets->NumTargets);
+		return -1;
+	}
+	gCoord target = targetCoord(pTargets,Pos);
+	return spliceTargets(pTargets,k,1,&target,1);
+}
+
+EXPORT char* TargetProtToString(TargetProt* pTargets){
+	//Serializes a checked and compacted copy; the handle keeps its timing and absolute moves so
+	//blocks can be spliced
+	uint64_t buildStart = metricClock();
+	ScanProt* pCopy = createProtocol();
+	if(pCopy == NULL || reserveCmds(pCopy,pTargets->pProt->NumCmds) != 0){
+		freeProtocol(pCopy);
+		return NULL;
+	}
+	memcpy(pCopy->pCmds,pTargets->pProt->pCmds,pTargets->pProt->NumCmds*sizeof(PackedCmd));
+	pCopy->NumCmds = pTargets->pProt->NumCmds;
+	return finishBuild(pCopy,&pTargets->Rig,1,buildStart);
+}
 
-	char* protocolString = ProtToString(pTargetProt);
-    clearProtocol(pTargetProt);
-    return protocolString;
+EXPORT void freeTargetProt(TargetProt* pTargets){
+	if(pTargets == NULL){
+		return;
+	}
+	freeProtocol(pTargets->pProt);
+	freeProtocol(pTargets->pScratch);
+	free(pTargets->pTargets);
+	free(pTargets);
 }
 
 // RAPID GRID ......................................................................................
@@ -395,23 +939,41 @@ EXPORT char* buildRapidGrid(uint32_t Baseline,
                      struct Coord* CenterOffset,
 					 enum Trigger* Trig,
 					 double RotAngle){
+	/* Convert time parameters from milliseconds to cycles */
+	return buildRapidGridCycles(Baseline*CYCLES_PER_MS,TimeOn*CYCLES_PER_MS,ISI*CYCLES_PER_MS,
+			EpisodePeriod*CYCLES_PER_MS,Reps,Dims,StartPos,Spacing,ScaleFactor,CenterOffset,Trig,
+			RotAngle,NULL);
+}
+
+EXPORT char* buildRapidGridCycles(uint32_t Baseline,
+					 uint32_t TimeOn,
+					 uint32_t ISI,
+					 uint32_t EpisodePeriod,
+					 uint16_t Reps,
+					 struct Coord* Dims,
+					 struct Coord* StartPos,
+					 struct Coord* Spacing,
+					 int64_t ScaleFactor,
+                     struct Coord* CenterOffset,
+					 enum Trigger* Trig,
+					 double RotAngle,
+					 struct RigProfile* Rig){
+
+	uint64_t buildStart = metricClock();
+	RigProfile rig = (Rig != NULL) ? *Rig : defaultRigProfile();	//Rig timing and channel map
 
-	//Time conversions from ms to cycles
+	//Timing coercion (all times in cycles)
     if(ISI < TimeOn){ ISI = TimeOn; }
     if(EpisodePeriod < (Baseline+(Dims->X*Dims->Y*ISI))){
 		EpisodePeriod = (Baseline+(Dims->X*Dims->Y*ISI));
 	}
-	Baseline = Baseline * CYCLES_PER_MS;
-    TimeOn = TimeOn * CYCLES_PER_MS;
-	ISI = ISI * CYCLES_PER_MS;
-	EpisodePeriod = EpisodePeriod * CYCLES_PER_MS;
 
 	uint32_t Time0 = 0;
-	uint32_t EpisodeStart = Time0 + TIME_OFFSET;
+	uint32_t EpisodeStart = Time0 + rig.TimeOffset;
 	uint32_t PulseStart = EpisodeStart + Baseline;
 	uint32_t XMoveTime = EpisodeStart + ISI;
 	uint32_t YMoveTime = EpisodeStart + (Dims->X*ISI);
-	uint32_t EndTime = EpisodeStart + EpisodePeriod + PROT_PERIOD;
+	uint32_t EndTime = EpisodeStart + EpisodePeriod + rig.ProtPeriod;
 
 	gCoord gStartPos = convertCoord(StartPos,ScaleFactor,CenterOffset,0);
 	gCoord gSpacing;
@@ -419,10 +981,14 @@ EXPORT char* buildRapidGrid(uint32_t Baseline,
 	gSpacing.Y = -1 * Spacing->Y * ScaleFactor;
 
 	ScanProt* pRapidGridProt = createProtocol();
+	if(reserveCmds(pRapidGridProt,countRapidGridCmds(Trig)) != 0){
+		freeProtocol(pRapidGridProt);
+		return NULL;
+	}
 
 	appendLoop(pRapidGridProt,START,Time0,Reps);
-	appendMove(pRapidGridProt,X,Time0,gStartPos.X);
-	appendMove(pRapidGridProt,Y,Time0,gStartPos.Y);
+	appendMove(pRapidGridProt,rig.ChanX,Time0,gStartPos.X);
+	appendMove(pRapidGridProt,rig.ChanY,Time0,gStartPos.Y);
 
 	switch(*Trig){   //Trigger before episode
         case T_NONE:
@@ -432,25 +998,29 @@ EXPORT char* buildRapidGrid(uint32_t Baseline,
             break;
         case T_OUT:
             appendTrigOut(pRapidGridProt,EpisodeStart,TH_DL);
-			appendTrigOut(pRapidGridProt,EpisodeStart+TRIG_LEN,TL_DL);
+			appendTrigOut(pRapidGridProt,EpisodeStart+rig.TrigLen,TL_DL);
             break;
+        case T_PACED_RISING:
+        case T_PACED_FALLING:
+            break;	//Waits are placed at every spot below.
     }
 
 	appendLoop(pRapidGridProt,START,EpisodeStart,Dims->Y);			//Y Loop START
 	appendLoop(pRapidGridProt,START,EpisodeStart,Dims->X);			//X Loop START
+	if(*Trig == T_PACED_RISING || *Trig == T_PACED_FALLING){
+		appendTrigIn(pRapidGridProt,PulseStart,pacedEdge(*Trig));	//Wait for edge at each spot
+	}
 	appendTrigOut(pRapidGridProt,PulseStart,TL_DH);
 	appendTrigOut(pRapidGridProt,PulseStart+TimeOn,TL_DL);
 
-	appendRel(pRapidGridProt,XMoveTime,X,-1*gSpacing.X);			//Move X
+	appendRel(pRapidGridProt,XMoveTime,rig.ChanX,-1*gSpacing.X);			//Move X
 	appendLoop(pRapidGridProt,END,XMoveTime,Dims->X);				//X Loop END
-	appendRel(pRapidGridProt,YMoveTime,Y,gSpacing.Y);				//Move Y
-	appendRel(pRapidGridProt,YMoveTime,X,gSpacing.X*Dims->X);		//Move X Back
+	appendRel(pRapidGridProt,YMoveTime,rig.ChanY,gSpacing.Y);				//Move Y
+	appendRel(pRapidGridProt,YMoveTime,rig.ChanX,gSpacing.X*Dims->X);		//Move X Back
 	appendLoop(pRapidGridProt,END,YMoveTime,Dims->Y);				//Move Y
 	appendLoop(pRapidGridProt,END,EndTime,Reps);					//End Master Loop
 
-	char* protocolString = ProtToString(pRapidGridProt);
-    clearProtocol(pRapidGridProt);
-    return protocolString;
+	return finishBuild(pRapidGridProt,&rig,0,buildStart);
 
 }
 
@@ -467,39 +1037,78 @@ EXPORT char* buildRapidTarget(const char* TargetFile,
                        struct Coord* CenterOffset,
 					   enum Trigger*Trig,
 					   double RotAngle){
+	/* Convert time parameters from milliseconds to cycles */
+	return buildRapidTargetCycles(TargetFile,Baseline*CYCLES_PER_MS,TimeOn*CYCLES_PER_MS,
+			ISI*CYCLES_PER_MS,EpisodePeriod*CYCLES_PER_MS,Reps,NumPoints,ScaleFactor,CenterOffset,Trig,
+			RotAngle,NULL);
+}
 
-	/* Time conversions */
-	if(ISI < TimeOn){ ISI = TimeOn; }
+EXPORT char* buildRapidTargetCycles(const char* TargetFile,
+					   uint32_t Baseline,
+					   uint32_t TimeOn,
+					   uint32_t ISI,
+					   uint32_t EpisodePeriod,
+					   uint16_t Reps,
+					   uint16_t NumPoints,
+					   int64_t ScaleFactor,
+                       struct Coord* CenterOffset,
+					   enum Trigger*Trig,
+					   double RotAngle,
+					   struct RigProfile* Rig){
+
+	CoordSource source;
+	if(fileSource(&source,TargetFile,NumPoints) != 0){
+		return NULL;
+	}
+	char* protocolString = buildRapidTargetSourceCycles(&source,Baseline,TimeOn,ISI,EpisodePeriod,Reps,
+			ScaleFactor,CenterOffset,Trig,RotAngle,Rig);
+	closeSource(&source);
+	return protocolString;
+}
+
+EXPORT char* buildRapidTargetSourceCycles(CoordSource* pSrc,
+					   uint32_t Baseline,
+					   uint32_t TimeOn,
+					   uint32_t ISI,
+					   uint32_t EpisodePeriod,
+					   uint16_t Reps,
+					   int64_t ScaleFactor,
+                       struct Coord* CenterOffset,
+					   enum Trigger*Trig,
+					   double RotAngle,
+					   struct RigProfile* Rig){
+
+	uint64_t buildStart = metricClock();
+	RigProfile rig = (Rig != NULL) ? *Rig : defaultRigProfile();	//Rig timing and channel map
+	uint32_t NumPoints = pSrc->Count;
+
+	/* Timing coercion (all times in cycles) */
+	if(ISI < TimeOn){ ISI = TimeOn; }
     if(EpisodePeriod < (Baseline+NumPoints*ISI)){ EpisodePeriod = (Baseline+NumPoints*ISI); }
-	Baseline = Baseline * CYCLES_PER_MS;
-    TimeOn = TimeOn * CYCLES_PER_MS;
-	ISI = ISI * CYCLES_PER_MS;
-	EpisodePeriod = EpisodePeriod * CYCLES_PER_MS;
 
 	uint32_t Time0 = 0;
-	uint32_t EpisodeStart = Time0 + TIME_OFFSET;
+	uint32_t EpisodeStart = Time0 + rig.TimeOffset;
 	uint32_t PulseStart = EpisodeStart + Baseline;
+	uint32_t NextMove = PulseStart;
 	uint32_t NextPulse = 0;
-	uint32_t EndTime = EpisodePeriod;
+	uint32_t EndTime = EpisodeStart + EpisodePeriod + rig.ProtPeriod;
 
-	Coord pCoordArr[NumPoints];
-	gCoord gCoordArr[NumPoints];
-	getCoords(TargetFile,NumPoints,pCoordArr);
+	/* Externally paced: every target waits for an edge once the galvos have settled */
+	int Paced = (*Trig == T_PACED_RISING || *Trig == T_PACED_FALLING);
+	uint32_t SettleTime = 0;
 
+	Coord centroid = {0,0};
 	if (RotAngle != 0){
-		Coord centroid = getCentroid(NumPoints,pCoordArr);
-		int i;
-		for (i=0;i < NumPoints;i++){
-			pCoordArr[i] = rotateCoord(&pCoordArr[i],&centroid,RotAngle);
-		}
-	}
-
-	int j;
-	for(j=0; j < NumPoints; j++){
-		gCoordArr[j] = convertCoord(&pCoordArr[j],ScaleFactor,CenterOffset,0);
+		centroid = sourceCentroid(pSrc);
 	}
 
 	ScanProt* pRapidTargetProt = createProtocol();
+	uint32_t fixedCmds = countRapidTargetCmds(0,Trig);
+	uint32_t perTarget = countRapidTargetCmds(1,Trig) - fixedCmds;
+	if(pRapidTargetProt == NULL || reserveCmds(pRapidTargetProt,fixedCmds + NumPoints*perTarget) != 0){
+		freeProtocol(pRapidTargetProt);
+		return NULL;
+	}
 
 	/* Initialize at T=0 */
 	appendLoop(pRapidTargetProt,START,Time0,Reps);
@@ -512,24 +1121,40 @@ EXPORT char* buildRapidTarget(const char* TargetFile,
 			break;
 		case T_OUT:
 			appendTrigOut(pRapidTargetProt,EpisodeStart,TH_DL);
-			appendTrigOut(pRapidTargetProt,EpisodeStart+TRIG_LEN,TL_DL);
+			appendTrigOut(pRapidTargetProt,EpisodeStart+rig.TrigLen,TL_DL);
 			break;
+		case T_PACED_RISING:
+		case T_PACED_FALLING:
+			break;	//Waits are placed at every target below.
 	}
 
-	/* Loop through array of coordinates */
-	int m;
-	for(m = 0; m < NumPoints; m++){
-		NextPulse = PulseStart + m*ISI;
-		appendMove(pRapidTargetProt,X,NextPulse,gCoordArr[m].X);
-		appendMove(pRapidTargetProt,Y,NextPulse,gCoordArr[m].Y);
+	/* Stream the coordinates */
+	gCoord prev;
+	gCoord target;
+	uint32_t m = 0;
+	resetSource(pSrc);
+	while(nextTarget(pSrc,&centroid,ScaleFactor,CenterOffset,RotAngle,&target)){
+		if(Paced){
+			SettleTime = (m == 0) ? rig.MoveTime : settleCycles(&rig,moveDistance(&prev,&target));
+		}
+		NextPulse = NextMove + SettleTime;
+		appendMove(pRapidTargetProt,rig.ChanX,NextMove,target.X);
+		appendMove(pRapidTargetProt,rig.ChanY,NextMove,target.Y);
+		if(Paced){
+			appendTrigIn(pRapidTargetProt,NextPulse,pacedEdge(*Trig));
+		}
 		appendTrigOut(pRapidTargetProt,NextPulse,TL_DH);
 		appendTrigOut(pRapidTargetProt,NextPulse+TimeOn,TL_DL);
-	} //for loop
+		NextMove = NextPulse + ISI;
+		prev = target;
+		m++;
+	} //while loop
+	if(Paced){
+		EndTime = NextMove + rig.ProtPeriod;
+	}
     appendLoop(pRapidTargetProt,END,EndTime,Reps);
 
-	char* protocolString = ProtToString(pRapidTargetProt);
-    clearProtocol(pRapidTargetProt);
-    return protocolString;
+	return finishBuild(pRapidTargetProt,&rig,1,buildStart);
 }
 
 // PATTERN .........................................................................................
@@ -548,92 +1173,118 @@ EXPORT char* buildPattern(const char* PatternFile,
 						  struct Coord* CenterOffset,
 						  enum Trigger* Trig,
 						  double RotAngle){
+	/* Convert time parameters from milliseconds to cycles */
+	return buildPatternCycles(PatternFile,Baseline*CYCLES_PER_MS,TimeOn*CYCLES_PER_MS,NumPulses,
+			ISI*CYCLES_PER_MS,Iterations,EpisodePeriod*CYCLES_PER_MS,Reps,StartPos,Spacing,ScaleFactor,
+			CenterOffset,Trig,RotAngle,NULL);
+}
 
-	uint16_t NumPoints = (uint16_t)getNumPoints(PatternFile);
+EXPORT char* buildPatternCycles(const char* PatternFile,
+						  uint32_t Baseline,
+						  uint32_t TimeOn,
+						  uint16_t NumPulses,
+						  uint32_t ISI,
+						  uint32_t Iterations,
+						  uint32_t EpisodePeriod,
+						  uint16_t Reps,
+						  struct Coord* StartPos,
+						  struct Coord* Spacing,
+						  int64_t ScaleFactor,
+						  struct Coord* CenterOffset,
+						  enum Trigger* Trig,
+						  double RotAngle,
+						  struct RigProfile* Rig){
 
-	/* Time conversions */
-	if(ISI < TimeOn){ ISI = TimeOn; }
-    if(EpisodePeriod < (Baseline+NumPulses*ISI)){ EpisodePeriod = (Baseline+NumPulses*ISI); }
-	Baseline = Baseline * CYCLES_PER_MS;
-    TimeOn = TimeOn * CYCLES_PER_MS;
-	ISI = ISI * CYCLES_PER_MS;
-	EpisodePeriod = EpisodePeriod * CYCLES_PER_MS * Iterations;
+	CoordSource source;
+	if(patternSource(&source,PatternFile,StartPos,Spacing) != 0){
+		return NULL;
+	}
+	char* protocolString = buildTargetSourceCycles(&source,Baseline,TimeOn,NumPulses,ISI,Iterations,
+			EpisodePeriod,Reps,ScaleFactor,CenterOffset,Trig,RotAngle,Rig);
+	closeSource(&source);
+	return protocolString;
+}
 
+EXPORT TargetProt* buildPatternProt(const char* PatternFile,
+						  uint32_t Baseline,
+						  uint32_t TimeOn,
+						  uint16_t NumPulses,
+						  uint32_t ISI,
+						  uint32_t Iterations,
+						  uint32_t EpisodePeriod,
+						  uint16_t Reps,
+						  struct Coord* StartPos,
+						  struct Coord* Spacing,
+						  int64_t ScaleFactor,
+						  struct Coord* CenterOffset,
+						  enum Trigger* Trig,
+						  double RotAngle,
+						  struct RigProfile* Rig){
 
-	uint32_t Time0 = 0;
-	uint32_t EpisodeStart = Time0 + TIME_OFFSET;
-	uint32_t NextEpisode = 0;
-	uint32_t NextPulse = 0;
-	uint32_t EndTime = EpisodePeriod*NumPoints;
+	CoordSource source;
+	if(patternSource(&source,PatternFile,StartPos,Spacing) != 0){
+		return NULL;
+	}
+	TargetProt* pTargets = buildSourceProt(&source,Baseline,TimeOn,NumPulses,ISI,Iterations,
+			EpisodePeriod,Reps,ScaleFactor,CenterOffset,Trig,RotAngle,Rig);
+	closeSource(&source);
+	return pTargets;
+}
 
-	Coord pCoordArr[NumPoints];
-	gCoord gCoordArr[NumPoints];
+/* SIZE QUERIES ==================================================================================*/
 
-	getPattern(PatternFile,NumPoints,pCoordArr,StartPos,Spacing);
+/* Each builder emits a fixed set of commands per protocol, per episode or per target, so the number
+   of commands follows from the parameters alone.  The builders reserve exactly this many records
+   before appending; callers may use the same functions to size buffers without building. */
 
-	/*Apply rotation before converting to galvo coordinates*/
-	if (RotAngle != 0){
-		Coord centroid = getCentroid(NumPoints,pCoordArr);
-		int i;
-		for (i=0;i < NumPoints;i++){
-			pCoordArr[i] = rotateCoord(&pCoordArr[i],&centroid,RotAngle);
-		}
+static uint32_t trigCmds(enum Trigger* Trig){
+	//Commands emitted by the trigger block before an episode
+	switch(*Trig){
+		case T_IN:
+		case T_PACED_RISING:
+		case T_PACED_FALLING:
+			return 1;
+		case T_OUT:
+			return 2;
+		case T_NONE:
+		default:
+			return 0;
 	}
+}
 
-	int j;
-	for(j=0; j < NumPoints; j++){
-		gCoordArr[j] = convertCoord(&pCoordArr[j],ScaleFactor,CenterOffset,0);
-	}
+static uint32_t pulseCmds(uint16_t NumPulses){
+	//Single pulse, or pulse train wrapped in a loop
+	return (NumPulses == 1) ? 2 : 4;
+}
 
-	ScanProt* pTargetProt = createProtocol();
+EXPORT uint32_t countSpotCmds(uint16_t NumPulses, enum Trigger* Trig){
+	return 2 + 2 + trigCmds(Trig) + pulseCmds(NumPulses);
+}
 
-	/* Initialize at T=0 */
-	appendLoop(pTargetProt,START,Time0,Reps);
-	/* Loop through array of coordinates */
-	int k;
-	for(k = 0; k < NumPoints; k++){
-		NextEpisode = EpisodeStart + (k*EpisodePeriod);
-		NextPulse = NextEpisode + Baseline;
-		appendMove(pTargetProt,X,NextEpisode,gCoordArr[k].X);
-		appendMove(pTargetProt,Y,NextEpisode,gCoordArr[k].Y);
-		if(Iterations > 1){
-			appendLoop(pTargetProt,START,NextEpisode,Iterations);	//Open loop, iterations at spot
-		}
-
-		switch(*Trig){   //Trigger before episode
-			case T_NONE:
-				break;	//Do nothing.
-			case T_IN:
-				appendTrigIn(pTargetProt,NextEpisode,RISING);
-				break;
-			case T_OUT:
-				appendTrigOut(pTargetProt,NextEpisode,TH_DL);
-				appendTrigOut(pTargetProt,NextEpisode+TRIG_LEN,TL_DL);
-				break;
-		}
+EXPORT uint32_t countGridCmds(uint16_t NumPulses, uint32_t Iterations, enum Trigger* Trig, double RotAngle){
+	uint32_t moveCmds = (RotAngle == 0) ? 5 : 8;
+	return 1 + 2 + 2 + ((Iterations > 1) ? 2 : 0) + trigCmds(Trig) + pulseCmds(NumPulses) + moveCmds + 1;
+}
 
-		/* Single pulse or train of pulses *****************************/
-		if(NumPulses == 1){
-			appendTrigOut(pTargetProt,NextPulse,TL_DH);
-			appendTrigOut(pTargetProt,NextPulse+TimeOn,TL_DL);
-		}else{
-			appendLoop(pTargetProt,START,NextPulse,NumPulses);
-			appendTrigOut(pTargetProt,NextPulse,TL_DH);
-			appendTrigOut(pTargetProt,NextPulse+TimeOn,TL_DL);
-			appendLoop(pTargetProt,END,NextPulse+(NumPulses*ISI),NumPulses);
-		}
-		/* *************************************************************/
-		if(Iterations > 1){
-			appendLoop(pTargetProt,END,NextEpisode + EpisodePeriod,Iterations);
-			//Close loop, iterations at spot
-		}
-	} //for loop
-    appendLoop(pTargetProt,END,EndTime,Reps);
+EXPORT uint32_t countTargetCmds(uint16_t NumPulses, uint32_t Iterations, uint16_t NumPoints, enum Trigger* Trig){
+	//Also applies to buildPattern, with NumPoints from getNumPoints
+	uint32_t perTarget = 2 + ((Iterations > 1) ? 2 : 0) + trigCmds(Trig) + pulseCmds(NumPulses);
+	return 2 + NumPoints*perTarget;
+}
 
+EXPORT uint32_t countRapidGridCmds(enum Trigger* Trig){
+	uint32_t paced = (*Trig == T_PACED_RISING || *Trig == T_PACED_FALLING);
+	return 3 + (trigCmds(Trig) - paced) + 2 + paced + 2 + 5 + 1;
+}
+
+EXPORT uint32_t countRapidTargetCmds(uint16_t NumPoints, enum Trigger* Trig){
+	uint32_t paced = (*Trig == T_PACED_RISING || *Trig == T_PACED_FALLING);
+	return 2 + (trigCmds(Trig) - paced) + NumPoints*(4 + paced);
+}
 
-	char* protocolString = ProtToString(pTargetProt);
-    clearProtocol(pTargetProt);
-    return protocolString;
+EXPORT size_t maxProtLength(uint32_t NumCmds){
+	//Upper bound on the ProtToString length (including terminator) for NumCmds commands
+	return sizeof(CLEAR) + (size_t)NumCmds*MAX_LINE_LEN;
 }
 
 /* HELPER FUNCTIONS ==============================================================================*/
@@ -704,9 +1355,19 @@ EXPORT int64_t calcScaling(uint16_t NumPoints, const char* calibrationFile){
     return (int64_t)round(scalefactor);
 }
 
+EXPORT uint32_t usToCycles(uint32_t Microseconds){
+	//Converts microseconds to 10-us cycles, rounding up so that no dwell is ever shortened
+	uint32_t Cycles = Microseconds / CYCLE_LEN;
+	if(Microseconds % CYCLE_LEN != 0){
+		fprintf(stderr,"%" PRIu32 " us is not a whole number of cycles, rounded up.\n",Microseconds);
+		Cycles++;
+	}
+	return Cycles;
+}
+
 EXPORT struct gCoord convertCoord(struct Coord* pixelCoord, int64_t ScaleFactor, struct Coord* CenterOffset, double RotAngle){
 
-    static gCoord galvoCoord = {0,0};
+    gCoord galvoCoord = {0,0};
     long double complex cCoord = (double)pixelCoord->X + (double)pixelCoord->Y * I;
     long double complex offset = (double)CenterOffset->X + (double)CenterOffset->Y * I;
 
@@ -741,7 +1402,7 @@ EXPORT struct Coord rotateCoord(struct Coord* pixelCoord, struct Coord* axisCent
 //..................................................................................................
 
 
-void getCoords(const char* CoordFile, uint16_t NumPoints, struct Coord CoordArr[NumPoints]){
+void getCoords(const char* CoordFile, uint16_t NumPoints, struct Coord CoordArr[]){
 /*Read target coordinates from file */
 	FILE* fp = fopen(CoordFile,"r");
 	if(fp == NULL){
@@ -761,39 +1422,34 @@ void getCoords(const char* CoordFile, uint16_t NumPoints, struct Coord CoordArr[
 	fclose(fp);
 }
 
-void getPattern(const char* PatternFile, uint16_t NumPoints, struct Coord CoordArr[NumPoints], struct Coord* StartPos, struct Coord* Spacing){
+void getPattern(const char* PatternFile, uint16_t NumPoints, struct Coord CoordArr[], struct Coord* StartPos, struct Coord* Spacing){
 /*Read pattern sequence from file - scale to the specified grid position and spacing*/
-	FILE *fp = fopen(PatternFile,"r");
-	if (fp==NULL){
-		fprintf(stderr,"Failed to open pattern file: %s\n",PatternFile);
+	CoordSource source;
+	if(patternSource(&source,PatternFile,StartPos,Spacing) != 0){
+		return;
 	}
-
-	int nPoints;
-	int xcoord = 0;
-	int ycoord = 0;
 	int i = 0;
-	fscanf(fp,"%d\n",&nPoints);
-	while((ftell(fp) != EOF) && (i < NumPoints)){
-		fscanf(fp,"%d\t%d\n",&xcoord,&ycoord);
-		fprintf(stdout,"%d\t%d\n",xcoord,ycoord);
-		CoordArr[i].X = StartPos->X + (xcoord-1)*Spacing->X;
-		CoordArr[i].Y = StartPos->Y - (ycoord-1)*Spacing->Y;
-		fprintf(stdout,"%d\t%d\n",CoordArr[i].X,CoordArr[i].Y);
+	while((i < NumPoints) && nextCoord(&source,&CoordArr[i])){
 		i++;
 	}
-	fclose(fp);
+	closeSource(&source);
 }
 
 int getNumPoints(const char* PatternFile){
 	FILE* fp = fopen(PatternFile,"r");
-	int NumPoints;
+	if(fp == NULL){
+		fprintf(stderr,"Failed to open pattern file: %s\n",PatternFile);
+		return -1;
+	}
+	int NumPoints = -1;
 	int xDims;
 	int yDims;
 	fscanf(fp,"%d\t%d\t%d\n",&NumPoints,&xDims,&yDims);
+	fclose(fp);
 	return NumPoints;
 }
 
-struct Coord getCentroid(uint16_t NumPoints, struct Coord CoordArr[NumPoints]){
+struct Coord getCentroid(uint16_t NumPoints, struct Coord CoordArr[]){
 
 	Coord coordSum = {0,0};
 
@@ -811,272 +1467,5561 @@ struct Coord getCentroid(uint16_t NumPoints, struct Coord CoordArr[NumPoints]){
 }
 
 int NumCmds(ScanProt* protocol){
-	int numCmds = 0;
-	CmdLine* pLoop = protocol->pFirst;
-	while(pLoop != NULL){
-		numCmds++;
-		pLoop = pLoop->pNext;
+	return (int)protocol->NumCmds;
+}
+
+static int trigInRange(const PackedCmd* pCmds, uint32_t numCmds){
+	//Counts trigger waits scheduled in cycle 0, where the firmware does not sense the edge
+	int numBad = 0;
+	uint32_t i;
+	for(i = 0; i < numCmds; i++){
+		char scanCmd = cmdScan(&pCmds[i]);
+		if((scanCmd == 'U' || scanCmd == 'D') && cmdCycle(&pCmds[i]) == 0){
+			fprintf(stderr,"Trigger wait (%c) scheduled in cycle 0 will not be sensed.\n",scanCmd);
+			numBad++;
+		}
 	}
-	return numCmds;
+	return numBad;
 }
 
-char* ProtToString(ScanProt* protocol){
+int checkTrigIn(ScanProt* protocol){
+	return trigInRange(protocol->pCmds,protocol->NumCmds);
+}
 
-	//Allocate a protocol string
-	int NCmds = NumCmds(protocol)+1;
-	char* StrProtocol = (char*)calloc((NCmds*MAX_CMD_LEN),sizeof(char));
-	if (StrProtocol == NULL){
-		fprintf(stderr,"Failure to allocate memory block for protocol string.\n");
-		return NULL;
+static int numDigits(uint64_t value){
+	int digits = 1;
+	while(value >= 10){
+		value /= 10;
+		digits++;
 	}
+	return digits;
+}
 
-	StrProtocol[0] = 'C';
-	StrProtocol[1] = '\n';				//Append CLEAR command at start
-	CmdLine* pLoop = protocol->pFirst;
+static int cmdLineLen(const PackedCmd* pCmd){
+	//Length of one command formatted with FORMAT: "A<op>,<cycle>,<channel>,<value>\n"
+	int64_t value = cmdValue(pCmd);
+	uint64_t magnitude = (value < 0) ? (uint64_t)0 - (uint64_t)value : (uint64_t)value;
+	return 2 + 1 + numDigits(cmdCycle(pCmd)) + 1 + numDigits((uint64_t)cmdChannel(pCmd)) + 1
+		 + (value < 0) + numDigits(magnitude) + 1;
+}
 
-	while(pLoop != NULL){
-		char* NextLine = (char*)calloc(MAX_CMD_LEN,sizeof(char));
-		if (NextLine == NULL){
-			fprintf(stderr,"Failure to allocate memory block for command line string.\n");
-			return NULL;
-		}
-		sprintf(NextLine,FORMAT,pLoop->DSPCmd,pLoop->ScanCmd,pLoop->Cycle,pLoop->Channel,pLoop->Value);
-		strcat(StrProtocol,NextLine);
-	    pLoop = pLoop->pNext;
-		free(NextLine);
+static size_t rangeLength(const PackedCmd* pCmds, uint32_t numCmds){
+	size_t len = 0;
+	uint32_t i;
+	for(i = 0; i < numCmds; i++){
+		len += cmdLineLen(&pCmds[i]);
 	}
+	return len;
+}
 
-	//Resize the protocol string based on actual size of lines
-	int ProtLen = strlen(StrProtocol)+1;
-    char* newStr = (char*)realloc(StrProtocol,(ProtLen*sizeof(char)));
-	if (newStr != NULL){
-		StrProtocol = newStr;
-	} else {
-		fprintf(stderr,"Failure to reallocate memory block.\n");
-		return NULL;
+static char* putDecimal(char* dest, uint64_t value){
+	char digits[20];
+	int n = 0;
+	do{
+		digits[n++] = (char)('0' + value%10);
+		value /= 10;
+	}while(value != 0);
+	while(n > 0){
+		*dest++ = digits[--n];
 	}
-
-	return StrProtocol;
+	return dest;
 }
 
-struct Coord expandGridCoords(struct Coord* Dims, struct Coord* StartPos, struct Coord* Spacing){
-
-	uint16_t NumPoints = Dims->X*Dims->Y;
-	Coord* pCoordArr;
-	pCoordArr = (Coord*)calloc(NumPoints,sizeof(Coord));
-	int StartX = StartPos->X;
-	int StartY = StartPos->Y;
-	int deltaX = Spacing->X;
-	int deltaY = Spacing->Y;
-	int i,j,k;
-	for (j=0; j < Dims->Y; j++){
-		for (i=0; i < Dims->X; i++){
-			k = j*Dims->X + (i+1);
-			pCoordArr[k].X = StartX + i*deltaX;
-			pCoordArr[k].Y = StartY + j*deltaY;
-		}
+static size_t formatCmd(char* dest, const PackedCmd* pCmd){
+	//Same text as FORMAT, without sprintf and without a terminating NUL
+	char* p = dest;
+	int64_t value = cmdValue(pCmd);
+	*p++ = 'A';
+	*p++ = cmdScan(pCmd);
+	*p++ = ',';
+	p = putDecimal(p,cmdCycle(pCmd));
+	*p++ = ',';
+	p = putDecimal(p,(uint64_t)cmdChannel(pCmd));
+	*p++ = ',';
+	if(value < 0){
+		*p++ = '-';
 	}
-	return *pCoordArr;
+	p = putDecimal(p,(value < 0) ? (uint64_t)0 - (uint64_t)value : (uint64_t)value);
+	*p++ = STOPCHAR;
+	return (size_t)(p - dest);
 }
 
+static size_t formatRange(char* dest, const PackedCmd* pCmds, uint32_t numCmds){
+	//Writes numCmds formatted lines at dest (not NUL-terminated), returns characters written
+	size_t len = 0;
+	uint32_t i;
+	for(i = 0; i < numCmds; i++){
+		len += formatCmd(dest+len,&pCmds[i]);
+	}
+	return len;
+}
 
-/* SCAN COMMAND FUNCTIONS =========================================================================*/
-
-void reassignPointers(ScanProt* pParentList, CmdLine* pChildNode){	  //Generalized function
-	if(pParentList->pFirst == NULL){								  //for reassigning pointers
-		pParentList->pFirst = pChildNode;							  //as list grows
-		pParentList->pLast = pChildNode;
-		}
-	else {
-	    pParentList->pLast->pNext = pChildNode;
-		pChildNode->pPrev = pParentList->pLast;
-		pParentList->pLast = pChildNode;
-		}
+size_t protLength(ScanProt* protocol){
+	//Exact ProtToString length, including the CLEAR line and terminator, without formatting
+	return sizeof(CLEAR) + rangeLength(protocol->pCmds,protocol->NumCmds);
 }
 
-ScanProt* createProtocol(){							//Initialize a protocol (allocate heap memory);
-    ScanProt* pScanProt = calloc(1,sizeof(ScanProt));
-	if (pScanProt == NULL){
-		perror("Failure to create protocol (allocation error) - ");
+char* ProtToString(ScanProt* protocol){
+
+	//Allocate a protocol string of exactly the formatted size
+	size_t ProtSize = protLength(protocol);
+	char* StrProtocol = (char*)malloc(ProtSize*sizeof(char));
+	if (StrProtocol == NULL){
+		fprintf(stderr,"Failure to allocate memory block for protocol string.\n");
+		return NULL;
 	}
-	return pScanProt;
+
+	strcpy(StrProtocol,CLEAR);			//Append CLEAR command at start
+	StrProtocol[ProtSize-1] = '\0';
+	formatRange(StrProtocol+sizeof(CLEAR)-1,protocol->pCmds,protocol->NumCmds);
+
+	return StrProtocol;
 }
 
-void clearProtocol(ScanProt* pProtocol){							//Free all nodes from protocol list
-	CmdLine* pCmdLine;
-	CmdLine* pNextCmd;
-	for(pCmdLine = pProtocol->pFirst; pCmdLine != NULL; pCmdLine = pNextCmd){
-		pNextCmd = pCmdLine->pNext;
-		free(pCmdLine);
+ScanProt* stringToProt(const char* StrProtocol){
+	//Parses protocol text (as produced by ProtToString) back into a protocol.  Blank lines and
+	//control lines other than 'A' (e.g. the leading CLEAR) are skipped.
+	ScanProt* pProt = createProtocol();
+	if(pProt == NULL){
+		return NULL;
+	}
+	const char* pLine = StrProtocol;
+	while(*pLine != '\0'){
+		const char* pEnd = strchr(pLine,STOPCHAR);
+		if(pEnd == NULL){
+			pEnd = pLine + strlen(pLine);
+		}
+		if(pLine[0] == 'A'){
+			char* pNext = (char*)pLine;
+			errno = 0;							//Out-of-range fields are malformed, not clamped
+			char scanCmd = (pEnd - pLine > 3 && pLine[2] == ',') ? pLine[1] : '\0';
+			unsigned long long cycle = (scanCmd != '\0') ? strtoull(pLine+3,&pNext,10) : 0;
+			long channel = (*pNext == ',') ? strtol(pNext+1,&pNext,10) : -1;
+			long long value = (*pNext == ',') ? strtoll(pNext+1,&pNext,10) : 0;
+			if(scanCmd == '\0' || channel < 0 || channel > CMD_CHAN_MASK || cycle > UINT32_MAX || errno == ERANGE
+					|| pNext != pEnd || strchr(CMD_OPS,scanCmd) == NULL
+					|| pushCmd(pProt,scanCmd,(uint32_t)cycle,(int)channel,(int64_t)value) != 0){
+				fprintf(stderr,"Malformed protocol line: %.*s\n",(int)(pEnd-pLine),pLine);
+				freeProtocol(pProt);
+				return NULL;
+			}
 		}
-		pProtocol->pFirst = pProtocol->pLast = NULL;
+		pLine = (*pEnd == '\0') ? pEnd : pEnd + 1;
+	}
+	return pProt;
 }
 
-int appendMove(ScanProt* pProtocol, int channel, const uint32_t cycle, const int64_t position){
-    //Appends a move command for single channel at end of list
-	CmdLine* pCmdLine = calloc(1,sizeof(CmdLine));
-	if (pCmdLine == NULL) {
-		perror("Failure to create line at appendMove - ");
+int expandGridCoords(struct Coord* Dims, struct Coord* StartPos, struct Coord* Spacing, struct Coord* CoordArr){
+/*Fills CoordArr (Dims->X*Dims->Y entries) with the grid positions in scan order; returns the count*/
+	CoordSource source;
+	if(gridSource(&source,Dims,StartPos,Spacing) != 0){
 		return -1;
 	}
+	int k = 0;
+	while(nextCoord(&source,&CoordArr[k])){
+		k++;
+	}
+	return k;
+}
+
 
-	pCmdLine->DSPCmd = 'A';
-	pCmdLine->ScanCmd = 'V';
-	pCmdLine->Cycle = cycle;
-	pCmdLine->Channel = channel;
-	pCmdLine->Value = position;
+/* COORDINATE SOURCES ============================================================================*/
 
-	reassignPointers(pProtocol,pCmdLine);
+/* A source is a small tagged struct; nextCoord computes grid positions from the index and reads
+   file and image sources one coordinate at a time, so no source holds its coordinates in memory.
+   File and image sources are scanned once when opened to find Count. */
+
+static int gridDims(CoordSource* pSrc, struct Coord* Dims, struct Coord* StartPos, struct Coord* Spacing){
+	//Common part of the grid and serpentine constructors
+	memset(pSrc,0,sizeof(CoordSource));
+	if(Dims->X < 0 || Dims->Y < 0){
+		fprintf(stderr,"Invalid grid dimensions: %d x %d\n",Dims->X,Dims->Y);
+		return -1;
+	}
+	pSrc->Dims = *Dims;
+	pSrc->StartPos = *StartPos;
+	pSrc->Spacing = *Spacing;
+	pSrc->Count = (uint32_t)Dims->X*(uint32_t)Dims->Y;
 	return 0;
 }
 
-int appendLoop(ScanProt* pProtocol, const char StartOrEnd, const uint32_t cycle, const int64_t repetitions){
-    //Append a loop start command at end of list.
-	//Start or end are specified as 'S' or 'E' characters
-	CmdLine* pCmdLine = calloc(1,sizeof(CmdLine));
-	if (pCmdLine == NULL) {
-		perror("Failure to create line at appendLoop - ");
+EXPORT int gridSource(CoordSource* pSrc, struct Coord* Dims, struct Coord* StartPos, struct Coord* Spacing){
+	if(gridDims(pSrc,Dims,StartPos,Spacing) != 0){
 		return -1;
 	}
+	pSrc->Kind = SRC_GRID;
+	return 0;
+}
 
-	pCmdLine->DSPCmd = 'A';
-	switch (StartOrEnd){
-		case 'S':
-		    pCmdLine->ScanCmd = START;
-            pCmdLine->Value = repetitions;
-			break;
-		case 'E':
-		    pCmdLine->ScanCmd = END;
-            pCmdLine->Value = repetitions;
-			break;
-		default: fputs("Start(S) or End(E) not indicated for loop command line\n", stderr);
+EXPORT int serpentineSource(CoordSource* pSrc, struct Coord* Dims, struct Coord* StartPos, struct Coord* Spacing){
+	if(gridDims(pSrc,Dims,StartPos,Spacing) != 0){
+		return -1;
 	}
-	pCmdLine->Cycle = cycle;
-	pCmdLine->Channel = LOOP;
-    //Note: no limit-checking on repetitions
-
-	reassignPointers(pProtocol,pCmdLine);
+	pSrc->Kind = SRC_SERPENTINE;
 	return 0;
 }
 
-int appendTrigOut(ScanProt* pProtocol, const uint32_t cycle, enum TrigCfg trigger){
+static uint32_t countPairs(FILE* fp, uint32_t MaxPairs){
+	//Counts the "X<TAB>Y" pairs from the current position (all of them if MaxPairs is 0)
+	int xcoord;
+	int ycoord;
+	uint32_t n = 0;
+	while((MaxPairs == 0 || n < MaxPairs) && fscanf(fp,"%d %d",&xcoord,&ycoord) == 2){
+		n++;
+	}
+	return n;
+}
 
-	CmdLine* pCmdLine = calloc(1,sizeof(CmdLine));
-	if (pCmdLine == NULL) {
-		perror("Failure to create line at appendTrig - ");
+EXPORT int patternSource(CoordSource* pSrc, const char* PatternFile, struct Coord* StartPos, struct Coord* Spacing){
+	//Pattern file: header "N<TAB>X<TAB>Y" (points, grid size), then N lines of 1-based grid indices
+	memset(pSrc,0,sizeof(CoordSource));
+	pSrc->Kind = SRC_PATTERN;
+	pSrc->StartPos = *StartPos;
+	pSrc->Spacing = *Spacing;
+	pSrc->fp = fopen(PatternFile,"r");
+	if(pSrc->fp == NULL){
+		fprintf(stderr,"Failed to open pattern file: %s\n",PatternFile);
 		return -1;
 	}
-
-	pCmdLine->DSPCmd = 'A';
-	pCmdLine->ScanCmd = 'V';
-	pCmdLine->Cycle = cycle;
-	pCmdLine->Channel = TRIG;
-	pCmdLine->Value = trigger;
-
-	reassignPointers(pProtocol,pCmdLine);
+	int nPoints;
+	if(fscanf(pSrc->fp,"%d %d %d",&nPoints,&pSrc->Dims.X,&pSrc->Dims.Y) != 3 || nPoints < 0){
+		fprintf(stderr,"Invalid pattern file header: %s\n",PatternFile);
+		closeSource(pSrc);
+		return -1;
+	}
+	pSrc->DataStart = fileTell(pSrc->fp);
+	pSrc->Count = countPairs(pSrc->fp,(uint32_t)nPoints);
+	if(pSrc->Count < (uint32_t)nPoints){
+		fprintf(stderr,"Pattern file %s has %" PRIu32 " of %d points.\n",PatternFile,pSrc->Count,nPoints);
+	}
+	resetSource(pSrc);
 	return 0;
 }
 
-int appendIncr(ScanProt* pProtocol,const uint32_t cycle, const int channel, const int64_t increment){
-    //Increment of increment to be implemented later.
-	CmdLine* pCmdLine = calloc(1,sizeof(CmdLine));
-	if (pCmdLine == NULL) {
-		perror("Failure to create line at appendIncr - ");
+EXPORT int fileSource(CoordSource* pSrc, const char* CoordFile, uint32_t NumPoints){
+	//Coordinate file as read by getCoords; at most NumPoints coordinates (0: every line)
+	memset(pSrc,0,sizeof(CoordSource));
+	pSrc->Kind = SRC_FILE;
+	pSrc->fp = fopen(CoordFile,"r");
+	if(pSrc->fp == NULL){
+		fprintf(stderr,"Failed to open coordinate file: %s\n",CoordFile);
 		return -1;
 	}
-
-	pCmdLine->DSPCmd = 'A';
-	pCmdLine->ScanCmd = 'I';
-	pCmdLine->Cycle = cycle;
-	pCmdLine->Channel = channel;
-	pCmdLine->Value = increment;
-
-	reassignPointers(pProtocol,pCmdLine);
+	pSrc->DataStart = fileTell(pSrc->fp);
+	pSrc->Count = countPairs(pSrc->fp,NumPoints);
+	if(pSrc->Count < NumPoints){
+		fprintf(stderr,"Coordinate file %s has %" PRIu32 " of %" PRIu32 " points.\n",CoordFile,pSrc->Count,NumPoints);
+	}
+	resetSource(pSrc);
 	return 0;
 }
 
-int appendWait(ScanProt* pProtocol, const int64_t waitTime){
+EXPORT int arraySource(CoordSource* pSrc, const struct Coord* CoordArr, uint32_t NumPoints){
+	memset(pSrc,0,sizeof(CoordSource));
+	pSrc->Kind = SRC_ARRAY;
+	pSrc->pArray = CoordArr;
+	pSrc->Count = NumPoints;
+	return 0;
+}
 
-	CmdLine* pCmdLine = calloc(1,sizeof(CmdLine));
-	if (pCmdLine == NULL){
-		perror("Failure to create line at appendWait - ");
+EXPORT int stridedSource(CoordSource* pSrc, const void* pX, const void* pY, int64_t StrideX, int64_t StrideY,
+				enum ElemType Elem, uint32_t NumPoints){
+	//X and Y read in place from the caller's arrays; float64 values must round to an int
+	memset(pSrc,0,sizeof(CoordSource));
+	pSrc->Kind = SRC_STRIDED;
+	pSrc->pX = pX;
+	pSrc->pY = pY;
+	pSrc->StrideX = StrideX;
+	pSrc->StrideY = StrideY;
+	pSrc->Elem = Elem;
+	pSrc->Count = NumPoints;
+	if(Elem != ELEM_INT32 && Elem != ELEM_FLOAT64){
+		fprintf(stderr,"Unknown coordinate element type: %d\n",(int)Elem);
 		return -1;
 	}
-
-	pCmdLine->DSPCmd = 'A';
-	pCmdLine->ScanCmd = '0';
-	pCmdLine->Cycle = waitTime;
-	pCmdLine->Channel = 0;
-	pCmdLine->Value = 0;
-
-	reassignPointers(pProtocol,pCmdLine);
+	uint32_t i;
+	for(i = 0; Elem == ELEM_FLOAT64 && i < NumPoints; i++){
+		double x = *(const double*)(pSrc->pX + (int64_t)i*StrideX);
+		double y = *(const double*)(pSrc->pY + (int64_t)i*StrideY);
+		if(!(x > INT_MIN && x < INT_MAX && y > INT_MIN && y < INT_MAX)){
+			fprintf(stderr,"Coordinate %" PRIu32 " is not a finite pixel position.\n",i);
+			return -1;
+		}
+	}
 	return 0;
 }
 
-int appendRel(ScanProt* pProtocol,  const uint32_t cycle, const int channel, const int64_t deltaValue){
-
-	CmdLine* pCmdLine = calloc(1,sizeof(CmdLine));
-	if (pCmdLine == NULL){
-		perror("Failure to create line at appendRel - ");
+static int pgmToken(FILE* fp, int* pValue){
+	//Reads one header integer, skipping white space and '#' comments
+	int c = fgetc(fp);
+	while(c != EOF && (isspace(c) || c == '#')){
+		if(c == '#'){
+			while(c != EOF && c != '\n'){ c = fgetc(fp); }
+		}
+		c = fgetc(fp);
+	}
+	if(c == EOF){
 		return -1;
 	}
+	ungetc(c,fp);
+	return (fscanf(fp,"%d",pValue) == 1) ? 0 : -1;
+}
 
-	pCmdLine->DSPCmd = 'A';
-	pCmdLine->ScanCmd = 'R';
-	pCmdLine->Cycle = cycle;
-	pCmdLine->Channel = channel;
-	pCmdLine->Value = deltaValue;
+static int pgmPixel(CoordSource* pSrc){
+	//Value of the next pixel, or -1 at the end of the data
+	if(!pSrc->Binary){
+		int value;
+		return (fscanf(pSrc->fp,"%d",&value) == 1) ? value : -1;
+	}
+	int hi = fgetc(pSrc->fp);
+	if(hi == EOF || pSrc->MaxVal < 256){
+		return hi;
+	}
+	int lo = fgetc(pSrc->fp);
+	return (lo == EOF) ? -1 : (hi << 8) | lo;		//16-bit samples are big-endian
+}
 
-	reassignPointers(pProtocol,pCmdLine);
+static int nextPixel(CoordSource* pSrc, struct Coord* pPos){
+	//Advances to the next pixel at or above the threshold; returns 0 at the end of the image
+	int64_t numPixels = (int64_t)pSrc->Dims.X*pSrc->Dims.Y;
+	while(pSrc->Pixel < numPixels){
+		int value = pgmPixel(pSrc);
+		if(value < 0){
+			pSrc->Pixel = numPixels;
+			break;
+		}
+		int64_t pixel = pSrc->Pixel++;
+		if(value >= pSrc->Threshold){
+			pPos->X = (int)(pixel % pSrc->Dims.X);
+			pPos->Y = (int)(pixel / pSrc->Dims.X);
+			return 1;
+		}
+	}
 	return 0;
 }
 
-int appendOffset(ScanProt* pProtocol, const uint32_t cycle, const int channel, const int64_t offsetValue){
-
-	CmdLine* pCmdLine = calloc(1,sizeof(CmdLine));
-	if (pCmdLine == NULL){
-		perror("Failure to create line at appendOffset - ");
+EXPORT int imageSource(CoordSource* pSrc, const char* ImageFile, int Threshold, struct Coord* StartPos, struct Coord* Spacing){
+	//Every pixel of a PGM mask with value >= Threshold, in raster order
+	memset(pSrc,0,sizeof(CoordSource));
+	pSrc->Kind = SRC_IMAGE;
+	pSrc->StartPos = *StartPos;
+	pSrc->Spacing = *Spacing;
+	pSrc->Threshold = Threshold;
+	pSrc->fp = fopen(ImageFile,"rb");
+	if(pSrc->fp == NULL){
+		fprintf(stderr,"Failed to open image file: %s\n",ImageFile);
 		return -1;
 	}
+	char magic[3] = {0,0,0};
+	if(fread(magic,1,2,pSrc->fp) != 2 || magic[0] != 'P' || (magic[1] != '2' && magic[1] != '5')
+			|| pgmToken(pSrc->fp,&pSrc->Dims.X) != 0 || pgmToken(pSrc->fp,&pSrc->Dims.Y) != 0
+			|| pgmToken(pSrc->fp,&pSrc->MaxVal) != 0
+			|| pSrc->Dims.X <= 0 || pSrc->Dims.Y <= 0 || pSrc->MaxVal <= 0 || pSrc->MaxVal > 65535){
+		fprintf(stderr,"Not a PGM image (P2/P5): %s\n",ImageFile);
+		closeSource(pSrc);
+		return -1;
+	}
+	pSrc->Binary = (magic[1] == '5');
+	fgetc(pSrc->fp);		//Single white space character before the data
+	pSrc->DataStart = fileTell(pSrc->fp);
 
-	pCmdLine->DSPCmd = 'A';
-	pCmdLine->ScanCmd = 'O';
-	pCmdLine->Cycle = cycle;
-	pCmdLine->Channel = channel;
-	pCmdLine->Value = offsetValue;
-
-	reassignPointers(pProtocol,pCmdLine);
+	Coord pos;
+	while(nextPixel(pSrc,&pos)){
+		pSrc->Count++;
+	}
+	resetSource(pSrc);
 	return 0;
 }
 
-int appendTrigIn(ScanProt* pProtocol, const uint32_t cycle, enum TrigIn risingFalling){
-
-		CmdLine* pCmdLine = calloc(1,sizeof(CmdLine));
-	if (pCmdLine == NULL){
-		perror("Failure to create line at appendTrigIn - ");
-		return -1;
+EXPORT int nextCoord(CoordSource* pSrc, struct Coord* pCoord){
+	if(pSrc->Index >= pSrc->Count){
+		return 0;
 	}
-
-	pCmdLine->DSPCmd = 'A';
-	switch (risingFalling){
-		case 1:
-			pCmdLine->ScanCmd = 'U';
+	uint32_t i;
+	uint32_t j;
+	int xcoord;
+	int ycoord;
+	Coord pos;
+	switch(pSrc->Kind){
+		case SRC_GRID:
+		case SRC_SERPENTINE:
+			i = pSrc->Index % (uint32_t)pSrc->Dims.X;
+			j = pSrc->Index / (uint32_t)pSrc->Dims.X;
+			if(pSrc->Kind == SRC_SERPENTINE && (j & 1)){
+				i = pSrc->Dims.X - 1 - i;			//Odd rows run backwards
+			}
+			pCoord->X = pSrc->StartPos.X + (int)i*pSrc->Spacing.X;
+			pCoord->Y = pSrc->StartPos.Y - (int)j*pSrc->Spacing.Y;
 			break;
-		case 2:
-			pCmdLine->ScanCmd = 'D';
+		case SRC_PATTERN:
+			if(fscanf(pSrc->fp,"%d %d",&xcoord,&ycoord) != 2){
+				return 0;
+			}
+			pCoord->X = pSrc->StartPos.X + (xcoord-1)*pSrc->Spacing.X;
+			pCoord->Y = pSrc->StartPos.Y - (ycoord-1)*pSrc->Spacing.Y;
+			break;
+		case SRC_FILE:
+			if(fscanf(pSrc->fp,"%d %d",&xcoord,&ycoord) != 2){
+				return 0;
+			}
+			pCoord->X = xcoord;
+			pCoord->Y = ycoord;
+			break;
+		case SRC_ARRAY:
+			*pCoord = pSrc->pArray[pSrc->Index];
+			break;
+		case SRC_STRIDED:
+			if(pSrc->Elem == ELEM_INT32){
+				pCoord->X = *(const int32_t*)(pSrc->pX + (int64_t)pSrc->Index*pSrc->StrideX);
+				pCoord->Y = *(const int32_t*)(pSrc->pY + (int64_t)pSrc->Index*pSrc->StrideY);
+			}else{
+				pCoord->X = (int)lround(*(const double*)(pSrc->pX + (int64_t)pSrc->Index*pSrc->StrideX));
+				pCoord->Y = (int)lround(*(const double*)(pSrc->pY + (int64_t)pSrc->Index*pSrc->StrideY));
+			}
+			break;
+		case SRC_IMAGE:
+			if(!nextPixel(pSrc,&pos)){
+				return 0;
+			}
+			pCoord->X = pSrc->StartPos.X + pos.X*pSrc->Spacing.X;
+			pCoord->Y = pSrc->StartPos.Y - pos.Y*pSrc->Spacing.Y;
 			break;
 		default:
-			pCmdLine->ScanCmd = 'U';
+			return 0;
+	}
+	pSrc->Index++;
+	return 1;
+}
+
+EXPORT void resetSource(CoordSource* pSrc){
+	pSrc->Index = 0;
+	pSrc->Pixel = 0;
+	if(pSrc->fp != NULL){
+		fileSeek(pSrc->fp,pSrc->DataStart,SEEK_SET);
+	}
+}
+
+EXPORT void closeSource(CoordSource* pSrc){
+	if(pSrc->fp != NULL){
+		fclose(pSrc->fp);
+		pSrc->fp = NULL;
+	}
+	pSrc->Count = pSrc->Index = 0;
+}
+
+EXPORT struct Coord sourceCentroid(CoordSource* pSrc){
+	//Centroid as computed by getCentroid, in one pass over the source; the source is left reset
+	int64_t sumX = 0;
+	int64_t sumY = 0;
+	uint32_t n = 0;
+	Coord pos;
+	Coord centroid = {0,0};
+	resetSource(pSrc);
+	while(nextCoord(pSrc,&pos)){
+		sumX += pos.X;
+		sumY += pos.Y;
+		n++;
 	}
-	pCmdLine->Cycle = cycle;
-	pCmdLine->Channel = TRIG;
-	pCmdLine->Value = 0;
+	resetSource(pSrc);
+	if(n > 0){
+		centroid.X = (int)(sumX/(int64_t)n);
+		centroid.Y = (int)(sumY/(int64_t)n);
+	}
+	return centroid;
+}
+
+
+/* RIG PROFILES ===================================================================================*/
+
+/* A rig profile holds the timing padding and channel map of one scan head.  Profiles are plain text,
+   one "Key<TAB>Value" pair per line ('#' starts a comment).  Keys not present keep their defaults,
+   which are the compile-time values from scancmdr.h. */
 
-	reassignPointers(pProtocol,pCmdLine);
+#define MAX_RIG_PROFILES 8
+#define GALVO_CHAN_MIN 3			//Galvo position channels (galvos 0-3)
+#define GALVO_CHAN_MAX 6
+
+typedef char DefaultGalvoChannels[(X >= GALVO_CHAN_MIN && X <= GALVO_CHAN_MAX && Y >= GALVO_CHAN_MIN
+								   && Y <= GALVO_CHAN_MAX && X != Y) ? 1 : -1];	//Compile-time check of the defaults
+
+static int checkRigChannels(double ChanX, double ChanY){
+	//The galvo channels of a profile: whole channel numbers, distinct, and galvo position channels,
+	//so never the trigger (TRIG) or loop (LOOP) channel.  Returns 0 or -1.
+	double chans[2] = {ChanX,ChanY};
+	int k;
+	for(k = 0; k < 2; k++){
+		if(!(chans[k] >= GALVO_CHAN_MIN && chans[k] <= GALVO_CHAN_MAX) || chans[k] != floor(chans[k])
+				|| chans[k] == TRIG || chans[k] == LOOP){
+			fprintf(stderr,"Rig profile Chan%c %g is not a galvo channel (%d-%d).\n",(k == 0) ? 'X' : 'Y',chans[k],
+					GALVO_CHAN_MIN,GALVO_CHAN_MAX);
+			return -1;
+		}
+	}
+	if(ChanX == ChanY){
+		fprintf(stderr,"Rig profile ChanX and ChanY are both channel %g.\n",ChanX);
+		return -1;
+	}
 	return 0;
 }
 
-//..................................................................................................
+static struct{
+	char Path[FILENAME_MAX];
+	RigProfile Profile;
+} RigCache[MAX_RIG_PROFILES];
+static int NumRigCached = 0;
+
+EXPORT struct RigProfile defaultRigProfile(){
+	RigProfile rig;
+	rig.SettleBase = MOVE_TIME;
+	rig.SettleSlope = 0;
+	rig.MoveTime = MOVE_TIME;
+	rig.TrigLen = TRIG_LEN;
+	rig.TimeOffset = TIME_OFFSET;
+	rig.ProtPeriod = PROT_PERIOD;
+	rig.ChanX = X;
+	rig.ChanY = Y;
+	rig.Baud = BAUD;
+	rig.MoveResync = MOVE_RESYNC;
+	rig.DutyWindow = 0;
+	rig.MaxDuty = 1;
+	rig.RegionSize = 0;
+	rig.MaxRegionDose = 0;
+	rig.RetimeExposure = 0;
+	return rig;
+}
+
+EXPORT struct RigProfile* loadRigProfile(const char* ProfileFile){
+	//Profiles are read once; later calls with the same file return the cached copy.
+	//Not thread-safe: load profiles at startup, before building protocols from several threads.
+	int i;
+	for(i = 0; i < NumRigCached; i++){
+		if(strcmp(RigCache[i].Path,ProfileFile) == 0){
+			metricAdd(&Metrics.RigHits,1);
+			return &RigCache[i].Profile;
+		}
+	}
+	metricAdd(&Metrics.RigMisses,1);
+	if(NumRigCached == MAX_RIG_PROFILES){
+		fprintf(stderr,"Too many rig profiles loaded (maximum %d).\n",MAX_RIG_PROFILES);
+		return NULL;
+	}
+
+	FILE* fp = fopen(ProfileFile,"r");
+	if(fp == NULL){
+		fprintf(stderr,"Failed to open rig profile: %s\n",ProfileFile);
+		return NULL;
+	}
+
+	RigProfile rig = defaultRigProfile();
+	double chanX = rig.ChanX;
+	double chanY = rig.ChanY;
+	char line[MAX_CMD_LEN];
+	char key[MAX_CMD_LEN];
+	double value;
+	while(fgets(line,MAX_CMD_LEN,fp) != NULL){
+		if(line[0] == '#' || sscanf(line,"%99s %lf",key,&value) != 2){
+			continue;
+		}
+		if(strcmp(key,"SettleBase") == 0)		{ rig.SettleBase = (uint32_t)value; }
+		else if(strcmp(key,"SettleSlope") == 0)	{ rig.SettleSlope = value; }
+		else if(strcmp(key,"MoveTime") == 0)	{ rig.MoveTime = (uint32_t)value; }
+		else if(strcmp(key,"TrigLen") == 0)		{ rig.TrigLen = (uint32_t)value; }
+		else if(strcmp(key,"TimeOffset") == 0)	{ rig.TimeOffset = (uint32_t)value; }
+		else if(strcmp(key,"ProtPeriod") == 0)	{ rig.ProtPeriod = (uint32_t)value; }
+		else if(strcmp(key,"ChanX") == 0)		{ chanX = value; }
+		else if(strcmp(key,"ChanY") == 0)		{ chanY = value; }
+		else if(strcmp(key,"Baud") == 0)		{ rig.Baud = (uint32_t)value; }
+		else if(strcmp(key,"MoveResync") == 0)	{ rig.MoveResync = (uint32_t)value; }
+		else if(strcmp(key,"DutyWindow") == 0)	{ rig.DutyWindow = (uint32_t)value; }
+		else if(strcmp(key,"MaxDuty") == 0)		{ rig.MaxDuty = value; }
+		else if(strcmp(key,"RegionSize") == 0)	{ rig.RegionSize = (int64_t)value; }
+		else if(strcmp(key,"MaxRegionDose") == 0)	{ rig.MaxRegionDose = (uint64_t)value; }
+		else if(strcmp(key,"RetimeExposure") == 0)	{ rig.RetimeExposure = (int)value; }
+		else { fprintf(stderr,"Unknown rig profile key: %s\n",key); }
+	}
+	fclose(fp);
+
+	if(checkRigChannels(chanX,chanY) != 0){
+		fprintf(stderr,"Rig profile not loaded: %s\n",ProfileFile);
+		return NULL;
+	}
+	rig.ChanX = (int)chanX;
+	rig.ChanY = (int)chanY;
+	if(rig.TimeOffset == 0){
+		fprintf(stderr,"Rig profile TimeOffset of 0 would put trigger waits in cycle 0, using %d.\n",TIME_OFFSET);
+		rig.TimeOffset = TIME_OFFSET;
+	}
+
+	strncpy(RigCache[NumRigCached].Path,ProfileFile,FILENAME_MAX-1);
+	RigCache[NumRigCached].Profile = rig;
+	return &RigCache[NumRigCached++].Profile;
+}
+
+EXPORT int saveRigProfile(const char* ProfileFile, struct RigProfile* Rig){
+	//Refuses a profile that loadRigProfile would reject, rather than write one that cannot be read
+	if(checkRigChannels(Rig->ChanX,Rig->ChanY) != 0){
+		return -1;
+	}
+	FILE* fp = fopen(ProfileFile,"w");
+	if(fp == NULL){
+		fprintf(stderr,"Failed to open rig profile for writing: %s\n",ProfileFile);
+		return -1;
+	}
+	fprintf(fp,"# scancmdr rig profile (times in 10-us cycles)\n");
+	fprintf(fp,"SettleBase\t%" PRIu32 "\n",Rig->SettleBase);
+	fprintf(fp,"SettleSlope\t%.9g\n",Rig->SettleSlope);
+	fprintf(fp,"MoveTime\t%" PRIu32 "\n",Rig->MoveTime);
+	fprintf(fp,"TrigLen\t%" PRIu32 "\n",Rig->TrigLen);
+	fprintf(fp,"TimeOffset\t%" PRIu32 "\n",Rig->TimeOffset);
+	fprintf(fp,"ProtPeriod\t%" PRIu32 "\n",Rig->ProtPeriod);
+	fprintf(fp,"ChanX\t%d\n",Rig->ChanX);
+	fprintf(fp,"ChanY\t%d\n",Rig->ChanY);
+	fprintf(fp,"Baud\t%" PRIu32 "\n",Rig->Baud);
+	fprintf(fp,"MoveResync\t%" PRIu32 "\n",Rig->MoveResync);
+	fprintf(fp,"DutyWindow\t%" PRIu32 "\n",Rig->DutyWindow);
+	fprintf(fp,"MaxDuty\t%.9g\n",Rig->MaxDuty);
+	fprintf(fp,"RegionSize\t%" PRId64 "\n",Rig->RegionSize);
+	fprintf(fp,"MaxRegionDose\t%" PRIu64 "\n",Rig->MaxRegionDose);
+	fprintf(fp,"RetimeExposure\t%d\n",Rig->RetimeExposure);
+	fclose(fp);
+	return 0;
+}
+
+uint32_t settleCycles(struct RigProfile* Rig, int64_t Distance){
+	//Settle model: fixed settle plus a term linear in travel, never more than a full-range move
+	double settle = Rig->SettleBase + Rig->SettleSlope*(double)Distance;
+	uint32_t cycles = (uint32_t)ceil(settle);
+	return (cycles < Rig->MoveTime) ? cycles : Rig->MoveTime;
+}
+
+EXPORT int measureSettle(const char* FeedbackFile, int64_t Tolerance, struct RigProfile* Rig){
+	/* Derives the settle model of a rig from recorded position feedback.  The feedback file holds
+	   one sample per line, "cycle<TAB>channel<TAB>commanded<TAB>position", where position is the
+	   reading returned by the '?' query and commanded is the value last set on that channel.  A
+	   step starts whenever the commanded value of a channel changes, and has settled at the first
+	   sample after which the reading stays within Tolerance of the command.  SettleBase and
+	   SettleSlope are fitted to all steps by least squares, and MoveTime is set to the slowest
+	   step.  Returns the number of steps measured, or -1 on error. */
+
+	FILE* fp = fopen(FeedbackFile,"r");
+	if(fp == NULL){
+		fprintf(stderr,"Failed to open feedback file: %s\n",FeedbackFile);
+		return -1;
+	}
+
+	struct{
+		int Active;
+		uint32_t StepCycle;		//Cycle at which the command changed
+		uint32_t SettleCycle;	//First cycle of the current in-tolerance run
+		int Settled;
+		int64_t Commanded;
+		int64_t Distance;
+	} chan[LOOP];
+	memset(chan,0,sizeof(chan));
+
+	double sum[4] = {0,0,0,0};	//Sums of distance, settle time, distance^2, distance*time
+	uint32_t maxT = 0;
+	int numSteps = 0;
+
+	uint32_t cycle;
+	int channel;
+	int64_t commanded, position;
+	int c;
+	for(;;){
+		int nRead = fscanf(fp,"%" SCNu32 "\t%d\t%" SCNd64 "\t%" SCNd64,&cycle,&channel,&commanded,&position);
+		int atEnd = (nRead != 4);
+		for(c = 0; c < LOOP; c++){
+			//A step is complete when its channel is commanded elsewhere, or at the end of the file
+			if(!(atEnd || (c == channel && chan[c].Active && commanded != chan[c].Commanded))){
+				continue;
+			}
+			if(chan[c].Active && chan[c].Settled && chan[c].Distance > 0){
+				double t = chan[c].SettleCycle - chan[c].StepCycle;
+				double d = chan[c].Distance;
+				sum[0] += d; sum[1] += t; sum[2] += d*d; sum[3] += d*t;
+				if(t > maxT){ maxT = (uint32_t)t; }
+				numSteps++;
+			}
+		}
+		if(atEnd){
+			break;
+		}
+		if(channel < 0 || channel >= LOOP){
+			continue;
+		}
+		if(!chan[channel].Active || commanded != chan[channel].Commanded){
+			chan[channel].Distance = chan[channel].Active ? llabs(commanded - chan[channel].Commanded) : 0;
+			chan[channel].Active = 1;
+			chan[channel].Commanded = commanded;
+			chan[channel].StepCycle = cycle;
+			chan[channel].Settled = 0;
+		}
+		if(llabs(position - commanded) <= Tolerance){
+			if(!chan[channel].Settled){
+				chan[channel].SettleCycle = cycle;
+				chan[channel].Settled = 1;
+			}
+		}else{
+			chan[channel].Settled = 0;			//Left tolerance again, not settled yet
+		}
+	}
+	fclose(fp);
+
+	if(numSteps == 0){
+		fprintf(stderr,"No settled steps found in feedback file: %s\n",FeedbackFile);
+		return 0;
+	}
+
+	double slope = 0;
+	double denom = numSteps*sum[2] - sum[0]*sum[0];
+	if(denom > 0){
+		slope = (numSteps*sum[3] - sum[0]*sum[1])/denom;
+	}
+	if(slope < 0){
+		slope = 0;
+	}
+	double base = (sum[1] - slope*sum[0])/numSteps;
+
+	Rig->SettleBase = (base > 0) ? (uint32_t)ceil(base) : 0;
+	Rig->SettleSlope = slope;
+	Rig->MoveTime = maxT;
+	return numSteps;
+}
+
+/* SCAN COMMAND FUNCTIONS =========================================================================*/
+
+/* Protocols are stored as a contiguous array of packed 16-byte records (see PackedCmd), which grows
+   by doubling.  The DSP control command is always 'A' inside a protocol, so only the scan command
+   is stored, as a 4-bit index into CMD_OPS. */
+
+PackedCmd packCmd(const char ScanCmd, const uint32_t cycle, const int channel, const int64_t value){
+	PackedCmd cmd = {0,0};
+	const char* pOp = (ScanCmd != '\0') ? strchr(CMD_OPS,ScanCmd) : NULL;
+	if(pOp == NULL){
+		fprintf(stderr,"Unknown scan command '%c', stored as '0'.\n",ScanCmd);
+		pOp = CMD_OPS;
+	}
+	if(channel < 0 || channel > CMD_CHAN_MASK){
+		fprintf(stderr,"Channel %d out of range for a packed command.\n",channel);
+	}
+	cmd.Head = ((uint64_t)cycle & CMD_CYCLE_MASK)
+			 | ((uint64_t)(pOp - CMD_OPS) << CMD_OP_SHIFT)
+			 | ((uint64_t)(channel & CMD_CHAN_MASK) << CMD_CHAN_SHIFT);
+	cmd.Value = value;
+	return cmd;
+}
+
+struct CmdLine unpackCmd(const PackedCmd* pCmd){
+	CmdLine line;
+	line.DSPCmd = 'A';
+	line.ScanCmd = cmdScan(pCmd);
+	line.Cycle = cmdCycle(pCmd);
+	line.Channel = cmdChannel(pCmd);
+	line.Value = cmdValue(pCmd);
+	return line;
+}
+
+ScanProt* createProtocol(){							//Initialize a protocol (allocate heap memory);
+    ScanProt* pScanProt = calloc(1,sizeof(ScanProt));
+	if (pScanProt == NULL){
+		perror("Failure to create protocol (allocation error) - ");
+	}
+	return pScanProt;
+}
+
+int reserveCmds(ScanProt* pProtocol, uint32_t capacity){		//Grow command array to hold capacity
+	if(capacity <= pProtocol->Capacity){
+		return 0;
+	}
+	PackedCmd* pCmds = realloc(pProtocol->pCmds,capacity*sizeof(PackedCmd));
+	if(pCmds == NULL){
+		perror("Failure to grow protocol (allocation error) - ");
+		return -1;
+	}
+	pProtocol->pCmds = pCmds;
+	pProtocol->Capacity = capacity;
+	return 0;
+}
+
+int pushCmd(ScanProt* pProtocol, const char ScanCmd, const uint32_t cycle, const int channel, const int64_t value){
+	//Appends one packed command at the end of the protocol; an unknown scan command or a channel
+	//the record cannot hold is rejected, not stored as another one
+	if(ScanCmd == '\0' || strchr(CMD_OPS,ScanCmd) == NULL){
+		fprintf(stderr,"Unknown scan command (code %d).\n",(int)(unsigned char)ScanCmd);
+		return -1;
+	}
+	if(channel < 0 || channel > CMD_CHAN_MASK){
+		fprintf(stderr,"Channel %d out of range for a packed command.\n",channel);
+		return -1;
+	}
+	if(pProtocol->NumCmds == pProtocol->Capacity){
+		uint32_t capacity = (pProtocol->Capacity == 0) ? 64 : 2*pProtocol->Capacity;
+		if(reserveCmds(pProtocol,capacity) != 0){
+			return -1;
+		}
+	}
+	pProtocol->pCmds[pProtocol->NumCmds++] = packCmd(ScanCmd,cycle,channel,value);
+	return 0;
+}
+
+void clearProtocol(ScanProt* pProtocol){							//Free all commands from protocol
+	free(pProtocol->pCmds);
+	pProtocol->pCmds = NULL;
+	pProtocol->NumCmds = pProtocol->Capacity = 0;
+}
+
+void freeProtocol(ScanProt* pProtocol){							//Free protocol and its commands
+	if(pProtocol != NULL){
+		clearProtocol(pProtocol);
+		free(pProtocol);
+	}
+}
+
+int appendMove(ScanProt* pProtocol, int channel, const uint32_t cycle, const int64_t position){
+    //Appends a move command for single channel at end of list
+	return pushCmd(pProtocol,'V',cycle,channel,position);
+}
+
+int appendLoop(ScanProt* pProtocol, const char StartOrEnd, const uint32_t cycle, const int64_t repetitions){
+    //Append a loop start command at end of list.
+	//Start or end are specified as 'S' or 'E' characters
+	//Note: no limit-checking on repetitions
+	switch (StartOrEnd){
+		case 'S':
+			return pushCmd(pProtocol,START,cycle,LOOP,repetitions);
+		case 'E':
+			return pushCmd(pProtocol,END,cycle,LOOP,repetitions);
+		default: fputs("Start(S) or End(E) not indicated for loop command line\n", stderr);
+	}
+	return -1;
+}
+
+int appendTrigOut(ScanProt* pProtocol, const uint32_t cycle, enum TrigCfg trigger){
+	return pushCmd(pProtocol,'V',cycle,TRIG,trigger);
+}
+
+int appendIncr(ScanProt* pProtocol,const uint32_t cycle, const int channel, const int64_t increment){
+    //Increment of increment to be implemented later.
+	return pushCmd(pProtocol,'I',cycle,channel,increment);
+}
+
+int appendWait(ScanProt* pProtocol, const int64_t waitTime){
+	return pushCmd(pProtocol,'0',(uint32_t)waitTime,0,0);
+}
+
+int appendRel(ScanProt* pProtocol,  const uint32_t cycle, const int channel, const int64_t deltaValue){
+	return pushCmd(pProtocol,'R',cycle,channel,deltaValue);
+}
+
+int appendOffset(ScanProt* pProtocol, const uint32_t cycle, const int channel, const int64_t offsetValue){
+	return pushCmd(pProtocol,'O',cycle,channel,offsetValue);
+}
+
+int appendTrigIn(ScanProt* pProtocol, const uint32_t cycle, enum TrigIn risingFalling){
+	switch (risingFalling){
+		case 2:
+			return pushCmd(pProtocol,'D',cycle,TRIG,0);
+		case 1:
+		default:
+			return pushCmd(pProtocol,'U',cycle,TRIG,0);
+	}
+}
+
+//..................................................................................................
+
+/* PROTOCOL SNAPSHOTS =============================================================================*/
+
+/* Snapshots and drafts hold a table of pointers to fixed-size chunks.  Each chunk counts the tables
+   (snapshots and drafts) that refer to it: a draft may write to a chunk in place only while it holds
+   the sole reference, otherwise it first replaces the chunk with a private copy.  Published chunks
+   are therefore never modified, and readers need no lock.  Reference counts use the GCC atomic
+   builtins (also provided by MinGW). */
+
+static void retainChunk(ProtChunk* pChunk){
+	__atomic_add_fetch(&pChunk->RefCount,1,__ATOMIC_RELAXED);
+}
+
+static void releaseChunk(ProtChunk* pChunk){
+	if(__atomic_sub_fetch(&pChunk->RefCount,1,__ATOMIC_ACQ_REL) == 0){
+		free(pChunk);
+	}
+}
+
+static ProtChunk** copyChunkTable(ProtChunk** ppChunks, uint32_t numChunks, uint32_t capacity){
+	//Copies a chunk table, taking a reference to every chunk
+	ProtChunk** ppCopy = malloc((capacity > 0 ? capacity : 1)*sizeof(ProtChunk*));
+	if(ppCopy == NULL){
+		perror("Failure to allocate chunk table - ");
+		return NULL;
+	}
+	uint32_t i;
+	for(i = 0; i < numChunks; i++){
+		ppCopy[i] = ppChunks[i];
+		retainChunk(ppCopy[i]);
+	}
+	return ppCopy;
+}
+
+ProtSnapshot* snapshotProtocol(ScanProt* pProtocol){
+	//Copies a protocol into a new snapshot, returned with one reference
+	ProtDraft* pDraft = editSnapshot(NULL);
+	if(pDraft == NULL){
+		return NULL;
+	}
+	uint32_t i;
+	for(i = 0; i < pProtocol->NumCmds; i++){
+		if(draftPushCmd(pDraft,pProtocol->pCmds[i]) != 0){
+			freeDraft(pDraft);
+			return NULL;
+		}
+	}
+	ProtSnapshot* pSnap = commitDraft(pDraft);
+	freeDraft(pDraft);
+	return pSnap;
+}
+
+void retainSnapshot(ProtSnapshot* pSnap){
+	__atomic_add_fetch(&pSnap->RefCount,1,__ATOMIC_RELAXED);
+}
+
+void releaseSnapshot(ProtSnapshot* pSnap){
+	if(pSnap == NULL){
+		return;
+	}
+	if(__atomic_sub_fetch(&pSnap->RefCount,1,__ATOMIC_ACQ_REL) == 0){
+		uint32_t i;
+		for(i = 0; i < pSnap->NumChunks; i++){
+			releaseChunk(pSnap->ppChunks[i]);
+		}
+		free(pSnap->ppChunks);
+		free(pSnap);
+	}
+}
+
+const PackedCmd* snapshotCmd(ProtSnapshot* pSnap, uint32_t index){
+	if(index >= pSnap->NumCmds){
+		return NULL;
+	}
+	return &pSnap->ppChunks[index/SNAP_CHUNK]->Cmds[index%SNAP_CHUNK];
+}
+
+static uint32_t chunkCmds(uint32_t numCmds, uint32_t chunk){
+	//Number of valid commands in a chunk of a table holding numCmds commands
+	uint32_t remaining = numCmds - chunk*SNAP_CHUNK;
+	return (remaining < SNAP_CHUNK) ? remaining : SNAP_CHUNK;
+}
+
+char* SnapshotToString(ProtSnapshot* pSnap){
+	//Same output as ProtToString for the protocol the snapshot was taken from
+	size_t ProtSize = sizeof(CLEAR);
+	uint32_t i;
+	for(i = 0; i < pSnap->NumChunks; i++){
+		ProtSize += rangeLength(pSnap->ppChunks[i]->Cmds,chunkCmds(pSnap->NumCmds,i));
+	}
+	char* StrProtocol = (char*)malloc(ProtSize*sizeof(char));
+	if (StrProtocol == NULL){
+		fprintf(stderr,"Failure to allocate memory block for protocol string.\n");
+		return NULL;
+	}
+	strcpy(StrProtocol,CLEAR);
+	size_t ProtLen = sizeof(CLEAR) - 1;
+	for(i = 0; i < pSnap->NumChunks; i++){
+		ProtLen += formatRange(StrProtocol+ProtLen,pSnap->ppChunks[i]->Cmds,chunkCmds(pSnap->NumCmds,i));
+	}
+	StrProtocol[ProtLen] = '\0';
+	return StrProtocol;
+}
+
+int checkSnapshotTrigIn(ProtSnapshot* pSnap){
+	int numBad = 0;
+	uint32_t i;
+	for(i = 0; i < pSnap->NumChunks; i++){
+		numBad += trigInRange(pSnap->ppChunks[i]->Cmds,chunkCmds(pSnap->NumCmds,i));
+	}
+	return numBad;
+}
+
+ProtDraft* editSnapshot(ProtSnapshot* pSnap){
+	//Starts a draft sharing every chunk of pSnap (NULL for an empty draft)
+	ProtDraft* pDraft = calloc(1,sizeof(ProtDraft));
+	if(pDraft == NULL){
+		perror("Failure to create draft (allocation error) - ");
+		return NULL;
+	}
+	if(pSnap != NULL){
+		pDraft->ppChunks = copyChunkTable(pSnap->ppChunks,pSnap->NumChunks,pSnap->NumChunks);
+		if(pDraft->ppChunks == NULL){
+			free(pDraft);
+			return NULL;
+		}
+		pDraft->NumCmds = pSnap->NumCmds;
+		pDraft->NumChunks = pDraft->Capacity = pSnap->NumChunks;
+	}
+	return pDraft;
+}
+
+const PackedCmd* draftCmd(ProtDraft* pDraft, uint32_t index){
+	if(index >= pDraft->NumCmds){
+		return NULL;
+	}
+	return &pDraft->ppChunks[index/SNAP_CHUNK]->Cmds[index%SNAP_CHUNK];
+}
+
+static ProtChunk* writableChunk(ProtDraft* pDraft, uint32_t chunk){
+	//Returns a chunk the draft may modify, copying it first if it is shared
+	ProtChunk* pChunk = pDraft->ppChunks[chunk];
+	if(__atomic_load_n(&pChunk->RefCount,__ATOMIC_ACQUIRE) == 1){
+		return pChunk;
+	}
+	ProtChunk* pCopy = malloc(sizeof(ProtChunk));
+	if(pCopy == NULL){
+		perror("Failure to copy protocol chunk - ");
+		return NULL;
+	}
+	memcpy(pCopy->Cmds,pChunk->Cmds,sizeof(pCopy->Cmds));
+	pCopy->RefCount = 1;
+	pDraft->ppChunks[chunk] = pCopy;
+	releaseChunk(pChunk);
+	return pCopy;
+}
+
+int draftSetCmd(ProtDraft* pDraft, uint32_t index, PackedCmd cmd){
+	if(index >= pDraft->NumCmds){
+		fprintf(stderr,"Command %" PRIu32 " is beyond the end of the draft.\n",index);
+		return -1;
+	}
+	ProtChunk* pChunk = writableChunk(pDraft,index/SNAP_CHUNK);
+	if(pChunk == NULL){
+		return -1;
+	}
+	pChunk->Cmds[index%SNAP_CHUNK] = cmd;
+	return 0;
+}
+
+int draftPushCmd(ProtDraft* pDraft, PackedCmd cmd){
+	uint32_t chunk = pDraft->NumCmds/SNAP_CHUNK;
+	if(chunk == pDraft->NumChunks){
+		if(pDraft->NumChunks == pDraft->Capacity){
+			uint32_t capacity = (pDraft->Capacity == 0) ? 8 : 2*pDraft->Capacity;
+			ProtChunk** ppChunks = realloc(pDraft->ppChunks,capacity*sizeof(ProtChunk*));
+			if(ppChunks == NULL){
+				perror("Failure to grow chunk table - ");
+				return -1;
+			}
+			pDraft->ppChunks = ppChunks;
+			pDraft->Capacity = capacity;
+		}
+		ProtChunk* pNew = malloc(sizeof(ProtChunk));
+		if(pNew == NULL){
+			perror("Failure to allocate protocol chunk - ");
+			return -1;
+		}
+		pNew->RefCount = 1;
+		pDraft->ppChunks[pDraft->NumChunks++] = pNew;
+	}
+	ProtChunk* pChunk = writableChunk(pDraft,chunk);
+	if(pChunk == NULL){
+		return -1;
+	}
+	pChunk->Cmds[pDraft->NumCmds%SNAP_CHUNK] = cmd;
+	pDraft->NumCmds++;
+	return 0;
+}
+
+void draftTruncate(ProtDraft* pDraft, uint32_t numCmds){
+	//Drops commands from the end; whole chunks past the new end are released
+	if(numCmds >= pDraft->NumCmds){
+		return;
+	}
+	uint32_t numChunks = (numCmds + SNAP_CHUNK - 1)/SNAP_CHUNK;
+	while(pDraft->NumChunks > numChunks){
+		releaseChunk(pDraft->ppChunks[--pDraft->NumChunks]);
+	}
+	pDraft->NumCmds = numCmds;
+}
+
+ProtSnapshot* commitDraft(ProtDraft* pDraft){
+	//Freezes the current draft contents into a new snapshot (one reference); the draft stays
+	//editable, and its next write to any chunk copies that chunk
+	ProtSnapshot* pSnap = calloc(1,sizeof(ProtSnapshot));
+	if(pSnap == NULL){
+		perror("Failure to create snapshot (allocation error) - ");
+		return NULL;
+	}
+	pSnap->ppChunks = copyChunkTable(pDraft->ppChunks,pDraft->NumChunks,pDraft->NumChunks);
+	if(pSnap->ppChunks == NULL){
+		free(pSnap);
+		return NULL;
+	}
+	pSnap->RefCount = 1;
+	pSnap->NumCmds = pDraft->NumCmds;
+	pSnap->NumChunks = pDraft->NumChunks;
+	return pSnap;
+}
+
+void freeDraft(ProtDraft* pDraft){
+	if(pDraft == NULL){
+		return;
+	}
+	uint32_t i;
+	for(i = 0; i < pDraft->NumChunks; i++){
+		releaseChunk(pDraft->ppChunks[i]);
+	}
+	free(pDraft->ppChunks);
+	free(pDraft);
+}
+
+static void spinWait(uint32_t* pSpins){
+	//Backoff for a short wait on another thread: a pause hint at first, then give up the core
+	if(++*pSpins < 64){
+#if defined(__i386__) || defined(__x86_64__)
+		__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+		__asm__ __volatile__("yield");
+#endif
+	}else{
+#ifdef __WIN32__
+		SwitchToThread();
+#else
+		sched_yield();
+#endif
+	}
+}
+
+void publishSnapshot(ProtSlot* pSlot, ProtSnapshot* pSnap){
+	/* Makes pSnap current, taking over the caller's reference.  The previous snapshot is released
+	   once no reader is between loading it and retaining it.  Readers count themselves under the
+	   parity of the epoch they read; flipping the epoch sends new readers to the other counter, so
+	   each wait below only covers readers already inside acquireSnapshot (a load and an increment)
+	   when the epoch flipped, however many keep arriving.  Two flips cover a reader that read the
+	   epoch before an earlier publish and counted itself late.  The wait is therefore bounded by a
+	   few reader critical sections, plus the time a preempted reader takes to run again. */
+	ProtSnapshot* pOld = __atomic_exchange_n(&pSlot->pCurrent,pSnap,__ATOMIC_SEQ_CST);
+	int flip;
+	for(flip = 0; flip < 2; flip++){
+		uint32_t epoch = __atomic_fetch_add(&pSlot->Epoch,1,__ATOMIC_SEQ_CST);
+		uint32_t spins = 0;
+		while(__atomic_load_n(&pSlot->Readers[epoch & 1],__ATOMIC_SEQ_CST) != 0){
+			spinWait(&spins);
+		}
+	}
+	releaseSnapshot(pOld);
+}
+
+ProtSnapshot* acquireSnapshot(ProtSlot* pSlot){
+	//Returns the current snapshot with a reference the caller must release (NULL if none)
+	uint32_t* pReaders = &pSlot->Readers[__atomic_load_n(&pSlot->Epoch,__ATOMIC_SEQ_CST) & 1];
+	__atomic_add_fetch(pReaders,1,__ATOMIC_SEQ_CST);
+	ProtSnapshot* pSnap = __atomic_load_n(&pSlot->pCurrent,__ATOMIC_SEQ_CST);
+	if(pSnap != NULL){
+		retainSnapshot(pSnap);
+	}
+	__atomic_sub_fetch(pReaders,1,__ATOMIC_SEQ_CST);
+	return pSnap;
+}
+
+/* PARALLEL SERIALIZATION =========================================================================*/
+
+/* The commands of all protocols in a batch are cut into chunks of SER_CHUNK.  Worker threads first
+   measure every chunk's formatted length, a prefix sum over the chunks gives each one its output
+   offset, and the workers then format the chunks straight into place in a single buffer.  Chunks
+   are handed out through an atomic counter.  The text is identical to ProtToString's. */
+
+#define SER_CHUNK 4096				//Commands per work item
+#define SER_MIN_PARALLEL 65536		//Batches with fewer commands are serialized on the calling thread
+#define MAX_WORKERS 64				//Most threads runWorkers starts, whatever the caller asks for
+
+typedef struct SerJob{
+	ScanProt** ppProts;
+	uint32_t* pChunkProt;			//Protocol of each chunk
+	uint32_t* pChunkStart;			//First command of each chunk within its protocol
+	size_t* pChunkPos;				//Formatted length of each chunk, then its output offset
+	uint32_t NumChunks;
+	uint32_t NextChunk;
+	int Format;						//0: measure chunks, 1: format chunks
+	char* pOut;
+} SerJob;
+
+static int numCores(){
+#ifdef __WIN32__
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (int)info.dwNumberOfProcessors;
+#else
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	return (cores > 0) ? (int)cores : 1;
+#endif
+}
+
+static void* serWorker(void* pArg){
+	SerJob* pJob = pArg;
+	uint32_t c;
+	while((c = __atomic_fetch_add(&pJob->NextChunk,1,__ATOMIC_RELAXED)) < pJob->NumChunks){
+		ScanProt* pProt = pJob->ppProts[pJob->pChunkProt[c]];
+		uint32_t start = pJob->pChunkStart[c];
+		uint32_t count = (pProt->NumCmds - start < SER_CHUNK) ? pProt->NumCmds - start : SER_CHUNK;
+		if(pJob->Format){
+			formatRange(pJob->pOut + pJob->pChunkPos[c],&pProt->pCmds[start],count);
+		}else{
+			pJob->pChunkPos[c] = rangeLength(&pProt->pCmds[start],count);
+		}
+	}
+	return NULL;
+}
+
+static void runWorkers(void* (*pWorker)(void*), void* pJob, int NumThreads){
+	//Runs pWorker(pJob) on NumThreads threads, including the calling thread.  The workers are CPU
+	//bound, so NumThreads is capped at the core count (and at MAX_WORKERS)
+	pthread_t threads[MAX_WORKERS-1];
+	int cores = numCores();
+	NumThreads = (NumThreads < cores) ? NumThreads : cores;
+	NumThreads = (NumThreads < MAX_WORKERS) ? NumThreads : MAX_WORKERS;
+	int started = 0;
+	while(started < NumThreads-1 && pthread_create(&threads[started],NULL,pWorker,pJob) == 0){
+		started++;
+	}
+	pWorker(pJob);
+	while(started > 0){
+		pthread_join(threads[--started],NULL);
+	}
+}
+
+EXPORT char* serializeBatch(ScanProt** ppProts, uint32_t NumProts, int NumThreads, size_t* pOffsets){
+	//Serializes NumProts protocols into one buffer (free with free()).  Protocol i starts at
+	//pOffsets[i] and is NUL-terminated, as ProtToString would return it; pOffsets[NumProts] is the
+	//total size.  pOffsets may be NULL.  NumThreads <= 0 uses one thread per core, as does a count
+	//above the core count.
+	SerJob job;
+	memset(&job,0,sizeof(job));
+	job.ppProts = ppProts;
+	uint64_t totalCmds = 0;
+	uint32_t p, c;
+	for(p = 0; p < NumProts; p++){
+		job.NumChunks += (ppProts[p]->NumCmds + SER_CHUNK - 1)/SER_CHUNK;
+		totalCmds += ppProts[p]->NumCmds;
+	}
+	if(NumThreads <= 0){
+		NumThreads = numCores();
+	}
+	if(totalCmds < SER_MIN_PARALLEL){
+		NumThreads = 1;
+	}
+
+	size_t* pStarts = (pOffsets != NULL) ? pOffsets : malloc((NumProts + 1)*sizeof(size_t));
+	job.pChunkProt = malloc((job.NumChunks + 1)*sizeof(uint32_t));
+	job.pChunkStart = malloc((job.NumChunks + 1)*sizeof(uint32_t));
+	job.pChunkPos = malloc((job.NumChunks + 1)*sizeof(size_t));
+	if(pStarts == NULL || job.pChunkProt == NULL || job.pChunkStart == NULL || job.pChunkPos == NULL){
+		fprintf(stderr,"Failure to allocate serialization chunks.\n");
+	}else{
+		c = 0;
+		for(p = 0; p < NumProts; p++){
+			uint32_t start;
+			for(start = 0; start < ppProts[p]->NumCmds; start += SER_CHUNK){
+				job.pChunkProt[c] = p;
+				job.pChunkStart[c++] = start;
+			}
+		}
+
+		/* Measure, then turn lengths into offsets (CLEAR line before and NUL after each protocol) */
+		job.NextChunk = 0;
+		runWorkers(serWorker,&job,NumThreads);
+		size_t offset = 0;
+		c = 0;
+		for(p = 0; p < NumProts; p++){
+			pStarts[p] = offset;
+			offset += sizeof(CLEAR) - 1;
+			for(; c < job.NumChunks && job.pChunkProt[c] == p; c++){
+				size_t len = job.pChunkPos[c];
+				job.pChunkPos[c] = offset;
+				offset += len;
+			}
+			offset++;
+		}
+		pStarts[NumProts] = offset;
+
+		/* Format */
+		job.pOut = malloc(offset > 0 ? offset : 1);
+		if(job.pOut == NULL){
+			fprintf(stderr,"Failure to allocate memory block for protocol batch.\n");
+		}else{
+			for(p = 0; p < NumProts; p++){
+				memcpy(job.pOut + pStarts[p],CLEAR,sizeof(CLEAR) - 1);
+				job.pOut[pStarts[p+1] - 1] = '\0';
+			}
+			job.Format = 1;
+			job.NextChunk = 0;
+			runWorkers(serWorker,&job,NumThreads);
+		}
+	}
+
+	if(pStarts != pOffsets){
+		free(pStarts);
+	}
+	free(job.pChunkProt);
+	free(job.pChunkStart);
+	free(job.pChunkPos);
+	return job.pOut;
+}
+
+EXPORT char* ProtToStringParallel(ScanProt* pProt, int NumThreads){
+	//ProtToString for one large protocol, formatted on NumThreads threads
+	return serializeBatch(&pProt,1,NumThreads,NULL);
+}
+
+/* PROTOCOL ARCHIVE ===============================================================================*/
+
+/* An archive is a pair of append-only files: <path>.obj holds each distinct protocol once, and
+   <path>.idx holds one 16-byte record (trial, hash) per archived trial.  Protocols are keyed by the
+   64-bit FNV-1a hash of their text.  Payloads are stored as binary command records (op and channel
+   in one byte, then zigzag varints of the cycle delta and of the value delta from the previous
+   command on the same channel) when the text parses and reformats byte-exactly, and as raw text
+   otherwise.  Records use the host byte order.
+
+	Object record:	key (8) | text length (4) | payload length (4) | kind (1) | payload
+	Index record:	trial (8) | key (8)
+
+   The key is the hash, unless another protocol was stored under it first: a match on the key is
+   confirmed on the length and bytes of the text, and a different text with the same hash takes the
+   next free key.  A write cut short (power loss, a full disk) can leave a partial record at the end
+   of either file; openArchive truncates it away, so the archive stays readable and appendable. */
+
+#define ARCH_RAW 0
+#define ARCH_PACKED 1
+#define ARCH_HEADER 17				//Bytes of an object record before its payload
+
+EXPORT uint64_t hashProtocol(const char* StrProtocol){
+	uint64_t hash = 14695981039346656037ULL;			//FNV-1a, 64-bit
+	const unsigned char* p;
+	for(p = (const unsigned char*)StrProtocol; *p != '\0'; p++){
+		hash = (hash ^ *p) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+static size_t putVarint(unsigned char* dest, int64_t value){
+	uint64_t zigzag = ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+	size_t len = 0;
+	while(zigzag >= 0x80){
+		dest[len++] = (unsigned char)(zigzag | 0x80);
+		zigzag >>= 7;
+	}
+	dest[len++] = (unsigned char)zigzag;
+	return len;
+}
+
+static const unsigned char* getVarint(const unsigned char* src, const unsigned char* end, int64_t* pValue){
+	uint64_t zigzag = 0;
+	int shift = 0;
+	while(src < end && shift < 64){
+		unsigned char byte = *src++;
+		zigzag |= (uint64_t)(byte & 0x7F) << shift;
+		if(!(byte & 0x80)){
+			*pValue = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+			return src;
+		}
+		shift += 7;
+	}
+	return NULL;
+}
+
+static unsigned char* packProtocol(ScanProt* pProt, uint32_t* pLen){
+	//Delta/varint encoding of a protocol (at most 1 + 2*10 bytes per command, plus the count)
+	unsigned char* pBuf = malloc(10 + (size_t)pProt->NumCmds*21);
+	if(pBuf == NULL){
+		perror("Failure to allocate archive buffer - ");
+		return NULL;
+	}
+	int64_t lastValue[CMD_CHAN_MASK+1] = {0};
+	int64_t lastCycle = 0;
+	size_t len = putVarint(pBuf,pProt->NumCmds);
+	uint32_t i;
+	for(i = 0; i < pProt->NumCmds; i++){
+		PackedCmd* pCmd = &pProt->pCmds[i];
+		int channel = cmdChannel(pCmd);
+		pBuf[len++] = (unsigned char)(((pCmd->Head >> CMD_OP_SHIFT) & 0xF) | (channel << 4));
+		len += putVarint(pBuf+len,(int64_t)cmdCycle(pCmd) - lastCycle);
+		len += putVarint(pBuf+len,cmdValue(pCmd) - lastValue[channel]);
+		lastCycle = cmdCycle(pCmd);
+		lastValue[channel] = cmdValue(pCmd);
+	}
+	*pLen = (uint32_t)len;
+	return pBuf;
+}
+
+static ScanProt* unpackProtocol(const unsigned char* pBuf, uint32_t len){
+	/* Nothing in the record is trusted: every command takes at least 3 bytes, so a count beyond a
+	   third of the payload is corrupt before anything is allocated for it, and each op code and
+	   cycle is checked before it is pushed. */
+	const unsigned char* end = pBuf + len;
+	int64_t numCmds = 0;
+	int64_t lastValue[CMD_CHAN_MASK+1] = {0};
+	int64_t cycle = 0;
+	pBuf = getVarint(pBuf,end,&numCmds);
+	if(pBuf == NULL || numCmds < 0 || numCmds > (end - pBuf)/3){
+		fprintf(stderr,"Corrupt archive record.\n");
+		return NULL;
+	}
+	ScanProt* pProt = createProtocol();
+	if(pProt == NULL || reserveCmds(pProt,(uint32_t)numCmds) != 0){
+		freeProtocol(pProt);
+		return NULL;
+	}
+	int64_t i;
+	for(i = 0; i < numCmds && pBuf != NULL && pBuf < end; i++){
+		int64_t dCycle = 0;
+		int64_t dValue = 0;
+		int op = *pBuf & 0xF;
+		int channel = *pBuf++ >> 4;
+		pBuf = getVarint(pBuf,end,&dCycle);
+		pBuf = (pBuf != NULL) ? getVarint(pBuf,end,&dValue) : NULL;
+		cycle += dCycle;
+		if(op == 0 || op >= (int)strlen(CMD_OPS) || cycle < 0 || cycle > UINT32_MAX){
+			break;
+		}
+		lastValue[channel] += dValue;
+		pushCmd(pProt,CMD_OPS[op],(uint32_t)cycle,channel,lastValue[channel]);
+	}
+	if(pBuf == NULL || i != numCmds){
+		fprintf(stderr,"Corrupt archive record.\n");
+		freeProtocol(pProt);
+		return NULL;
+	}
+	return pProt;
+}
+
+static int64_t findObject(ProtArchive* pArchive, uint64_t hash){
+	//Open addressing on the hash; returns the object's file offset, or -1
+	if(pArchive->Slots == 0){
+		return -1;
+	}
+	uint32_t mask = pArchive->Slots - 1;
+	uint32_t slot = (uint32_t)hash & mask;
+	while(pArchive->pOffsets[slot] != 0){
+		if(pArchive->pHashes[slot] == hash){
+			return (int64_t)pArchive->pOffsets[slot] - 1;
+		}
+		slot = (slot + 1) & mask;
+	}
+	return -1;
+}
+
+static int addObject(ProtArchive* pArchive, uint64_t hash, uint64_t offset){
+	if(2*(pArchive->NumObjects + 1) > pArchive->Slots){			//Keep load factor below 1/2
+		uint32_t slots = (pArchive->Slots == 0) ? 64 : 2*pArchive->Slots;
+		uint64_t* pHashes = calloc(slots,sizeof(uint64_t));
+		uint64_t* pOffsets = calloc(slots,sizeof(uint64_t));
+		if(pHashes == NULL || pOffsets == NULL){
+			perror("Failure to grow archive table - ");
+			free(pHashes);
+			free(pOffsets);
+			return -1;
+		}
+		uint32_t i;
+		for(i = 0; i < pArchive->Slots; i++){
+			if(pArchive->pOffsets[i] != 0){
+				uint32_t slot = (uint32_t)pArchive->pHashes[i] & (slots - 1);
+				while(pOffsets[slot] != 0){
+					slot = (slot + 1) & (slots - 1);
+				}
+				pHashes[slot] = pArchive->pHashes[i];
+				pOffsets[slot] = pArchive->pOffsets[i];
+			}
+		}
+		free(pArchive->pHashes);
+		free(pArchive->pOffsets);
+		pArchive->pHashes = pHashes;
+		pArchive->pOffsets = pOffsets;
+		pArchive->Slots = slots;
+	}
+	uint32_t slot = (uint32_t)hash & (pArchive->Slots - 1);
+	while(pArchive->pOffsets[slot] != 0){
+		slot = (slot + 1) & (pArchive->Slots - 1);
+	}
+	pArchive->pHashes[slot] = hash;
+	pArchive->pOffsets[slot] = offset + 1;				//0 marks an empty slot
+	pArchive->NumObjects++;
+	return 0;
+}
+
+static FILE* openArchiveFile(const char* ArchivePath, const char* Extension){
+	char path[FILENAME_MAX];
+	snprintf(path,sizeof(path),"%s%s",ArchivePath,Extension);
+	FILE* fp = fopen(path,"a+b");
+	if(fp == NULL){
+		fprintf(stderr,"Failed to open archive file: %s\n",path);
+	}
+	return fp;
+}
+
+static int archTruncate(FILE* fp, int64_t Size, const char* What){
+	//Cuts a partial record off the end of an archive file, leaving it positioned at the new end
+	fprintf(stderr,"Archive %s file ends in a partial record (interrupted write); truncating it.\n",What);
+	fflush(fp);
+#ifdef __WIN32__
+	int status = _chsize_s(_fileno(fp),Size);
+#else
+	int status = ftruncate(fileno(fp),(off_t)Size);
+#endif
+	if(status != 0 || fileSeek(fp,0,SEEK_END) != 0){
+		fprintf(stderr,"Failed to truncate archive %s file.\n",What);
+		return -1;
+	}
+	return 0;
+}
+
+EXPORT ProtArchive* openArchive(const char* ArchivePath){
+	//Opens (or creates) the archive <ArchivePath>.obj/.idx and indexes the stored objects
+	ProtArchive* pArchive = calloc(1,sizeof(ProtArchive));
+	if(pArchive == NULL){
+		perror("Failure to open archive (allocation error) - ");
+		return NULL;
+	}
+	pArchive->pObjects = openArchiveFile(ArchivePath,".obj");
+	pArchive->pIndex = openArchiveFile(ArchivePath,".idx");
+	if(pArchive->pObjects == NULL || pArchive->pIndex == NULL){
+		closeArchive(pArchive);
+		return NULL;
+	}
+
+	/* Index objects by key, stopping at a record that would run past the end of the file */
+	uint64_t key;
+	uint32_t lens[2];
+	unsigned char kind;
+	fileSeek(pArchive->pObjects,0,SEEK_END);
+	int64_t objectSize = fileTell(pArchive->pObjects);
+	fileSeek(pArchive->pObjects,0,SEEK_SET);
+	int64_t offset = 0;
+	while(offset + ARCH_HEADER <= objectSize
+			&& fread(&key,sizeof(key),1,pArchive->pObjects) == 1 && fread(lens,sizeof(lens),1,pArchive->pObjects) == 1
+			&& fread(&kind,1,1,pArchive->pObjects) == 1
+			&& offset + ARCH_HEADER + lens[1] <= objectSize){
+		if(addObject(pArchive,key,(uint64_t)offset) != 0 || fileSeek(pArchive->pObjects,lens[1],SEEK_CUR) != 0){
+			closeArchive(pArchive);
+			return NULL;
+		}
+		offset += ARCH_HEADER + lens[1];
+	}
+	if(offset < objectSize && archTruncate(pArchive->pObjects,offset,"object") != 0){
+		closeArchive(pArchive);
+		return NULL;
+	}
+
+	/* Load the trial index */
+	fileSeek(pArchive->pIndex,0,SEEK_END);
+	int64_t indexSize = fileTell(pArchive->pIndex);
+	if(indexSize % sizeof(ArchiveEntry) != 0){
+		indexSize -= indexSize % sizeof(ArchiveEntry);
+		if(archTruncate(pArchive->pIndex,indexSize,"index") != 0){
+			closeArchive(pArchive);
+			return NULL;
+		}
+	}
+	if(indexSize/sizeof(ArchiveEntry) > UINT32_MAX){
+		fprintf(stderr,"Archive index too large.\n");
+		closeArchive(pArchive);
+		return NULL;
+	}
+	pArchive->NumTrials = pArchive->MaxTrials = (uint32_t)(indexSize/sizeof(ArchiveEntry));
+	pArchive->pTrials = malloc((pArchive->MaxTrials > 0 ? pArchive->MaxTrials : 1)*sizeof(ArchiveEntry));
+	fileSeek(pArchive->pIndex,0,SEEK_SET);
+	if(pArchive->pTrials == NULL
+			|| fread(pArchive->pTrials,sizeof(ArchiveEntry),pArchive->NumTrials,pArchive->pIndex) != pArchive->NumTrials){
+		fprintf(stderr,"Failed to read archive index.\n");
+		closeArchive(pArchive);
+		return NULL;
+	}
+	return pArchive;
+}
+
+static char* readObject(ProtArchive* pArchive, int64_t Offset, uint32_t* pTextLen){
+	//Text of the object record at Offset (NULL on error); with pTextLen, only reads the header and
+	//gives the text's length if it differs from *pTextLen
+	uint64_t key;
+	uint32_t lens[2];
+	unsigned char kind;
+	fileSeek(pArchive->pObjects,Offset,SEEK_SET);
+	if(fread(&key,sizeof(key),1,pArchive->pObjects) != 1 || fread(lens,sizeof(lens),1,pArchive->pObjects) != 1
+			|| fread(&kind,1,1,pArchive->pObjects) != 1){
+		fprintf(stderr,"Corrupt archive record.\n");
+		return NULL;
+	}
+	if(pTextLen != NULL && *pTextLen != lens[0]){
+		*pTextLen = lens[0];
+		return NULL;
+	}
+	unsigned char* pPayload = malloc((size_t)lens[1] + 1);
+	if(pPayload == NULL || fread(pPayload,1,lens[1],pArchive->pObjects) != lens[1]){
+		fprintf(stderr,"Failed to read archive record.\n");
+		free(pPayload);
+		return NULL;
+	}
+	if(kind == ARCH_RAW){
+		pPayload[lens[1]] = '\0';
+		return (char*)pPayload;
+	}
+	ScanProt* pProt = unpackProtocol(pPayload,lens[1]);
+	free(pPayload);
+	if(pProt == NULL){
+		return NULL;
+	}
+	char* StrProtocol = ProtToString(pProt);
+	freeProtocol(pProt);
+	return StrProtocol;
+}
+
+static int sameObject(ProtArchive* pArchive, uint64_t Key, int64_t Offset, const char* StrProtocol, size_t Len){
+	//1 if the object stored under Key holds exactly StrProtocol, 0 if another text, -1 on error.  The
+	//last object matched is kept in memory, so archiving the same protocol again reads nothing.
+	if(pArchive->pLastText == NULL || pArchive->LastKey != Key){
+		uint32_t textLen = (uint32_t)Len;
+		char* pText = readObject(pArchive,Offset,&textLen);
+		if(pText == NULL){
+			return (textLen != (uint32_t)Len) ? 0 : -1;
+		}
+		free(pArchive->pLastText);
+		pArchive->pLastText = pText;
+		pArchive->LastLen = strlen(pText);
+		pArchive->LastKey = Key;
+	}
+	return pArchive->LastLen == Len && memcmp(pArchive->pLastText,StrProtocol,Len) == 0;
+}
+
+EXPORT int archiveTrial(ProtArchive* pArchive, uint64_t Trial, const char* StrProtocol){
+	//Records the protocol sent for a trial.  Returns 0 if the protocol was already stored (only the
+	//16-byte index record is written), 1 if it was added, -1 on error.
+	size_t textLen = strlen(StrProtocol);
+	if(textLen > UINT32_MAX){
+		fprintf(stderr,"Protocol too large to archive.\n");
+		return -1;
+	}
+	uint64_t key = hashProtocol(StrProtocol);
+	int64_t found;
+	while((found = findObject(pArchive,key)) >= 0){
+		int same = sameObject(pArchive,key,found,StrProtocol,textLen);
+		if(same != 0){
+			if(same < 0){
+				return -1;
+			}
+			break;
+		}
+		key++;										//Hash collision: the next key
+	}
+	int added = 0;
+	if(found < 0){
+		uint32_t lens[2] = {(uint32_t)textLen,0};
+		unsigned char kind = ARCH_RAW;
+		unsigned char* pPayload = NULL;
+		ScanProt* pProt = stringToProt(StrProtocol);
+		if(pProt != NULL){
+			char* pCheck = ProtToString(pProt);
+			if(pCheck != NULL && strcmp(pCheck,StrProtocol) == 0){
+				pPayload = packProtocol(pProt,&lens[1]);
+				kind = (pPayload != NULL) ? ARCH_PACKED : ARCH_RAW;
+			}
+			free(pCheck);
+			freeProtocol(pProt);
+		}
+		if(kind == ARCH_RAW){
+			lens[1] = lens[0];
+		}
+		fileSeek(pArchive->pObjects,0,SEEK_END);
+		int64_t offset = fileTell(pArchive->pObjects);
+		int ok = offset >= 0
+			  && fwrite(&key,sizeof(key),1,pArchive->pObjects) == 1
+			  && fwrite(lens,sizeof(lens),1,pArchive->pObjects) == 1
+			  && fwrite(&kind,1,1,pArchive->pObjects) == 1
+			  && fwrite((kind == ARCH_RAW) ? (const void*)StrProtocol : (const void*)pPayload,1,lens[1],pArchive->pObjects) == lens[1]
+			  && fflush(pArchive->pObjects) == 0;
+		free(pPayload);
+		if(!ok || addObject(pArchive,key,(uint64_t)offset) != 0){
+			perror("Failure to write archive object - ");
+			return -1;
+		}
+		added = 1;
+	}
+
+	if(pArchive->NumTrials == pArchive->MaxTrials){
+		uint32_t maxTrials = (pArchive->MaxTrials == 0) ? 64 : 2*pArchive->MaxTrials;
+		ArchiveEntry* pTrials = realloc(pArchive->pTrials,maxTrials*sizeof(ArchiveEntry));
+		if(pTrials == NULL){
+			perror("Failure to grow archive index - ");
+			return -1;
+		}
+		pArchive->pTrials = pTrials;
+		pArchive->MaxTrials = maxTrials;
+	}
+	ArchiveEntry entry = {Trial,key};
+	fileSeek(pArchive->pIndex,0,SEEK_END);
+	if(fwrite(&entry,sizeof(entry),1,pArchive->pIndex) != 1 || fflush(pArchive->pIndex) != 0){
+		perror("Failure to write archive index - ");
+		return -1;
+	}
+	pArchive->pTrials[pArchive->NumTrials++] = entry;
+	metricAdd(added ? &Metrics.ArchiveMisses : &Metrics.ArchiveHits,1);
+	return added;
+}
+
+EXPORT char* loadProtocol(ProtArchive* pArchive, uint64_t Hash){
+	//Reconstructs the exact protocol text stored under Hash (NULL if absent)
+	int64_t offset = findObject(pArchive,Hash);
+	if(offset < 0){
+		fprintf(stderr,"Protocol %016" PRIx64 " not in archive.\n",Hash);
+		return NULL;
+	}
+	return readObject(pArchive,offset,NULL);
+}
+
+EXPORT char* loadTrial(ProtArchive* pArchive, uint64_t Trial){
+	//Protocol text of the most recent record for Trial (NULL if absent)
+	uint32_t i;
+	for(i = pArchive->NumTrials; i > 0; i--){
+		if(pArchive->pTrials[i-1].Trial == Trial){
+			return loadProtocol(pArchive,pArchive->pTrials[i-1].Hash);
+		}
+	}
+	fprintf(stderr,"Trial %" PRIu64 " not in archive.\n",Trial);
+	return NULL;
+}
+
+EXPORT void closeArchive(ProtArchive* pArchive){
+	if(pArchive == NULL){
+		return;
+	}
+	if(pArchive->pObjects != NULL){ fclose(pArchive->pObjects); }
+	if(pArchive->pIndex != NULL){ fclose(pArchive->pIndex); }
+	free(pArchive->pHashes);
+	free(pArchive->pOffsets);
+	free(pArchive->pTrials);
+	free(pArchive->pLastText);
+	free(pArchive);
+}
+
+/* PROTOCOL DIFF ==================================================================================*/
+
+/* Commands are aligned on everything but their cycle (scan command, channel and value) with Myers'
+   O(ND) algorithm in its linear-space form (bisection on the middle snake, after trimming common
+   prefix and suffix).  Aligned commands whose cycles differ by the same amount are reported as one
+   SHIFT; an unaligned removal and insertion of the same scan command and channel at the same point
+   is reported as a MODIFY.  The edit script is kept in the ProtDiff so it can also drive partial
+   uploads. */
+
+#define DIFF_MAX_D 1024				//Edit distance beyond which a range is treated as replaced
+
+typedef struct DiffCtx{
+	const PackedCmd* pOld;
+	const PackedCmd* pNew;
+	int* pV;						//Forward and reverse furthest-reaching paths (bisect only)
+	uint32_t NextOld;				//First commands after the last aligned pair
+	uint32_t NextNew;
+	ProtDiff* pDiff;
+	int Failed;
+} DiffCtx;
+
+static int sameCmd(const PackedCmd* pA, const PackedCmd* pB){
+	//Equal apart from the cycle
+	return ((pA->Head ^ pB->Head) & ~CMD_CYCLE_MASK) == 0 && pA->Value == pB->Value;
+}
+
+static void addEdit(DiffCtx* pCtx, enum DiffOp Op, uint32_t OldIndex, uint32_t NewIndex, int64_t Shift){
+	//Appends one command to the script, merging it into the previous edit where possible
+	ProtDiff* pDiff = pCtx->pDiff;
+	if(pDiff->NumEdits > 0){
+		ProtEdit* pLast = &pDiff->pEdits[pDiff->NumEdits-1];
+		uint32_t oldStep = (Op == D_INSERT) ? 0 : 1;
+		uint32_t newStep = (Op == D_REMOVE) ? 0 : 1;
+		if(pLast->Op == Op && pLast->Shift == Shift
+				&& pLast->OldStart + pLast->Count*oldStep == OldIndex && pLast->NewStart + pLast->Count*newStep == NewIndex){
+			pLast->Count++;
+			return;
+		}
+	}
+	if(pDiff->NumEdits == pDiff->Capacity){
+		uint32_t capacity = (pDiff->Capacity == 0) ? 64 : 2*pDiff->Capacity;
+		ProtEdit* pEdits = realloc(pDiff->pEdits,capacity*sizeof(ProtEdit));
+		if(pEdits == NULL){
+			pCtx->Failed = 1;
+			return;
+		}
+		pDiff->pEdits = pEdits;
+		pDiff->Capacity = capacity;
+	}
+	ProtEdit edit = {Op,OldIndex,NewIndex,1,Shift};
+	pDiff->pEdits[pDiff->NumEdits++] = edit;
+}
+
+static void addGap(DiffCtx* pCtx, uint32_t a0, uint32_t a1, uint32_t b0, uint32_t b1){
+	//Unaligned commands between two aligned ones: pair same-kind commands as modifications
+	while(a0 < a1 && b0 < b1 && ((pCtx->pOld[a0].Head ^ pCtx->pNew[b0].Head) & ~CMD_CYCLE_MASK) == 0){
+		addEdit(pCtx,D_MODIFY,a0++,b0++,0);
+	}
+	while(a0 < a1){
+		addEdit(pCtx,D_REMOVE,a0++,b0,0);
+	}
+	while(b0 < b1){
+		addEdit(pCtx,D_INSERT,a0,b0++,0);
+	}
+}
+
+static void addMatch(DiffCtx* pCtx, uint32_t OldIndex, uint32_t NewIndex){
+	//Aligned pair; everything since the previous pair is unaligned.  Myers yields the pairs in order.
+	addGap(pCtx,pCtx->NextOld,OldIndex,pCtx->NextNew,NewIndex);
+	pCtx->NextOld = OldIndex + 1;
+	pCtx->NextNew = NewIndex + 1;
+	int64_t shift = (int64_t)cmdCycle(&pCtx->pNew[NewIndex]) - (int64_t)cmdCycle(&pCtx->pOld[OldIndex]);
+	addEdit(pCtx,(shift == 0) ? D_SAME : D_SHIFT,OldIndex,NewIndex,shift);
+}
+
+static void diffRange(DiffCtx* pCtx, uint32_t a0, uint32_t a1, uint32_t b0, uint32_t b1);
+
+static void bisectRange(DiffCtx* pCtx, uint32_t a0, uint32_t a1, uint32_t b0, uint32_t b1){
+	//Finds the middle snake of the shortest edit script and recurses on both halves
+	const PackedCmd* pA = pCtx->pOld + a0;
+	const PackedCmd* pB = pCtx->pNew + b0;
+	int N = (int)(a1 - a0);
+	int M = (int)(b1 - b0);
+	int maxD = (N + M + 1)/2;
+	int vOffset = maxD;
+	int vLength = 2*maxD;
+	int* v1 = pCtx->pV;
+	int* v2 = pCtx->pV + vLength;
+	int i;
+	for(i = 0; i < vLength; i++){
+		v1[i] = v2[i] = -1;
+	}
+	v1[vOffset+1] = v2[vOffset+1] = 0;
+	int delta = N - M;
+	int front = (delta % 2 != 0);
+	int k1start = 0, k1end = 0, k2start = 0, k2end = 0;
+	int d;
+	for(d = 0; d < maxD && d < DIFF_MAX_D; d++){
+		int k1;
+		for(k1 = -d + k1start; k1 <= d - k1end; k1 += 2){
+			int k1Offset = vOffset + k1;
+			int x1 = (k1 == -d || (k1 != d && v1[k1Offset-1] < v1[k1Offset+1])) ? v1[k1Offset+1] : v1[k1Offset-1] + 1;
+			int y1 = x1 - k1;
+			while(x1 < N && y1 < M && sameCmd(&pA[x1],&pB[y1])){
+				x1++;
+				y1++;
+			}
+			v1[k1Offset] = x1;
+			if(x1 > N){
+				k1end += 2;
+			}else if(y1 > M){
+				k1start += 2;
+			}else if(front){
+				int k2Offset = vOffset + delta - k1;
+				if(k2Offset >= 0 && k2Offset < vLength && v2[k2Offset] != -1 && x1 >= N - v2[k2Offset]){
+					diffRange(pCtx,a0,a0+x1,b0,b0+y1);
+					diffRange(pCtx,a0+x1,a1,b0+y1,b1);
+					return;
+				}
+			}
+		}
+		int k2;
+		for(k2 = -d + k2start; k2 <= d - k2end; k2 += 2){
+			int k2Offset = vOffset + k2;
+			int x2 = (k2 == -d || (k2 != d && v2[k2Offset-1] < v2[k2Offset+1])) ? v2[k2Offset+1] : v2[k2Offset-1] + 1;
+			int y2 = x2 - k2;
+			while(x2 < N && y2 < M && sameCmd(&pA[N-x2-1],&pB[M-y2-1])){
+				x2++;
+				y2++;
+			}
+			v2[k2Offset] = x2;
+			if(x2 > N){
+				k2end += 2;
+			}else if(y2 > M){
+				k2start += 2;
+			}else if(!front){
+				int k1Offset = vOffset + delta - k2;
+				if(k1Offset >= 0 && k1Offset < vLength && v1[k1Offset] != -1){
+					int x1 = v1[k1Offset];
+					int y1 = vOffset + x1 - k1Offset;
+					if(x1 >= N - x2){
+						diffRange(pCtx,a0,a0+x1,b0,b0+y1);
+						diffRange(pCtx,a0+x1,a1,b0+y1,b1);
+						return;
+					}
+				}
+			}
+		}
+	}
+	//Nothing in common (or too little to be worth DIFF_MAX_D rounds): the range is left unaligned
+}
+
+static void diffRange(DiffCtx* pCtx, uint32_t a0, uint32_t a1, uint32_t b0, uint32_t b1){
+	while(a0 < a1 && b0 < b1 && sameCmd(&pCtx->pOld[a0],&pCtx->pNew[b0])){	//Common prefix
+		addMatch(pCtx,a0++,b0++);
+	}
+	uint32_t suffix = 0;
+	while(a1 - suffix > a0 && b1 - suffix > b0 && sameCmd(&pCtx->pOld[a1-suffix-1],&pCtx->pNew[b1-suffix-1])){
+		suffix++;
+	}
+	a1 -= suffix;
+	b1 -= suffix;
+	if(a0 < a1 && b0 < b1){
+		bisectRange(pCtx,a0,a1,b0,b1);
+	}
+	uint32_t i;
+	for(i = 0; i < suffix; i++){									//Common suffix
+		addMatch(pCtx,a1+i,b1+i);
+	}
+}
+
+EXPORT ProtDiff* diffProtocols(ScanProt* pOld, ScanProt* pNew){
+	//Edit script turning pOld into pNew (free with freeDiff)
+	ProtDiff* pDiff = calloc(1,sizeof(ProtDiff));
+	int* pV = malloc(((size_t)2*(pOld->NumCmds + pNew->NumCmds) + 4)*sizeof(int));
+	if(pDiff == NULL || pV == NULL){
+		perror("Failure to allocate protocol diff - ");
+		free(pDiff);
+		free(pV);
+		return NULL;
+	}
+	DiffCtx ctx = {pOld->pCmds,pNew->pCmds,pV,0,0,pDiff,0};
+	diffRange(&ctx,0,pOld->NumCmds,0,pNew->NumCmds);
+	addGap(&ctx,ctx.NextOld,pOld->NumCmds,ctx.NextNew,pNew->NumCmds);
+	free(pV);
+	if(ctx.Failed){
+		perror("Failure to grow protocol diff - ");
+		freeDiff(pDiff);
+		return NULL;
+	}
+	uint32_t i;
+	for(i = 0; i < pDiff->NumEdits; i++){
+		pDiff->NumChanged += (pDiff->pEdits[i].Op != D_SAME);
+	}
+	return pDiff;
+}
+
+EXPORT char* DiffToString(ProtDiff* pDiff, ScanProt* pOld, ScanProt* pNew){
+	//Readable report: one line per unchanged or shifted range, one per modified, inserted or
+	//removed command.  Indices count commands (the CLEAR line is not included).
+	size_t size = 64;
+	uint32_t i, j;
+	for(i = 0; i < pDiff->NumEdits; i++){
+		uint32_t lines = (pDiff->pEdits[i].Op == D_SAME || pDiff->pEdits[i].Op == D_SHIFT) ? 1 : pDiff->pEdits[i].Count;
+		size += (size_t)lines*(64 + 2*MAX_LINE_LEN);
+	}
+	char* pReport = malloc(size);
+	if(pReport == NULL){
+		fprintf(stderr,"Failure to allocate memory block for diff report.\n");
+		return NULL;
+	}
+	size_t len = sprintf(pReport,"%" PRIu32 " edits, %" PRIu32 " changed\n",pDiff->NumEdits,pDiff->NumChanged);
+	for(i = 0; i < pDiff->NumEdits; i++){
+		ProtEdit* pEdit = &pDiff->pEdits[i];
+		switch(pEdit->Op){
+			case D_SAME:
+				len += sprintf(pReport+len,"= %" PRIu32 "-%" PRIu32 " unchanged\n",pEdit->OldStart,pEdit->OldStart+pEdit->Count-1);
+				break;
+			case D_SHIFT:
+				len += sprintf(pReport+len,"~ %" PRIu32 "-%" PRIu32 " -> %" PRIu32 "-%" PRIu32 " shifted %+" PRId64 " cycles\n",
+						pEdit->OldStart,pEdit->OldStart+pEdit->Count-1,pEdit->NewStart,pEdit->NewStart+pEdit->Count-1,pEdit->Shift);
+				break;
+			case D_MODIFY:
+				for(j = 0; j < pEdit->Count; j++){
+					len += sprintf(pReport+len,"! %" PRIu32 " -> %" PRIu32 " ",pEdit->OldStart+j,pEdit->NewStart+j);
+					len += formatRange(pReport+len,&pOld->pCmds[pEdit->OldStart+j],1) - 1;
+					len += sprintf(pReport+len," => ");
+					len += formatRange(pReport+len,&pNew->pCmds[pEdit->NewStart+j],1);
+				}
+				break;
+			case D_INSERT:
+				for(j = 0; j < pEdit->Count; j++){
+					len += sprintf(pReport+len,"+ %" PRIu32 " ",pEdit->NewStart+j);
+					len += formatRange(pReport+len,&pNew->pCmds[pEdit->NewStart+j],1);
+				}
+				break;
+			case D_REMOVE:
+				for(j = 0; j < pEdit->Count; j++){
+					len += sprintf(pReport+len,"- %" PRIu32 " ",pEdit->OldStart+j);
+					len += formatRange(pReport+len,&pOld->pCmds[pEdit->OldStart+j],1);
+				}
+				break;
+		}
+	}
+	pReport[len] = '\0';
+	return pReport;
+}
+
+EXPORT char* diffArchivedTrials(ProtArchive* pArchive, uint64_t OldTrial, uint64_t NewTrial){
+	//Diff report between the protocols archived for two trials
+	char* pOldStr = loadTrial(pArchive,OldTrial);
+	char* pNewStr = loadTrial(pArchive,NewTrial);
+	ScanProt* pOld = (pOldStr != NULL) ? stringToProt(pOldStr) : NULL;
+	ScanProt* pNew = (pNewStr != NULL) ? stringToProt(pNewStr) : NULL;
+	ProtDiff* pDiff = (pOld != NULL && pNew != NULL) ? diffProtocols(pOld,pNew) : NULL;
+	char* pReport = (pDiff != NULL) ? DiffToString(pDiff,pOld,pNew) : NULL;
+	free(pOldStr);
+	free(pNewStr);
+	freeProtocol(pOld);
+	freeProtocol(pNew);
+	freeDiff(pDiff);
+	return pReport;
+}
+
+EXPORT void freeDiff(ProtDiff* pDiff){
+	if(pDiff != NULL){
+		free(pDiff->pEdits);
+		free(pDiff);
+	}
+}
+
+/* MOSAIC TILING ==================================================================================*/
+
+/* Targets are binned into a grid of TileSize cells anchored at the corner of their bounding box; a
+   hash table from cell to tile keeps only the occupied cells, so partitioning is linear in the number
+   of targets however sparse the field.  Each tile is centred on the bounding box of its own targets,
+   which are therefore within half a tile of the centre.  Tiles are visited nearest-neighbour first,
+   then improved by 2-opt; larger mosaics are scanned row by row, alternating direction. */
+
+#define MOSAIC_MAX_OPT 4096			//Larger mosaics are ordered by rows
+#define MOSAIC_2OPT_PASSES 50
+
+typedef struct TileCell{
+	uint32_t Col;
+	uint32_t Row;
+	uint32_t Count;
+	Coord Min;						//Bounding box of the tile's targets
+	Coord Max;
+} TileCell;
+
+typedef struct TileIndex{			//Occupied cells, with an open-addressing table (key + 1 -> cell)
+	TileCell* pCells;
+	uint32_t NumCells;
+	uint32_t MaxCells;
+	uint64_t* pKeys;
+	uint32_t* pIds;
+	uint32_t Slots;
+} TileIndex;
+
+typedef struct MosaicJob{
+	Mosaic* pMosaic;
+	uint32_t NextTile;
+	uint32_t Baseline;
+	uint32_t TimeOn;
+	uint16_t NumPulses;
+	uint32_t ISI;
+	uint32_t Iterations;
+	uint32_t EpisodePeriod;
+	uint16_t Reps;
+	int64_t ScaleFactor;
+	enum Trigger Trig;
+	struct RigProfile* Rig;
+} MosaicJob;
+
+static uint32_t tileSlot(uint64_t key, uint32_t Slots){
+	return (uint32_t)((key*0x9E3779B97F4A7C15ULL) >> 32) & (Slots-1);
+}
+
+static int growTileIndex(TileIndex* pIndex){
+	//Doubles the cell array and rehashes the table
+	uint32_t maxCells = (pIndex->MaxCells > 0) ? 2*pIndex->MaxCells : 64;
+	TileCell* pCells = realloc(pIndex->pCells,maxCells*sizeof(TileCell));
+	uint64_t* pKeys = calloc(2*maxCells,sizeof(uint64_t));
+	uint32_t* pIds = malloc(2*maxCells*sizeof(uint32_t));
+	if(pCells != NULL){
+		pIndex->pCells = pCells;
+	}
+	if(pCells == NULL || pKeys == NULL || pIds == NULL){
+		perror("Failure to grow tile index - ");
+		free(pKeys);
+		free(pIds);
+		return -1;
+	}
+	uint32_t c;
+	for(c = 0; c < pIndex->NumCells; c++){
+		uint64_t key = ((uint64_t)pCells[c].Col << 32 | pCells[c].Row) + 1;
+		uint32_t slot = tileSlot(key,2*maxCells);
+		while(pKeys[slot] != 0){
+			slot = (slot + 1) & (2*maxCells-1);
+		}
+		pKeys[slot] = key;
+		pIds[slot] = c;
+	}
+	free(pIndex->pKeys);
+	free(pIndex->pIds);
+	pIndex->pKeys = pKeys;
+	pIndex->pIds = pIds;
+	pIndex->MaxCells = maxCells;
+	pIndex->Slots = 2*maxCells;
+	return 0;
+}
+
+static int64_t tileCell(TileIndex* pIndex, uint32_t Col, uint32_t Row){
+	//Cell (Col, Row), added if new; -1 on allocation failure
+	uint64_t key = ((uint64_t)Col << 32 | Row) + 1;
+	if(pIndex->NumCells == pIndex->MaxCells && growTileIndex(pIndex) != 0){
+		return -1;
+	}
+	uint32_t slot = tileSlot(key,pIndex->Slots);
+	while(pIndex->pKeys[slot] != 0){
+		if(pIndex->pKeys[slot] == key){
+			return pIndex->pIds[slot];
+		}
+		slot = (slot + 1) & (pIndex->Slots-1);
+	}
+	uint32_t c = pIndex->NumCells++;
+	pIndex->pKeys[slot] = key;
+	pIndex->pIds[slot] = c;
+	memset(&pIndex->pCells[c],0,sizeof(TileCell));
+	pIndex->pCells[c].Col = Col;
+	pIndex->pCells[c].Row = Row;
+	return c;
+}
+
+static int64_t stageDistance(Coord* From, Coord* To){
+	//Stage axes move together, so the longer axis sets the travel time
+	int64_t dX = llabs((int64_t)To->X - From->X);
+	int64_t dY = llabs((int64_t)To->Y - From->Y);
+	return (dX > dY) ? dX : dY;
+}
+
+static int rowOrder(const void* pA, const void* pB){
+	//Rows in order, columns alternating direction (pointers into a TileCell array)
+	const TileCell* a = *(const TileCell* const*)pA;
+	const TileCell* b = *(const TileCell* const*)pB;
+	if(a->Row != b->Row){
+		return (a->Row < b->Row) ? -1 : 1;
+	}
+	if(a->Col == b->Col){
+		return 0;
+	}
+	return ((a->Col < b->Col) == !(a->Row & 1)) ? -1 : 1;
+}
+
+static void orderTiles(Coord* pCenters, uint32_t* pOrder, uint32_t NumTiles, uint32_t First){
+	//Visiting order starting at tile First: nearest neighbour, then 2-opt on the open path
+	uint32_t i, j;
+	for(i = 0; i < NumTiles; i++){
+		pOrder[i] = i;
+	}
+	pOrder[0] = First;
+	pOrder[First] = 0;
+	for(i = 1; i < NumTiles; i++){
+		uint32_t best = i;
+		int64_t bestDist = INT64_MAX;
+		for(j = i; j < NumTiles; j++){
+			int64_t dist = stageDistance(&pCenters[pOrder[i-1]],&pCenters[pOrder[j]]);
+			if(dist < bestDist){
+				bestDist = dist;
+				best = j;
+			}
+		}
+		uint32_t swap = pOrder[i];
+		pOrder[i] = pOrder[best];
+		pOrder[best] = swap;
+	}
+
+	int pass;
+	int improved = 1;
+	for(pass = 0; improved && pass < MOSAIC_2OPT_PASSES; pass++){
+		improved = 0;
+		for(i = 0; i + 2 < NumTiles; i++){
+			Coord* a = &pCenters[pOrder[i]];
+			Coord* b = &pCenters[pOrder[i+1]];
+			int64_t ab = stageDistance(a,b);
+			for(j = i + 2; j < NumTiles; j++){
+				Coord* c = &pCenters[pOrder[j]];
+				int64_t delta = stageDistance(a,c) - ab;
+				if(j + 1 < NumTiles){
+					Coord* d = &pCenters[pOrder[j+1]];
+					delta += stageDistance(b,d) - stageDistance(c,d);
+				}
+				if(delta < 0){
+					uint32_t lo = i + 1;
+					uint32_t hi = j;
+					while(lo < hi){			//Reverse the path between b and c
+						uint32_t swap = pOrder[lo];
+						pOrder[lo++] = pOrder[hi];
+						pOrder[hi--] = swap;
+					}
+					b = &pCenters[pOrder[i+1]];
+					ab = stageDistance(a,b);
+					improved = 1;
+				}
+			}
+		}
+	}
+}
+
+static void* mosaicWorker(void* pArg){
+	MosaicJob* pJob = pArg;
+	Mosaic* pMosaic = pJob->pMosaic;
+	uint32_t t;
+	while((t = __atomic_fetch_add(&pJob->NextTile,1,__ATOMIC_RELAXED)) < pMosaic->NumTiles){
+		MosaicTile* pTile = &pMosaic->pTiles[t];
+		CoordSource source;
+		arraySource(&source,&pMosaic->pTargets[pTile->FirstTarget],pTile->NumTargets);
+		pTile->Protocol = buildTargetSourceCycles(&source,pJob->Baseline,pJob->TimeOn,pJob->NumPulses,
+				pJob->ISI,pJob->Iterations,pJob->EpisodePeriod,pJob->Reps,pJob->ScaleFactor,
+				&pTile->Center,&pJob->Trig,0,pJob->Rig);
+	}
+	return NULL;
+}
+
+static int partitionTargets(Mosaic* pMosaic, CoordSource* pSrc, TileIndex* pIndex){
+	//Reads the targets, bins them into cells and groups them by cell in visiting order
+	uint32_t n = pSrc->Count;
+	Coord* pRaw = malloc((n > 0 ? n : 1)*sizeof(Coord));
+	uint32_t* pCell = malloc((n > 0 ? n : 1)*sizeof(uint32_t));
+	pMosaic->pTargets = malloc((n > 0 ? n : 1)*sizeof(Coord));
+	if(pRaw == NULL || pCell == NULL || pMosaic->pTargets == NULL){
+		perror("Failure to partition mosaic (allocation error) - ");
+		free(pRaw);
+		free(pCell);
+		return -1;
+	}
+
+	/* Bounding box, then one cell per occupied tile */
+	Coord lo = {INT32_MAX,INT32_MAX};
+	uint32_t i = 0;
+	resetSource(pSrc);
+	while(i < n && nextCoord(pSrc,&pRaw[i])){
+		if(pRaw[i].X < lo.X){ lo.X = pRaw[i].X; }
+		if(pRaw[i].Y < lo.Y){ lo.Y = pRaw[i].Y; }
+		i++;
+	}
+	n = i;
+	for(i = 0; i < n; i++){
+		uint32_t col = (uint32_t)(((int64_t)pRaw[i].X - lo.X)/pMosaic->TileSize.X);
+		uint32_t row = (uint32_t)(((int64_t)pRaw[i].Y - lo.Y)/pMosaic->TileSize.Y);
+		int64_t c = tileCell(pIndex,col,row);
+		if(c < 0){
+			free(pRaw);
+			free(pCell);
+			return -1;
+		}
+		TileCell* pTileCell = &pIndex->pCells[c];
+		if(pTileCell->Count++ == 0){
+			pTileCell->Min = pTileCell->Max = pRaw[i];
+		}else{
+			if(pRaw[i].X < pTileCell->Min.X){ pTileCell->Min.X = pRaw[i].X; }
+			if(pRaw[i].Y < pTileCell->Min.Y){ pTileCell->Min.Y = pRaw[i].Y; }
+			if(pRaw[i].X > pTileCell->Max.X){ pTileCell->Max.X = pRaw[i].X; }
+			if(pRaw[i].Y > pTileCell->Max.Y){ pTileCell->Max.Y = pRaw[i].Y; }
+		}
+		pCell[i] = (uint32_t)c;
+	}
+
+	/* Tile centres and visiting order */
+	uint32_t numTiles = pIndex->NumCells;
+	pMosaic->pTiles = calloc((numTiles > 0 ? numTiles : 1),sizeof(MosaicTile));
+	Coord* pCenters = malloc((numTiles > 0 ? numTiles : 1)*sizeof(Coord));
+	uint32_t* pOrder = malloc((numTiles > 0 ? numTiles : 1)*sizeof(uint32_t));
+	uint32_t* pVisit = malloc((numTiles > 0 ? numTiles : 1)*sizeof(uint32_t));
+	TileCell** ppRows = malloc((numTiles > 0 ? numTiles : 1)*sizeof(TileCell*));
+	int failed = (pMosaic->pTiles == NULL || pCenters == NULL || pOrder == NULL || pVisit == NULL || ppRows == NULL);
+	if(failed){
+		perror("Failure to order mosaic tiles (allocation error) - ");
+	}else{
+		uint32_t c, t;
+		for(c = 0; c < numTiles; c++){
+			TileCell* pTileCell = &pIndex->pCells[c];
+			pCenters[c].X = (int)(((int64_t)pTileCell->Min.X + pTileCell->Max.X)/2);
+			pCenters[c].Y = (int)(((int64_t)pTileCell->Min.Y + pTileCell->Max.Y)/2);
+		}
+		if(numTiles <= MOSAIC_MAX_OPT){
+			if(numTiles > 0){
+				orderTiles(pCenters,pOrder,numTiles,pCell[0]);		//Start at the first target's tile
+			}
+		}else{
+			for(c = 0; c < numTiles; c++){
+				ppRows[c] = &pIndex->pCells[c];
+			}
+			qsort(ppRows,numTiles,sizeof(TileCell*),rowOrder);
+			for(t = 0; t < numTiles; t++){
+				pOrder[t] = (uint32_t)(ppRows[t] - pIndex->pCells);
+			}
+		}
+
+		/* Tiles in visiting order, then targets grouped by tile */
+		uint32_t first = 0;
+		for(t = 0; t < numTiles; t++){
+			MosaicTile* pTile = &pMosaic->pTiles[t];
+			c = pOrder[t];
+			pVisit[c] = t;
+			pTile->Center = pCenters[c];
+			pTile->FirstTarget = first;
+			pTile->Travel = (t > 0) ? stageDistance(&pCenters[pOrder[t-1]],&pCenters[c]) : 0;
+			pMosaic->Travel += pTile->Travel;
+			first += pIndex->pCells[c].Count;
+		}
+		pMosaic->NumTiles = numTiles;
+		for(i = 0; i < n; i++){
+			MosaicTile* pTile = &pMosaic->pTiles[pVisit[pCell[i]]];
+			pMosaic->pTargets[pTile->FirstTarget + pTile->NumTargets++] = pRaw[i];
+		}
+		pMosaic->NumTargets = n;
+	}
+	free(pCenters);
+	free(pOrder);
+	free(pVisit);
+	free(ppRows);
+	free(pRaw);
+	free(pCell);
+	return failed ? -1 : 0;
+}
+
+EXPORT Mosaic* buildMosaic(CoordSource* pSrc,
+				  struct Coord* TileSize,
+				  uint32_t Baseline,
+				  uint32_t TimeOn,
+				  uint16_t NumPulses,
+				  uint32_t ISI,
+				  uint32_t Iterations,
+				  uint32_t EpisodePeriod,
+				  uint16_t Reps,
+				  int64_t ScaleFactor,
+				  struct Coord* CenterOffset,
+				  enum Trigger* Trig,
+				  struct RigProfile* Rig,
+				  int NumThreads){
+
+	if(TileSize->X <= 0 || TileSize->Y <= 0){
+		fprintf(stderr,"Invalid tile size: %d x %d\n",TileSize->X,TileSize->Y);
+		return NULL;
+	}
+	Mosaic* pMosaic = calloc(1,sizeof(Mosaic));
+	if(pMosaic == NULL){
+		perror("Failure to create mosaic (allocation error) - ");
+		return NULL;
+	}
+	pMosaic->TileSize = *TileSize;
+
+	TileIndex index;
+	memset(&index,0,sizeof(index));
+	int status = partitionTargets(pMosaic,pSrc,&index);
+	free(index.pCells);
+	free(index.pKeys);
+	free(index.pIds);
+	if(status != 0){
+		freeMosaic(pMosaic);
+		return NULL;
+	}
+
+	uint32_t t;
+	for(t = 0; t < pMosaic->NumTiles; t++){
+		pMosaic->pTiles[t].Offset = convertCoord(&pMosaic->pTiles[t].Center,ScaleFactor,CenterOffset,0);
+	}
+
+	/* Build the tiles' protocols */
+	MosaicJob job;
+	memset(&job,0,sizeof(job));
+	job.pMosaic = pMosaic;
+	job.Baseline = Baseline;
+	job.TimeOn = TimeOn;
+	job.NumPulses = NumPulses;
+	job.ISI = ISI;
+	job.Iterations = Iterations;
+	job.EpisodePeriod = EpisodePeriod;
+	job.Reps = Reps;
+	job.ScaleFactor = ScaleFactor;
+	job.Trig = *Trig;
+	job.Rig = Rig;
+	if(NumThreads <= 0){
+		NumThreads = numCores();
+	}
+	if((uint32_t)NumThreads > pMosaic->NumTiles){
+		NumThreads = (pMosaic->NumTiles > 0) ? (int)pMosaic->NumTiles : 1;
+	}
+	runWorkers(mosaicWorker,&job,NumThreads);
+	return pMosaic;
+}
+
+EXPORT char* MosaicToString(Mosaic* pMosaic){
+	//Tile schedule: a header comment, then one line per tile in visiting order
+	static const char header[] = "#Tile\tX\tY\tOffsetX\tOffsetY\tTargets\tTravel\n";
+	size_t size = sizeof(header) + (size_t)pMosaic->NumTiles*(7 + 2*12 + 2*21 + 11 + 21);
+	char* pSchedule = malloc(size);
+	if(pSchedule == NULL){
+		perror("Failure to create tile schedule (allocation error) - ");
+		return NULL;
+	}
+	size_t len = sprintf(pSchedule,"%s",header);
+	uint32_t t;
+	for(t = 0; t < pMosaic->NumTiles; t++){
+		MosaicTile* pTile = &pMosaic->pTiles[t];
+		len += sprintf(pSchedule+len,"%" PRIu32 "\t%d\t%d\t%" PRId64 "\t%" PRId64 "\t%" PRIu32 "\t%" PRId64 "\n",
+				t,pTile->Center.X,pTile->Center.Y,pTile->Offset.X,pTile->Offset.Y,pTile->NumTargets,pTile->Travel);
+	}
+	return pSchedule;
+}
+
+EXPORT void freeMosaic(Mosaic* pMosaic){
+	if(pMosaic == NULL){
+		return;
+	}
+	uint32_t t;
+	for(t = 0; t < pMosaic->NumTiles; t++){
+		free(pMosaic->pTiles[t].Protocol);
+	}
+	free(pMosaic->pTiles);
+	free(pMosaic->pTargets);
+	free(pMosaic);
+}
+
+/* TARGET PREPROCESSING ===========================================================================*/
+
+/* Merging and clustering share one pass (mergePass): every target is binned into a hash grid of
+   cells 2*Radius wide, and looks for a leader (an earlier target that was kept) within Radius in its
+   own cell and the three neighbours on its nearer sides.  The nearest leader absorbs it; if there is
+   none, it becomes a leader.  Each target thus sees O(1) candidates on average. */
+
+typedef struct MergeGrid{			//Leaders by cell: open-addressing table of chain heads
+	uint64_t* pKeys;
+	uint32_t* pHeads;				//UINT32_MAX: empty slot
+	uint32_t* pNext;				//Next leader in the same cell
+	uint32_t Slots;
+} MergeGrid;
+
+static int64_t floorDiv(int64_t a, int64_t b){
+	//Rounds towards minus infinity, for either sign of b
+	int64_t q = a/b;
+	return (q*b != a && ((a < 0) != (b < 0))) ? q - 1 : q;
+}
+
+static uint32_t* mergeHead(MergeGrid* pGrid, int64_t cx, int64_t cy, int create){
+	//Chain head of cell (cx, cy); NULL if the cell is empty and create is 0
+	uint64_t key = ((uint64_t)(uint32_t)cx << 32) | (uint32_t)cy;
+	uint32_t slot = (uint32_t)((key*0x9E3779B97F4A7C15ULL) >> 32) & (pGrid->Slots-1);
+	while(pGrid->pHeads[slot] != UINT32_MAX){
+		if(pGrid->pKeys[slot] == key){
+			return &pGrid->pHeads[slot];
+		}
+		slot = (slot + 1) & (pGrid->Slots-1);
+	}
+	if(!create){
+		return NULL;
+	}
+	pGrid->pKeys[slot] = key;
+	return &pGrid->pHeads[slot];
+}
+
+static int64_t mergePass(Coord* pPts, uint32_t n, int Radius, uint32_t* pLeader){
+	//Sets pLeader[i] to the leader that absorbs target i (i itself for a leader); returns the number
+	//of leaders, or -1
+	MergeGrid grid;
+	grid.Slots = 16;
+	while(grid.Slots < 2*(uint64_t)n){
+		grid.Slots *= 2;
+	}
+	grid.pKeys = malloc(grid.Slots*sizeof(uint64_t));
+	grid.pHeads = malloc(grid.Slots*sizeof(uint32_t));
+	grid.pNext = malloc((n > 0 ? n : 1)*sizeof(uint32_t));
+	if(grid.pKeys == NULL || grid.pHeads == NULL || grid.pNext == NULL){
+		perror("Failure to merge targets (allocation error) - ");
+		free(grid.pKeys);
+		free(grid.pHeads);
+		free(grid.pNext);
+		return -1;
+	}
+	memset(grid.pHeads,0xFF,grid.Slots*sizeof(uint32_t));
+
+	int64_t cell = (Radius > 0) ? 2*(int64_t)Radius : 1;
+	int64_t r2 = (int64_t)Radius*Radius;
+	int64_t numLeaders = 0;
+	uint32_t i;
+	for(i = 0; i < n; i++){
+		int64_t cx = floorDiv(pPts[i].X,cell);
+		int64_t cy = floorDiv(pPts[i].Y,cell);
+		/* Cells are 2*Radius wide, so only the neighbours on the nearer sides can hold a leader */
+		int64_t nx = (pPts[i].X - cx*cell < Radius) ? -1 : 1;
+		int64_t ny = (pPts[i].Y - cy*cell < Radius) ? -1 : 1;
+		uint32_t best = i;
+		int64_t bestDist = INT64_MAX;
+		int c;
+		for(c = 0; c < ((Radius > 0) ? 4 : 1); c++){
+			uint32_t* pHead = mergeHead(&grid,cx + ((c & 1) ? nx : 0),cy + ((c & 2) ? ny : 0),0);
+			uint32_t k = (pHead != NULL) ? *pHead : UINT32_MAX;
+			for(; k != UINT32_MAX; k = grid.pNext[k]){
+				int64_t ex = (int64_t)pPts[k].X - pPts[i].X;
+				int64_t ey = (int64_t)pPts[k].Y - pPts[i].Y;
+				int64_t dist = ex*ex + ey*ey;
+				if(dist <= r2 && (dist < bestDist || (dist == bestDist && k < best))){
+					best = k;
+					bestDist = dist;
+				}
+			}
+		}
+		pLeader[i] = best;
+		if(best == i){
+			uint32_t* pHead = mergeHead(&grid,cx,cy,1);
+			grid.pNext[i] = *pHead;
+			*pHead = i;
+			numLeaders++;
+		}
+	}
+	free(grid.pKeys);
+	free(grid.pHeads);
+	free(grid.pNext);
+	return numLeaders;
+}
+
+EXPORT int prepareTargets(CoordSource* pSrc,
+				  struct Coord* CoordArr,
+				  int MergeRadius,
+				  int ClusterRadius,
+				  enum ClipMode Clip,
+				  int64_t ScaleFactor,
+				  struct Coord* CenterOffset,
+				  int32_t* pMap,
+				  PrepReport* pReport){
+
+	if(ScaleFactor <= 0){
+		fprintf(stderr,"Invalid scale factor: %" PRId64 "\n",ScaleFactor);
+		return -1;
+	}
+	PrepReport report;
+	memset(&report,0,sizeof(report));
+	uint32_t n = pSrc->Count;
+	uint32_t* pIndex = malloc((n > 0 ? n : 1)*sizeof(uint32_t));		//Input target -> CoordArr index
+	uint32_t* pLeader = malloc((n > 0 ? n : 1)*sizeof(uint32_t));
+	if(pIndex == NULL || pLeader == NULL){
+		perror("Failure to prepare targets (allocation error) - ");
+		free(pIndex);
+		free(pLeader);
+		return -1;
+	}
+
+	/* Range: convertCoord gives -(P - CenterOffset)*ScaleFactor ucounts */
+	int64_t hiDelta = -UCOUNT_MIN/ScaleFactor;
+	int64_t loDelta = -(UCOUNT_MAX/ScaleFactor);
+	uint32_t numIn = 0;
+	uint32_t m = 0;
+	Coord pos;
+	resetSource(pSrc);
+	while(numIn < n && nextCoord(pSrc,&pos)){
+		int64_t dX = (int64_t)pos.X - CenterOffset->X;
+		int64_t dY = (int64_t)pos.Y - CenterOffset->Y;
+		if(dX < loDelta || dX > hiDelta || dY < loDelta || dY > hiDelta){
+			if(Clip == CLIP_REJECT){
+				pIndex[numIn++] = UINT32_MAX;
+				report.Rejected++;
+				continue;
+			}
+			dX = (dX < loDelta) ? loDelta : (dX > hiDelta) ? hiDelta : dX;
+			dY = (dY < loDelta) ? loDelta : (dY > hiDelta) ? hiDelta : dY;
+			pos.X = (int)(CenterOffset->X + dX);
+			pos.Y = (int)(CenterOffset->Y + dY);
+			report.Clipped++;
+		}
+		CoordArr[m] = pos;
+		pIndex[numIn++] = m++;
+	}
+	report.NumIn = numIn;
+
+	/* Merge duplicates (first target of each group is kept) */
+	int status = 0;
+	uint32_t i;
+	if(MergeRadius >= 0){
+		int64_t kept = mergePass(CoordArr,m,MergeRadius,pLeader);
+		if(kept < 0){
+			status = -1;
+		}else{
+			uint32_t k = 0;
+			for(i = 0; i < m; i++){
+				if(pLeader[i] == i){
+					CoordArr[k] = CoordArr[i];
+					pLeader[i] = k++;				//Leaders precede their members
+				}else{
+					pLeader[i] = pLeader[pLeader[i]];
+				}
+			}
+			for(i = 0; i < numIn; i++){
+				if(pIndex[i] != UINT32_MAX){ pIndex[i] = pLeader[pIndex[i]]; }
+			}
+			report.Duplicates = m - k;
+			m = k;
+		}
+	}
+
+	/* Cluster into sites at the members' centroid */
+	if(status == 0 && ClusterRadius > 0){
+		int64_t numSites = mergePass(CoordArr,m,ClusterRadius,pLeader);
+		int64_t* pSums = calloc(3*(numSites > 0 ? numSites : 1),sizeof(int64_t));
+		if(numSites < 0 || pSums == NULL){
+			perror("Failure to cluster targets - ");
+			status = -1;
+		}else{
+			uint32_t k = 0;
+			for(i = 0; i < m; i++){
+				uint32_t site = (pLeader[i] == i) ? k++ : pLeader[pLeader[i]];
+				pLeader[i] = site;
+				pSums[3*site] += CoordArr[i].X;
+				pSums[3*site+1] += CoordArr[i].Y;
+				pSums[3*site+2]++;
+			}
+			for(k = 0; k < numSites; k++){
+				CoordArr[k].X = (int)(pSums[3*k]/pSums[3*k+2]);
+				CoordArr[k].Y = (int)(pSums[3*k+1]/pSums[3*k+2]);
+				report.NumClusters += (pSums[3*k+2] > 1);
+			}
+			for(i = 0; i < numIn; i++){
+				if(pIndex[i] != UINT32_MAX){ pIndex[i] = pLeader[pIndex[i]]; }
+			}
+			report.Clustered = m - (uint32_t)numSites;
+			m = (uint32_t)numSites;
+		}
+		free(pSums);
+	}
+	report.NumOut = m;
+
+	if(status == 0 && pMap != NULL){
+		for(i = 0; i < numIn; i++){
+			pMap[i] = (pIndex[i] == UINT32_MAX) ? -1 : (int32_t)pIndex[i];
+		}
+	}
+	if(pReport != NULL){
+		*pReport = report;
+	}
+	free(pIndex);
+	free(pLeader);
+	return (status == 0) ? (int)m : -1;
+}
+
+EXPORT char* PrepReportToString(PrepReport* pReport){
+	char* pText = malloc(256);
+	if(pText == NULL){
+		perror("Failure to create report (allocation error) - ");
+		return NULL;
+	}
+	sprintf(pText,"Targets in\t%" PRIu32 "\nRejected\t%" PRIu32 "\nClipped\t%" PRIu32 "\nDuplicates\t%" PRIu32
+			"\nClustered\t%" PRIu32 "\nClusters\t%" PRIu32 "\nTargets out\t%" PRIu32 "\n",
+			pReport->NumIn,pReport->Rejected,pReport->Clipped,pReport->Duplicates,pReport->Clustered,
+			pReport->NumClusters,pReport->NumOut);
+	return pText;
+}
+
+/* PROTOCOL EMULATOR ==============================================================================*/
+
+/* Timing follows the firmware description (IV.5 and the ramp example in Appendix B): commands run in
+   list order in their cycle, and a loop end takes no cycle, so one iteration lasts from the cycle of
+   the loop start to that of the loop end and the last cycle of an iteration is the first of the
+   next.  The commands after a loop are listed at the cycle they run in once every iteration has
+   passed ("0 + 1000 iterations * 1000 cycles"), so the emulator adds a shift to the listed cycles
+   for each pass through a loop and drops it again when the loop is left; a command listed before
+   the cycle the loop left off in is out of order.  Trigger waits delay all later commands.
+   Increments ('I', 'J') are applied lazily, from the cycle after they are set, and are held while
+   waiting for a trigger. */
+
+#define EMU_CHANNELS 16
+#define EMU_MAX_LOOPS 100			//Nesting depth of the DSP
+#define EMU_MAX_CHANNEL 8			//Highest channel of the TMSI (loop and trigger commands excepted)
+#define DOUT_HIGH 4					//D-OUT bit of the digital output channel (laser shutter)
+
+typedef struct EmuLoop{
+	uint32_t Start;					//Index of the loop start
+	int64_t Remaining;				//Iterations left, including the current one
+	int64_t Shift;					//Shift of the listed cycles when the loop was entered
+} EmuLoop;
+
+typedef struct EmuChannel{
+	int64_t Value;
+	int64_t Incr;					//1st increment, added every cycle
+	int64_t Incr2;					//2nd increment, added to Incr every cycle
+	int64_t Time;					//Cycle up to which increments have been applied
+} EmuChannel;
+
+static void emuAdvance(EmuChannel* pChan, int64_t Time){
+	//Applies the increments of the cycles after pChan->Time, up to and including Time
+	int64_t dt = Time - pChan->Time;
+	if(dt > 0 && (pChan->Incr != 0 || pChan->Incr2 != 0)){
+		pChan->Value += pChan->Incr*dt + pChan->Incr2*(dt*(dt-1)/2);
+		pChan->Incr += pChan->Incr2*dt;
+	}
+	if(dt > 0){
+		pChan->Time = Time;
+	}
+}
+
+static void emuError(EmuResult* pResult, int Status, uint32_t Cmd){
+	//Keeps the first error, as the DSP reports it when the command is added
+	if(pResult->Status == 0){
+		pResult->Status = Status;
+		pResult->ErrorCmd = Cmd;
+	}
+}
+
+static int emuShot(EmuResult* pResult, int64_t Time, EmuChannel* pX, EmuChannel* pY, int64_t Settled, uint32_t Cmd){
+	if(pResult->NumShots == pResult->MaxShots){
+		uint32_t maxShots = (pResult->MaxShots > 0) ? 2*pResult->MaxShots : 64;
+		EmuShot* pShots = realloc(pResult->pShots,maxShots*sizeof(EmuShot));
+		if(pShots == NULL){
+			perror("Failure to record laser pulses (allocation error) - ");
+			return -1;
+		}
+		pResult->pShots = pShots;
+		pResult->MaxShots = maxShots;
+	}
+	EmuShot* pShot = &pResult->pShots[pResult->NumShots++];
+	emuAdvance(pX,Time);
+	emuAdvance(pY,Time);
+	pShot->Time = (uint64_t)Time;
+	pShot->Length = 0;
+	pShot->X = pX->Value;
+	pShot->Y = pY->Value;
+	pShot->Slack = Time - Settled;
+	pShot->Cmd = Cmd;
+	return 0;
+}
+
+/* Trigger event streams */
+
+EXPORT int edgeTrigger(TrigStream* pTrig, TrigEdge* pEdges, uint64_t NumEdges){
+	//Recorded edges, in time order; the array is not copied
+	uint64_t i;
+	memset(pTrig,0,sizeof(TrigStream));
+	pTrig->Kind = TRIG_EDGES;
+	for(i = 1; i < NumEdges; i++){
+		if(pEdges[i].Time < pEdges[i-1].Time){
+			fprintf(stderr,"Trigger edge %" PRIu64 " is earlier than the one before it.\n",i);
+			return -1;
+		}
+	}
+	pTrig->pEdges = pEdges;
+	pTrig->NumEdges = NumEdges;
+	return 0;
+}
+
+EXPORT int fileTrigger(TrigStream* pTrig, const char* LogFile, double CyclesPerUnit){
+	memset(pTrig,0,sizeof(TrigStream));
+	pTrig->Kind = TRIG_EDGES;
+	FILE* fp = fopen(LogFile,"r");
+	if(fp == NULL){
+		fprintf(stderr,"Failed to open trigger log: %s\n",LogFile);
+		return -1;
+	}
+	char line[256];
+	int failed = 0;
+	uint64_t maxEdges = 0;
+	uint64_t lineNum = 0;
+	enum TrigIn last = FALLING;
+	while(fgets(line,sizeof(line),fp) != NULL){
+		lineNum++;
+		char* pText = line;
+		while(isspace((unsigned char)*pText)){ pText++; }
+		if(*pText == '\0' || *pText == '#'){
+			continue;
+		}
+		char* pEnd;
+		double t = strtod(pText,&pEnd)*CyclesPerUnit;
+		if(pEnd == pText || t < 0 || t > (double)UINT64_MAX){
+			fprintf(stderr,"Invalid time on line %" PRIu64 " of trigger log %s\n",lineNum,LogFile);
+			failed = 1;
+			break;
+		}
+		while(isspace((unsigned char)*pEnd) || *pEnd == ','){ pEnd++; }
+		enum TrigIn edge;
+		switch(toupper((unsigned char)*pEnd)){
+			case 'U':
+			case 'R':
+				edge = RISING;
+				break;
+			case 'D':
+			case 'F':
+				edge = FALLING;
+				break;
+			default:
+				edge = (last == RISING) ? FALLING : RISING;
+				break;
+		}
+		if(pTrig->NumEdges == maxEdges){
+			maxEdges = (maxEdges > 0) ? 2*maxEdges : 256;
+			TrigEdge* pEdges = realloc(pTrig->pEdges,maxEdges*sizeof(TrigEdge));
+			if(pEdges == NULL){
+				perror("Failure to read trigger log (allocation error) - ");
+				failed = 1;
+				break;
+			}
+			pTrig->pEdges = pEdges;
+		}
+		TrigEdge* pEdge = &pTrig->pEdges[pTrig->NumEdges];
+		pEdge->Time = (uint64_t)(t + 0.5);
+		pEdge->Edge = last = edge;
+		if(pTrig->NumEdges > 0 && pEdge->Time < pEdge[-1].Time){
+			fprintf(stderr,"Edge on line %" PRIu64 " of trigger log %s is earlier than the one before it.\n",
+					lineNum,LogFile);
+			failed = 1;
+			break;
+		}
+		pTrig->NumEdges++;
+	}
+	fclose(fp);
+	pTrig->Owned = 1;
+	if(failed){
+		closeTrigger(pTrig);
+		return -1;
+	}
+	return 0;
+}
+
+EXPORT int periodicTrigger(TrigStream* pTrig, uint64_t First, uint64_t Period, uint64_t Width, uint64_t NumPulses){
+	memset(pTrig,0,sizeof(TrigStream));
+	if(Period <= Width){
+		fprintf(stderr,"Trigger period (%" PRIu64 ") must be longer than the pulse width (%" PRIu64 ").\n",
+				Period,Width);
+		return -1;
+	}
+	pTrig->Kind = TRIG_PERIODIC;
+	pTrig->First = First;
+	pTrig->Period = Period;
+	pTrig->Width = Width;
+	pTrig->NumPulses = NumPulses;
+	return 0;
+}
+
+EXPORT int poissonTrigger(TrigStream* pTrig, uint64_t First, uint64_t MeanInterval, uint64_t Width,
+				uint64_t NumPulses, uint64_t Seed){
+	memset(pTrig,0,sizeof(TrigStream));
+	if(MeanInterval == 0){
+		fprintf(stderr,"Mean trigger interval must be at least one cycle.\n");
+		return -1;
+	}
+	pTrig->Kind = TRIG_POISSON;
+	pTrig->First = First;
+	pTrig->Period = MeanInterval;
+	pTrig->Width = Width;
+	pTrig->NumPulses = NumPulses;
+	pTrig->Seed = pTrig->State = Seed;
+	return 0;
+}
+
+static uint64_t splitMix(uint64_t* pState){
+	//splitmix64: one 64-bit state, so sequences are reproducible from their seed
+	uint64_t z = (*pState += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30))*0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27))*0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+static uint64_t trigRandom(TrigStream* pTrig){
+	return splitMix(&pTrig->State);
+}
+
+EXPORT int nextEdge(TrigStream* pTrig, TrigEdge* pEdge){
+	if(pTrig->Kind == TRIG_EDGES){
+		if(pTrig->Index >= pTrig->NumEdges){
+			return 0;
+		}
+		*pEdge = pTrig->pEdges[pTrig->Index++];
+		return 1;
+	}
+	if(pTrig->Falling){
+		pTrig->Falling = 0;
+		pEdge->Time = pTrig->Rise + pTrig->Width;
+		pEdge->Edge = FALLING;
+		return 1;
+	}
+	if(pTrig->NumPulses > 0 && pTrig->Index >= pTrig->NumPulses){
+		return 0;
+	}
+	if(pTrig->Kind == TRIG_PERIODIC){
+		pTrig->Rise = pTrig->First + pTrig->Index*pTrig->Period;
+	}else{
+		double u = ((trigRandom(pTrig) >> 11) + 1.0)/9007199254740992.0;		//(0,1]
+		uint64_t gap = (uint64_t)(-log(u)*pTrig->Period + 0.5);
+		if(pTrig->Index > 0 && gap <= pTrig->Width){
+			gap = pTrig->Width + 1;				//The input is busy until the falling edge
+		}
+		pTrig->Rise = ((pTrig->Index > 0) ? pTrig->Rise : pTrig->First) + gap;
+	}
+	pTrig->Index++;
+	pTrig->Falling = 1;
+	pEdge->Time = pTrig->Rise;
+	pEdge->Edge = RISING;
+	return 1;
+}
+
+EXPORT void resetTrigger(TrigStream* pTrig){
+	pTrig->Index = 0;
+	pTrig->Rise = 0;
+	pTrig->Falling = 0;
+	pTrig->State = pTrig->Seed;
+}
+
+EXPORT void closeTrigger(TrigStream* pTrig){
+	if(pTrig->Owned){
+		free(pTrig->pEdges);
+	}
+	pTrig->pEdges = NULL;
+	pTrig->NumEdges = 0;
+	pTrig->Owned = 0;
+	resetTrigger(pTrig);
+}
+
+static int64_t emuWait(TrigStream* pTrig, int64_t Time, enum TrigIn Edge, EmuResult* pResult){
+	//Cycle of the first edge of the awaited kind at or after Time, or -1 if the stream ends first
+	TrigEdge edge;
+	while(nextEdge(pTrig,&edge)){
+		if(edge.Edge != Edge){
+			continue;
+		}
+		if((int64_t)edge.Time >= Time){
+			return (int64_t)edge.Time;
+		}
+		pResult->MissedEdges++;
+	}
+	return -1;
+}
+
+typedef int (*EmuSpanFn)(void* pCtx, int64_t X, int64_t Y, int64_t From, int64_t To, uint32_t OnCmd, uint64_t Pulse);
+	//Receives laser-on cycles From..To-1 at one galvo position, part of pulse number Pulse (from 1),
+	//which command OnCmd switched on.  A non-zero return stops the emulation
+
+static int addDwell(void* pCtx, int64_t X, int64_t Y, int64_t From, int64_t To, uint32_t OnCmd, uint64_t Pulse){
+	(void)OnCmd;						//A map sums dwell by position, whichever pulse it came from
+	(void)Pulse;
+	ExposureMap* pMap = pCtx;
+	int64_t Cycles = To - From;
+	int64_t bx = floorDiv(X - pMap->OriginX,pMap->BinX);
+	int64_t by = floorDiv(Y - pMap->OriginY,pMap->BinY);
+	pMap->Total += (uint64_t)Cycles;
+	if(bx < 0 || by < 0 || bx >= pMap->Width || by >= pMap->Height){
+		pMap->Outside += (uint64_t)Cycles;
+		return 0;
+	}
+	pMap->pDwell[(size_t)by*pMap->Width + (size_t)bx] += (double)Cycles;
+	return 0;
+}
+
+static int64_t rampRun(const EmuChannel* pChan, int64_t Origin, int64_t Bin, int64_t Limit){
+	//Cycles from pChan->Time on, at most Limit, that the channel stays in its current bin.  A ramp
+	//is monotonic up to the cycle its 2nd increment turns it, so the first cycle out of the bin is
+	//found by bisection up to there
+	int64_t incr = pChan->Incr;
+	int64_t incr2 = pChan->Incr2;
+	if(incr == 0 && incr2 == 0){
+		return Limit;
+	}
+	if(incr != 0 && incr2 != 0 && (incr < 0) != (incr2 < 0)){
+		int64_t turn = ((incr < 0) ? -incr : incr)/((incr2 < 0) ? -incr2 : incr2) + 1;
+		Limit = (turn < Limit) ? turn : Limit;
+	}
+	int64_t bin = floorDiv(pChan->Value - Origin,Bin);
+	int64_t in = 0;						//Cycle known to be in the bin
+	int64_t out = Limit + 1;			//First cycle that may be out of it
+	while(out - in > 1){
+		int64_t k = in + (out - in)/2;
+		int64_t value = pChan->Value + incr*k + incr2*(k*(k-1)/2);
+		if(floorDiv(value - Origin,Bin) == bin){
+			in = k;
+		}else{
+			out = k;
+		}
+	}
+	return (out > Limit) ? Limit : out;
+}
+
+static int dwellRamp(ExposureMap* pMap, EmuChannel* pX, EmuChannel* pY, int64_t From, int64_t To,
+				uint32_t OnCmd, uint64_t Pulse){
+	//Bins the laser-on cycles From..To-1 of a ramp one run per bin it crosses, not cycle by cycle
+	int64_t t = From;
+	while(t < To){
+		emuAdvance(pX,t);
+		emuAdvance(pY,t);
+		int64_t n = rampRun(pX,pMap->OriginX,pMap->BinX,To - t);
+		n = rampRun(pY,pMap->OriginY,pMap->BinY,n);
+		addDwell(pMap,pX->Value,pY->Value,t,t + n,OnCmd,Pulse);
+		t += n;
+	}
+	return 0;
+}
+
+static int emuExpose(EmuSpanFn pSpan, void* pCtx, EmuChannel* pX, EmuChannel* pY, int64_t From, int64_t To,
+				uint32_t OnCmd, uint64_t Pulse){
+	//Passes on the laser-on cycles From..To-1: one span while the galvos hold still; while one of
+	//them ramps, one span per bin crossed for an exposure map, or else cycle by cycle
+	if(pSpan == NULL || To <= From){
+		return 0;
+	}
+	EmuChannel x = *pX;
+	EmuChannel y = *pY;
+	if(x.Incr == 0 && x.Incr2 == 0 && y.Incr == 0 && y.Incr2 == 0){
+		return pSpan(pCtx,x.Value,y.Value,From,To,OnCmd,Pulse);
+	}
+	if(pSpan == addDwell){
+		return dwellRamp(pCtx,&x,&y,From,To,OnCmd,Pulse);
+	}
+	int64_t t;
+	for(t = From; t < To; t++){
+		emuAdvance(&x,t);
+		emuAdvance(&y,t);
+		if(pSpan(pCtx,x.Value,y.Value,t,t+1,OnCmd,Pulse) != 0){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+EXPORT EmuResult* emulateProtocol(ScanProt* pProtocol, struct RigProfile* Rig, int RecordShots){
+	return emulateTriggered(pProtocol,Rig,NULL,RecordShots);
+}
+
+static EmuResult* emulate(ScanProt* pProtocol, RigProfile* Rig, TrigStream* pTrig, int RecordShots,
+				EmuSpanFn pSpan, void* pCtx){
+	//Emulator core; laser-on spans are passed to pSpan if it is not NULL
+
+	RigProfile rig = (Rig != NULL) ? *Rig : defaultRigProfile();
+	EmuResult* pResult = calloc(1,sizeof(EmuResult));
+	uint32_t numCmds = pProtocol->NumCmds;
+	uint32_t* pCycles = malloc((numCmds > 0 ? numCmds : 1)*sizeof(uint32_t));
+	if(pResult == NULL || pCycles == NULL){
+		perror("Failure to emulate protocol (allocation error) - ");
+		free(pResult);
+		free(pCycles);
+		return NULL;
+	}
+
+	/* Static checks, as the DSP makes them while commands are added.  A command listed before the
+	   cycle of its predecessor is run in the predecessor's cycle. */
+	uint32_t i;
+	uint32_t last = 0;
+	int depth = 0;
+	for(i = 0; i < numCmds; i++){
+		PackedCmd* pCmd = &pProtocol->pCmds[i];
+		char op = cmdScan(pCmd);
+		uint32_t cycle = cmdCycle(pCmd);
+		if(cycle < last){
+			emuError(pResult,11,i);			//SCAN_CMD_LIST_DISORDER
+			cycle = last;
+		}
+		pCycles[i] = last = cycle;
+		if(op == START){
+			if(++depth > EMU_MAX_LOOPS){ emuError(pResult,13,i); }		//SCAN_CMD_LOOP_OVERFLOW
+			if(cmdValue(pCmd) < 0){ emuError(pResult,14,i); }			//SCAN_CMD_INVALID_ITERATIONS
+		}else if(op == END){
+			if(--depth < 0){
+				emuError(pResult,15,i);										//SCAN_CMD_LOOP_IS_CLOSED
+				depth = 0;
+			}
+		}else if(op != 'U' && op != 'D' && op != '0' && cmdChannel(pCmd) > EMU_MAX_CHANNEL){
+			emuError(pResult,12,i);											//SCAN_CMD_INVALID_CHANNEL
+		}
+	}
+
+	/* Execution */
+	EmuChannel chans[EMU_CHANNELS];
+	memset(chans,0,sizeof(chans));
+	EmuLoop loops[EMU_MAX_LOOPS];
+	int numLoops = 0;
+	int64_t shift = 0;
+	int64_t now = 0;
+	int64_t resume = 0;					//Cycle in which the last loop was left
+	EmuShot* pOpen = NULL;				//Pulse in progress
+	int failed = 0;
+	EmuChannel* pX = &chans[rig.ChanX & (EMU_CHANNELS-1)];
+	EmuChannel* pY = &chans[rig.ChanY & (EMU_CHANNELS-1)];
+	int64_t settled = 0;				//Cycle by which the last galvo move has settled
+	int64_t exposed = 0;				//Start of the laser-on span not yet passed to pSpan
+	uint32_t onCmd = 0;					//Command that switched the laser on
+	uint64_t pulse = 0;					//Laser pulses so far
+	i = 0;
+	while(i < numCmds && !failed){
+		PackedCmd* pCmd = &pProtocol->pCmds[i];
+		EmuChannel* pChan = &chans[cmdChannel(pCmd)];
+		int64_t value = cmdValue(pCmd);
+		now = (int64_t)pCycles[i] + shift;
+		if(now < resume){
+			emuError(pResult,11,i);			//SCAN_CMD_LIST_DISORDER, listed within the loop's run
+			now = resume;
+		}
+		pResult->NumExecuted++;
+		switch(cmdScan(pCmd)){
+			case 'V':
+			case 'R':
+				if((pChan == pX || pChan == pY) && (chans[TRIG].Value & DOUT_HIGH)
+						&& (pChan->Incr != 0 || pChan->Incr2 != 0 || (cmdScan(pCmd) == 'V' && value != pChan->Value)
+							|| (cmdScan(pCmd) == 'R' && value != 0))){
+					failed = emuExpose(pSpan,pCtx,pX,pY,exposed,now,onCmd,pulse);	//Before the ramp is advanced
+					exposed = now;
+				}
+				emuAdvance(pChan,now);
+				if(pChan == pX || pChan == pY){
+					int64_t newValue = (cmdScan(pCmd) == 'V') ? value : pChan->Value + value;
+					if(newValue != pChan->Value){
+						int64_t end = now + settleCycles(&rig,llabs(newValue - pChan->Value));
+						settled = (end > settled) ? end : settled;
+					}
+				}
+				if(pChan == &chans[TRIG]){
+					int64_t newValue = (cmdScan(pCmd) == 'V') ? value : pChan->Value + value;
+					if(!(pChan->Value & DOUT_HIGH) && (newValue & DOUT_HIGH)){
+						exposed = now;
+						onCmd = i;
+						pulse++;
+					}else if((pChan->Value & DOUT_HIGH) && !(newValue & DOUT_HIGH)){
+						failed = emuExpose(pSpan,pCtx,pX,pY,exposed,now,onCmd,pulse);
+					}
+				}
+				if(pChan == &chans[TRIG] && RecordShots){
+					int64_t newValue = (cmdScan(pCmd) == 'V') ? value : pChan->Value + value;
+					if(!(pChan->Value & DOUT_HIGH) && (newValue & DOUT_HIGH)){
+						failed = (emuShot(pResult,now,pX,pY,settled,i) != 0);
+						pOpen = failed ? NULL : &pResult->pShots[pResult->NumShots-1];
+					}else if((pChan->Value & DOUT_HIGH) && !(newValue & DOUT_HIGH) && pOpen != NULL){
+						pOpen->Length = (uint64_t)(now - (int64_t)pOpen->Time);
+						pOpen = NULL;
+					}
+				}
+				pChan->Value = (cmdScan(pCmd) == 'V') ? value : pChan->Value + value;
+				break;
+			case 'I':
+			case 'J':
+				if((pChan == pX || pChan == pY) && (chans[TRIG].Value & DOUT_HIGH)){
+					failed = emuExpose(pSpan,pCtx,pX,pY,exposed,now,onCmd,pulse);
+					exposed = now;
+				}
+				emuAdvance(pChan,now);
+				if(cmdScan(pCmd) == 'I'){
+					pChan->Incr = value;
+				}else{
+					pChan->Incr2 = value;
+				}
+				break;
+			case START:
+				if(numLoops < EMU_MAX_LOOPS){
+					loops[numLoops].Start = i;
+					loops[numLoops].Shift = shift;
+					loops[numLoops++].Remaining = (value > 1) ? value : 1;
+				}
+				break;
+			case END:
+				if(numLoops > 0 && --loops[numLoops-1].Remaining > 0){
+					uint32_t start = loops[numLoops-1].Start;
+					shift += (int64_t)pCycles[i] - pCycles[start];		//Next iteration
+					i = start + 1;
+					continue;
+				}
+				if(numLoops > 0){
+					shift = loops[--numLoops].Shift;		//Later cycles count every iteration
+					resume = now;
+				}
+				break;
+			case 'U':
+			case 'D':
+				pResult->NumWaits++;
+				if(pCycles[i] == 0){
+					pResult->Stalled = 1;		//Edges in cycle 0 are not sensed
+					failed = 1;
+				}else if(pTrig != NULL){
+					int64_t edge = emuWait(pTrig,now,(cmdScan(pCmd) == 'U') ? RISING : FALLING,pResult);
+					if(edge < 0){
+						pResult->Stalled = 1;
+						failed = 1;
+						break;
+					}
+					int64_t wait = edge - now;
+					if(pSpan != NULL && (chans[TRIG].Value & DOUT_HIGH)){
+						EmuChannel x = *pX;
+						EmuChannel y = *pY;
+						emuAdvance(&x,now);
+						emuAdvance(&y,now);
+						failed = emuExpose(pSpan,pCtx,pX,pY,exposed,now,onCmd,pulse)
+							  || pSpan(pCtx,x.Value,y.Value,now,edge,onCmd,pulse) != 0;	//The laser stays on while waiting
+						exposed = edge;
+					}
+					int c;
+					for(c = 0; c < EMU_CHANNELS; c++){
+						chans[c].Time += wait;	//Increments are held while waiting
+					}
+					for(c = 0; c < numLoops; c++){
+						loops[c].Shift += wait;	//The delay outlasts the loops it was taken in
+					}
+					shift += wait;
+					now = edge;
+					pResult->WaitCycles += (uint64_t)wait;
+				}
+				break;
+			default:
+				break;						//'0' and 'O' do not change channel values
+		}
+		pResult->EndTime = (uint64_t)now;
+		i++;
+	}
+	if(chans[TRIG].Value & DOUT_HIGH){
+		emuExpose(pSpan,pCtx,pX,pY,exposed,now,onCmd,pulse);		//Laser left on: counted up to the last command
+	}
+
+	int c;
+	for(c = 0; c < EMU_CHANNELS; c++){
+		emuAdvance(&chans[c],now);
+		pResult->Values[c] = chans[c].Value;
+	}
+	free(pCycles);
+	return pResult;
+}
+
+EXPORT EmuResult* emulateTriggered(ScanProt* pProtocol, struct RigProfile* Rig, TrigStream* pTrig, int RecordShots){
+	return emulate(pProtocol,Rig,pTrig,RecordShots,NULL,NULL);
+}
+
+EXPORT char* testTriggerLogs(ScanProt* pProtocol, struct RigProfile* Rig, const char** LogFiles, int NumLogs,
+				double CyclesPerUnit){
+	//One line per log: edges read, waits, missed edges, predicted times (ms) and the verdict
+	static const char header[] = "#Log\tEdges\tWaits\tMissed\tWaiting\tDuration\tShots\tFirstShot\tLastShot\tResult\n";
+	size_t size = sizeof(header);
+	int l;
+	for(l = 0; l < NumLogs; l++){
+		size += strlen(LogFiles[l]) + 9*24;
+	}
+	char* pReport = malloc(size);
+	if(pReport == NULL){
+		perror("Failure to create trigger log report (allocation error) - ");
+		return NULL;
+	}
+	size_t len = sprintf(pReport,"%s",header);
+	for(l = 0; l < NumLogs; l++){
+		TrigStream trig;
+		if(fileTrigger(&trig,LogFiles[l],CyclesPerUnit) != 0){
+			len += sprintf(pReport+len,"%s\t\t\t\t\t\t\t\t\tFAIL unreadable\n",LogFiles[l]);
+			continue;
+		}
+		EmuResult* pRun = emulateTriggered(pProtocol,Rig,&trig,1);
+		if(pRun == NULL){
+			closeTrigger(&trig);
+			free(pReport);
+			return NULL;
+		}
+		double first = (pRun->NumShots > 0) ? (double)pRun->pShots[0].Time/CYCLES_PER_MS : 0;
+		double last = (pRun->NumShots > 0) ? (double)pRun->pShots[pRun->NumShots-1].Time/CYCLES_PER_MS : 0;
+		len += sprintf(pReport+len,"%s\t%" PRIu64 "\t%" PRIu32 "\t%" PRIu32 "\t%.2f\t%.2f\t%" PRIu32 "\t%.2f\t%.2f\t",
+				LogFiles[l],trig.NumEdges,pRun->NumWaits,pRun->MissedEdges,(double)pRun->WaitCycles/CYCLES_PER_MS,
+				(double)pRun->EndTime/CYCLES_PER_MS,pRun->NumShots,first,last);
+		if(pRun->Status != 0){
+			len += sprintf(pReport+len,"FAIL status %d at command %" PRIu32 "\n",pRun->Status,pRun->ErrorCmd);
+		}else if(pRun->Stalled){
+			len += sprintf(pReport+len,"FAIL stalled at %.2f\n",(double)pRun->EndTime/CYCLES_PER_MS);
+		}else{
+			len += sprintf(pReport+len,"OK\n");
+		}
+		freeEmuResult(pRun);
+		closeTrigger(&trig);
+	}
+	return pReport;
+}
+
+EXPORT void freeEmuResult(EmuResult* pResult){
+	if(pResult != NULL){
+		free(pResult->pShots);
+		free(pResult);
+	}
+}
+
+/* Library validation */
+
+typedef struct LibJob{
+	ScanProt** ppProts;
+	uint32_t NumProts;
+	uint32_t NextProt;
+	RigProfile* pRig;
+	EmuSummary* pSummaries;
+} LibJob;
+
+static void* libWorker(void* pArg){
+	//Emulates protocols until none are left; all state is local or in the protocol's own summary
+	LibJob* pJob = pArg;
+	uint32_t p;
+	while((p = __atomic_fetch_add(&pJob->NextProt,1,__ATOMIC_RELAXED)) < pJob->NumProts){
+		EmuSummary* pSum = &pJob->pSummaries[p];
+		EmuResult* pRun = emulateProtocol(pJob->ppProts[p],pJob->pRig,1);
+		if(pRun == NULL){
+			pSum->Status = -1;
+			continue;
+		}
+		pSum->Status = pRun->Status;
+		pSum->ErrorCmd = pRun->ErrorCmd;
+		pSum->Stalled = pRun->Stalled;
+		pSum->Duration = pRun->EndTime;
+		pSum->NumShots = pRun->NumShots;
+		uint32_t s;
+		for(s = 0; s < pRun->NumShots; s++){
+			int64_t slack = pRun->pShots[s].Slack;
+			pSum->SettleViolations += (slack < 0);
+			if(s == 0 || slack < pSum->WorstSlack){
+				pSum->WorstSlack = slack;
+			}
+		}
+		freeEmuResult(pRun);
+	}
+	return NULL;
+}
+
+EXPORT LibraryReport* emulateLibrary(ScanProt** ppProts, uint32_t NumProts, struct RigProfile* Rig, int NumThreads){
+	RigProfile rig = (Rig != NULL) ? *Rig : defaultRigProfile();
+	LibraryReport* pReport = calloc(1,sizeof(LibraryReport));
+	EmuSummary* pSummaries = calloc(NumProts > 0 ? NumProts : 1,sizeof(EmuSummary));
+	if(pReport == NULL || pSummaries == NULL){
+		perror("Failure to emulate protocol library (allocation error) - ");
+		free(pReport);
+		free(pSummaries);
+		return NULL;
+	}
+	pReport->pSummaries = pSummaries;
+	pReport->NumProts = NumProts;
+
+	LibJob job;
+	job.ppProts = ppProts;
+	job.NumProts = NumProts;
+	job.NextProt = 0;
+	job.pRig = &rig;
+	job.pSummaries = pSummaries;
+	if(NumThreads <= 0){
+		NumThreads = numCores();
+	}
+	if((uint32_t)NumThreads > NumProts){
+		NumThreads = (NumProts > 0) ? (int)NumProts : 1;
+	}
+	runWorkers(libWorker,&job,NumThreads);
+
+	uint32_t p;
+	for(p = 0; p < NumProts; p++){
+		EmuSummary* pSum = &pSummaries[p];
+		pReport->NumErrors += (pSum->Status != 0);
+		pReport->NumStalled += (pSum->Stalled != 0);
+		pReport->NumSettle += (pSum->SettleViolations > 0);
+		pReport->NumFailed += (pSum->Status != 0 || pSum->Stalled || pSum->SettleViolations > 0);
+		pReport->TotalDuration += pSum->Duration;
+		if(pSum->Duration > pReport->MaxDuration){
+			pReport->MaxDuration = pSum->Duration;
+			pReport->Longest = p;
+		}
+	}
+	return pReport;
+}
+
+EXPORT char* LibraryReportToString(LibraryReport* pReport){
+	//Totals, then one line per failed protocol
+	static const char header[] = "#Protocol\tStatus\tErrorCmd\tStalled\tDuration\tShots\tSettleViolations\tWorstSlack\n";
+	size_t size = 512 + sizeof(header) + (size_t)pReport->NumFailed*(10 + 11 + 10 + 1 + 20 + 10 + 10 + 20 + 8);
+	char* pText = malloc(size);
+	if(pText == NULL){
+		perror("Failure to create library report (allocation error) - ");
+		return NULL;
+	}
+	size_t len = sprintf(pText,"Protocols\t%" PRIu32 "\nFailed\t%" PRIu32 "\nErrors\t%" PRIu32 "\nStalled\t%" PRIu32
+			"\nSettle violations\t%" PRIu32 "\nTotal duration\t%.2f ms\nLongest\t%" PRIu32 " (%.2f ms)\n%s",
+			pReport->NumProts,pReport->NumFailed,pReport->NumErrors,pReport->NumStalled,pReport->NumSettle,
+			(double)pReport->TotalDuration/CYCLES_PER_MS,pReport->Longest,(double)pReport->MaxDuration/CYCLES_PER_MS,
+			header);
+	uint32_t p;
+	for(p = 0; p < pReport->NumProts; p++){
+		EmuSummary* pSum = &pReport->pSummaries[p];
+		if(pSum->Status != 0 || pSum->Stalled || pSum->SettleViolations > 0){
+			len += sprintf(pText+len,"%" PRIu32 "\t%d\t%" PRIu32 "\t%d\t%" PRIu64 "\t%" PRIu32 "\t%" PRIu32 "\t%" PRId64 "\n",
+					p,pSum->Status,pSum->ErrorCmd,pSum->Stalled,pSum->Duration,pSum->NumShots,
+					pSum->SettleViolations,pSum->WorstSlack);
+		}
+	}
+	return pText;
+}
+
+EXPORT void freeLibraryReport(LibraryReport* pReport){
+	if(pReport != NULL){
+		free(pReport->pSummaries);
+		free(pReport);
+	}
+}
+
+/* LASER EXPOSURE =================================================================================*/
+
+EXPORT ExposureMap* createExposureMap(uint32_t Width, uint32_t Height, int64_t OriginX, int64_t OriginY, int64_t BinSize){
+	if(Width == 0 || Height == 0 || BinSize == 0){
+		fprintf(stderr,"Exposure map needs at least one bin of non-zero size.\n");
+		return NULL;
+	}
+	ExposureMap* pMap = calloc(1,sizeof(ExposureMap));
+	double* pDwell = calloc((size_t)Width*Height,sizeof(double));
+	if(pMap == NULL || pDwell == NULL){
+		perror("Failure to create exposure map (allocation error) - ");
+		free(pMap);
+		free(pDwell);
+		return NULL;
+	}
+	pMap->pDwell = pDwell;
+	pMap->Width = Width;
+	pMap->Height = Height;
+	pMap->OriginX = OriginX;
+	pMap->OriginY = OriginY;
+	pMap->BinX = pMap->BinY = BinSize;
+	return pMap;
+}
+
+EXPORT ExposureMap* pixelExposureMap(uint32_t Width, uint32_t Height, int64_t ScaleFactor, struct Coord* CenterOffset){
+	//convertCoord maps pixel p to -(p - CenterOffset)*ScaleFactor, so pixel bins run against the
+	//galvo axes and are centred on those positions
+	if(ScaleFactor <= 0){
+		fprintf(stderr,"Exposure map needs a positive scale factor.\n");
+		return NULL;
+	}
+	ExposureMap* pMap = createExposureMap(Width,Height,0,0,-ScaleFactor);
+	if(pMap != NULL){
+		pMap->OriginX = CenterOffset->X*ScaleFactor + ScaleFactor/2;
+		pMap->OriginY = CenterOffset->Y*ScaleFactor + ScaleFactor/2;
+	}
+	return pMap;
+}
+
+EXPORT int accumulateExposure(ExposureMap* pMap, ScanProt* pProtocol, struct RigProfile* Rig, TrigStream* pTrig){
+	EmuResult* pRun = emulate(pProtocol,Rig,pTrig,0,addDwell,pMap);
+	if(pRun == NULL){
+		return -1;
+	}
+	int status = pRun->Status;
+	freeEmuResult(pRun);
+	return status;
+}
+
+EXPORT int saveExposureMap(ExposureMap* pMap, const char* MapFile){
+	FILE* fp = fopen(MapFile,"wb");
+	if(fp == NULL){
+		fprintf(stderr,"Failed to create exposure map file: %s\n",MapFile);
+		return -1;
+	}
+	fprintf(fp,"Pf\n%" PRIu32 " %" PRIu32 "\n-1.0\n",pMap->Width,pMap->Height);	//Negative scale: little-endian
+	uint8_t* pRow = malloc((size_t)pMap->Width*4);
+	if(pRow == NULL){
+		perror("Failure to save exposure map (allocation error) - ");
+		fclose(fp);
+		return -1;
+	}
+	uint32_t x, y;
+	int failed = 0;
+	for(y = pMap->Height; y-- > 0 && !failed;){		//PFM rows run bottom to top
+		for(x = 0; x < pMap->Width; x++){
+			float ms = (float)(pMap->pDwell[(size_t)y*pMap->Width + x]/CYCLES_PER_MS);
+			uint32_t bits;
+			memcpy(&bits,&ms,4);
+			pRow[4*x] = (uint8_t)bits;
+			pRow[4*x+1] = (uint8_t)(bits >> 8);
+			pRow[4*x+2] = (uint8_t)(bits >> 16);
+			pRow[4*x+3] = (uint8_t)(bits >> 24);
+		}
+		failed = (fwrite(pRow,4,pMap->Width,fp) != pMap->Width);
+	}
+	free(pRow);
+	if(fclose(fp) != 0 || failed){
+		fprintf(stderr,"Failed to write exposure map file: %s\n",MapFile);
+		return -1;
+	}
+	return 0;
+}
+
+EXPORT void freeExposureMap(ExposureMap* pMap){
+	if(pMap != NULL){
+		free(pMap->pDwell);
+		free(pMap);
+	}
+}
+
+/* EXPOSURE LIMITS ================================================================================*/
+
+/* limitExposure emulates the protocol with a span sink (expSpan) that keeps, for every target, its
+   laser-on spans that reach into the duty window, oldest first, and for every region its dose;
+   targets and regions are found by position through a hash index (PosIndex).  The highest laser-on
+   time in any window occurs in a window that ends with a span, so each span is checked as it ends.
+   For a span of length L ending at e, with Allowed cycles allowed per window, a delay d makes the
+   window ending at e+d hold L plus whatever earlier spans lie after e+d-Window; the least d is
+   found by walking the earlier spans back until they hold more than Allowed-L.  Delaying the command
+   that starts the pulse delays every later run of it too, so if it ran n times since that point (a
+   pulse loop, or targets revisited by a repetition loop), d is spread over the n runs. */
+
+#define EXPOSE_MAX_DELAYS 1024		//Delays inserted before a protocol is rejected
+
+typedef struct PosIndex{			//Distinct positions, with an open-addressing table (id + 1 -> position)
+	int64_t* pX;
+	int64_t* pY;
+	uint32_t Num;
+	uint32_t Max;
+	uint32_t* pSlots;				//2*Max slots
+} PosIndex;
+
+typedef struct DutyTrack{			//Laser-on spans of one target, oldest first from Head
+	int64_t* pSpans;				//Start/end pairs
+	uint32_t Head;
+	uint32_t Num;
+	uint32_t Max;
+	int64_t OnTime;					//Sum of the spans held
+} DutyTrack;
+
+typedef struct ExpCheck{
+	int64_t Window;
+	int64_t Allowed;				//Laser-on cycles allowed per window
+	int64_t RegionSize;
+	uint64_t MaxDose;
+	int Retime;
+	PosIndex Targets;
+	DutyTrack* pTracks;
+	PosIndex Regions;
+	uint64_t* pDoses;
+	ExposureReport Report;
+	int64_t* pPulses;				//Start and command of the recent pulses (within the window), oldest first
+	uint32_t PulseHead;
+	uint32_t NumPulses;
+	uint32_t MaxPulses;
+	uint64_t LastPulse;
+	uint32_t FixCmd;				//First pulse over the duty limit, and the delay it needs
+	int64_t FixDelay;
+	int Unfixable;					//A pulse that is over the limit on its own
+	int Failed;
+} ExpCheck;
+
+static uint32_t posSlot(int64_t X, int64_t Y, uint32_t Slots){
+	uint64_t key = (uint64_t)X*0x9E3779B97F4A7C15ULL ^ ((uint64_t)Y + 0x632BE59BD9B4E019ULL)*0xC2B2AE3D27D4EB4FULL;
+	return (uint32_t)(key >> 32) & (Slots-1);
+}
+
+static int growPosIndex(PosIndex* pIndex){
+	//Doubles the position arrays and rehashes the table
+	uint32_t max = (pIndex->Max > 0) ? 2*pIndex->Max : 64;
+	int64_t* pX = realloc(pIndex->pX,max*sizeof(int64_t));
+	if(pX != NULL){
+		pIndex->pX = pX;
+	}
+	int64_t* pY = realloc(pIndex->pY,max*sizeof(int64_t));
+	if(pY != NULL){
+		pIndex->pY = pY;
+	}
+	uint32_t* pSlots = calloc(2*max,sizeof(uint32_t));
+	if(pX == NULL || pY == NULL || pSlots == NULL){
+		perror("Failure to grow exposure index - ");
+		free(pSlots);
+		return -1;
+	}
+	uint32_t id;
+	for(id = 0; id < pIndex->Num; id++){
+		uint32_t slot = posSlot(pX[id],pY[id],2*max);
+		while(pSlots[slot] != 0){
+			slot = (slot + 1) & (2*max-1);
+		}
+		pSlots[slot] = id + 1;
+	}
+	free(pIndex->pSlots);
+	pIndex->pSlots = pSlots;
+	pIndex->Max = max;
+	return 0;
+}
+
+static uint32_t posFind(PosIndex* pIndex, int64_t X, int64_t Y){
+	//Id of a position, added if it is new; UINT32_MAX on allocation failure
+	if(pIndex->Num == pIndex->Max && growPosIndex(pIndex) != 0){
+		return UINT32_MAX;
+	}
+	uint32_t slot = posSlot(X,Y,2*pIndex->Max);
+	while(pIndex->pSlots[slot] != 0){
+		uint32_t id = pIndex->pSlots[slot] - 1;
+		if(pIndex->pX[id] == X && pIndex->pY[id] == Y){
+			return id;
+		}
+		slot = (slot + 1) & (2*pIndex->Max-1);
+	}
+	uint32_t id = pIndex->Num++;
+	pIndex->pX[id] = X;
+	pIndex->pY[id] = Y;
+	pIndex->pSlots[slot] = id + 1;
+	return id;
+}
+
+static void freePosIndex(PosIndex* pIndex){
+	free(pIndex->pX);
+	free(pIndex->pY);
+	free(pIndex->pSlots);
+}
+
+static void* growParallel(void* pArray, uint32_t Old, uint32_t New, size_t Size){
+	//Resizes an array kept parallel to a PosIndex, zeroing the new entries
+	char* pNew = realloc(pArray,New*Size);
+	if(pNew != NULL){
+		memset(pNew + Old*Size,0,(New - Old)*Size);
+	}
+	return pNew;
+}
+
+static int expDose(ExpCheck* pCheck, int64_t X, int64_t Y, int64_t Cycles){
+	uint32_t max = pCheck->Regions.Max;
+	uint32_t id = posFind(&pCheck->Regions,floorDiv(X,pCheck->RegionSize),floorDiv(Y,pCheck->RegionSize));
+	if(id == UINT32_MAX){
+		return -1;
+	}
+	if(pCheck->Regions.Max != max){
+		uint64_t* pDoses = growParallel(pCheck->pDoses,max,pCheck->Regions.Max,sizeof(uint64_t));
+		if(pDoses == NULL){
+			return -1;
+		}
+		pCheck->pDoses = pDoses;
+	}
+	uint64_t before = pCheck->pDoses[id];
+	uint64_t dose = pCheck->pDoses[id] = before + (uint64_t)Cycles;
+	if(before <= pCheck->MaxDose && dose > pCheck->MaxDose){
+		pCheck->Report.DoseViolations++;
+	}
+	if(dose > pCheck->Report.PeakDose){
+		pCheck->Report.PeakDose = dose;
+	}
+	return 0;
+}
+
+static int expPulse(ExpCheck* pCheck, int64_t Start, uint32_t OnCmd){
+	//Records the start of a pulse, forgetting those that can no longer matter
+	int64_t* pPulses = pCheck->pPulses;
+	while(pCheck->NumPulses > 0 && pPulses[2*pCheck->PulseHead] < Start - pCheck->Window){
+		pCheck->PulseHead++;
+		pCheck->NumPulses--;
+	}
+	if(pCheck->PulseHead > 0 && pCheck->PulseHead + pCheck->NumPulses == pCheck->MaxPulses){
+		memmove(pPulses,&pPulses[2*pCheck->PulseHead],2*pCheck->NumPulses*sizeof(int64_t));
+		pCheck->PulseHead = 0;
+	}
+	if(pCheck->NumPulses == pCheck->MaxPulses){
+		uint32_t maxPulses = (pCheck->MaxPulses > 0) ? 2*pCheck->MaxPulses : 64;
+		pPulses = realloc(pPulses,2*maxPulses*sizeof(int64_t));
+		if(pPulses == NULL){
+			return -1;
+		}
+		pCheck->pPulses = pPulses;
+		pCheck->MaxPulses = maxPulses;
+	}
+	pPulses[2*(pCheck->PulseHead + pCheck->NumPulses)] = Start;
+	pPulses[2*(pCheck->PulseHead + pCheck->NumPulses)+1] = OnCmd;
+	pCheck->NumPulses++;
+	return 0;
+}
+
+static int64_t dutyDelay(ExpCheck* pCheck, DutyTrack* pTrack, uint32_t OnCmd){
+	//Least delay of command OnCmd that brings the window of the last span under the limit; -1 if
+	//none does
+	int64_t* pLast = &pTrack->pSpans[2*(pTrack->Head + pTrack->Num - 1)];
+	int64_t budget = pCheck->Allowed - (pLast[1] - pLast[0]);
+	if(budget < 0){
+		return -1;
+	}
+	int64_t held = 0;
+	uint32_t k;
+	for(k = pTrack->Num - 1; k-- > 0;){
+		int64_t* pSpan = &pTrack->pSpans[2*(pTrack->Head + k)];
+		if(held + pSpan[1] - pSpan[0] > budget){
+			int64_t from = pSpan[1] - (budget - held);		//Earlier on-time after this point fits
+			int64_t delay = from + pCheck->Window - pLast[1];
+			int64_t runs = 0;
+			uint32_t p;
+			for(p = pCheck->PulseHead; p < pCheck->PulseHead + pCheck->NumPulses; p++){
+				runs += (pCheck->pPulses[2*p] >= from && pCheck->pPulses[2*p+1] == OnCmd);
+			}
+			runs = (runs > 0) ? runs : 1;
+			return (delay > 0) ? (delay + runs - 1)/runs : 1;
+		}
+		held += pSpan[1] - pSpan[0];
+	}
+	return 1;
+}
+
+static int expDuty(ExpCheck* pCheck, int64_t X, int64_t Y, int64_t From, int64_t To, uint32_t OnCmd, uint64_t Pulse){
+	if(Pulse != pCheck->LastPulse){
+		pCheck->LastPulse = Pulse;
+		if(expPulse(pCheck,From,OnCmd) != 0){		//The first span of a pulse starts with it
+			return -1;
+		}
+	}
+	uint32_t max = pCheck->Targets.Max;
+	uint32_t id = posFind(&pCheck->Targets,X,Y);
+	if(id == UINT32_MAX){
+		return -1;
+	}
+	if(pCheck->Targets.Max != max){
+		DutyTrack* pTracks = growParallel(pCheck->pTracks,max,pCheck->Targets.Max,sizeof(DutyTrack));
+		if(pTracks == NULL){
+			return -1;
+		}
+		pCheck->pTracks = pTracks;
+	}
+	DutyTrack* pTrack = &pCheck->pTracks[id];
+
+	/* Drop spans that end before the window ending at To, then add this one */
+	int64_t cut = To - pCheck->Window;
+	while(pTrack->Num > 0 && pTrack->pSpans[2*pTrack->Head+1] <= cut){
+		pTrack->OnTime -= pTrack->pSpans[2*pTrack->Head+1] - pTrack->pSpans[2*pTrack->Head];
+		pTrack->Head++;
+		pTrack->Num--;
+	}
+	if(pTrack->Num > 0 && pTrack->pSpans[2*(pTrack->Head+pTrack->Num)-1] == From){
+		pTrack->pSpans[2*(pTrack->Head+pTrack->Num)-1] = To;		//Continues the last span
+	}else{
+		if(pTrack->Head > 0 && pTrack->Head + pTrack->Num == pTrack->Max){
+			memmove(pTrack->pSpans,&pTrack->pSpans[2*pTrack->Head],2*pTrack->Num*sizeof(int64_t));
+			pTrack->Head = 0;
+		}
+		if(pTrack->Num == pTrack->Max){
+			uint32_t maxSpans = (pTrack->Max > 0) ? 2*pTrack->Max : 8;
+			int64_t* pSpans = realloc(pTrack->pSpans,2*maxSpans*sizeof(int64_t));
+			if(pSpans == NULL){
+				return -1;
+			}
+			pTrack->pSpans = pSpans;
+			pTrack->Max = maxSpans;
+		}
+		pTrack->pSpans[2*(pTrack->Head+pTrack->Num)] = From;
+		pTrack->pSpans[2*(pTrack->Head+pTrack->Num)+1] = To;
+		pTrack->Num++;
+	}
+	pTrack->OnTime += To - From;
+
+	/* Laser-on time in the window ending at To: only the oldest span can start before it */
+	int64_t first = pTrack->pSpans[2*pTrack->Head];
+	int64_t onTime = pTrack->OnTime - ((first < cut) ? cut - first : 0);
+	double duty = (double)onTime/pCheck->Window;
+	if(duty > pCheck->Report.PeakDuty){
+		pCheck->Report.PeakDuty = duty;
+	}
+	if(onTime > pCheck->Allowed){
+		pCheck->Report.DutyViolations++;
+		if(pCheck->Retime && pCheck->FixDelay == 0 && !pCheck->Unfixable){
+			int64_t delay = dutyDelay(pCheck,pTrack,OnCmd);
+			if(delay < 0){
+				pCheck->Unfixable = 1;
+			}else{
+				pCheck->FixCmd = OnCmd;
+				pCheck->FixDelay = delay;
+			}
+		}
+	}
+	return 0;
+}
+
+static int expSpan(void* pCtx, int64_t X, int64_t Y, int64_t From, int64_t To, uint32_t OnCmd, uint64_t Pulse){
+	ExpCheck* pCheck = pCtx;
+	if((pCheck->RegionSize > 0 && expDose(pCheck,X,Y,To - From) != 0)
+			|| (pCheck->Window > 0 && expDuty(pCheck,X,Y,From,To,OnCmd,Pulse) != 0)){
+		perror("Failure to check exposure (allocation error) - ");
+		pCheck->Failed = 1;
+		return 1;
+	}
+	return 0;
+}
+
+static int delayCmds(ScanProt* pProtocol, uint32_t First, int64_t Delay){
+	//Moves command First and all later ones Delay cycles later.  Inside the loops around First every
+	//iteration is Delay longer, so the commands after each of those loops move by Delay times the
+	//iterations of every loop closed so far
+	uint32_t i;
+	int64_t iterations[EMU_MAX_LOOPS];
+	int depth = 0;
+	for(i = 0; i < First; i++){
+		char op = cmdScan(&pProtocol->pCmds[i]);
+		if(op == START && depth < EMU_MAX_LOOPS){
+			int64_t n = cmdValue(&pProtocol->pCmds[i]);
+			iterations[depth++] = (n > 1) ? n : 1;
+		}else if(op == END && depth > 0){
+			depth--;
+		}
+	}
+	int pass;
+	for(pass = 0; pass < 2; pass++){	//Range check first, so a failure leaves the protocol as it was
+		int open = depth;
+		int inner = 0;					//Loops opened at or after First that are still open
+		int64_t shift = Delay;
+		for(i = First; i < pProtocol->NumCmds; i++){
+			PackedCmd* pCmd = &pProtocol->pCmds[i];
+			int64_t cycle = (int64_t)cmdCycle(pCmd) + shift;
+			if(cycle > UINT32_MAX){
+				fprintf(stderr,"Re-timed protocol would run past the last cycle.\n");
+				return -1;
+			}
+			if(pass == 1){
+				*pCmd = packCmd(cmdScan(pCmd),(uint32_t)cycle,cmdChannel(pCmd),cmdValue(pCmd));
+			}
+			if(cmdScan(pCmd) == START){
+				inner++;
+			}else if(cmdScan(pCmd) == END){
+				if(inner > 0){
+					inner--;
+				}else if(open > 0){
+					int64_t n = iterations[--open];	//Loop around First closed after all its iterations
+					shift = (n > ((int64_t)UINT32_MAX + 1)/shift) ? (int64_t)UINT32_MAX + 1 : shift*n;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+EXPORT int limitExposure(ScanProt* pProtocol, struct RigProfile* Rig, ExposureReport* pReport){
+	RigProfile rig = (Rig != NULL) ? *Rig : defaultRigProfile();
+	ExposureReport report;
+	memset(&report,0,sizeof(report));
+	int status = 0;
+	while(rig.DutyWindow > 0 || rig.RegionSize > 0){
+		ExpCheck check;
+		memset(&check,0,sizeof(check));
+		check.Window = rig.DutyWindow;
+		check.Allowed = (int64_t)floor(rig.MaxDuty*rig.DutyWindow);
+		check.RegionSize = rig.RegionSize;
+		check.MaxDose = rig.MaxRegionDose;
+		check.Retime = rig.RetimeExposure;
+		EmuResult* pRun = emulate(pProtocol,&rig,NULL,0,expSpan,&check);
+		int emulated = (pRun != NULL);
+		freeEmuResult(pRun);
+		uint32_t t;
+		for(t = 0; t < check.Targets.Num; t++){
+			free(check.pTracks[t].pSpans);
+		}
+		free(check.pTracks);
+		free(check.pDoses);
+		free(check.pPulses);
+		freePosIndex(&check.Targets);
+		freePosIndex(&check.Regions);
+		if(!emulated || check.Failed){
+			status = -1;
+			break;
+		}
+
+		if(report.Delays == 0){
+			report.DutyViolations = check.Report.DutyViolations;
+			report.DoseViolations = check.Report.DoseViolations;
+		}
+		report.PeakDuty = check.Report.PeakDuty;
+		report.PeakDose = check.Report.PeakDose;
+		if(check.Report.DoseViolations > 0){
+			fprintf(stderr,"Protocol exceeds the exposure dose limit in %" PRIu32 " region(s).\n",
+					check.Report.DoseViolations);
+			status = -1;
+			break;
+		}
+		if(check.Report.DutyViolations == 0){
+			break;
+		}
+		if(!rig.RetimeExposure || check.Unfixable || check.FixDelay == 0 || report.Delays == EXPOSE_MAX_DELAYS){
+			fprintf(stderr,"Protocol exceeds the exposure duty-cycle limit (%.3f in %" PRIu32 " cycles)%s.\n",
+					rig.MaxDuty,rig.DutyWindow,rig.RetimeExposure ? " and cannot be re-timed" : "");
+			status = -1;
+			break;
+		}
+		if(delayCmds(pProtocol,check.FixCmd,check.FixDelay) != 0){
+			status = -1;
+			break;
+		}
+		report.Delays++;
+		report.AddedCycles += (uint64_t)check.FixDelay;
+	}
+	if(pReport != NULL){
+		*pReport = report;
+	}
+	return (status == 0) ? (int)report.Delays : -1;
+}
+
+/* MOVE ENCODING ==================================================================================*/
+
+/* A relative move is only as good as the position it starts from.  Within one pass through the
+   protocol the position of a channel is tracked from its last absolute move, but a loop that writes
+   a channel starts its second iteration from wherever the first one left it; so at every loop start,
+   the channels its body writes are forgotten until their next absolute move.  At the loop end, the
+   tracked position is that of every iteration's end, and stays valid after the loop.  A channel
+   with a ramp set ('I' or 'J' non-zero) drifts between moves, so it is not known until the ramp is
+   cleared and it is moved absolutely again. */
+
+static int loopWriteMasks(ScanProt* pProtocol, uint16_t* pMasks){
+	//For every loop start, the channels written anywhere in its body (bit per channel)
+	uint32_t stack[EMU_MAX_LOOPS];
+	int depth = 0;
+	int d;
+	uint32_t i;
+	for(i = 0; i < pProtocol->NumCmds; i++){
+		PackedCmd* pCmd = &pProtocol->pCmds[i];
+		char op = cmdScan(pCmd);
+		pMasks[i] = 0;
+		if(op == START){
+			if(depth == EMU_MAX_LOOPS){
+				fprintf(stderr,"Loops nested deeper than %d.\n",EMU_MAX_LOOPS);
+				return -1;
+			}
+			stack[depth++] = i;
+		}else if(op == END){
+			depth = (depth > 0) ? depth - 1 : 0;
+		}else if(op == 'V' || op == 'R' || op == 'I' || op == 'J'){
+			for(d = 0; d < depth; d++){
+				pMasks[stack[d]] |= (uint16_t)(1 << cmdChannel(pCmd));
+			}
+		}
+	}
+	while(depth > 0){
+		pMasks[stack[--depth]] = 0xFFFF;		//Unclosed loop: trust nothing after it
+	}
+	return 0;
+}
+
+EXPORT int compactMoves(ScanProt* pProtocol, uint32_t ResyncEvery){
+	if(ResyncEvery == 0 || pProtocol->NumCmds == 0){
+		return 0;
+	}
+	uint16_t* pMasks = malloc(pProtocol->NumCmds*sizeof(uint16_t));
+	if(pMasks == NULL){
+		perror("Failure to compact moves (allocation error) - ");
+		return -1;
+	}
+	if(loopWriteMasks(pProtocol,pMasks) != 0){
+		free(pMasks);
+		return -1;
+	}
+
+	int known[EMU_CHANNELS] = {0};
+	int64_t pos[EMU_CHANNELS];
+	int64_t incr[EMU_CHANNELS] = {0};				//Ramp increments set ('I', 'J'): while one is
+	int64_t incr2[EMU_CHANNELS] = {0};				//non-zero the channel drifts, so it is not known
+	uint32_t numRelative[EMU_CHANNELS] = {0};		//Relative moves since the last absolute one
+	int numRewritten = 0;
+	uint32_t i;
+	int c;
+	for(i = 0; i < pProtocol->NumCmds; i++){
+		PackedCmd* pCmd = &pProtocol->pCmds[i];
+		int chan = cmdChannel(pCmd);
+		int64_t value = cmdValue(pCmd);
+		switch(cmdScan(pCmd)){
+			case START:
+				for(c = 0; c < EMU_CHANNELS; c++){
+					if(pMasks[i] & (1 << c)){ known[c] = 0; }
+				}
+				break;
+			case 'V':
+				if(known[chan] && numRelative[chan] < ResyncEvery){
+					PackedCmd relative = packCmd('R',cmdCycle(pCmd),chan,value - pos[chan]);
+					if(cmdLineLen(&relative) < cmdLineLen(pCmd)){
+						*pCmd = relative;
+						numRelative[chan]++;
+						numRewritten++;
+					}else{
+						numRelative[chan] = 0;
+					}
+				}else{
+					numRelative[chan] = 0;
+				}
+				known[chan] = (incr[chan] == 0 && incr2[chan] == 0);
+				pos[chan] = value;
+				break;
+			case 'R':
+				if(known[chan]){
+					pos[chan] += value;
+				}
+				break;
+			case 'I':
+			case 'J':
+				if(cmdScan(pCmd) == 'I'){
+					incr[chan] = value;
+				}else{
+					incr2[chan] = value;
+				}
+				known[chan] = 0;
+				break;
+			default:
+				break;
+		}
+	}
+	free(pMasks);
+	return numRewritten;
+}
+
+/* EXPERIMENT LANGUAGE ============================================================================*/
+
+#define EXP_MAX_TARGETS 256			//Named targets per experiment
+#define EXP_MAX_NAME 32				//Longest target name
+#define EXP_MAX_TOKEN 256			//Longest word (target lists are one word)
+
+typedef struct ExpTarget{
+	char Name[EXP_MAX_NAME];
+	Coord Pos;						//Pixels
+} ExpTarget;
+
+typedef struct Experiment{			//Compiler state
+	const char* pText;				//Next character of the source
+	const char* pToken;				//Start of the current token
+	char Token[EXP_MAX_TOKEN];
+	uint32_t Line;
+	int NewLine;					//Current token ends a line
+	ExpTarget Targets[EXP_MAX_TARGETS];
+	uint32_t NumTargets;
+	int64_t ScaleFactor;
+	Coord Center;
+	uint64_t Rng;					//Random target orders (splitMix)
+	RigProfile Rig;
+	ScanProt* pProt;
+	uint64_t Time;					//Cycle of the next command, as listed
+	gCoord Pos;						//Galvo position, if Known
+	int Known;
+	uint32_t Moves;
+	int Depth;						//Open DSP loops
+	int Varies;						//Commands compiled since the enclosing repeat differ between its repetitions
+	uint32_t Loops;
+	uint32_t Unrolled;
+} Experiment;
+
+static int expError(Experiment* pExp, const char* Message){
+	fprintf(stderr,"Experiment line %" PRIu32 ": %s (at '%s')\n",pExp->Line,Message,pExp->Token);
+	return -1;
+}
+
+static int expToken(Experiment* pExp){
+	//Reads the next token: a word, "{", "}", or ";" for the end of a statement (';' or a newline).
+	//Returns 1, 0 at the end of the source, or -1.
+	if(pExp->NewLine){
+		pExp->Line++;
+		pExp->NewLine = 0;
+	}
+	const char* p = pExp->pText;
+	while(*p == ' ' || *p == '\t' || *p == '\r' || *p == '#'){
+		if(*p == '#'){
+			while(*p != '\0' && *p != '\n'){ p++; }
+		}else{
+			p++;
+		}
+	}
+	size_t len = 1;
+	if(*p == '\0'){
+		len = 0;
+	}else if(*p == '\n' || *p == ';'){
+		pExp->NewLine = (*p == '\n');
+	}else if(*p != '{' && *p != '}'){
+		while(p[len] != '\0' && !isspace((unsigned char)p[len]) && strchr(";{}#",p[len]) == NULL){
+			len++;
+		}
+	}
+	pExp->pToken = p;
+	pExp->pText = p + len;
+	if(len >= EXP_MAX_TOKEN){
+		memcpy(pExp->Token,p,EXP_MAX_TOKEN-1);
+		pExp->Token[EXP_MAX_TOKEN-1] = '\0';
+		return expError(pExp,"word too long");
+	}
+	memcpy(pExp->Token,p,len);
+	pExp->Token[len] = '\0';
+	if(len == 1 && (*p == '\n' || *p == ';')){
+		strcpy(pExp->Token,";");
+	}
+	return (len > 0) ? 1 : 0;
+}
+
+static int expWord(Experiment* pExp, const char* What){
+	//Reads a token that must be a word
+	int r = expToken(pExp);
+	if(r < 0){
+		return -1;
+	}
+	if(r == 0 || strchr(";{}",pExp->Token[0]) != NULL){
+		fprintf(stderr,"Experiment line %" PRIu32 ": %s expected\n",pExp->Line,What);
+		return -1;
+	}
+	return 0;
+}
+
+static int expEnd(Experiment* pExp){
+	//Ends a statement; a closing brace or the end of the source is left for expBlock
+	int r = expToken(pExp);
+	if(r < 0){
+		return -1;
+	}
+	if(r == 0 || strcmp(pExp->Token,"}") == 0){
+		pExp->pText = pExp->pToken;
+		return 0;
+	}
+	return (strcmp(pExp->Token,";") == 0) ? 0 : expError(pExp,"end of statement expected");
+}
+
+static int expNumber(Experiment* pExp, const char* What, double Min, double Max, double* pValue){
+	if(expWord(pExp,What) != 0){
+		return -1;
+	}
+	char* pEnd;
+	*pValue = strtod(pExp->Token,&pEnd);
+	if(pEnd == pExp->Token || *pEnd != '\0' || !(*pValue >= Min && *pValue <= Max)){
+		return expError(pExp,What);
+	}
+	return 0;
+}
+
+static int expTime(Experiment* pExp, int AllowRate, uint64_t* pCycles){
+	//Reads a duration ("500 ms", "2s", "250 us", "40 cycles") or, with AllowRate set, a frequency
+	//("10 Hz") as its period, in cycles
+	if(expWord(pExp,"duration") != 0){
+		return -1;
+	}
+	char* pEnd;
+	double value = strtod(pExp->Token,&pEnd);
+	if(pEnd == pExp->Token || !(value >= 0)){
+		return expError(pExp,"duration expected");
+	}
+	if(*pEnd == '\0'){
+		if(expWord(pExp,"unit") != 0){
+			return -1;
+		}
+		pEnd = pExp->Token;
+	}
+	double cycles;
+	if(strcmp(pEnd,"us") == 0){
+		cycles = value/CYCLE_LEN;
+	}else if(strcmp(pEnd,"ms") == 0){
+		cycles = value*CYCLES_PER_MS;
+	}else if(strcmp(pEnd,"s") == 0){
+		cycles = value*1000*CYCLES_PER_MS;
+	}else if(strcmp(pEnd,"cycles") == 0){
+		cycles = value;
+	}else if(AllowRate && strcmp(pEnd,"Hz") == 0 && value > 0){
+		cycles = 1000*CYCLES_PER_MS/value;
+	}else{
+		return expError(pExp,AllowRate ? "unit must be us, ms, s, cycles or Hz" : "unit must be us, ms, s or cycles");
+	}
+	if(cycles > UINT32_MAX){
+		return expError(pExp,"duration too long");
+	}
+	*pCycles = (uint64_t)llround(cycles);
+	return 0;
+}
+
+static int expFindTarget(Experiment* pExp, const char* Name, size_t Len){
+	uint32_t k;
+	for(k = 0; k < pExp->NumTargets; k++){
+		if(strlen(pExp->Targets[k].Name) == Len && strncmp(pExp->Targets[k].Name,Name,Len) == 0){
+			return (int)k;
+		}
+	}
+	return -1;
+}
+
+static int expTargets(Experiment* pExp, uint32_t* pList, uint32_t* pCount){
+	//Reads a target list: names separated by ',', where A-F stands for the targets defined from A
+	//to F
+	if(expWord(pExp,"target list") != 0){
+		return -1;
+	}
+	const char* p = pExp->Token;
+	*pCount = 0;
+	while(*p != '\0'){
+		size_t len = strcspn(p,",-");
+		int first = expFindTarget(pExp,p,len);
+		int last = first;
+		p += len;
+		if(*p == '-'){
+			p++;
+			len = strcspn(p,",-");
+			last = expFindTarget(pExp,p,len);
+			p += len;
+		}
+		if(first < 0 || last < 0){
+			return expError(pExp,"unknown target");
+		}
+		int step = (last >= first) ? 1 : -1;
+		int k;
+		for(k = first; ; k += step){
+			if(*pCount == EXP_MAX_TARGETS){
+				return expError(pExp,"target list too long");
+			}
+			pList[(*pCount)++] = (uint32_t)k;
+			if(k == last){
+				break;
+			}
+		}
+		if(*p == ','){
+			p++;
+		}else if(*p != '\0'){
+			return expError(pExp,"invalid target list");
+		}
+	}
+	return 0;
+}
+
+static int expCheck(Experiment* pExp, uint64_t Time){
+	if(Time > UINT32_MAX){
+		return expError(pExp,"experiment too long");
+	}
+	if(pExp->pProt->NumCmds > MAX_CMDS){
+		return expError(pExp,"experiment has more commands than the DSP holds");
+	}
+	return 0;
+}
+
+static int expMove(Experiment* pExp, uint32_t k){
+	//Moves to a target and waits for the galvos to settle; from an unknown position (the start, or
+	//the first move of a loop body) the wait is a full-range move
+	RigProfile* pRig = &pExp->Rig;
+	if(pExp->ScaleFactor == 0){
+		return expError(pExp,"scale must be set before moving to a target");
+	}
+	gCoord target = convertCoord(&pExp->Targets[k].Pos,pExp->ScaleFactor,&pExp->Center,0);
+	if(pExp->Known && target.X == pExp->Pos.X && target.Y == pExp->Pos.Y){
+		return 0;
+	}
+	uint32_t settle = pExp->Known ? settleCycles(pRig,moveDistance(&pExp->Pos,&target)) : pRig->MoveTime;
+	if(appendMove(pExp->pProt,pRig->ChanX,(uint32_t)pExp->Time,target.X) != 0
+			|| appendMove(pExp->pProt,pRig->ChanY,(uint32_t)pExp->Time,target.Y) != 0){
+		return expError(pExp,"allocation error");
+	}
+	pExp->Time += settle;
+	pExp->Pos = target;
+	pExp->Known = 1;
+	pExp->Moves++;
+	return expCheck(pExp,pExp->Time);
+}
+
+static int expTrain(Experiment* pExp, uint32_t Count, uint64_t Width, uint64_t Period){
+	//Count pulses of Width cycles, one every Period, as one DSP loop.  The END is listed one period
+	//after the START, and what follows at the expanded time, Count periods on
+	ScanProt* pProt = pExp->pProt;
+	uint32_t t = (uint32_t)pExp->Time;
+	if(expCheck(pExp,pExp->Time + Count*Period) != 0){
+		return -1;
+	}
+	int failed = 0;
+	if(Count > 1){
+		if(pExp->Depth == EMU_MAX_LOOPS){
+			return expError(pExp,"loops nested too deeply");
+		}
+		failed |= appendLoop(pProt,START,t,Count);
+		pExp->Loops++;
+	}
+	failed |= appendTrigOut(pProt,t,TL_DH);
+	failed |= appendTrigOut(pProt,t+(uint32_t)Width,TL_DL);
+	if(Count > 1){
+		failed |= appendLoop(pProt,END,t+(uint32_t)Period,Count);
+	}
+	pExp->Time += Count*Period;
+	return failed ? expError(pExp,"allocation error") : expCheck(pExp,pExp->Time);
+}
+
+static int expStimulate(Experiment* pExp, uint32_t Count, uint64_t Width, uint64_t Period){
+	//Train at the current position, or "at LIST [random]": at each listed target in turn
+	uint32_t list[EXP_MAX_TARGETS];
+	uint32_t numListed = 0;
+	int r = expToken(pExp);
+	if(r < 0){
+		return -1;
+	}
+	if(r == 0 || strcmp(pExp->Token,"at") != 0){
+		pExp->pText = pExp->pToken;
+		return expTrain(pExp,Count,Width,Period);
+	}
+	if(expTargets(pExp,list,&numListed) != 0 || (r = expToken(pExp)) < 0){
+		return -1;
+	}
+	if(r > 0 && strcmp(pExp->Token,"random") == 0){
+		uint32_t i;
+		for(i = numListed; i > 1; i--){		//Fisher-Yates
+			uint32_t j = (uint32_t)(splitMix(&pExp->Rng) % i);
+			uint32_t swap = list[i-1];
+			list[i-1] = list[j];
+			list[j] = swap;
+		}
+		pExp->Varies = 1;
+	}else{
+		pExp->pText = pExp->pToken;
+	}
+	uint32_t i;
+	for(i = 0; i < numListed; i++){
+		if(expMove(pExp,list[i]) != 0 || expTrain(pExp,Count,Width,Period) != 0){
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int expBlock(Experiment* pExp, int Nested);
+
+static int expRepeat(Experiment* pExp, uint32_t Reps){
+	//Compiles the body once inside a DSP loop, with the END after one repetition and what follows
+	//at the expanded time.  A body that differs between repetitions (random target orders) is
+	//unrolled instead: its commands are dropped and it is compiled Reps times.
+	const char* pBody = pExp->pText;
+	uint32_t bodyLine = pExp->Line;
+	int bodyNewLine = pExp->NewLine;
+	if(Reps == 1){
+		return expBlock(pExp,1);
+	}
+	if(pExp->Depth == EMU_MAX_LOOPS){
+		return expError(pExp,"loops nested too deeply");
+	}
+	ScanProt* pProt = pExp->pProt;
+	uint32_t entryCmds = pProt->NumCmds;
+	uint64_t entryTime = pExp->Time;
+	gCoord entryPos = pExp->Pos;
+	int entryKnown = pExp->Known;
+	uint32_t entryMoves = pExp->Moves;
+	int entryVaries = pExp->Varies;
+	uint32_t entryLoops = pExp->Loops;
+	uint32_t entryUnrolled = pExp->Unrolled;
+	if(appendLoop(pProt,START,(uint32_t)pExp->Time,Reps) != 0){
+		return expError(pExp,"allocation error");
+	}
+	pExp->Depth++;
+	pExp->Known = 0;
+	pExp->Varies = 0;
+	if(expBlock(pExp,1) != 0){
+		return -1;
+	}
+	pExp->Depth--;
+	if(!pExp->Varies){
+		if(appendLoop(pProt,END,(uint32_t)pExp->Time,Reps) != 0){
+			return expError(pExp,"allocation error");
+		}
+		pExp->Time = entryTime + Reps*(pExp->Time - entryTime);
+		if(expCheck(pExp,pExp->Time) != 0){
+			return -1;
+		}
+		pExp->Loops++;
+		pExp->Varies = entryVaries;
+		if(pExp->Moves == entryMoves){
+			pExp->Pos = entryPos;
+			pExp->Known = entryKnown;
+		}
+		return 0;
+	}
+	pProt->NumCmds = entryCmds;
+	pExp->Time = entryTime;
+	pExp->Pos = entryPos;
+	pExp->Known = entryKnown;
+	pExp->Loops = entryLoops;
+	pExp->Unrolled = entryUnrolled;
+	uint32_t r;
+	for(r = 0; r < Reps; r++){
+		pExp->pText = pBody;
+		pExp->Line = bodyLine;
+		pExp->NewLine = bodyNewLine;
+		if(expBlock(pExp,1) != 0){
+			return -1;
+		}
+	}
+	pExp->Unrolled++;
+	return 0;
+}
+
+static int expStatement(Experiment* pExp){
+	RigProfile* pRig = &pExp->Rig;
+	char keyword[EXP_MAX_TOKEN];
+	strcpy(keyword,pExp->Token);
+	double a, b;
+	uint64_t width, period;
+	if(strcmp(keyword,"target") == 0){
+		if(expWord(pExp,"target name") != 0){
+			return -1;
+		}
+		if(strlen(pExp->Token) >= EXP_MAX_NAME || strcspn(pExp->Token,",-") != strlen(pExp->Token)
+				|| expFindTarget(pExp,pExp->Token,strlen(pExp->Token)) >= 0 || pExp->NumTargets == EXP_MAX_TARGETS){
+			return expError(pExp,"invalid or repeated target name, or too many targets");
+		}
+		ExpTarget* pTarget = &pExp->Targets[pExp->NumTargets];
+		strcpy(pTarget->Name,pExp->Token);
+		if(expNumber(pExp,"X position",INT_MIN,INT_MAX,&a) != 0 || expNumber(pExp,"Y position",INT_MIN,INT_MAX,&b) != 0){
+			return -1;
+		}
+		pTarget->Pos.X = (int)a;
+		pTarget->Pos.Y = (int)b;
+		pExp->NumTargets++;
+	}else if(strcmp(keyword,"scale") == 0){
+		if(expNumber(pExp,"scale factor",1,(double)UCOUNT_MAX,&a) != 0){
+			return -1;
+		}
+		pExp->ScaleFactor = (int64_t)a;
+	}else if(strcmp(keyword,"center") == 0){
+		if(expNumber(pExp,"X offset",INT_MIN,INT_MAX,&a) != 0 || expNumber(pExp,"Y offset",INT_MIN,INT_MAX,&b) != 0){
+			return -1;
+		}
+		pExp->Center.X = (int)a;
+		pExp->Center.Y = (int)b;
+	}else if(strcmp(keyword,"seed") == 0){
+		if(expWord(pExp,"seed") != 0){
+			return -1;
+		}
+		char* pEnd;
+		errno = 0;
+		pExp->Rng = strtoull(pExp->Token,&pEnd,10);		//All 64 bits: a double would round above 2^53
+		if(!isdigit((unsigned char)pExp->Token[0]) || *pEnd != '\0' || errno == ERANGE){
+			return expError(pExp,"seed");
+		}
+	}else if(strcmp(keyword,"wait") == 0){
+		if(expTime(pExp,0,&period) != 0){
+			return -1;
+		}
+		pExp->Time += period;
+		if(expCheck(pExp,pExp->Time) != 0){
+			return -1;
+		}
+	}else if(strcmp(keyword,"trigger") == 0){
+		if(expWord(pExp,"in, falling or out") != 0){
+			return -1;
+		}
+		int failed;
+		if(strcmp(pExp->Token,"in") == 0 || strcmp(pExp->Token,"rising") == 0 || strcmp(pExp->Token,"falling") == 0){
+			if(pExp->Time == 0){
+				return expError(pExp,"trigger wait in cycle 0 (set a TimeOffset)");
+			}
+			failed = appendTrigIn(pExp->pProt,(uint32_t)pExp->Time,(pExp->Token[0] == 'f') ? FALLING : RISING);
+		}else if(strcmp(pExp->Token,"out") == 0){
+			failed = appendTrigOut(pExp->pProt,(uint32_t)pExp->Time,TH_DL)
+				  | appendTrigOut(pExp->pProt,(uint32_t)pExp->Time + pRig->TrigLen,TL_DL);
+			pExp->Time += pRig->TrigLen;
+		}else{
+			return expError(pExp,"trigger must be in, rising, falling or out");
+		}
+		if(failed){
+			return expError(pExp,"allocation error");
+		}
+		if(expCheck(pExp,pExp->Time) != 0){
+			return -1;
+		}
+	}else if(strcmp(keyword,"move") == 0){
+		if(expWord(pExp,"target name") != 0){
+			return -1;
+		}
+		int k = expFindTarget(pExp,pExp->Token,strlen(pExp->Token));
+		if(k < 0 || expMove(pExp,(uint32_t)k) != 0){
+			return (k < 0) ? expError(pExp,"unknown target") : -1;
+		}
+	}else if(strcmp(keyword,"pulse") == 0){
+		if(expTime(pExp,0,&width) != 0){
+			return -1;
+		}
+		if(width == 0){
+			return expError(pExp,"pulse width must be at least one cycle");
+		}
+		if(expStimulate(pExp,1,width,width) != 0){
+			return -1;
+		}
+	}else if(strcmp(keyword,"train") == 0){
+		//train N x WIDTH every PERIOD|rate FREQUENCY
+		if(expNumber(pExp,"pulse count",1,UINT16_MAX,&a) != 0 || expWord(pExp,"x") != 0){
+			return -1;
+		}
+		if(strcmp(pExp->Token,"x") != 0){
+			return expError(pExp,"x expected");
+		}
+		if(expTime(pExp,0,&width) != 0 || expWord(pExp,"every or rate") != 0){
+			return -1;
+		}
+		if(strcmp(pExp->Token,"every") != 0 && strcmp(pExp->Token,"rate") != 0){
+			return expError(pExp,"every or rate expected");
+		}
+		if(expTime(pExp,1,&period) != 0){
+			return -1;
+		}
+		if(width == 0){
+			return expError(pExp,"pulse width must be at least one cycle");
+		}
+		if(period < width){
+			period = width;			//Coerce the interval to the pulse width, as the builders do
+		}
+		if(expStimulate(pExp,(uint32_t)a,width,period) != 0){
+			return -1;
+		}
+	}else if(strcmp(keyword,"repeat") == 0){
+		if(expNumber(pExp,"repetitions",1,UINT16_MAX,&a) != 0 || expToken(pExp) < 0){
+			return -1;
+		}
+		if(strcmp(pExp->Token,"{") != 0){
+			return expError(pExp,"{ expected");
+		}
+		return expRepeat(pExp,(uint32_t)a);
+	}else{
+		return expError(pExp,"unknown statement");
+	}
+	return expEnd(pExp);
+}
+
+static int expBlock(Experiment* pExp, int Nested){
+	//Compiles statements up to the closing brace (Nested) or the end of the source
+	int r;
+	while((r = expToken(pExp)) > 0){
+		if(strcmp(pExp->Token,";") == 0){
+			continue;
+		}
+		if(strcmp(pExp->Token,"}") == 0){
+			return Nested ? expEnd(pExp) : expError(pExp,"unmatched }");
+		}
+		if(strcmp(pExp->Token,"{") == 0){
+			return expError(pExp,"unexpected {");
+		}
+		if(expStatement(pExp) != 0){
+			return -1;
+		}
+	}
+	if(r == 0 && Nested){
+		return expError(pExp,"missing }");
+	}
+	return r;
+}
+
+EXPORT char* compileExperiment(const char* Source, struct RigProfile* Rig, ExpStats* pStats){
+	uint64_t buildStart = metricClock();
+	Experiment* pExp = calloc(1,sizeof(Experiment));
+	if(pExp == NULL){
+		perror("Failure to compile experiment (allocation error) - ");
+		return NULL;
+	}
+	pExp->pText = Source;
+	pExp->Line = 1;
+	pExp->Rig = (Rig != NULL) ? *Rig : defaultRigProfile();
+	pExp->Rng = 1;
+	pExp->Time = pExp->Rig.TimeOffset;			//Keeps trigger waits out of cycle 0
+	pExp->pProt = createProtocol();
+	if(pExp->pProt == NULL || expBlock(pExp,0) != 0){
+		freeProtocol(pExp->pProt);
+		free(pExp);
+		return NULL;
+	}
+	if(pExp->pProt->NumCmds == 0){
+		fprintf(stderr,"Experiment has no commands.\n");
+		freeProtocol(pExp->pProt);
+		free(pExp);
+		return NULL;
+	}
+	RigProfile rig = pExp->Rig;
+	uint32_t loops = pExp->Loops;
+	uint32_t unrolled = pExp->Unrolled;
+	char* protocolString = finishBuild(pExp->pProt,&rig,1,buildStart);
+	free(pExp);
+	if(protocolString != NULL && pStats != NULL){
+		//Run time from the emulator, so it includes any re-timing by limitExposure
+		memset(pStats,0,sizeof(ExpStats));
+		pStats->Bytes = strlen(protocolString);
+		pStats->Loops = loops;
+		pStats->Unrolled = unrolled;
+		ScanProt* pFinal = stringToProt(protocolString);
+		EmuResult* pRun = (pFinal != NULL) ? emulateProtocol(pFinal,&rig,0) : NULL;
+		if(pRun != NULL){
+			pStats->NumCmds = pFinal->NumCmds;
+			pStats->Cycles = pRun->EndTime;
+			pStats->NumWaits = pRun->NumWaits;
+		}
+		freeEmuResult(pRun);
+		freeProtocol(pFinal);
+	}
+	return protocolString;
+}
+
+EXPORT char* compileExperimentFile(const char* ExpFile, struct RigProfile* Rig, ExpStats* pStats){
+	FILE* fp = fopen(ExpFile,"rb");
+	if(fp == NULL){
+		fprintf(stderr,"Failed to open experiment file: %s\n",ExpFile);
+		return NULL;
+	}
+	fileSeek(fp,0,SEEK_END);
+	int64_t size = fileTell(fp);
+	fileSeek(fp,0,SEEK_SET);
+	char* pSource = (size >= 0 && (uint64_t)size < SIZE_MAX) ? malloc((size_t)size + 1) : NULL;
+	if(pSource == NULL || fread(pSource,1,(size_t)size,fp) != (size_t)size){
+		fprintf(stderr,"Failed to read experiment file: %s\n",ExpFile);
+		free(pSource);
+		fclose(fp);
+		return NULL;
+	}
+	fclose(fp);
+	pSource[size] = '\0';
+	char* protocolString = compileExperiment(pSource,Rig,pStats);
+	free(pSource);
+	return protocolString;
+}
+
+/* DSP LINK =======================================================================================*/
+
+#define LINK_MAX_WINDOW 32			//Most lines a link may send ahead of their acknowledgement
+#define LINK_WINDOW 4				//Default MaxWindow
+#define LINK_PROBE_LINES 32			//Clean acknowledgements before the window grows by one line
+#define LINK_MARGIN 1.1			//Lines are started this multiple of the DSP's time per line apart
+#define LINK_TIMEOUT_US 500000		//Longest wait for an acknowledgement once its line is on the wire
+#define LINK_QUIET_US 50000			//Silence that ends a drain of the DSP's output
+#define LINK_RETRIES 3				//Restarts at the safe rate before an upload fails
+#define LINK_POLL_US 10000			//Longest read of an upload between checks of the abort flag
+#define DSP_RUN_ABORTED 2			//DSP status of a stopped run, recorded for an aborted upload
+
+struct DSPLink{					//Connection to the DSP, with the upload pacing it has learned
+	enum LinkKind Kind;
+	uint32_t Baud;
+#ifdef __WIN32__
+	HANDLE hPort;
+	uint32_t ReadTimeoutUs;			//Read timeout last set on the port
+#else
+	int fd;
+#endif
+	LinkWriteFn pWrite;
+	LinkReadFn pRead;
+	void* pCtx;
+	uint32_t Window;				//Lines sent ahead of their acknowledgement (1: wait for each)
+	uint32_t MaxWindow;				//Largest window an upload probes; lowered after a link error
+	double ServiceUs;				//Measured DSP time per line, microseconds (0: not yet measured)
+	uint32_t Clean;					//Acknowledgements since the window last grew
+	pthread_mutex_t Busy;			//Held by an upload or an abort for its whole exchange
+	pthread_mutex_t WriteLock;		//Held for each write, so lines from two threads never interleave
+	int Abort;						//Set by abortLink; an upload in progress stops at its next poll
+	char AbortCmd[LINK_CMD_LEN];	//Laser off and park, formatted by setParkPosition
+	size_t AbortLen;
+	char QueryCmd[LINK_CMD_LEN];	//Read-back of the laser and galvo channels
+	size_t QueryLen;
+	int ParkChan[3];				//Channels read back: laser, X galvo, Y galvo
+	int64_t ParkValue[3];			//Values they were set to
+};
+
+typedef struct LinkLine{			//Line sent and not yet acknowledged
+	size_t Start;					//Offset in the text
+	size_t Len;
+	uint64_t WireEnd;				//Estimated time its last byte reaches the DSP, microseconds
+	size_t Echoed;					//Bytes of its echo received
+	int Digits;						//Digits of its status received
+	int Status;
+} LinkLine;
+
+static void linkSleep(uint64_t Us){
+#ifdef __WIN32__
+	Sleep((DWORD)((Us + 999)/1000));
+#else
+	struct timespec ts = {(time_t)(Us/1000000),(long)(Us%1000000)*1000};
+	nanosleep(&ts,NULL);
+#endif
+}
+
+#ifndef __WIN32__
+static speed_t baudConstant(uint32_t Baud){
+	switch(Baud){
+		case 9600:		return B9600;
+		case 19200:		return B19200;
+		case 38400:		return B38400;
+		case 57600:		return B57600;
+		case 115200:	return B115200;
+		case 230400:	return B230400;
+		default:		return B0;
+	}
+}
+#endif
+
+EXPORT DSPLink* openLink(const char* Port, uint32_t Baud){
+	//Opens a serial port at Baud, 8 data bits, no parity, 1 stop bit, no flow control
+	DSPLink* pLink = calloc(1,sizeof(DSPLink));
+	if(pLink == NULL){
+		perror("Failure to open DSP link (allocation error) - ");
+		return NULL;
+	}
+	pLink->Kind = LINK_SERIAL;
+	pLink->Baud = Baud;
+	pLink->Window = 1;
+	pLink->MaxWindow = LINK_WINDOW;
+	pthread_mutex_init(&pLink->Busy,NULL);
+	pthread_mutex_init(&pLink->WriteLock,NULL);
+	setParkPosition(pLink,NULL,0,0);
+#ifdef __WIN32__
+	char path[FILENAME_MAX];
+	snprintf(path,FILENAME_MAX,(strncmp(Port,"\\\\.\\",4) == 0) ? "%s" : "\\\\.\\%s",Port);
+	pLink->hPort = CreateFileA(path,GENERIC_READ|GENERIC_WRITE,0,NULL,OPEN_EXISTING,0,NULL);
+	if(pLink->hPort == INVALID_HANDLE_VALUE){
+		fprintf(stderr,"Failed to open serial port: %s\n",Port);
+		free(pLink);
+		return NULL;
+	}
+	DCB dcb;
+	memset(&dcb,0,sizeof(dcb));
+	dcb.DCBlength = sizeof(dcb);
+	int ok = GetCommState(pLink->hPort,&dcb);
+	dcb.BaudRate = Baud;
+	dcb.ByteSize = 8;
+	dcb.Parity = NOPARITY;
+	dcb.StopBits = ONESTOPBIT;
+	dcb.fBinary = TRUE;
+	dcb.fParity = FALSE;
+	dcb.fOutxCtsFlow = FALSE;
+	dcb.fOutxDsrFlow = FALSE;
+	dcb.fDsrSensitivity = FALSE;
+	dcb.fDtrControl = DTR_CONTROL_ENABLE;
+	dcb.fRtsControl = RTS_CONTROL_ENABLE;
+	dcb.fOutX = FALSE;
+	dcb.fInX = FALSE;
+	if(!ok || !SetCommState(pLink->hPort,&dcb)){
+		fprintf(stderr,"Failed to configure serial port %s at %" PRIu32 " baud.\n",Port,Baud);
+		CloseHandle(pLink->hPort);
+		free(pLink);
+		return NULL;
+	}
+	PurgeComm(pLink->hPort,PURGE_RXCLEAR|PURGE_TXCLEAR);
+#else
+	speed_t speed = baudConstant(Baud);
+	struct termios tio;
+	pLink->fd = (speed != B0) ? open(Port,O_RDWR|O_NOCTTY|O_NONBLOCK) : -1;		//Does not wait for carrier
+	if(pLink->fd < 0 || fcntl(pLink->fd,F_SETFL,0) != 0 || tcgetattr(pLink->fd,&tio) != 0){
+		fprintf(stderr,"Failed to open serial port %s at %" PRIu32 " baud.\n",Port,Baud);
+		if(pLink->fd >= 0){
+			close(pLink->fd);
+		}
+		free(pLink);
+		return NULL;
+	}
+	cfmakeraw(&tio);
+	cfsetispeed(&tio,speed);
+	cfsetospeed(&tio,speed);
+	tio.c_cflag &= ~(CSTOPB|PARENB|CRTSCTS);
+	tio.c_cflag |= CS8|CLOCAL|CREAD;
+	tio.c_iflag &= ~(IXON|IXOFF|IXANY);
+	tio.c_cc[VMIN] = 0;
+	tio.c_cc[VTIME] = 0;
+	if(tcsetattr(pLink->fd,TCSANOW,&tio) != 0){
+		fprintf(stderr,"Failed to configure serial port %s at %" PRIu32 " baud.\n",Port,Baud);
+		close(pLink->fd);
+		free(pLink);
+		return NULL;
+	}
+	tcflush(pLink->fd,TCIOFLUSH);
+#endif
+	return pLink;
+}
+
+EXPORT DSPLink* callbackLink(LinkWriteFn pWrite, LinkReadFn pRead, void* pCtx, uint32_t Baud){
+	//Link over the caller's transport; Baud is the line rate behind it, used for pacing
+	DSPLink* pLink = calloc(1,sizeof(DSPLink));
+	if(pLink == NULL){
+		perror("Failure to open DSP link (allocation error) - ");
+		return NULL;
+	}
+	pLink->Kind = LINK_CALLBACK;
+	pLink->Baud = Baud;
+	pLink->pWrite = pWrite;
+	pLink->pRead = pRead;
+	pLink->pCtx = pCtx;
+	pLink->Window = 1;
+	pLink->MaxWindow = LINK_WINDOW;
+	pthread_mutex_init(&pLink->Busy,NULL);
+	pthread_mutex_init(&pLink->WriteLock,NULL);
+	setParkPosition(pLink,NULL,0,0);
+	return pLink;
+}
+
+EXPORT void closeLink(DSPLink* pLink){
+	if(pLink == NULL){
+		return;
+	}
+	if(pLink->Kind == LINK_SERIAL){
+#ifdef __WIN32__
+		CloseHandle(pLink->hPort);
+#else
+		close(pLink->fd);
+#endif
+	}
+	pthread_mutex_destroy(&pLink->Busy);
+	pthread_mutex_destroy(&pLink->WriteLock);
+	free(pLink);
+}
+
+static int linkPut(DSPLink* pLink, const char* pData, size_t Len){
+	//Writes all of pData, the caller holding WriteLock; returns 0 or -1
+	while(Len > 0){
+		long n;
+		if(pLink->Kind == LINK_CALLBACK){
+			n = pLink->pWrite(pLink->pCtx,pData,Len);
+		}else{
+#ifdef __WIN32__
+			DWORD written = 0;
+			n = WriteFile(pLink->hPort,pData,(DWORD)Len,&written,NULL) ? (long)written : -1;
+#else
+			n = write(pLink->fd,pData,Len);
+			if(n < 0 && errno == EINTR){
+				continue;
+			}
+#endif
+		}
+		if(n <= 0){
+			fprintf(stderr,"Failure to write to the DSP link.\n");
+			return -1;
+		}
+		pData += n;
+		Len -= (size_t)n;
+	}
+	return 0;
+}
+
+static int linkWrite(DSPLink* pLink, const char* pData, size_t Len){
+	//Writes all of pData unless the link is being aborted; returns 0, -1, or -2 if aborted
+	pthread_mutex_lock(&pLink->WriteLock);
+	int status = __atomic_load_n(&pLink->Abort,__ATOMIC_ACQUIRE) ? -2 : linkPut(pLink,pData,Len);
+	pthread_mutex_unlock(&pLink->WriteLock);
+	return status;
+}
+
+static int linkRead(DSPLink* pLink, char* pData, size_t Len, uint64_t TimeoutUs){
+	//Reads what has arrived, waiting up to TimeoutUs for the first byte; returns the count, 0 on
+	//timeout, or -1
+	if(TimeoutUs > UINT32_MAX){
+		TimeoutUs = UINT32_MAX;
+	}
+	if(pLink->Kind == LINK_CALLBACK){
+		return pLink->pRead(pLink->pCtx,pData,Len,(uint32_t)TimeoutUs);
+	}
+#ifdef __WIN32__
+	if(pLink->ReadTimeoutUs != (uint32_t)TimeoutUs){
+		//Return as soon as any byte is there, or after the timeout
+		COMMTIMEOUTS timeouts = {MAXDWORD,MAXDWORD,(DWORD)((TimeoutUs + 999)/1000),0,0};
+		if(timeouts.ReadTotalTimeoutConstant == 0){
+			timeouts.ReadTotalTimeoutConstant = 1;
+		}
+		if(!SetCommTimeouts(pLink->hPort,&timeouts)){
+			return -1;
+		}
+		pLink->ReadTimeoutUs = (uint32_t)TimeoutUs;
+	}
+	DWORD got = 0;
+	return ReadFile(pLink->hPort,pData,(DWORD)Len,&got,NULL) ? (int)got : -1;
+#else
+	struct pollfd pfd = {pLink->fd,POLLIN,0};
+	int r = poll(&pfd,1,(int)((TimeoutUs + 999)/1000));
+	if(r < 0){
+		return (errno == EINTR) ? 0 : -1;
+	}
+	if(r == 0){
+		return 0;
+	}
+	long n = read(pLink->fd,pData,Len);
+	return (n < 0) ? ((errno == EINTR || errno == EAGAIN) ? 0 : -1) : (int)n;
+#endif
+}
+
+static void linkDrain(DSPLink* pLink){
+	//Discards the DSP's output until it has been quiet for LINK_QUIET_US
+	char buffer[256];
+	while(!__atomic_load_n(&pLink->Abort,__ATOMIC_ACQUIRE) && linkRead(pLink,buffer,sizeof(buffer),LINK_QUIET_US) > 0){
+	}
+}
+
+typedef struct LinkState{			//Lines of one linkSend in flight
+	LinkLine Lines[LINK_MAX_WINDOW];
+	uint32_t Head;
+	uint32_t Count;
+	uint32_t Window;
+	uint64_t LastAck;
+	int Safe;
+} LinkState;
+
+static int linkAck(DSPLink* pLink, LinkState* pState, UploadReport* pReport, uint64_t Now){
+	/* Retires the oldest line.  The DSP could start it once it was on the wire and the previous line
+	   was done, and its status took Digits+1 characters to come back; the rest is the DSP's time per
+	   line.  Returns 0, the line's status, or -1 if the status says the line arrived garbled. */
+	LinkLine* pLine = &pState->Lines[pState->Head];
+	double byteUs = 1e7/pLink->Baud;
+	double service = (double)Now - (double)((pLine->WireEnd > pState->LastAck) ? pLine->WireEnd : pState->LastAck)
+				   - (pLine->Digits + 1)*byteUs;
+	service = (service > 0) ? service : 0;
+	pLink->ServiceUs = (pLink->ServiceUs == 0) ? service : pLink->ServiceUs + (service - pLink->ServiceUs)/8;
+	pState->LastAck = Now;
+	pState->Head = (pState->Head + 1) % LINK_MAX_WINDOW;
+	pState->Count--;
+	pReport->Lines++;
+	pReport->Bytes += pLine->Len;
+	if(pLine->Status == 16 || pLine->Status == 18){		//Unknown command, invalid syntax
+		fprintf(stderr,"DSP received line %" PRIu64 " garbled (status %d).\n",pReport->Lines,pLine->Status);
+		return -1;
+	}
+	if(pLine->Status != 0){
+		fprintf(stderr,"DSP rejected line %" PRIu64 " with status %d.\n",pReport->Lines,pLine->Status);
+		return pLine->Status;
+	}
+	if(!pState->Safe && ++pLink->Clean >= LINK_PROBE_LINES && pLink->Window < pLink->MaxWindow){
+		pLink->Window++;
+		pLink->Clean = 0;
+		pState->Window = pLink->Window;
+	}
+	if(pState->Window > pReport->PeakWindow){
+		pReport->PeakWindow = pState->Window;
+	}
+	return 0;
+}
+
+static int linkSend(DSPLink* pLink, const char* pText, size_t Len, int Safe, UploadReport* pReport){
+	/* Sends the lines of pText, each checked against its echo and acknowledged by its status (the DSP
+	   echoes a line as its command loop reads it, so the echo follows the previous status).  Lines
+	   are sent up to the link's window ahead of their acknowledgements, started no closer together
+	   than LINK_MARGIN times the DSP's measured time per line, so the DSP's input never holds more
+	   than the window.  The window starts at one line and grows while acknowledgements come back
+	   clean; Safe keeps it at one (stop-and-wait).  Returns 0, the first nonzero DSP status, -1 on
+	   a link error (a timeout, an echo that differs from the line, or a status saying the DSP
+	   received a garbled line), or -2 as soon as the link's abort flag is seen. */
+	double byteUs = 1e7/pLink->Baud;
+	LinkState state;
+	memset(&state,0,sizeof(state));
+	if(pLink->MaxWindow > LINK_MAX_WINDOW){
+		pLink->MaxWindow = LINK_MAX_WINDOW;
+	}
+	state.Safe = Safe;
+	state.Window = Safe ? 1 : pLink->Window;
+	state.LastAck = metricClock();
+	uint64_t wireEnd = state.LastAck;
+	uint64_t nextSend = state.LastAck;
+	size_t next = 0;
+	char buffer[256];
+	while(next < Len || state.Count > 0){
+		if(__atomic_load_n(&pLink->Abort,__ATOMIC_ACQUIRE)){
+			return -2;
+		}
+		uint64_t now = metricClock();
+		if(next < Len && state.Count < state.Window && now >= nextSend){
+			size_t end = next;
+			while(end < Len && pText[end] != '\n' && pText[end] != '\r' && pText[end] != ';'){
+				end++;
+			}
+			end += (end < Len);
+			size_t first = next;
+			while(first < end && isspace((unsigned char)pText[first])){
+				first++;
+			}
+			next = end;
+			if(first == end){
+				continue;							//Blank line
+			}
+			int written = linkWrite(pLink,pText+first,end-first);
+			if(written != 0){
+				return written;
+			}
+			LinkLine* pLine = &state.Lines[(state.Head + state.Count++) % LINK_MAX_WINDOW];
+			memset(pLine,0,sizeof(LinkLine));
+			pLine->Start = first;
+			pLine->Len = end - first;
+			wireEnd = ((wireEnd > now) ? wireEnd : now) + (uint64_t)(pLine->Len*byteUs);
+			pLine->WireEnd = wireEnd;
+			double interval = pLink->ServiceUs*LINK_MARGIN;
+			nextSend = now + (uint64_t)((interval > pLine->Len*byteUs) ? interval : pLine->Len*byteUs);
+			continue;
+		}
+		if(state.Count == 0){
+			linkSleep((nextSend - now < LINK_POLL_US) ? nextSend - now : LINK_POLL_US);
+			continue;
+		}
+
+		/* Wait for the oldest line's acknowledgement, or until the next line may be sent.  A status
+		   ends at the first character after its digits, or at a pause. */
+		LinkLine* pOld = &state.Lines[state.Head];
+		uint64_t deadline = ((pOld->WireEnd > state.LastAck) ? pOld->WireEnd : state.LastAck) + LINK_TIMEOUT_US;
+		uint64_t timeout = (pOld->Digits > 0) ? (uint64_t)(4*byteUs) + 1000 : ((deadline > now) ? deadline - now : 0);
+		if(next < Len && state.Count < state.Window && nextSend - now < timeout){
+			timeout = nextSend - now;
+		}
+		if(timeout > LINK_POLL_US){
+			timeout = LINK_POLL_US;
+		}
+		int n = linkRead(pLink,buffer,sizeof(buffer),timeout);
+		if(__atomic_load_n(&pLink->Abort,__ATOMIC_ACQUIRE)){
+			return -2;								//What was read may be the replies to the abort
+		}
+		if(n < 0){
+			fprintf(stderr,"Failure to read from the DSP link.\n");
+			return -1;
+		}
+		now = metricClock();
+		if(n == 0){
+			if(pOld->Digits > 0){
+				int status = linkAck(pLink,&state,pReport,now);
+				if(status != 0){
+					return status;
+				}
+			}else if(now >= deadline){
+				fprintf(stderr,"No acknowledgement from the DSP for line %" PRIu64 ".\n",pReport->Lines+1);
+				return -1;
+			}
+			continue;
+		}
+		int k;
+		for(k = 0; k < n; k++){
+			char c = buffer[k];
+			pOld = &state.Lines[state.Head];
+			if(state.Count == 0 || (pOld->Echoed == 0 && isspace((unsigned char)c))){
+				if(!isspace((unsigned char)c)){
+					fprintf(stderr,"Unexpected reply from the DSP.\n");
+					return -1;
+				}
+			}else if(pOld->Echoed < pOld->Len){
+				if(c != pText[pOld->Start + pOld->Echoed]){
+					fprintf(stderr,"DSP echo of line %" PRIu64 " differs from the line sent.\n",pReport->Lines+1);
+					return -1;
+				}
+				pOld->Echoed++;
+			}else if(isdigit((unsigned char)c)){
+				pOld->Status = 10*pOld->Status + (c - '0');
+				pOld->Digits++;
+			}else if(pOld->Digits > 0){
+				int status = linkAck(pLink,&state,pReport,now);
+				if(status != 0){
+					return status;
+				}
+				if(!isspace((unsigned char)c)){
+					k--;							//Start of the next line's echo
+				}
+			}else if(!isspace((unsigned char)c)){
+				fprintf(stderr,"Unexpected reply from the DSP to line %" PRIu64 ".\n",pReport->Lines+1);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+EXPORT int uploadProtocol(DSPLink* pLink, const char* StrProtocol, UploadReport* pReport){
+	/* Sends a protocol (as from ProtToString) to the DSP.  After a link error the DSP's input is
+	   flushed, the protocol is cleared and the upload starts over at the safe rate (one line at a
+	   time); the window at which the error happened is not probed again on this link.  An abort
+	   ends the upload at once, leaving the DSP's replies to abortLink. */
+	UploadReport report;
+	memset(&report,0,sizeof(report));
+	size_t len = strlen(StrProtocol);
+	pthread_mutex_lock(&pLink->Busy);
+	uint64_t start = metricClock();
+	int status = -1;
+	int attempt;
+	pLink->Window = 1;
+	pLink->Clean = 0;
+	for(attempt = 0; attempt <= LINK_RETRIES && status == -1; attempt++){
+		int safe = (attempt > 0);
+		if(safe){
+			report.Fallbacks++;
+			metricAdd(&Metrics.UploadFallbacks,1);
+			linkWrite(pLink,"\n",1);				//Ends any partial line in the DSP's input
+			linkDrain(pLink);
+			if(StrProtocol[0] != CLEAR[0] && (status = linkSend(pLink,CLEAR,strlen(CLEAR),1,&report)) != 0){
+				status = (status == -2) ? -2 : -1;
+				continue;
+			}
+		}
+		report.Lines = 0;
+		report.Bytes = 0;
+		status = linkSend(pLink,StrProtocol,len,safe,&report);
+		if(status == -1){
+			pLink->MaxWindow = (pLink->Window > 1) ? pLink->Window - 1 : 1;
+			pLink->Window = 1;
+			pLink->ServiceUs *= 1.5;
+		}
+	}
+	if(status != 0 && status != -2){
+		linkDrain(pLink);							//Replies to lines still in flight
+	}
+	pthread_mutex_unlock(&pLink->Busy);
+	report.Seconds = (metricClock() - start)*1e-6;
+	report.Throughput = (report.Seconds > 0) ? report.Bytes/report.Seconds : 0;
+	report.RawThroughput = pLink->Baud/10.0;
+	report.ServiceUs = pLink->ServiceUs;
+	report.MaxWindow = pLink->MaxWindow;
+	report.Status = (status > 0) ? status : ((status == -2) ? DSP_RUN_ABORTED : 0);
+	recordUpload((size_t)report.Bytes,report.Seconds,(status == -2) ? DSP_RUN_ABORTED : status);
+	if(pReport != NULL){
+		*pReport = report;
+	}
+	return status;
+}
+
+EXPORT int setParkPosition(DSPLink* pLink, struct RigProfile* Rig, int64_t ParkX, int64_t ParkY){
+	/* Formats the abort commands once, so that abortLink only has to write them: a '#', which the
+	   DSP discards as a stop character if a protocol is running, the digital outputs low, then the
+	   galvos to ParkX,ParkY; and the '?' read-back of the same three channels.  Returns 0 or -1. */
+	if(ParkX < UCOUNT_MIN || ParkX > UCOUNT_MAX || ParkY < UCOUNT_MIN || ParkY > UCOUNT_MAX){
+		fprintf(stderr,"Park position out of the galvo range.\n");
+		return -1;
+	}
+	int chanX = (Rig != NULL) ? Rig->ChanX : X;
+	int chanY = (Rig != NULL) ? Rig->ChanY : Y;
+	pthread_mutex_lock(&pLink->WriteLock);
+	pLink->ParkChan[0] = TRIG;
+	pLink->ParkChan[1] = chanX;
+	pLink->ParkChan[2] = chanY;
+	pLink->ParkValue[0] = 0;
+	pLink->ParkValue[1] = ParkX;
+	pLink->ParkValue[2] = ParkY;
+	pLink->AbortLen = (size_t)snprintf(pLink->AbortCmd,LINK_CMD_LEN,"#\nV%d,0\nV%d,%" PRId64 "\nV%d,%" PRId64 "\n",
+									   TRIG,chanX,ParkX,chanY,ParkY);
+	pLink->QueryLen = (size_t)snprintf(pLink->QueryCmd,LINK_CMD_LEN,"?%d\n?%d\n?%d\n",TRIG,chanX,chanY);
+	pthread_mutex_unlock(&pLink->WriteLock);
+	return 0;
+}
+
+static int parkReply(AbortReport* pReport, const int* pChans, unsigned* pSeen, int Chan, int64_t Value){
+	//Files a read-back value under its channel; returns 1 if it is the first for one of the three
+	int s;
+	for(s = 0; s < 3; s++){
+		if(pChans[s] == Chan && !(*pSeen & (1u << s))){
+			pReport->Values[s] = Value;
+			*pSeen |= 1u << s;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+EXPORT int abortLink(DSPLink* pLink, AbortReport* pReport){
+	/* Stops the DSP and parks it.  The abort commands go out first, ahead of anything the caller's
+	   upload still had queued for the port (which is discarded); only then does the abort wait for
+	   the upload to give up the link, at its next check of the abort flag, and read back the
+	   channels.  Nothing here allocates: the commands were formatted by setParkPosition. */
+	AbortReport report;
+	memset(&report,0,sizeof(report));
+	uint64_t start = metricClock();
+	__atomic_store_n(&pLink->Abort,1,__ATOMIC_RELEASE);
+	pthread_mutex_lock(&pLink->WriteLock);
+	if(pLink->Kind == LINK_SERIAL){
+#ifdef __WIN32__
+		PurgeComm(pLink->hPort,PURGE_TXABORT|PURGE_TXCLEAR);
+#else
+		tcflush(pLink->fd,TCOFLUSH);
+#endif
+	}
+	int status = linkPut(pLink,pLink->AbortCmd,pLink->AbortLen);
+	pthread_mutex_unlock(&pLink->WriteLock);
+	report.SentUs = (double)(metricClock() - start);
+
+	pthread_mutex_lock(&pLink->Busy);
+	__atomic_store_n(&pLink->Abort,0,__ATOMIC_RELEASE);
+	if(status == 0){
+		pthread_mutex_lock(&pLink->WriteLock);
+		int64_t park[3] = {pLink->ParkValue[0],pLink->ParkValue[1],pLink->ParkValue[2]};
+		int chans[3] = {pLink->ParkChan[0],pLink->ParkChan[1],pLink->ParkChan[2]};
+		status = linkPut(pLink,pLink->QueryCmd,pLink->QueryLen);
+		pthread_mutex_unlock(&pLink->WriteLock);
+
+		/* Each reply is the echo of '?', the channel and the terminator, then the value.  Anything
+		   before the first '?' is the tail of the upload and the replies to the abort commands, and
+		   a reply is filed by its channel, so one to another channel cannot pass for the read-back. */
+		double byteUs = 1e7/pLink->Baud;
+		uint64_t deadline = metricClock() + LINK_TIMEOUT_US;
+		enum {SEEK, CHANNEL, VALUE} phase = SEEK;
+		int got = 0;
+		unsigned seen = 0;
+		int chan = 0;
+		int digits = 0;
+		int negative = 0;
+		int64_t value = 0;
+		char buffer[256];
+		while(status == 0 && got < 3){
+			uint64_t now = metricClock();
+			if(now >= deadline){
+				fprintf(stderr,"No read-back from the DSP after the abort.\n");
+				status = -1;
+				break;
+			}
+			uint64_t timeout = (digits > 0) ? (uint64_t)(4*byteUs) + 1000 : deadline - now;
+			int n = linkRead(pLink,buffer,sizeof(buffer),timeout);
+			if(n < 0){
+				fprintf(stderr,"Failure to read from the DSP link.\n");
+				status = -1;
+				break;
+			}
+			if(n == 0 && digits > 0){
+				got += parkReply(&report,chans,&seen,chan,negative ? -value : value);	//A value ends at a pause
+				digits = 0;
+				phase = SEEK;
+			}
+			int k;
+			for(k = 0; k < n && got < 3; k++){
+				char c = buffer[k];
+				if(phase == SEEK){
+					phase = (c == '?') ? CHANNEL : SEEK;
+					chan = 0;
+				}else if(phase == CHANNEL){
+					if(isdigit((unsigned char)c)){
+						chan = 10*chan + (c - '0');
+					}else if(c == '\n' || c == '\r' || c == ';'){
+						phase = VALUE;
+						digits = 0;
+						negative = 0;
+						value = 0;
+					}
+				}else if(isdigit((unsigned char)c)){
+					value = 10*value + (c - '0');
+					digits++;
+				}else if(digits == 0 && c == '-'){
+					negative = 1;
+				}else if(digits > 0){
+					got += parkReply(&report,chans,&seen,chan,negative ? -value : value);
+					digits = 0;
+					phase = (c == '?') ? CHANNEL : SEEK;
+					chan = 0;
+				}
+			}
+		}
+		report.Confirmed = (got == 3 && !(report.Values[0] & DOUT_HIGH) && report.Values[1] == park[1]
+						   && report.Values[2] == park[2]);
+		if(got == 3 && !report.Confirmed){
+			fprintf(stderr,"DSP did not confirm the abort (laser %" PRId64 ", galvos %" PRId64 ",%" PRId64 ").\n",
+					report.Values[0],report.Values[1],report.Values[2]);
+		}
+	}
+	pthread_mutex_unlock(&pLink->Busy);
+	report.Seconds = (metricClock() - start)*1e-6;
+	if(pReport != NULL){
+		*pReport = report;
+	}
+	return (status != 0) ? -1 : !report.Confirmed;
+}
+
+/* ARRAY INTERFACE ================================================================================*/
+
+#if __STDC_VERSION__ >= 201112L
+#define INT64_ALIGN _Alignof(int64_t)
+#else
+#define INT64_ALIGN __alignof__(int64_t)	//GCC's spelling, for -std=c99 and gnu99
+#endif
+
+EXPORT int64_t buildTargetArrays(const void* pX, const void* pY, int64_t StrideX, int64_t StrideY, int Elem,
+				uint32_t NumPoints,
+				uint32_t Baseline,
+				uint32_t TimeOn,
+				uint16_t NumPulses,
+				uint32_t ISI,
+				uint32_t Iterations,
+				uint32_t EpisodePeriod,
+				uint16_t Reps,
+				int64_t ScaleFactor,
+				int32_t CenterX,
+				int32_t CenterY,
+				int Trig,
+				double RotAngle,
+				struct RigProfile* Rig,
+				char* pOut,
+				size_t OutLen){
+	/* buildTargetSourceCycles over strided arrays, formatted straight into pOut.  The length is
+	   known before formatting, so a buffer that is too small costs the build but no writes. */
+	uint64_t buildStart = metricClock();
+	if(Elem != ELEM_INT32 && Elem != ELEM_FLOAT64){		//Plain ints from the caller, checked before the casts
+		fprintf(stderr,"Unknown coordinate element type: %d\n",Elem);
+		return -1;
+	}
+	if(Trig < T_NONE || Trig > T_PACED_FALLING){
+		fprintf(stderr,"Unknown trigger mode: %d\n",Trig);
+		return -1;
+	}
+	CoordSource src;
+	if(stridedSource(&src,pX,pY,StrideX,StrideY,(enum ElemType)Elem,NumPoints) != 0){
+		return -1;
+	}
+	Coord center = {CenterX,CenterY};
+	enum Trigger trig = (enum Trigger)Trig;
+	RigProfile rig;
+	ScanProt* pProt = targetSourceProt(&src,Baseline,TimeOn,NumPulses,ISI,Iterations,EpisodePeriod,Reps,
+									   ScaleFactor,&center,&trig,RotAngle,Rig,&rig);
+	if(pProt == NULL){
+		return -1;
+	}
+	int64_t len = -1;
+	if(checkBuild(pProt,&rig,1) == 0){
+		len = (int64_t)protLength(pProt) - 1;
+		if(pOut != NULL && (size_t)len < OutLen){
+			memcpy(pOut,CLEAR,sizeof(CLEAR)-1);
+			formatRange(pOut+sizeof(CLEAR)-1,pProt->pCmds,pProt->NumCmds);
+			pOut[len] = '\0';
+		}
+	}
+	recordBuild(pProt,(len >= 0) ? (size_t)len : 0,len >= 0,buildStart);
+	freeProtocol(pProt);
+	return len;
+}
+
+EXPORT ProtArrays* ProtToArrays(ScanProt* pProt){
+	//The arrays follow the header in the same block, widest elements first so each is aligned.  The
+	//header is padded to the alignment of int64_t: on 32-bit hosts its size is not a multiple of 8
+	size_t n = pProt->NumCmds;
+	size_t header = (sizeof(ProtArrays) + INT64_ALIGN - 1)/INT64_ALIGN*INT64_ALIGN;
+	ProtArrays* pArrays = malloc(header + n*(sizeof(int64_t) + sizeof(uint32_t) + sizeof(int32_t) + 1));
+	if(pArrays == NULL){
+		perror("Failure to allocate protocol arrays - ");
+		return NULL;
+	}
+	pArrays->NumCmds = pProt->NumCmds;
+	pArrays->pValue = (int64_t*)((char*)pArrays + header);
+	pArrays->pCycle = (uint32_t*)(pArrays->pValue + n);
+	pArrays->pChannel = (int32_t*)(pArrays->pCycle + n);
+	pArrays->pOp = (char*)(pArrays->pChannel + n);
+	size_t i;
+	for(i = 0; i < n; i++){
+		const PackedCmd* pCmd = &pProt->pCmds[i];
+		pArrays->pValue[i] = cmdValue(pCmd);
+		pArrays->pCycle[i] = cmdCycle(pCmd);
+		pArrays->pChannel[i] = cmdChannel(pCmd);
+		pArrays->pOp[i] = cmdScan(pCmd);
+	}
+	return pArrays;
+}
+
+EXPORT ProtArrays* stringToArrays(const char* StrProtocol){
+	ScanProt* pProt = stringToProt(StrProtocol);
+	if(pProt == NULL){
+		return NULL;
+	}
+	ProtArrays* pArrays = ProtToArrays(pProt);
+	freeProtocol(pProt);
+	return pArrays;
+}
+
+EXPORT void freeArrays(ProtArrays* pArrays){
+	free(pArrays);
+}
+
+EXPORT void freeString(char* pString){
+	//For callers that cannot reach this library's free (ctypes, or another C runtime on Windows)
+	free(pString);
+}
+
+/* METRICS ========================================================================================*/
+
+#define METRICS_MAX_LEN 16384		//Upper bound on the text of one metrics snapshot
+
+static struct{						//Background writer started by startMetricsExport
+	pthread_mutex_t Lock;
+	pthread_cond_t Wake;
+	pthread_t Thread;
+	int Running;
+	int Stop;
+	char Path[FILENAME_MAX];
+	enum MetricsFormat Format;
+	uint32_t PeriodMs;
+	clockid_t Clock;				//Clock of the Wake deadlines
+} Exporter = {PTHREAD_MUTEX_INITIALIZER,PTHREAD_COND_INITIALIZER,0,0,0,"",METRICS_PROMETHEUS,0,CLOCK_REALTIME};
+
+static pthread_once_t ExporterOnce = PTHREAD_ONCE_INIT;
+
+static void initExporter(){
+	//Waits on the monotonic clock where the condition variable can use it, so that setting the wall
+	//clock neither holds back nor hurries the next write
+#if defined(_POSIX_CLOCK_SELECTION) && _POSIX_CLOCK_SELECTION >= 0
+	pthread_condattr_t attr;
+	if(pthread_condattr_init(&attr) != 0){
+		return;
+	}
+	if(pthread_condattr_setclock(&attr,CLOCK_MONOTONIC) == 0){
+		pthread_cond_destroy(&Exporter.Wake);
+		pthread_cond_init(&Exporter.Wake,&attr);
+		Exporter.Clock = CLOCK_MONOTONIC;
+	}
+	pthread_condattr_destroy(&attr);
+#endif
+}
+
+EXPORT void recordUpload(size_t Bytes, double Seconds, int Status){
+	//Uploads through uploadProtocol are recorded there; other transports report each upload here
+	metricAdd(&Metrics.Uploads,1);
+	metricAdd(&Metrics.UploadBytes,Bytes);
+	metricObserve(&Metrics.UploadTime,(Seconds > 0) ? (uint64_t)(Seconds*1e6) : 0);
+	if(Status < 0){
+		metricAdd(&Metrics.LinkErrors,1);				//Failed on the link, no status from the DSP
+	}else if(Status != 0){
+		metricAdd(&Metrics.DeviceErrors[(Status < METRIC_DEVICE_CODES) ? Status : 0],1);
+	}
+}
+
+static uint64_t metricRead(uint64_t* pCounter){
+	return __atomic_load_n(pCounter,__ATOMIC_RELAXED);
+}
+
+static int promCounter(char* pOut, const char* Name, const char* Help, uint64_t Value){
+	return sprintf(pOut,"# HELP scancmdr_%s %s\n# TYPE scancmdr_%s counter\nscancmdr_%s %" PRIu64 "\n",
+			Name,Help,Name,Name,Value);
+}
+
+static int promHist(char* pOut, const char* Name, const char* Help, MetricHist* pHist){
+	//Buckets are cumulative in the exposition format; the count is the +Inf bucket so a snapshot
+	//taken while another thread observes stays self-consistent
+	int len = sprintf(pOut,"# HELP scancmdr_%s %s\n# TYPE scancmdr_%s histogram\n",Name,Help,Name);
+	uint64_t count = 0;
+	int b;
+	for(b = 0; b <= METRIC_BUCKETS; b++){
+		count += metricRead(&pHist->Buckets[b]);
+		if(b < METRIC_BUCKETS){
+			len += sprintf(pOut+len,"scancmdr_%s_bucket{le=\"%g\"} %" PRIu64 "\n",Name,MetricBounds[b]*1e-6,count);
+		}else{
+			len += sprintf(pOut+len,"scancmdr_%s_bucket{le=\"+Inf\"} %" PRIu64 "\n",Name,count);
+		}
+	}
+	len += sprintf(pOut+len,"scancmdr_%s_sum %.6f\nscancmdr_%s_count %" PRIu64 "\n",
+			Name,metricRead(&pHist->Sum)*1e-6,Name,count);
+	return len;
+}
+
+static int jsonHist(char* pOut, const char* Name, MetricHist* pHist){
+	int len = sprintf(pOut,"\t\"%s\": {\"le\": [",Name);
+	int b;
+	for(b = 0; b < METRIC_BUCKETS; b++){
+		len += sprintf(pOut+len,"%s%g",(b > 0) ? ", " : "",MetricBounds[b]*1e-6);
+	}
+	len += sprintf(pOut+len,"], \"buckets\": [");
+	uint64_t count = 0;
+	for(b = 0; b <= METRIC_BUCKETS; b++){
+		count += metricRead(&pHist->Buckets[b]);
+		len += sprintf(pOut+len,"%s%" PRIu64,(b > 0) ? ", " : "",count);
+	}
+	len += sprintf(pOut+len,"], \"sum\": %.6f, \"count\": %" PRIu64 "}",metricRead(&pHist->Sum)*1e-6,count);
+	return len;
+}
+
+EXPORT char* MetricsToString(enum MetricsFormat Format){
+	//Snapshot of the session metrics.  Counters are read one at a time, not as a single atomic
+	//snapshot; every value is monotonic, so a scraper sees at worst a partly updated build.
+	char* pOut = malloc(METRICS_MAX_LEN);
+	if(pOut == NULL){
+		perror("Failure to allocate metrics - ");
+		return NULL;
+	}
+	int len = 0;
+	int c;
+	if(Format == METRICS_JSON){
+		len += sprintf(pOut+len,"{\n\t\"timestamp\": %" PRIu64 ",\n",(uint64_t)time(NULL));
+		len += sprintf(pOut+len,"\t\"builds_total\": %" PRIu64 ",\n",metricRead(&Metrics.Builds));
+		len += sprintf(pOut+len,"\t\"build_failures_total\": %" PRIu64 ",\n",metricRead(&Metrics.BuildFailures));
+		len += sprintf(pOut+len,"\t\"commands_built_total\": %" PRIu64 ",\n",metricRead(&Metrics.CmdsBuilt));
+		len += sprintf(pOut+len,"\t\"bytes_built_total\": %" PRIu64 ",\n",metricRead(&Metrics.BytesBuilt));
+		len += sprintf(pOut+len,"\t\"validation_failures_total\": {\"trigin\": %" PRIu64 ", \"exposure\": %" PRIu64 "},\n",
+				metricRead(&Metrics.TrigInFailures),metricRead(&Metrics.ExposureFailures));
+		len += sprintf(pOut+len,"\t\"exposure_delays_total\": %" PRIu64 ",\n",metricRead(&Metrics.ExposureDelays));
+		len += sprintf(pOut+len,"\t\"rig_cache\": {\"hits\": %" PRIu64 ", \"misses\": %" PRIu64 "},\n",
+				metricRead(&Metrics.RigHits),metricRead(&Metrics.RigMisses));
+		len += sprintf(pOut+len,"\t\"archive\": {\"hits\": %" PRIu64 ", \"misses\": %" PRIu64 "},\n",
+				metricRead(&Metrics.ArchiveHits),metricRead(&Metrics.ArchiveMisses));
+		len += sprintf(pOut+len,"\t\"uploads_total\": %" PRIu64 ",\n",metricRead(&Metrics.Uploads));
+		len += sprintf(pOut+len,"\t\"upload_bytes_total\": %" PRIu64 ",\n",metricRead(&Metrics.UploadBytes));
+		len += sprintf(pOut+len,"\t\"upload_fallbacks_total\": %" PRIu64 ",\n",metricRead(&Metrics.UploadFallbacks));
+		len += sprintf(pOut+len,"\t\"link_errors_total\": %" PRIu64 ",\n",metricRead(&Metrics.LinkErrors));
+		len += sprintf(pOut+len,"\t\"device_errors_total\": {");
+		for(c = 1; c < METRIC_DEVICE_CODES; c++){
+			len += sprintf(pOut+len,"\"%d\": %" PRIu64 ", ",c,metricRead(&Metrics.DeviceErrors[c]));
+		}
+		len += sprintf(pOut+len,"\"other\": %" PRIu64 "},\n",metricRead(&Metrics.DeviceErrors[0]));
+		len += jsonHist(pOut+len,"build_seconds",&Metrics.BuildTime);
+		len += sprintf(pOut+len,",\n");
+		len += jsonHist(pOut+len,"upload_seconds",&Metrics.UploadTime);
+		len += sprintf(pOut+len,"\n}\n");
+		return pOut;
+	}
+
+	len += promCounter(pOut+len,"builds_total","Protocols built and serialized.",metricRead(&Metrics.Builds));
+	len += promCounter(pOut+len,"build_failures_total","Protocol builds that returned NULL.",metricRead(&Metrics.BuildFailures));
+	len += promCounter(pOut+len,"commands_built_total","Commands in built protocols.",metricRead(&Metrics.CmdsBuilt));
+	len += promCounter(pOut+len,"bytes_built_total","Bytes of built protocol text.",metricRead(&Metrics.BytesBuilt));
+	len += sprintf(pOut+len,"# HELP scancmdr_validation_failures_total Builds rejected by a check.\n"
+			"# TYPE scancmdr_validation_failures_total counter\n"
+			"scancmdr_validation_failures_total{check=\"trigin\"} %" PRIu64 "\n"
+			"scancmdr_validation_failures_total{check=\"exposure\"} %" PRIu64 "\n",
+			metricRead(&Metrics.TrigInFailures),metricRead(&Metrics.ExposureFailures));
+	len += promCounter(pOut+len,"exposure_delays_total","Delays inserted to meet laser exposure limits.",metricRead(&Metrics.ExposureDelays));
+	len += promCounter(pOut+len,"rig_cache_hits_total","Rig profile loads served from the cache.",metricRead(&Metrics.RigHits));
+	len += promCounter(pOut+len,"rig_cache_misses_total","Rig profile loads read from file.",metricRead(&Metrics.RigMisses));
+	len += promCounter(pOut+len,"archive_hits_total","Archived trials whose protocol was already stored.",metricRead(&Metrics.ArchiveHits));
+	len += promCounter(pOut+len,"archive_misses_total","Archived trials that stored a new protocol.",metricRead(&Metrics.ArchiveMisses));
+	len += promCounter(pOut+len,"uploads_total","Protocol uploads.",metricRead(&Metrics.Uploads));
+	len += promCounter(pOut+len,"upload_bytes_total","Bytes uploaded to the DSP.",metricRead(&Metrics.UploadBytes));
+	len += promCounter(pOut+len,"upload_fallbacks_total","Uploads restarted at the safe rate after a link error.",metricRead(&Metrics.UploadFallbacks));
+	len += promCounter(pOut+len,"link_errors_total","Uploads that failed on the link, with no status from the DSP.",metricRead(&Metrics.LinkErrors));
+	len += sprintf(pOut+len,"# HELP scancmdr_device_errors_total Uploads that returned a device error, by status code.\n"
+			"# TYPE scancmdr_device_errors_total counter\n");
+	for(c = 1; c < METRIC_DEVICE_CODES; c++){
+		len += sprintf(pOut+len,"scancmdr_device_errors_total{status=\"%d\"} %" PRIu64 "\n",c,metricRead(&Metrics.DeviceErrors[c]));
+	}
+	len += sprintf(pOut+len,"scancmdr_device_errors_total{status=\"other\"} %" PRIu64 "\n",metricRead(&Metrics.DeviceErrors[0]));
+	len += promHist(pOut+len,"build_seconds","Time to build and serialize a protocol.",&Metrics.BuildTime);
+	len += promHist(pOut+len,"upload_seconds","Time to upload a protocol to the DSP.",&Metrics.UploadTime);
+	len += sprintf(pOut+len,"# HELP scancmdr_metrics_timestamp_seconds Time this snapshot was written.\n"
+			"# TYPE scancmdr_metrics_timestamp_seconds gauge\n"
+			"scancmdr_metrics_timestamp_seconds %" PRIu64 "\n",(uint64_t)time(NULL));
+	return pOut;
+}
+
+EXPORT int writeMetrics(const char* MetricsFile, enum MetricsFormat Format){
+	//Writes a snapshot to a temporary file and renames it over MetricsFile, so a collector never
+	//reads a half-written file
+	char* pText = MetricsToString(Format);
+	if(pText == NULL){
+		return -1;
+	}
+	char tmpFile[FILENAME_MAX];
+	if(snprintf(tmpFile,FILENAME_MAX,"%s.tmp",MetricsFile) >= FILENAME_MAX){
+		fprintf(stderr,"Metrics file name too long: %s\n",MetricsFile);
+		free(pText);
+		return -1;
+	}
+	FILE* pFile = fopen(tmpFile,"w");
+	if(pFile == NULL){
+		perror("Failure to open metrics file - ");
+		free(pText);
+		return -1;
+	}
+	int ok = fputs(pText,pFile) >= 0;
+	ok = (fclose(pFile) == 0) && ok;
+	free(pText);
+#ifdef __WIN32__
+	if(ok){
+		remove(MetricsFile);
+	}
+#endif
+	if(!ok || rename(tmpFile,MetricsFile) != 0){
+		perror("Failure to write metrics file - ");
+		remove(tmpFile);
+		return -1;
+	}
+	return 0;
+}
+
+static void* exportWorker(void* pArg){
+	//Writes on start, every PeriodMs, and once more when stopped
+	(void)pArg;
+	pthread_mutex_lock(&Exporter.Lock);
+	while(1){
+		pthread_mutex_unlock(&Exporter.Lock);
+		writeMetrics(Exporter.Path,Exporter.Format);
+		pthread_mutex_lock(&Exporter.Lock);
+		if(Exporter.Stop){
+			break;
+		}
+		struct timespec deadline;
+		clock_gettime(Exporter.Clock,&deadline);
+		deadline.tv_sec += Exporter.PeriodMs/1000;
+		deadline.tv_nsec += (long)(Exporter.PeriodMs%1000)*1000000L;
+		if(deadline.tv_nsec >= 1000000000L){
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		int status = 0;
+		while(!Exporter.Stop && status != ETIMEDOUT){		//Until stopped or the deadline passes
+			status = pthread_cond_timedwait(&Exporter.Wake,&Exporter.Lock,&deadline);
+			if(status != 0 && status != ETIMEDOUT){
+				fprintf(stderr,"Metrics export stopped, wait failed: %s\n",strerror(status));
+				break;
+			}
+		}
+		if(status != 0 && status != ETIMEDOUT){
+			break;
+		}
+	}
+	pthread_mutex_unlock(&Exporter.Lock);
+	return NULL;
+}
+
+EXPORT int startMetricsExport(const char* MetricsFile, enum MetricsFormat Format, uint32_t PeriodMs){
+	if(PeriodMs == 0 || strlen(MetricsFile) >= FILENAME_MAX){
+		fprintf(stderr,"Invalid metrics export settings.\n");
+		return -1;
+	}
+	pthread_once(&ExporterOnce,initExporter);
+	pthread_mutex_lock(&Exporter.Lock);
+	if(Exporter.Running){
+		pthread_mutex_unlock(&Exporter.Lock);
+		fprintf(stderr,"Metrics export already running to %s\n",Exporter.Path);
+		return -1;
+	}
+	strcpy(Exporter.Path,MetricsFile);
+	Exporter.Format = Format;
+	Exporter.PeriodMs = PeriodMs;
+	Exporter.Stop = 0;
+	if(pthread_create(&Exporter.Thread,NULL,exportWorker,NULL) != 0){
+		pthread_mutex_unlock(&Exporter.Lock);
+		fprintf(stderr,"Failure to start metrics export thread.\n");
+		return -1;
+	}
+	Exporter.Running = 1;
+	pthread_mutex_unlock(&Exporter.Lock);
+	return 0;
+}
+
+EXPORT void stopMetricsExport(){
+	pthread_mutex_lock(&Exporter.Lock);
+	if(!Exporter.Running){
+		pthread_mutex_unlock(&Exporter.Lock);
+		return;
+	}
+	Exporter.Stop = 1;
+	pthread_cond_signal(&Exporter.Wake);
+	pthread_mutex_unlock(&Exporter.Lock);
+	pthread_join(Exporter.Thread,NULL);
+	pthread_mutex_lock(&Exporter.Lock);
+	Exporter.Running = 0;
+	pthread_mutex_unlock(&Exporter.Lock);
+}
 
 #ifdef __cplusplus
 }
@@ -89,7 +89,13 @@
 		**Important Notes**
 
 		-Due to a bug in the DSP firmware, triggering will not work as expected if it is set within 
-		 cycle zero.
+		 cycle zero.  checkTrigIn() flags any such wait, and the builders refuse to return a protocol
+		 that contains one.
+		-Externally paced triggering.  With T_PACED_RISING or T_PACED_FALLING, the target builders
+		 (buildTarget, buildRapidTarget, buildPattern) wait for the next external edge before every
+		 target instead of once per episode.  Each target block is padded only by the galvo move
+		 time (MOVE_TIME), and EpisodePeriod is ignored, so throughput is set by the external clock.
+		 The remaining builders treat the paced modes as a per-episode wait on the selected edge.
 		-Loop timing.  Loops starting at time t0 with n iterations, and single iteration time of dt,
 		 are entered as follows:
 
@@ -102,19 +108,29 @@
 		 	AS,t0,9,n\n
 		 	AE,tf,9,n\n
 
-		 	where tf = t0 + n * dt
+		 	where tf = t0 + dt
+
+		 A loop end takes no cycle: the last cycle of one iteration is the first cycle of the
+		 next.  Commands after a loop are listed at the cycle they run in once every iteration has
+		 passed, t0 + n * dt (firmware description, Appendix D).  The builders and the emulator
+		 (emulateProtocol) all follow this convention.
 		 	
 		-The technical documents indicate that channel and value in a loop start/end command are not
 		 read by the DSP.  However, for readability, the channel for all loop start/end commands is
 		 entered as 9, and the value (no. of loop iterations) is included for both start AND end 
 		 commands.
+		-Exposure limits.  A rig profile may cap the laser duty cycle at any one target within a
+		 sliding window (DutyWindow, MaxDuty) and the total laser-on time per square region
+		 (RegionSize, MaxRegionDose).  Every builder passes its protocol through limitExposure, which
+		 rejects a protocol over either limit, or with RetimeExposure set, delays pulses that are
+		 over the duty limit by the least amount that brings them under it.
 
 		 Example:
 		 Simple loop, 1000 iterations, with a nested 10-cycle wait.
 
 			AS,0,9,1000\n 			#Loop Start
 			A0,10,0,0\n             #Wait 10 cycles
-			AE,10000,9,1000\n       #End loop after 10*1000 = 10000 cycles (total loop time)
+			AE,10,9,1000\n          #End loop after 10 cycles (one iteration), 10*1000 = 10000 in all
 	Values:
 
 		Position (Channels 3,4,5,6)
@@ -155,7 +171,7 @@
 	Important values/constants:
 
 		Cycle: 10-us (therefore, 10^5 cycles per second)
-		Position value range: -2^34 to +2^35-1 (microcounts)
+		Position value range: -2^35 to +2^35-1 (microcounts)
 		Maximum commands (lines) in protocol: 10000
 
 	Serial Control (RS232) :
@@ -170,7 +186,11 @@
 	Dependencies :
 	------------
 
-	scancmdr.dll : scancmdr.c scancmdr.h
+	scancmdr.dll : scancmdr.c scstd.c scancmdr.h (link with -lpthread)
+	scstd.c : scgen (generated; see scgen.c)
+	scancmdr.hpp : scancmdr.h (header-only C++20 layer; see scancmdr.hpp)
+	sccheck.c : scancmdr.dll (regression checks, exits non-zero on failure)
+	sccheckpp.cpp : scancmdr.hpp scancmdr.dll (C++ layer checks against the C builders)
 
 	Author Information :
 	------------------
@@ -185,6 +205,8 @@
 #ifndef SCANCMDR_H_
 #define SCANCMDR_H_
 
+#include <stddef.h>
+#include <stdio.h>
 #include <inttypes.h>
 #ifdef __WIN32__
 #include <windows.h>
@@ -196,6 +218,8 @@
 #define CYCLES_PER_MS 100	  //Cyles per millisecond
 #define TRIG_LEN 10           //Trigger length, cycles (default: 100 us)
 #define MAX_CMD_LEN 100		  //Maximum length of command line, in characters
+#define MAX_LINE_LEN 38		  //Longest formatted protocol line: 2+1+10+1+2+1+20+1 characters
+#define MAX_CMDS 10000		  //Command list capacity of the DSP
 #define STOPCHAR '\n'		  //Options, '\n, '\r' or ';' may be redundant with FORMAT specifier
 #define	CLEAR "C\n"			  //Clear command
 #define EXECUTE "X\n"		  //Execute command
@@ -204,6 +228,17 @@
 #define MOVE_TIME 140         //Smart-move time + jump time for galvos (in cycles)
 #define TIME_OFFSET 10	      //Offset, cycles (x10 microseconds)
 #define PROT_PERIOD 50         //Wait time after each complete protocol repetition (in cycles)
+#define CMD_OPS "0VRIJOSEUD"	  //Scan commands, indexed by the 4-bit op code of a packed command
+#define CMD_CYCLE_MASK 0xFFFFFFFFFFFFULL	//48-bit cycle field of a packed command
+#define CMD_OP_SHIFT 48
+#define CMD_CHAN_SHIFT 52
+#define CMD_CHAN_MASK 0xF
+#define BAUD 57600			  //RS232 baud rate of the DSP
+#define MOVE_RESYNC 16		  //Absolute move after this many relative ones (see compactMoves)
+#define LINK_CMD_LEN 96		  //Longest pre-formatted direct command sequence of a DSP link
+#define SNAP_CHUNK 256		  //Commands per copy-on-write snapshot chunk
+#define UCOUNT_MIN (-(1LL << 35))			  //Galvo position range (36-bit ucounts)
+#define UCOUNT_MAX ((1LL << 35) - 1)
 
 #ifdef __WIN32__
 #define FORMAT "%c%c,%I32u,%i,%I64d\n"				//WINDOWS format specifier
@@ -238,29 +273,334 @@ typedef struct gCoord{				//For galvo coordinates (microcounts)
 	int64_t Y;
 }gCoord;
 
+enum SourceKind{					//Coordinate sources (see gridSource etc.)
+	SRC_GRID = 0,					//Raster scan of a regular grid
+	SRC_SERPENTINE = 1,				//Grid, every other row reversed
+	SRC_PATTERN = 2,				//Pattern file ("N X Y" header, then grid indices from 1)
+	SRC_FILE = 3,					//Coordinate file (see getCoords)
+	SRC_ARRAY = 4,					//Caller's array
+	SRC_IMAGE = 5,					//Pixels of a PGM mask at or above a threshold
+	SRC_STRIDED = 6					//Caller's X and Y arrays, any element stride (see stridedSource)
+};
+
+enum ElemType{						//Element types of strided coordinate arrays
+	ELEM_INT32 = 0,
+	ELEM_FLOAT64 = 1				//Rounded to the nearest pixel
+};
+
+typedef struct CoordSource{			//Lazy sequence of pixel coordinates, read with nextCoord
+	enum SourceKind Kind;
+	uint32_t Count;					//Number of coordinates
+	uint32_t Index;					//Coordinates returned so far
+	Coord Dims;						//Grid/image size
+	Coord StartPos;					//Pixel position of grid index (0,0)
+	Coord Spacing;
+	const Coord* pArray;
+	FILE* fp;						//Pattern, coordinate or image file
+	int64_t DataStart;				//File offset of the first coordinate or pixel
+	int64_t Pixel;					//Next image pixel to test
+	int Binary;						//Image is P5 (binary) rather than P2
+	int MaxVal;
+	int Threshold;
+	const char* pX;					//Strided arrays: first X and Y elements
+	const char* pY;
+	int64_t StrideX;				//Bytes between elements (may be negative)
+	int64_t StrideY;
+	enum ElemType Elem;
+}CoordSource;
+
 enum Trigger{
     T_NONE = 0,
     T_IN = 1,
-    T_OUT = 2
+    T_OUT = 2,
+    T_PACED_RISING = 3,			//Externally paced: every target waits for the next rising edge
+    T_PACED_FALLING = 4			//Externally paced: every target waits for the next falling edge
 };
 
 /* Scan commands */
-typedef struct CmdLine{				//Nodes in the doubly linked protocol lists
+typedef struct CmdLine{				//Unpacked view of a single command line
 	char DSPCmd;
 	char ScanCmd;
 	uint32_t Cycle;
 	int Channel;
 	int64_t Value;
-
-	struct CmdLine* pPrev;
-	struct CmdLine* pNext;
 } CmdLine;
 
+typedef struct PackedCmd{			//Packed command record (16 bytes), see packCmd/cmdCycle etc.
+	uint64_t Head;					//Bits 0-47: cycle, 48-51: scan command, 52-55: channel
+	int64_t Value;
+} PackedCmd;
+
 typedef struct ScanProt{			//This will serve as the master protocol list:
-	struct CmdLine* pFirst;			//Doubly linked list of command lines (nodes)
-	struct CmdLine* pLast;
+	PackedCmd* pCmds;				//Contiguous array of packed commands, in upload order
+	uint32_t NumCmds;
+	uint32_t Capacity;
 } ScanProt;
 
+typedef struct ProtChunk{			//Fixed block of SNAP_CHUNK commands, shared by snapshots/drafts
+	uint32_t RefCount;
+	PackedCmd Cmds[SNAP_CHUNK];
+} ProtChunk;
+
+typedef struct ProtSnapshot{		//Immutable, reference-counted version of a protocol
+	uint32_t RefCount;
+	uint32_t NumCmds;
+	uint32_t NumChunks;
+	ProtChunk** ppChunks;			//Command i is ppChunks[i/SNAP_CHUNK]->Cmds[i%SNAP_CHUNK]
+} ProtSnapshot;
+
+typedef struct ProtDraft{			//Editable version; copies a chunk only when it is first written
+	uint32_t NumCmds;
+	uint32_t NumChunks;
+	uint32_t Capacity;				//Size of the chunk table
+	ProtChunk** ppChunks;
+} ProtDraft;
+
+typedef struct ProtSlot{			//Latest published snapshot (zero-initialize before use)
+	ProtSnapshot* pCurrent;
+	uint32_t Readers[2];			//Readers between loading pCurrent and retaining it, by epoch parity
+	uint32_t Epoch;					//Advanced by publishSnapshot, so new readers count apart
+} ProtSlot;
+
+typedef struct RigProfile{			//Per-rig timing and channel map (see loadRigProfile)
+	uint32_t SettleBase;			//Settle time of any galvo move, cycles
+	double SettleSlope;				//Additional settle time per ucount of travel, cycles
+	uint32_t MoveTime;				//Longest settle time (full-range move), cycles
+	uint32_t TrigLen;				//Trigger-out pulse length, cycles
+	uint32_t TimeOffset;			//Offset of the first episode from cycle 0, cycles
+	uint32_t ProtPeriod;			//Wait after each protocol repetition, cycles
+	int ChanX;						//Galvo channel driven by X coordinates (3-6)
+	int ChanY;						//Galvo channel driven by Y coordinates (3-6, not ChanX)
+	uint32_t Baud;					//RS232 baud rate
+	uint32_t MoveResync;			//Relative moves between absolute ones (0: absolute moves only)
+	uint32_t DutyWindow;			//Sliding window of the duty-cycle limit, cycles (0: no limit)
+	double MaxDuty;					//Largest laser-on fraction of any window at one target
+	int64_t RegionSize;				//Side of the dose-limit regions, ucounts (0: no limit)
+	uint64_t MaxRegionDose;			//Largest laser-on time per region over the protocol, cycles
+	int RetimeExposure;				//Delay pulses over the duty limit instead of rejecting the protocol
+} RigProfile;
+
+typedef struct TargetProt{			//Editable target/pattern protocol (see buildTargetProt)
+	ScanProt* pProt;				//Loop start, one block of BlockCmds commands per target, loop end
+	ScanProt* pScratch;				//Reused buffer for regenerated blocks
+	gCoord* pTargets;				//Galvo coordinates of the targets, in protocol order
+	uint16_t NumTargets;
+	uint16_t MaxTargets;
+	uint32_t BlockCmds;
+	uint32_t Baseline;				//Timing after coercion, cycles
+	uint32_t TimeOn;
+	uint16_t NumPulses;
+	uint32_t ISI;
+	uint32_t Iterations;
+	uint32_t EpisodePeriod;			//Whole block period (all iterations), excluding settle time
+	uint16_t Reps;
+	enum Trigger Trig;
+	int64_t ScaleFactor;			//Conversion applied to inserted targets
+	Coord CenterOffset;
+	Coord Centroid;
+	double RotAngle;
+	RigProfile Rig;
+} TargetProt;
+
+typedef struct ArchiveEntry{			//Per-trial index record of a protocol archive
+	uint64_t Trial;
+	uint64_t Hash;					//Key of the protocol: hashProtocol() of its text, unless that collided
+} ArchiveEntry;
+
+typedef struct ProtArchive{			//Open protocol archive (see openArchive)
+	FILE* pObjects;					//<path>.obj, unique protocols
+	FILE* pIndex;					//<path>.idx, ArchiveEntry per trial
+	uint64_t* pHashes;				//Open-addressing table: hash -> object offset + 1
+	uint64_t* pOffsets;
+	uint32_t Slots;
+	uint32_t NumObjects;
+	ArchiveEntry* pTrials;			//Copy of the index, in archive order
+	uint32_t NumTrials;
+	uint32_t MaxTrials;
+	char* pLastText;				//Text of the last object matched, with its length and key
+	size_t LastLen;
+	uint64_t LastKey;
+} ProtArchive;
+
+enum DiffOp{						//Kinds of edit in a protocol diff
+	D_SAME = 0,						//Commands identical
+	D_SHIFT = 1,					//Commands identical except for a common cycle shift
+	D_MODIFY = 2,					//Same scan command and channel, other cycle and/or value
+	D_INSERT = 3,					//Commands only in the new protocol
+	D_REMOVE = 4					//Commands only in the old protocol
+};
+
+typedef struct ProtEdit{			//Run of Count commands of one kind (see diffProtocols)
+	enum DiffOp Op;
+	uint32_t OldStart;				//First command in the old protocol (insert position for D_INSERT)
+	uint32_t NewStart;				//First command in the new protocol (position for D_REMOVE)
+	uint32_t Count;
+	int64_t Shift;					//Cycle shift of a D_SHIFT run
+} ProtEdit;
+
+typedef struct ProtDiff{			//Edit script, in protocol order
+	ProtEdit* pEdits;
+	uint32_t NumEdits;
+	uint32_t Capacity;
+	uint32_t NumChanged;			//Edits other than D_SAME
+} ProtDiff;
+
+typedef struct MosaicTile{			//One stage position of a mosaic (see buildMosaic)
+	Coord Center;					//Tile centre, pixels; the tile's protocol is relative to it
+	gCoord Offset;					//Galvo position of the centre, ucounts
+	uint32_t FirstTarget;			//Targets FirstTarget.. of the mosaic's pTargets
+	uint32_t NumTargets;
+	int64_t Travel;					//Stage travel from the previous tile (longer axis), pixels
+	char* Protocol;					//Target protocol (NULL if the build failed)
+} MosaicTile;
+
+typedef struct Mosaic{				//Tiles in visiting order
+	MosaicTile* pTiles;
+	uint32_t NumTiles;
+	Coord* pTargets;				//Pixel targets grouped by tile
+	uint32_t NumTargets;
+	Coord TileSize;
+	int64_t Travel;					//Total stage travel, pixels
+} Mosaic;
+
+enum ClipMode{						//Handling of targets outside the galvo range (see prepareTargets)
+	CLIP_REJECT = 0,				//Drop the target
+	CLIP_CLAMP = 1					//Move the target to the nearest position in range
+};
+
+typedef struct PrepReport{			//What prepareTargets changed
+	uint32_t NumIn;
+	uint32_t NumOut;
+	uint32_t Rejected;				//Out of range, dropped
+	uint32_t Clipped;				//Out of range, clamped
+	uint32_t Duplicates;			//Merged into an earlier target within MergeRadius
+	uint32_t Clustered;				//Absorbed into a site within ClusterRadius
+	uint32_t NumClusters;			//Sites formed from more than one target
+} PrepReport;
+
+typedef struct EmuShot{				//Laser pulse seen by the emulator (D-OUT high)
+	uint64_t Time;					//Cycle the pulse starts, after loops and trigger waits
+	uint64_t Length;				//Cycles until D-OUT went low (0 if it never did)
+	int64_t X;						//Galvo positions during the pulse, ucounts
+	int64_t Y;
+	int64_t Slack;					//Cycles from the galvos settling (settleCycles) to the pulse; < 0: too early
+	uint32_t Cmd;					//Command that switched D-OUT high
+} EmuShot;
+
+typedef struct EmuResult{			//Outcome of emulateProtocol
+	int Status;						//DSP status code of the first error (0: none)
+	uint32_t ErrorCmd;				//Command that caused it
+	int Stalled;					//Stopped at a trigger wait that is never satisfied
+	uint64_t EndTime;				//Cycle of the last command executed
+	uint64_t NumExecuted;			//Commands executed, counting every loop iteration
+	uint32_t NumWaits;				//Trigger waits executed
+	uint64_t WaitCycles;			//Cycles spent waiting for trigger edges
+	uint32_t MissedEdges;			//Edges of the awaited kind that came while no wait was pending
+	int64_t Values[16];				//Final value of every channel
+	EmuShot* pShots;				//Laser pulses in time order (if requested)
+	uint32_t NumShots;
+	uint32_t MaxShots;
+} EmuResult;
+
+typedef struct EmuSummary{			//One protocol of an emulateLibrary run
+	int Status;						//DSP status code of the first error (0: none; -1: not emulated)
+	uint32_t ErrorCmd;
+	int Stalled;
+	uint64_t Duration;				//End time, cycles
+	uint32_t NumShots;
+	uint32_t SettleViolations;		//Pulses fired before the galvos settled
+	int64_t WorstSlack;				//Smallest settle slack of any pulse, cycles (0 without pulses)
+} EmuSummary;
+
+typedef struct ExposureMap{			//Laser-on time per bin (see createExposureMap)
+	double* pDwell;					//Width*Height bins, row by row, cycles
+	uint32_t Width;
+	uint32_t Height;
+	int64_t OriginX;				//Galvo position of the outer corner of bin (0,0), ucounts
+	int64_t OriginY;
+	int64_t BinX;					//Bin size, ucounts (negative: bins run against the galvo axis)
+	int64_t BinY;
+	uint64_t Total;					//All laser-on time, cycles
+	uint64_t Outside;				//Laser-on time outside the map, cycles
+} ExposureMap;
+
+typedef struct ExposureReport{		//What limitExposure found and changed
+	uint32_t DutyViolations;		//Laser-on spans over the duty limit (before re-timing)
+	uint32_t DoseViolations;		//Regions over the dose limit
+	uint32_t Delays;				//Delays inserted
+	uint64_t AddedCycles;			//Sum of the delays, cycles
+	double PeakDuty;				//Highest duty cycle of any target window, after re-timing
+	uint64_t PeakDose;				//Highest laser-on time of any region, cycles
+} ExposureReport;
+
+typedef int (*LinkWriteFn)(void* pCtx, const char* pData, size_t Len);				//Bytes written, or -1
+typedef int (*LinkReadFn)(void* pCtx, char* pData, size_t Len, uint32_t TimeoutUs);	//Bytes read, 0 on timeout, or -1
+
+enum LinkKind{						//Transports of a DSP link (see openLink)
+	LINK_SERIAL = 0,				//Serial port opened by openLink
+	LINK_CALLBACK = 1				//Caller's transport (see callbackLink)
+};
+
+typedef struct DSPLink DSPLink;		//Connection to the DSP (opaque, see openLink)
+
+typedef struct AbortReport{			//Outcome of abortLink
+	double SentUs;					//From the call until the abort commands were written
+	double Seconds;					//From the call until the read-back was complete
+	int64_t Values[3];				//Read back with '?': laser, X galvo, Y galvo
+	int Confirmed;					//Laser off and galvos at the park position
+} AbortReport;
+
+typedef struct UploadReport{		//Outcome of uploadProtocol
+	uint64_t Lines;					//Lines acknowledged by the DSP
+	uint64_t Bytes;					//Bytes of the acknowledged lines
+	double Seconds;
+	double Throughput;				//Protocol bytes per second
+	double RawThroughput;			//Bytes per second at the baud rate (10 bits per byte)
+	uint32_t Fallbacks;				//Restarts at the safe rate after a link error
+	uint32_t PeakWindow;
+	uint32_t MaxWindow;				//Largest window later uploads on the link will probe
+	double ServiceUs;				//DSP time per line at the end of the upload
+	int Status;						//DSP status that stopped the upload, or 0
+} UploadReport;
+
+typedef struct ProtArrays{			//Struct-of-arrays view of a protocol, one allocation (see freeArrays)
+	uint32_t NumCmds;
+	uint32_t* pCycle;
+	char* pOp;						//Scan command characters ('V', 'S', ...)
+	int32_t* pChannel;
+	int64_t* pValue;
+} ProtArrays;
+
+typedef struct StdProtocol{			//Standard protocol compiled into the library (see findStdProtocol)
+	const char* Name;
+	const char* Text;				//Protocol text, as from ProtToString
+	size_t Len;
+	const PackedCmd* pCmds;			//The same protocol as packed records
+	uint32_t NumCmds;
+	uint64_t Hash;					//hashProtocol of Text
+} StdProtocol;
+
+typedef struct ExpStats{			//What compileExperiment produced
+	uint32_t NumCmds;				//Commands in the protocol
+	size_t Bytes;					//Length of the protocol text
+	uint64_t Cycles;				//Emulated run time, not counting time spent waiting for trigger edges
+	uint64_t NumWaits;				//Trigger waits in one run
+	uint32_t Loops;					//DSP loops emitted (repeats and pulse trains)
+	uint32_t Unrolled;				//Repeats unrolled because their body changes between repetitions
+} ExpStats;
+
+typedef struct LibraryReport{		//Outcome of emulateLibrary, one summary per protocol
+	EmuSummary* pSummaries;
+	uint32_t NumProts;
+	uint32_t NumFailed;				//Protocols with an error, a stall or a settle violation
+	uint32_t NumErrors;
+	uint32_t NumStalled;
+	uint32_t NumSettle;
+	uint64_t TotalDuration;			//Sum of the durations, cycles
+	uint64_t MaxDuration;
+	uint32_t Longest;				//Protocol with the longest duration
+} LibraryReport;
+
 enum { X = 4,						//Constants defining the channels to be used (for readability)
        Y = 3,
 	TRIG = 7,
@@ -272,12 +612,44 @@ enum TrigCfg{						//Trigger out configurations
 	TH_DL = 2,						//D-OUT is shutter control of laser
 	TL_DH = 4,
 	TH_DH = 6
-}TrigCfg;
+};
 
 enum TrigIn{
 	RISING = 1,
 	FALLING = 2
-}TrigIn;
+};
+
+enum TrigKind{						//Kinds of trigger event stream (see emulateTriggered)
+	TRIG_EDGES = 0,					//Recorded edges, from an array or a log file
+	TRIG_PERIODIC = 1,				//Pulses at a fixed period
+	TRIG_POISSON = 2				//Pulses at exponentially distributed intervals
+};
+
+enum MetricsFormat{					//Session metrics file formats (see writeMetrics)
+	METRICS_PROMETHEUS = 0,			//Prometheus text format (node exporter textfile collector)
+	METRICS_JSON = 1
+};
+
+typedef struct TrigEdge{			//Edge on the trigger input
+	uint64_t Time;					//Cycle of the edge, from the start of the protocol
+	enum TrigIn Edge;				//RISING or FALLING
+} TrigEdge;
+
+typedef struct TrigStream{			//Trigger input edges in time order (see nextEdge)
+	enum TrigKind Kind;
+	TrigEdge* pEdges;				//TRIG_EDGES: the edges
+	uint64_t NumEdges;
+	int Owned;						//pEdges allocated by fileTrigger
+	uint64_t First;					//Generators: first rising edge, or earliest one for TRIG_POISSON
+	uint64_t Period;				//Period, or mean interval of TRIG_POISSON, cycles
+	uint64_t Width;					//Rising to falling edge, cycles
+	uint64_t NumPulses;				//Pulses to generate (0: no end)
+	uint64_t Seed;
+	uint64_t Index;					//Next edge (TRIG_EDGES) or pulse
+	uint64_t Rise;					//Rising edge of the current pulse
+	uint64_t State;					//Random state
+	int Falling;					//Next generated edge is the falling one
+} TrigStream;
 
 
 /* FUNCTION PROTOTYPES ===========================================================================*/
@@ -363,35 +735,315 @@ EXPORT char* buildPattern(const char* PatternFile,
 				enum Trigger* Trig,
 				double RotAngle);
 
+/* Cycle-resolution builders.  Identical to the builders above, except that Baseline, TimeOn, ISI
+   and EpisodePeriod are given in 10-us cycles rather than milliseconds (see usToCycles), and that
+   padding and galvo channels come from a rig profile (NULL uses the defaults below). */
+
+EXPORT char* buildSpotCycles(uint32_t Baseline,
+                uint32_t TimeOn,
+                uint16_t NumPulses,
+                uint32_t ISI,
+                uint32_t EpisodePeriod,
+                uint16_t Reps,
+                struct Coord* Pos,
+                int64_t ScaleFactor,
+                struct Coord* CenterOffset,
+                enum Trigger* Trig,
+                struct RigProfile* Rig);
+
+EXPORT char* buildGridCycles(uint32_t Baseline,
+				uint32_t TimeOn,
+				uint16_t NumPulses,
+				uint32_t ISI,
+				uint32_t Iterations,
+				uint32_t EpisodePeriod,
+				uint16_t Reps,
+				struct Coord* Dims,
+				struct Coord* StartPos,
+				struct Coord* Spacing,
+				int64_t ScaleFactor,
+                struct Coord* CenterOffset,
+				enum Trigger* Trig,
+			    double RotAngle,
+			    struct RigProfile* Rig);
+
+EXPORT char* buildTargetCycles(const char* TargetFile,
+				uint32_t Baseline,
+				uint32_t TimeOn,
+				uint16_t NumPulses,
+				uint32_t ISI,
+				uint32_t Iterations,
+				uint32_t EpisodePeriod,
+				uint16_t Reps,
+				uint16_t NumPoints,
+				int64_t ScaleFactor,
+				struct Coord* CenterOffset,
+				enum Trigger* Trig,
+				double RotAngle,
+				struct RigProfile* Rig);
+
+EXPORT char* buildRapidGridCycles(uint32_t Baseline,
+				uint32_t TimeOn,
+				uint32_t ISI,
+				uint32_t EpisodePeriod,
+				uint16_t Reps,
+				struct Coord* Dims,
+				struct Coord* StartPos,
+				struct Coord* Spacing,
+				int64_t ScaleFactor,
+				struct Coord* CenterOffset,
+				enum Trigger* Trig,
+				double RotAngle,
+				struct RigProfile* Rig);
+
+EXPORT char* buildRapidTargetCycles(const char* TargetFile,
+				uint32_t Baseline,
+				uint32_t TimeOn,
+				uint32_t ISI,
+				uint32_t EpisodePeriod,
+				uint16_t Reps,
+				uint16_t NumPoints,
+				int64_t ScaleFactor,
+				struct Coord* CenterOffset,
+				enum Trigger* Trig,
+				double RotAngle,
+				struct RigProfile* Rig);
+
+EXPORT char* buildPatternCycles(const char* PatternFile,
+				uint32_t Baseline,
+				uint32_t TimeOn,
+				uint16_t NumPulses,
+				uint32_t ISI,
+				uint32_t Iterations,
+				uint32_t EpisodePeriod,
+				uint16_t Reps,
+				struct Coord* StartPos,
+				struct Coord* Spacing,
+				int64_t ScaleFactor,
+				struct Coord* CenterOffset,
+				enum Trigger* Trig,
+				double RotAngle,
+				struct RigProfile* Rig);
+
+/* Editable target protocols.  buildTargetProt and buildPatternProt take the same arguments as
+   buildTargetCycles and buildPatternCycles but return a handle whose targets can be inserted,
+   removed or moved one at a time.  Each edit regenerates only the affected target blocks and shifts
+   the cycles of the commands after them (O(block + tail)), instead of rebuilding the protocol.
+   Inserted or moved targets are pixel coordinates, converted like those read from the file.
+   buildSourceProt takes its targets from a coordinate source (see below); the handle keeps them,
+   so it is limited to UINT16_MAX targets.  TargetProtToString returns the protocol string (as buildTarget would). */
+
+EXPORT TargetProt* buildTargetProt(const char* TargetFile,
+				uint32_t Baseline,
+				uint32_t TimeOn,
+				uint16_t NumPulses,
+				uint32_t ISI,
+				uint32_t Iterations,
+				uint32_t EpisodePeriod,
+				uint16_t Reps,
+				uint16_t NumPoints,
+				int64_t ScaleFactor,
+				struct Coord* CenterOffset,
+				enum Trigger* Trig,
+				double RotAngle,
+				struct RigProfile* Rig);
+
+EXPORT TargetProt* buildPatternProt(const char* PatternFile,
+				uint32_t Baseline,
+				uint32_t TimeOn,
+				uint16_t NumPulses,
+				uint32_t ISI,
+				uint32_t Iterations,
+				uint32_t EpisodePeriod,
+				uint16_t Reps,
+				struct Coord* StartPos,
+				struct Coord* Spacing,
+				int64_t ScaleFactor,
+				struct Coord* CenterOffset,
+				enum Trigger* Trig,
+				double RotAngle,
+				struct RigProfile* Rig);
+
+EXPORT TargetProt* buildSourceProt(CoordSource* pSrc,
+				uint32_t Baseline,
+				uint32_t TimeOn,
+				uint16_t NumPulses,
+				uint32_t ISI,
+				uint32_t Iterations,
+				uint32_t EpisodePeriod,
+				uint16_t Reps,
+				int64_t ScaleFactor,
+				struct Coord* CenterOffset,
+				enum Trigger* Trig,
+				double RotAngle,
+				struct RigProfile* Rig);
+
+EXPORT int insertTarget(TargetProt* pTargets, uint16_t k, struct Coord* Pos);
+
+EXPORT int removeTarget(TargetProt* pTargets, uint16_t k);
+
+EXPORT int moveTarget(TargetProt* pTargets, uint16_t k, struct Coord* Pos);
+
+EXPORT char* TargetProtToString(TargetProt* pTargets);
+
+EXPORT void freeTargetProt(TargetProt* pTargets);
+
+/* Coordinate sources.  A source yields pixel coordinates one at a time (nextCoord returns 1, or 0
+   once all Count coordinates have been returned) without holding them in memory; file and image
+   sources keep only the open file.  Grid positions are StartPos.X + i*Spacing.X, StartPos.Y -
+   j*Spacing.Y for column i and row j, as scanned by buildGrid; pattern files and images use the
+   same mapping (pattern indices start at 1, image rows at the top).  Images are binary or plain
+   PGM (P5/P2).  The constructors return 0, or -1 if the file cannot be read; closeSource closes
+   the file.  The source builders stream the coordinates into the protocol in fixed memory (a
+   rotation makes one extra pass for the centroid); buildTarget, buildRapidTarget and buildPattern
+   are these builders on a file or pattern source. */
+
+EXPORT int gridSource(CoordSource* pSrc, struct Coord* Dims, struct Coord* StartPos, struct Coord* Spacing);
+
+EXPORT int serpentineSource(CoordSource* pSrc, struct Coord* Dims, struct Coord* StartPos, struct Coord* Spacing);
+
+EXPORT int patternSource(CoordSource* pSrc, const char* PatternFile, struct Coord* StartPos, struct Coord* Spacing);
+
+EXPORT int fileSource(CoordSource* pSrc, const char* CoordFile, uint32_t NumPoints);
+
+EXPORT int arraySource(CoordSource* pSrc, const struct Coord* CoordArr, uint32_t NumPoints);
+
+EXPORT int imageSource(CoordSource* pSrc, const char* ImageFile, int Threshold, struct Coord* StartPos, struct Coord* Spacing);
+
+EXPORT int stridedSource(CoordSource* pSrc, const void* pX, const void* pY, int64_t StrideX, int64_t StrideY,
+				enum ElemType Elem, uint32_t NumPoints);
+
+EXPORT int nextCoord(CoordSource* pSrc, struct Coord* pCoord);
+
+EXPORT void resetSource(CoordSource* pSrc);
+
+EXPORT void closeSource(CoordSource* pSrc);
+
+EXPORT struct Coord sourceCentroid(CoordSource* pSrc);
+
+EXPORT char* buildTargetSourceCycles(CoordSource* pSrc,
+				uint32_t Baseline,
+				uint32_t TimeOn,
+				uint16_t NumPulses,
+				uint32_t ISI,
+				uint32_t Iterations,
+				uint32_t EpisodePeriod,
+				uint16_t Reps,
+				int64_t ScaleFactor,
+				struct Coord* CenterOffset,
+				enum Trigger* Trig,
+				double RotAngle,
+				struct RigProfile* Rig);
+
+EXPORT char* buildRapidTargetSourceCycles(CoordSource* pSrc,
+				uint32_t Baseline,
+				uint32_t TimeOn,
+				uint32_t ISI,
+				uint32_t EpisodePeriod,
+				uint16_t Reps,
+				int64_t ScaleFactor,
+				struct Coord* CenterOffset,
+				enum Trigger* Trig,
+				double RotAngle,
+				struct RigProfile* Rig);
+
+/* Size queries.  Number of commands each builder emits for the given parameters (O(1)), and bounds
+   on the serialized length.  protLength gives the exact ProtToString length including terminator. */
+
+EXPORT uint32_t countSpotCmds(uint16_t NumPulses, enum Trigger* Trig);
+
+EXPORT uint32_t countGridCmds(uint16_t NumPulses, uint32_t Iterations, enum Trigger* Trig, double RotAngle);
+
+EXPORT uint32_t countTargetCmds(uint16_t NumPulses, uint32_t Iterations, uint16_t NumPoints, enum Trigger* Trig);
+
+EXPORT uint32_t countRapidGridCmds(enum Trigger* Trig);
+
+EXPORT uint32_t countRapidTargetCmds(uint16_t NumPoints, enum Trigger* Trig);
+
+EXPORT size_t maxProtLength(uint32_t NumCmds);
+
+/* Rig profile functions */
+
+EXPORT struct RigProfile defaultRigProfile();
+
+EXPORT struct RigProfile* loadRigProfile(const char* ProfileFile);
+
+EXPORT int saveRigProfile(const char* ProfileFile, struct RigProfile* Rig);
+
+EXPORT int measureSettle(const char* FeedbackFile, int64_t Tolerance, struct RigProfile* Rig);
+
+EXPORT uint32_t settleCycles(struct RigProfile* Rig, int64_t Distance);
+
+EXPORT int64_t moveDistance(struct gCoord* From, struct gCoord* To);
+
 /* Protocol helper functions */
 
 EXPORT int64_t calcScaling(uint16_t NumPoints, const char* calibrationFile);
 
+EXPORT uint32_t usToCycles(uint32_t Microseconds);
+
 EXPORT struct gCoord convertCoord(struct Coord* pixelCoord, int64_t ScaleFactor, struct Coord* CenterOffset, double RotAngle);
 
 EXPORT struct Coord rotateCoord(struct Coord* pixelCoord, struct Coord* axisCenter, double RotAngle);
 
-void getCoords(const char* CoordFile, uint16_t NumPoints, struct Coord CoordArr[NumPoints]);
+void getCoords(const char* CoordFile, uint16_t NumPoints, struct Coord CoordArr[]);
 
-void getPattern(const char* PatternFile, uint16_t NumPoints, struct Coord CoordArr[NumPoints],struct Coord* StartPos, struct Coord* Spacing);
+void getPattern(const char* PatternFile, uint16_t NumPoints, struct Coord CoordArr[],struct Coord* StartPos, struct Coord* Spacing);
 
 int getNumPoints(const char* PatternFile);
 
-struct Coord getCentroid(uint16_t NumPoints, struct Coord CoordArr[NumPoints]);
+struct Coord getCentroid(uint16_t NumPoints, struct Coord CoordArr[]);
 
 int NumCmds(ScanProt* protocol);
 
-char* ProtToString(ScanProt* protocol);
+size_t protLength(ScanProt* protocol);
+
+EXPORT char* ProtToString(ScanProt* protocol);
+
+EXPORT ScanProt* stringToProt(const char* StrProtocol);
+
+EXPORT char* serializeBatch(ScanProt** ppProts, uint32_t NumProts, int NumThreads, size_t* pOffsets);
+
+EXPORT char* ProtToStringParallel(ScanProt* pProt, int NumThreads);
+
+int checkTrigIn(ScanProt* protocol);
+
+EXPORT char* finishProtocol(ScanProt* pProtocol, struct RigProfile* Rig, int Compact);
 
-struct Coord expandGridCoords(struct Coord* Dims, struct Coord* StartPos, struct Coord* Spacing);
+int expandGridCoords(struct Coord* Dims, struct Coord* StartPos, struct Coord* Spacing, struct Coord* CoordArr);
 
 
+/* Packed command accessors */
+static inline uint32_t cmdCycle(const PackedCmd* pCmd){
+	return (uint32_t)(pCmd->Head & CMD_CYCLE_MASK);
+}
+
+static inline char cmdScan(const PackedCmd* pCmd){
+	return CMD_OPS[(pCmd->Head >> CMD_OP_SHIFT) & 0xF];
+}
+
+static inline int cmdChannel(const PackedCmd* pCmd){
+	return (int)((pCmd->Head >> CMD_CHAN_SHIFT) & CMD_CHAN_MASK);
+}
+
+static inline int64_t cmdValue(const PackedCmd* pCmd){
+	return pCmd->Value;
+}
+
+PackedCmd packCmd(const char ScanCmd, const uint32_t cycle, const int channel, const int64_t value);
+
+struct CmdLine unpackCmd(const PackedCmd* pCmd);
+
 /* Scan command functions */
-ScanProt* createProtocol();
+EXPORT ScanProt* createProtocol();
 
 void clearProtocol(ScanProt* pProtocol);
 
-void reassignPointers(ScanProt* pParentList, CmdLine* pChildNode);
+EXPORT void freeProtocol(ScanProt* pProtocol);
+
+EXPORT int reserveCmds(ScanProt* pProtocol, uint32_t capacity);
+
+EXPORT int pushCmd(ScanProt* pProtocol, const char ScanCmd, const uint32_t cycle, const int channel, const int64_t value);
 
 int appendMove(ScanProt* pProtocol, int channel, const uint32_t cycle, const int64_t position);
 
@@ -410,6 +1062,346 @@ int appendOffset(ScanProt* pProtocol, const uint32_t cycle, const int channel, c
 int appendTrigIn(ScanProt* pProtocol, const uint32_t cycle, enum TrigIn risingFalling);
 
 
+/* Protocol snapshots.  A snapshot is an immutable copy of a protocol that any number of threads may
+   read without locking; a draft is an editable copy that shares unmodified chunks with the snapshot
+   it came from.  The writer edits a draft, commits it to a new snapshot and publishes that to a
+   ProtSlot; readers acquire the current snapshot from the slot and release it when done.  Readers
+   never wait; publishSnapshot waits only for readers already acquiring when it was called. */
+
+ProtSnapshot* snapshotProtocol(ScanProt* pProtocol);
+
+void retainSnapshot(ProtSnapshot* pSnap);
+
+void releaseSnapshot(ProtSnapshot* pSnap);
+
+const PackedCmd* snapshotCmd(ProtSnapshot* pSnap, uint32_t index);
+
+char* SnapshotToString(ProtSnapshot* pSnap);
+
+int checkSnapshotTrigIn(ProtSnapshot* pSnap);
+
+ProtDraft* editSnapshot(ProtSnapshot* pSnap);
+
+const PackedCmd* draftCmd(ProtDraft* pDraft, uint32_t index);
+
+int draftSetCmd(ProtDraft* pDraft, uint32_t index, PackedCmd cmd);
+
+int draftPushCmd(ProtDraft* pDraft, PackedCmd cmd);
+
+void draftTruncate(ProtDraft* pDraft, uint32_t numCmds);
+
+ProtSnapshot* commitDraft(ProtDraft* pDraft);
+
+void freeDraft(ProtDraft* pDraft);
+
+void publishSnapshot(ProtSlot* pSlot, ProtSnapshot* pSnap);
+
+ProtSnapshot* acquireSnapshot(ProtSlot* pSlot);
+
+/* Protocol archive.  Stores every distinct protocol text once and a compact record per trial;
+   archiving a repeated protocol costs one hash and one comparison of the text and one 16-byte
+   index write.  Any archived protocol is returned byte-exact by loadTrial/loadProtocol (caller
+   frees); a protocol whose hash collided is found by the key in its trial's record. */
+
+EXPORT uint64_t hashProtocol(const char* StrProtocol);
+
+EXPORT ProtArchive* openArchive(const char* ArchivePath);
+
+EXPORT int archiveTrial(ProtArchive* pArchive, uint64_t Trial, const char* StrProtocol);
+
+EXPORT char* loadProtocol(ProtArchive* pArchive, uint64_t Hash);
+
+EXPORT char* loadTrial(ProtArchive* pArchive, uint64_t Trial);
+
+EXPORT void closeArchive(ProtArchive* pArchive);
+
+/* Protocol diff.  Aligns two protocols command by command (Myers, linear space) and reports
+   unchanged and uniformly shifted ranges, and modified, inserted and removed commands. */
+
+EXPORT ProtDiff* diffProtocols(ScanProt* pOld, ScanProt* pNew);
+
+EXPORT char* DiffToString(ProtDiff* pDiff, ScanProt* pOld, ScanProt* pNew);
+
+EXPORT char* diffArchivedTrials(ProtArchive* pArchive, uint64_t OldTrial, uint64_t NewTrial);
+
+EXPORT void freeDiff(ProtDiff* pDiff);
+
+/* Mosaics.  buildMosaic splits a target set wider than the galvo range into tiles of at most
+   TileSize pixels, orders the tiles to shorten stage travel, and builds each tile's target protocol
+   (as buildTargetSourceCycles, unrotated) on NumThreads threads (<= 0: one per core).  Each tile's
+   protocol is built about the tile centre; Offset is where that centre lies relative to
+   CenterOffset, for repositioning with the DSP offset ('O') or a stage move.  MosaicToString
+   returns the tile schedule, one line per tile. */
+
+EXPORT Mosaic* buildMosaic(CoordSource* pSrc,
+				struct Coord* TileSize,
+				uint32_t Baseline,
+				uint32_t TimeOn,
+				uint16_t NumPulses,
+				uint32_t ISI,
+				uint32_t Iterations,
+				uint32_t EpisodePeriod,
+				uint16_t Reps,
+				int64_t ScaleFactor,
+				struct Coord* CenterOffset,
+				enum Trigger* Trig,
+				struct RigProfile* Rig,
+				int NumThreads);
+
+EXPORT char* MosaicToString(Mosaic* pMosaic);
+
+EXPORT void freeMosaic(Mosaic* pMosaic);
+
+/* Target preprocessing.  prepareTargets reads a source into CoordArr (room for pSrc->Count
+   coordinates) and returns the number kept, or -1.  Targets whose galvo position (convertCoord)
+   lies outside UCOUNT_MIN..UCOUNT_MAX are dropped or clamped, then targets within MergeRadius pixels
+   of an earlier kept target are merged into it (0: exact duplicates only; < 0: no merging).  With
+   ClusterRadius > 0, targets within that radius of a site's first target are replaced by one site
+   at their centroid.  Binning on a hash grid keeps this linear in expected time.  pMap, if not
+   NULL, receives for each input target its index in CoordArr, or -1 if it was dropped; pReport,
+   if not NULL, the counts.  PrepReportToString formats a report. */
+
+EXPORT int prepareTargets(CoordSource* pSrc,
+				struct Coord* CoordArr,
+				int MergeRadius,
+				int ClusterRadius,
+				enum ClipMode Clip,
+				int64_t ScaleFactor,
+				struct Coord* CenterOffset,
+				int32_t* pMap,
+				PrepReport* pReport);
+
+EXPORT char* PrepReportToString(PrepReport* pReport);
+
+/* Protocol emulator.  Runs a protocol offline with the DSP's loop and timing rules and reports the
+   final channel values, the end time and, if RecordShots is set, the galvo position at every laser
+   pulse.  Trigger waits are taken as satisfied at once (see emulateTriggered), except in cycle 0
+   where the DSP never senses the edge.  Commands out of cycle order, invalid loops and channels
+   are reported with the status codes the DSP would return (see the firmware description,
+   Appendix C). */
+
+EXPORT EmuResult* emulateProtocol(ScanProt* pProtocol, struct RigProfile* Rig, int RecordShots);
+
+EXPORT void freeEmuResult(EmuResult* pResult);
+
+/* Trigger event streams.  With a stream, emulateTriggered resolves every trigger wait at the first
+   edge of the awaited kind at or after the cycle the wait starts, and stalls if the stream runs out;
+   edges that come while no wait is pending are lost, as on the DSP, and counted in MissedEdges.
+   Shot times then give the timing of every target.  fileTrigger reads a log with one edge per line,
+   "time [U|D]" (R/F also accepted; without a letter, edges alternate starting with a rising one),
+   with times multiplied by CyclesPerUnit (1 for cycles, CYCLES_PER_MS for ms, ...); '#' starts a
+   comment.  periodicTrigger and poissonTrigger generate pulses Width cycles long, NumPulses of them
+   (0: no end); Poisson intervals are never shorter than Width+1.  nextEdge returns 1 and the next
+   edge, or 0 at the end of the stream; resetTrigger rewinds (generators repeat the same edges).
+   testTriggerLogs emulates a protocol against each of NumLogs logs and returns a report, one line
+   per log, with FAIL where the protocol errs or stalls. */
+
+EXPORT int edgeTrigger(TrigStream* pTrig, TrigEdge* pEdges, uint64_t NumEdges);
+
+EXPORT int fileTrigger(TrigStream* pTrig, const char* LogFile, double CyclesPerUnit);
+
+EXPORT int periodicTrigger(TrigStream* pTrig, uint64_t First, uint64_t Period, uint64_t Width, uint64_t NumPulses);
+
+EXPORT int poissonTrigger(TrigStream* pTrig, uint64_t First, uint64_t MeanInterval, uint64_t Width,
+				uint64_t NumPulses, uint64_t Seed);
+
+EXPORT int nextEdge(TrigStream* pTrig, TrigEdge* pEdge);
+
+EXPORT void resetTrigger(TrigStream* pTrig);
+
+EXPORT void closeTrigger(TrigStream* pTrig);
+
+EXPORT EmuResult* emulateTriggered(ScanProt* pProtocol, struct RigProfile* Rig, TrigStream* pTrig, int RecordShots);
+
+EXPORT char* testTriggerLogs(ScanProt* pProtocol, struct RigProfile* Rig, const char** LogFiles, int NumLogs,
+				double CyclesPerUnit);
+
+/* Library validation.  emulateLibrary emulates NumProts protocols (waits satisfied at once) on
+   NumThreads threads (<= 0: one per core) and checks every laser pulse against the rig's settle
+   model.  Each thread takes the next protocol from a shared counter and writes only that
+   protocol's summary, so the threads share nothing else; totals are added up once they are done.
+   LibraryReportToString lists the totals and every protocol that failed. */
+
+EXPORT LibraryReport* emulateLibrary(ScanProt** ppProts, uint32_t NumProts, struct RigProfile* Rig, int NumThreads);
+
+EXPORT char* LibraryReportToString(LibraryReport* pReport);
+
+EXPORT void freeLibraryReport(LibraryReport* pReport);
+
+/* Laser exposure.  An exposure map adds up the time D-OUT is high at each galvo position over any
+   number of emulated protocols (a session).  createExposureMap bins ucount space into Width*Height
+   bins of BinSize ucounts from (OriginX, OriginY); pixelExposureMap bins by pixel, bin (x, y) being
+   the pixel that convertCoord (no rotation) maps to the galvo position.  accumulateExposure
+   emulates one protocol (pTrig as in emulateTriggered, NULL to satisfy waits at once), adds its
+   laser-on time and returns the protocol's DSP status (0: none), or -1.  A span goes into its
+   bin at once while the galvos hold still, and a ramp one run per bin it crosses, so the cost does
+   not grow with pulse length.  saveExposureMap writes a Portable Float Map (PFM) in ms, with row 0
+   at the top. */
+
+EXPORT ExposureMap* createExposureMap(uint32_t Width, uint32_t Height, int64_t OriginX, int64_t OriginY, int64_t BinSize);
+
+EXPORT ExposureMap* pixelExposureMap(uint32_t Width, uint32_t Height, int64_t ScaleFactor, struct Coord* CenterOffset);
+
+EXPORT int accumulateExposure(ExposureMap* pMap, ScanProt* pProtocol, struct RigProfile* Rig, TrigStream* pTrig);
+
+EXPORT int saveExposureMap(ExposureMap* pMap, const char* MapFile);
+
+EXPORT void freeExposureMap(ExposureMap* pMap);
+
+/* Exposure limits.  limitExposure checks a protocol against the rig profile's limits in one
+   emulated pass, keeping for every target (galvo position) the laser-on spans that fall within
+   DutyWindow and for every region its dose.  Over the duty limit, with RetimeExposure set, the
+   command that switched the laser on and all later ones are delayed by the least amount that brings
+   that pulse under the limit, and the check starts over; a delay inside a loop lengthens every
+   iteration.  Dose violations cannot be re-timed away.  Returns the number of delays inserted, or
+   -1 if the protocol is rejected.  pReport may be NULL. */
+
+EXPORT int limitExposure(ScanProt* pProtocol, struct RigProfile* Rig, ExposureReport* pReport);
+
+/* Move encoding.  compactMoves rewrites absolute moves ('V') as relative moves ('R') from the last
+   known position of the channel wherever that gives a shorter line, and keeps an absolute move after
+   every ResyncEvery relative ones.  A position is known only where it is the same on every pass
+   through the enclosing loops, and not while a ramp is set on the channel.  Returns the number of
+   moves rewritten, or -1.  buildTarget, buildRapidTarget and buildPattern apply it with the rig
+   profile's MoveResync. */
+
+EXPORT int compactMoves(ScanProt* pProtocol, uint32_t ResyncEvery);
+
+/* Experiment language.  compileExperiment compiles a whole session, written as statements one per
+   line (or separated by ';', '#' starts a comment), to one checked and compacted protocol:
+
+		target NAME X Y				Names a pixel position
+		scale N						ucounts per pixel, required before the first move
+		center X Y					CenterOffset of the pixel coordinates (default 0 0)
+		seed N						Seed of the random target orders (default 1)
+		wait T						Laser off for T
+		trigger in|falling|out		Wait for a rising (in) or falling edge, or send a trigger out
+		move NAME					Move to a target and wait for the galvos to settle
+		pulse T [at LIST [random]]
+		train N x T every P|rate F [at LIST [random]]
+		repeat N { ... }
+
+   Times take a unit: us, ms, s or cycles; a rate is in Hz.  A pulse or train "at" a list of targets
+   (names separated by ',', A-F for the targets defined from A to F) moves to each target in turn,
+   in the listed order or a new random order each time the statement runs.  A train is one DSP loop;
+   a repeat is one DSP loop around its body unless the body contains a random order, in which case
+   it is unrolled.  The session runs once from TimeOffset.  Example:
+
+		target A 100 100; target B 140 100; target C 180 100
+		scale 67108864; center 512 512
+		repeat 20 {
+			trigger in
+			wait 500 ms
+			train 10 x 5 ms rate 10 Hz at A-C random
+		}
+
+   Errors are reported with their line number.  pStats, if not NULL, receives the size and emulated
+   run time of the protocol. */
+
+EXPORT char* compileExperiment(const char* Source, struct RigProfile* Rig, ExpStats* pStats);
+
+EXPORT char* compileExperimentFile(const char* ExpFile, struct RigProfile* Rig, ExpStats* pStats);
+
+/* DSP link.  openLink opens the serial port with the settings listed above; callbackLink wraps the
+   caller's own transport.  The link has no flow control, so uploadProtocol paces itself on the DSP's
+   replies: the DSP echoes every character and answers each line with its status, and the time
+   between a line reaching the DSP and its status gives the DSP's time per line.  Lines are sent a
+   few ahead of their acknowledgements (the window, probed up from one line to MaxWindow), spaced by
+   that time plus a margin so the DSP's input does not overrun.  On a timeout, an echo that differs
+   from the line sent, or a status for a garbled line, the upload is restarted from a cleared
+   protocol, one line at a time, and MaxWindow is lowered for later uploads.  Returns 0, the DSP
+   status that rejected a line, -1 if the link failed, or -2 if aborted (see abortLink); pReport,
+   if not NULL, receives the throughput achieved and the raw throughput of the baud rate. */
+
+EXPORT DSPLink* openLink(const char* Port, uint32_t Baud);
+
+EXPORT DSPLink* callbackLink(LinkWriteFn pWrite, LinkReadFn pRead, void* pCtx, uint32_t Baud);
+
+EXPORT int uploadProtocol(DSPLink* pLink, const char* StrProtocol, UploadReport* pReport);
+
+EXPORT void closeLink(DSPLink* pLink);
+
+/* Abort.  abortLink may be called from any thread, and does not allocate.  It sets the link's abort
+   flag, discards output still queued for the port, and writes in one burst a '#' (which stops a
+   running protocol, or ends a partial line), direct 'V' commands setting the digital outputs
+   (laser shutter) low and both galvos to the park position.  An upload in progress stops within
+   LINK_POLL_US and returns -2.  abortLink then reads the three channels back with '?', taking each
+   reply by its channel.  Returns 0 if they read back as set, 1 if not, or -1 if the link failed.
+   setParkPosition sets the park position (galvo coordinates; default 0,0) and the rig's galvo
+   channels (Rig may be NULL). */
+
+EXPORT int setParkPosition(DSPLink* pLink, struct RigProfile* Rig, int64_t ParkX, int64_t ParkY);
+
+EXPORT int abortLink(DSPLink* pLink, AbortReport* pReport);
+
+/* Array interface.  For callers that hold coordinates in arrays (NumPy through ctypes): plain
+   scalar arguments, no files, and no memory that the caller cannot give back.  stridedSource reads
+   X and Y in place from int32 or float64 arrays with byte strides, as NumPy reports them, so any
+   column or slice of a coordinate array can be passed without a copy; it serves every *Source
+   builder.  buildTargetArrays builds a target protocol from such arrays into the caller's buffer
+   and returns the text length; if that is OutLen or more, nothing was written and the caller
+   retries with a buffer of at least the length plus one (maxProtLength of countTargetCmds is a
+   bound).  It returns -1 if the protocol cannot be built.  ProtToArrays and stringToArrays give a
+   protocol as parallel arrays in one block, released with freeArrays; freeString releases any
+   string the library returns. */
+
+EXPORT int64_t buildTargetArrays(const void* pX, const void* pY, int64_t StrideX, int64_t StrideY, int Elem,
+				uint32_t NumPoints,
+				uint32_t Baseline,
+				uint32_t TimeOn,
+				uint16_t NumPulses,
+				uint32_t ISI,
+				uint32_t Iterations,
+				uint32_t EpisodePeriod,
+				uint16_t Reps,
+				int64_t ScaleFactor,
+				int32_t CenterX,
+				int32_t CenterY,
+				int Trig,
+				double RotAngle,
+				struct RigProfile* Rig,
+				char* pOut,
+				size_t OutLen);
+
+EXPORT ProtArrays* ProtToArrays(ScanProt* pProt);
+
+EXPORT ProtArrays* stringToArrays(const char* StrProtocol);
+
+EXPORT void freeArrays(ProtArrays* pArrays);
+
+EXPORT void freeString(char* pString);
+
+/* Standard protocols.  The calibration and test protocols in scgen's table are built when the
+   library is built, not at runtime: scgen writes them to scstd.c as const text and packed records,
+   which are then compiled in read-only.  findStdProtocol returns one by name (NULL if there is no
+   such protocol), and stdProtocols all of them.  Neither the text nor the records may be freed or
+   modified; stringToProt(pStd->Text) gives an editable copy. */
+
+EXPORT const StdProtocol* stdProtocols(uint32_t* pCount);
+
+EXPORT const StdProtocol* findStdProtocol(const char* Name);
+
+/* Session metrics.  The library keeps counters for every protocol built by a builder or
+   TargetProtToString (count, commands, bytes, build latency histogram, trigger and exposure check
+   failures, exposure delays), rig profile cache and archive dedupe hits, and uploads.  Counters use
+   atomic adds only, so builders on several threads do not serialize on them.  uploadProtocol
+   records its uploads; callers that upload over their own transport report each upload's size,
+   duration and DSP status with recordUpload.  A positive status is counted as a device error, a
+   negative one (the upload failed on the link, with no status from the DSP) as a link error.
+   writeMetrics saves a snapshot (renamed into place, so a collector never reads a partial file);
+   startMetricsExport does so from a background thread every PeriodMs until stopMetricsExport,
+   which writes a final snapshot. */
+
+EXPORT void recordUpload(size_t Bytes, double Seconds, int Status);
+
+EXPORT char* MetricsToString(enum MetricsFormat Format);
+
+EXPORT int writeMetrics(const char* MetricsFile, enum MetricsFormat Format);
+
+EXPORT int startMetricsExport(const char* MetricsFile, enum MetricsFormat Format, uint32_t PeriodMs);
+
+EXPORT void stopMetricsExport();
+
 #ifdef __cplusplus
 }
 #endif
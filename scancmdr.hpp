@@ -0,0 +1,331 @@
+/* ===============================================================================================
+
+	SCANCMDR.HPP
+	------------
+
+	Header-only C++ layer over the scancmdr library.  Adds nothing to the C interface; it owns
+	what the C functions return, so that no error path leaks:
+
+		Text		Protocol text returned by the library, viewed as a std::string_view
+		Protocol	Editable protocol (ScanProt)
+		Session		Connection to the DSP (DSPLink)
+
+	All three are move-only.  Constructors and builders throw std::bad_alloc or std::runtime_error
+	when the C call fails; DSP status codes are returned, as in the C interface.  A moved-from
+	Protocol or Session holds nothing: it may be assigned to or destroyed, and any other call that
+	would pass its NULL handle to the library throws std::logic_error instead.
+
+	buildTargets is the target builder with the trigger mode and pulse shape as template
+	parameters, so each combination compiles to its own loop over the targets without a runtime
+	switch on the trigger.  For a Trigger and a pulse count matching Shape (Pulse::Single for one
+	pulse, Pulse::Train for more), its output is identical to buildTargetSourceCycles.
+
+		std::vector<Coord> targets = ...;
+		scancmdr::TargetTiming timing;
+		timing.TimeOn = 50;
+		timing.NumPulses = 5;
+		timing.ISI = 200;
+		timing.ScaleFactor = scale;
+		scancmdr::Text text = scancmdr::buildTargets<T_OUT,scancmdr::Pulse::Train>(targets,timing);
+		scancmdr::Session dsp("/dev/ttyUSB0");
+		int status = dsp.upload(text);
+
+	Dependencies :
+	------------
+
+	scancmdr.hpp : scancmdr.h scancmdr.dll (C++20, for std::span)
+
+  =============================================================================================== */
+
+#ifndef SCANCMDR_HPP_
+#define SCANCMDR_HPP_
+
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+
+#include "scancmdr.h"
+
+namespace scancmdr{
+
+class Text{							//Protocol text owned by the library (freed with freeString)
+public:
+	Text() noexcept = default;
+	explicit Text(char* pText) noexcept : pText(pText), Len(pText != nullptr ? std::strlen(pText) : 0){}
+	Text(Text&& Other) noexcept : pText(std::exchange(Other.pText,nullptr)), Len(std::exchange(Other.Len,0)){}
+	Text& operator=(Text&& Other) noexcept{
+		if(this != &Other){
+			freeString(pText);
+			pText = std::exchange(Other.pText,nullptr);
+			Len = std::exchange(Other.Len,0);
+		}
+		return *this;
+	}
+	Text(const Text&) = delete;
+	Text& operator=(const Text&) = delete;
+	~Text(){ freeString(pText); }
+
+	std::string_view view() const noexcept{ return std::string_view(c_str(),Len); }
+	operator std::string_view() const noexcept{ return view(); }
+	const char* c_str() const noexcept{ return (pText != nullptr) ? pText : ""; }
+	size_t size() const noexcept{ return Len; }
+	bool empty() const noexcept{ return Len == 0; }
+	char* release() noexcept{ Len = 0; return std::exchange(pText,nullptr); }
+
+private:
+	char* pText = nullptr;
+	size_t Len = 0;
+};
+
+class Protocol{						//Editable protocol (freed with freeProtocol)
+public:
+	Protocol() : pProt(createProtocol()){
+		if(pProt == nullptr){
+			throw std::bad_alloc();
+		}
+	}
+	explicit Protocol(ScanProt* pAdopt) noexcept : pProt(pAdopt){}
+	Protocol(Protocol&& Other) noexcept : pProt(std::exchange(Other.pProt,nullptr)){}
+	Protocol& operator=(Protocol&& Other) noexcept{
+		if(this != &Other){
+			freeProtocol(pProt);
+			pProt = std::exchange(Other.pProt,nullptr);
+		}
+		return *this;
+	}
+	Protocol(const Protocol&) = delete;
+	Protocol& operator=(const Protocol&) = delete;
+	~Protocol(){ freeProtocol(pProt); }
+
+	static Protocol parse(const char* StrProtocol){
+		ScanProt* pParsed = stringToProt(StrProtocol);
+		if(pParsed == nullptr){
+			throw std::runtime_error("scancmdr: malformed protocol text");
+		}
+		return Protocol(pParsed);
+	}
+
+	void reserve(uint32_t Capacity){
+		if(reserveCmds(live(),Capacity) != 0){
+			throw std::bad_alloc();
+		}
+	}
+	void push(char ScanCmd, uint32_t Cycle, int Channel, int64_t Value){
+		if(pushCmd(live(),ScanCmd,Cycle,Channel,Value) != 0){
+			throw std::runtime_error("scancmdr: command rejected");
+		}
+	}
+
+	std::span<const PackedCmd> commands() const noexcept{
+		return (pProt != nullptr) ? std::span<const PackedCmd>(pProt->pCmds,pProt->NumCmds) : std::span<const PackedCmd>();
+	}
+	uint32_t size() const noexcept{ return (pProt != nullptr) ? pProt->NumCmds : 0; }
+
+	Text text() const{
+		//Serialized as is, without the builder checks
+		char* pText = ProtToString(live());
+		if(pText == nullptr){
+			throw std::bad_alloc();
+		}
+		return Text(pText);
+	}
+	Text finish(RigProfile* Rig = nullptr, bool Compact = true){
+		//Serialized after the checks every builder applies (trigger waits, exposure limits), which
+		//may retime pulses or compact moves in place
+		char* pText = finishProtocol(live(),Rig,Compact);
+		if(pText == nullptr){
+			throw std::runtime_error("scancmdr: protocol failed the builder checks");
+		}
+		return Text(pText);
+	}
+
+	ScanProt* get() const noexcept{ return pProt; }
+	ScanProt* release() noexcept{ return std::exchange(pProt,nullptr); }
+
+private:
+	ScanProt* live() const{
+		if(pProt == nullptr){
+			throw std::logic_error("scancmdr: use of a moved-from Protocol");
+		}
+		return pProt;
+	}
+
+	ScanProt* pProt;
+};
+
+class Session{						//Connection to the DSP (closed with closeLink)
+public:
+	explicit Session(const char* Port, uint32_t Baud = BAUD) : pLink(openLink(Port,Baud)){
+		if(pLink == nullptr){
+			throw std::runtime_error("scancmdr: cannot open the DSP link");
+		}
+	}
+	Session(LinkWriteFn pWrite, LinkReadFn pRead, void* pCtx, uint32_t Baud = BAUD)
+		: pLink(callbackLink(pWrite,pRead,pCtx,Baud)){
+		if(pLink == nullptr){
+			throw std::bad_alloc();
+		}
+	}
+	Session(Session&& Other) noexcept : pLink(std::exchange(Other.pLink,nullptr)){}
+	Session& operator=(Session&& Other) noexcept{
+		if(this != &Other){
+			closeLink(pLink);
+			pLink = std::exchange(Other.pLink,nullptr);
+		}
+		return *this;
+	}
+	Session(const Session&) = delete;
+	Session& operator=(const Session&) = delete;
+	~Session(){ closeLink(pLink); }
+
+	int upload(const char* StrProtocol, UploadReport* pReport = nullptr){
+		return uploadProtocol(live(),StrProtocol,pReport);
+	}
+	int upload(const Text& Prot, UploadReport* pReport = nullptr){
+		return uploadProtocol(live(),Prot.c_str(),pReport);
+	}
+	int park(int64_t X, int64_t Y, RigProfile* Rig = nullptr){
+		return setParkPosition(live(),Rig,X,Y);
+	}
+	int abort(AbortReport* pReport = nullptr){
+		//Safe from any thread, while another is in upload
+		return abortLink(live(),pReport);
+	}
+
+	DSPLink* get() const noexcept{ return pLink; }
+
+private:
+	DSPLink* live() const{
+		if(pLink == nullptr){
+			throw std::logic_error("scancmdr: use of a moved-from Session");
+		}
+		return pLink;
+	}
+
+	DSPLink* pLink;
+};
+
+enum class Pulse{					//Pulse shape at each target
+	Single,							//One pulse
+	Train							//NumPulses pulses, ISI apart, as a DSP loop
+};
+
+struct TargetTiming{				//Target protocol parameters, in cycles (as buildTargetSourceCycles)
+	uint32_t Baseline = 0;
+	uint32_t TimeOn = 0;
+	uint16_t NumPulses = 1;			//Pulse::Train only
+	uint32_t ISI = 0;
+	uint32_t Iterations = 1;
+	uint32_t EpisodePeriod = 0;
+	uint16_t Reps = 1;
+	int64_t ScaleFactor = 0;
+	Coord CenterOffset = {0,0};
+	double RotAngle = 0;
+};
+
+template<Trigger Trig, Pulse Shape>
+Protocol buildTargetProtocol(std::span<const Coord> Targets, const TargetTiming& Timing, const RigProfile* Rig = nullptr){
+	/* The block of appendTargetBlock, with the trigger and pulse branches resolved at compile
+	   time, under the same loop timing: each END one iteration after its START, and the next
+	   block at the expanded time.  sccheckpp compares the output with the C builder's for every
+	   trigger and shape, so a change to either must be made to both.  Returns the protocol
+	   before the builder checks (see Protocol::finish). */
+	constexpr bool paced = (Trig == T_PACED_RISING || Trig == T_PACED_FALLING);
+	RigProfile rig = (Rig != nullptr) ? *Rig : defaultRigProfile();
+
+	/* Timing coercion, as initTargetTiming */
+	const uint32_t numPulses = (Shape == Pulse::Single) ? 1 : Timing.NumPulses;
+	const uint32_t isi = (Timing.ISI < Timing.TimeOn) ? Timing.TimeOn : Timing.ISI;
+	uint32_t period = Timing.EpisodePeriod;
+	if(period < Timing.Baseline + numPulses*isi){ period = Timing.Baseline + numPulses*isi; }
+	period *= Timing.Iterations;
+	if constexpr(paced){
+		period = (Timing.Baseline + numPulses*isi)*Timing.Iterations;
+	}
+
+	Coord centroid = {0,0};
+	if(Timing.RotAngle != 0 && !Targets.empty()){		//As sourceCentroid
+		int64_t sumX = 0;
+		int64_t sumY = 0;
+		for(const Coord& target : Targets){
+			sumX += target.X;
+			sumY += target.Y;
+		}
+		centroid.X = (int)(sumX/(int64_t)Targets.size());
+		centroid.Y = (int)(sumY/(int64_t)Targets.size());
+	}
+
+	constexpr uint32_t trigCmds = (Trig == T_NONE) ? 0 : (Trig == T_OUT) ? 2 : 1;
+	constexpr uint32_t pulseCmds = (Shape == Pulse::Single) ? 2 : 4;
+	const uint32_t blockCmds = 2 + trigCmds + pulseCmds + ((Timing.Iterations > 1) ? 2 : 0);
+	Protocol prot;
+	prot.reserve(2 + (uint32_t)Targets.size()*blockCmds);
+	ScanProt* pProt = prot.get();
+
+	uint32_t nextEpisode = rig.TimeOffset;
+	gCoord prev = {0,0};
+	bool first = true;
+	int failed = pushCmd(pProt,START,0,LOOP,Timing.Reps);
+	for(const Coord& target : Targets){
+		Coord pixel = target;
+		Coord center = Timing.CenterOffset;
+		if(Timing.RotAngle != 0){
+			pixel = rotateCoord(&pixel,&centroid,Timing.RotAngle);
+		}
+		gCoord galvo = convertCoord(&pixel,Timing.ScaleFactor,&center,0);
+
+		uint32_t nextTrig = nextEpisode;
+		if constexpr(paced){
+			nextTrig += first ? rig.MoveTime : settleCycles(&rig,moveDistance(&prev,&galvo));
+		}
+		const uint32_t nextPulse = nextTrig + Timing.Baseline;
+		failed |= pushCmd(pProt,'V',nextEpisode,rig.ChanX,galvo.X);
+		failed |= pushCmd(pProt,'V',nextEpisode,rig.ChanY,galvo.Y);
+		if(Timing.Iterations > 1){
+			failed |= pushCmd(pProt,START,nextTrig,LOOP,Timing.Iterations);
+		}
+		if constexpr(Trig == T_IN){
+			failed |= pushCmd(pProt,'U',nextEpisode,TRIG,0);
+		}else if constexpr(Trig == T_OUT){
+			failed |= pushCmd(pProt,'V',nextEpisode,TRIG,TH_DL);
+			failed |= pushCmd(pProt,'V',nextEpisode + rig.TrigLen,TRIG,TL_DL);
+		}else if constexpr(paced){
+			failed |= pushCmd(pProt,(Trig == T_PACED_FALLING) ? 'D' : 'U',nextTrig,TRIG,0);
+		}
+		if constexpr(Shape == Pulse::Single){
+			failed |= pushCmd(pProt,'V',nextPulse,TRIG,TL_DH);
+			failed |= pushCmd(pProt,'V',nextPulse + Timing.TimeOn,TRIG,TL_DL);
+		}else{
+			failed |= pushCmd(pProt,START,nextPulse,LOOP,numPulses);
+			failed |= pushCmd(pProt,'V',nextPulse,TRIG,TL_DH);
+			failed |= pushCmd(pProt,'V',nextPulse + Timing.TimeOn,TRIG,TL_DL);
+			failed |= pushCmd(pProt,END,nextPulse + isi,LOOP,numPulses);
+		}
+		if(Timing.Iterations > 1){
+			failed |= pushCmd(pProt,END,nextTrig + period/Timing.Iterations,LOOP,Timing.Iterations);
+		}
+		nextEpisode = nextTrig + period;
+		prev = galvo;
+		first = false;
+	}
+	failed |= pushCmd(pProt,END,nextEpisode,LOOP,Timing.Reps);
+	if(failed){
+		throw std::runtime_error("scancmdr: target protocol does not fit the DSP");
+	}
+	return prot;
+}
+
+template<Trigger Trig, Pulse Shape>
+Text buildTargets(std::span<const Coord> Targets, const TargetTiming& Timing, RigProfile* Rig = nullptr){
+	//Target protocol text, checked like the output of every C builder
+	Protocol prot = buildTargetProtocol<Trig,Shape>(Targets,Timing,Rig);
+	return prot.finish(Rig,true);
+}
+
+}	//namespace scancmdr
+
+#endif //SCANCMDR_HPP_
@@ -0,0 +1,225 @@
+/* ===============================================================================================
+
+	SCBENCH
+	-------
+
+	Benchmark for the scancmdr protocol store.  Builds a protocol of NUMCMDS commands twice: once
+	as an array of packed 16-byte records (PackedCmd, as used by the library) and once as the
+	40-byte doubly linked CmdLine nodes used by earlier versions.  Times a serialization pass
+	(formatting every command with FORMAT) and a validation pass (cycle order, trigger waits in
+	cycle 0, channel range) over each, and prints the time per command.  Times ProtToString against
+	ProtToStringParallel (one thread per core) on a protocol of PAR_CMDS commands.  Then builds a
+	target protocol over a serpentine grid with absolute moves only and with compactMoves, and
+	checks with the emulator that both put the galvos in the same place at every laser pulse.
+
+	Dependencies :
+	------------
+
+	scbench.c : scancmdr.dll : scancmdr.c scancmdr.h
+
+  =============================================================================================== */
+
+
+#define _POSIX_C_SOURCE 200809L		//clock_gettime under -std=c11
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "scancmdr.h"
+
+#define NUMCMDS 10000		//Commands per protocol (DSP maximum)
+#define REPEATS 200			//Passes timed per measurement
+#define PAR_CMDS 1000000		//Commands of the protocol serialized in parallel
+#define GRID_SIDE 40			//Targets per side of the move encoding grid
+#define GRID_SCALE 67108864		//ucounts per pixel (2^36 over a 1024-pixel field)
+
+typedef struct ListCmd{		//Node layout of the former linked-list protocol store
+	char DSPCmd;
+	char ScanCmd;
+	uint32_t Cycle;
+	int Channel;
+	int64_t Value;
+
+	struct ListCmd* pPrev;
+	struct ListCmd* pNext;
+} ListCmd;
+
+static double now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+static ListCmd* buildList(ScanProt* pProtocol){
+	//Copies the packed protocol into individually allocated list nodes
+	ListCmd* pFirst = NULL;
+	ListCmd* pLast = NULL;
+	uint32_t i;
+	for(i = 0; i < pProtocol->NumCmds; i++){
+		ListCmd* pNode = calloc(1,sizeof(ListCmd));
+		CmdLine line = unpackCmd(&pProtocol->pCmds[i]);
+		pNode->DSPCmd = line.DSPCmd;
+		pNode->ScanCmd = line.ScanCmd;
+		pNode->Cycle = line.Cycle;
+		pNode->Channel = line.Channel;
+		pNode->Value = line.Value;
+		if(pFirst == NULL){
+			pFirst = pNode;
+		}else{
+			pLast->pNext = pNode;
+			pNode->pPrev = pLast;
+		}
+		pLast = pNode;
+	}
+	return pFirst;
+}
+
+int main(){
+
+	/* Synthetic target protocol: move, settle, pulse, repeated */
+	ScanProt* pProt = createProtocol();
+	uint32_t cycle = 10;
+	appendLoop(pProt,START,0,1);
+	while(pProt->NumCmds + 6 <= NUMCMDS){
+		appendMove(pProt,X,cycle,(int64_t)(rand() % 2000000000) - 1000000000);
+		appendMove(pProt,Y,cycle,(int64_t)(rand() % 2000000000) - 1000000000);
+		appendTrigIn(pProt,cycle+140,RISING);
+		appendTrigOut(pProt,cycle+140,TL_DH);
+		appendTrigOut(pProt,cycle+240,TL_DL);
+		cycle += 400;
+	}
+	appendLoop(pProt,END,cycle,1);
+	ListCmd* pList = buildList(pProt);
+
+	char* buffer = malloc((size_t)(pProt->NumCmds+1)*MAX_CMD_LEN);
+	volatile long sink = 0;
+	double t0, tPackedSer, tListSer, tPackedVal, tListVal;
+	int r;
+
+	/* Serialization */
+	t0 = now();
+	for(r = 0; r < REPEATS; r++){
+		int len = 0;
+		uint32_t i;
+		for(i = 0; i < pProt->NumCmds; i++){
+			PackedCmd* pCmd = &pProt->pCmds[i];
+			len += sprintf(buffer+len,FORMAT,'A',cmdScan(pCmd),cmdCycle(pCmd),cmdChannel(pCmd),cmdValue(pCmd));
+		}
+		sink += len;
+	}
+	tPackedSer = now() - t0;
+
+	t0 = now();
+	for(r = 0; r < REPEATS; r++){
+		int len = 0;
+		ListCmd* pLoop;
+		for(pLoop = pList; pLoop != NULL; pLoop = pLoop->pNext){
+			len += sprintf(buffer+len,FORMAT,pLoop->DSPCmd,pLoop->ScanCmd,pLoop->Cycle,pLoop->Channel,pLoop->Value);
+		}
+		sink += len;
+	}
+	tListSer = now() - t0;
+
+	/* Validation */
+	t0 = now();
+	for(r = 0; r < REPEATS; r++){
+		long bad = 0;
+		uint32_t last = 0;
+		uint32_t i;
+		for(i = 0; i < pProt->NumCmds; i++){
+			PackedCmd* pCmd = &pProt->pCmds[i];
+			uint32_t c = cmdCycle(pCmd);
+			char op = cmdScan(pCmd);
+			bad += (c < last) + ((op == 'U' || op == 'D') && c == 0) + (cmdChannel(pCmd) > LOOP);
+			last = c;
+		}
+		sink += bad;
+	}
+	tPackedVal = now() - t0;
+
+	t0 = now();
+	for(r = 0; r < REPEATS; r++){
+		long bad = 0;
+		uint32_t last = 0;
+		ListCmd* pLoop;
+		for(pLoop = pList; pLoop != NULL; pLoop = pLoop->pNext){
+			bad += (pLoop->Cycle < last) + ((pLoop->ScanCmd == 'U' || pLoop->ScanCmd == 'D') && pLoop->Cycle == 0)
+				 + (pLoop->Channel > LOOP);
+			last = pLoop->Cycle;
+		}
+		sink += bad;
+	}
+	tListVal = now() - t0;
+
+	double perCmd = 1e9/((double)REPEATS*pProt->NumCmds);
+	fprintf(stdout,"Commands:\t%" PRIu32 "\n",pProt->NumCmds);
+	fprintf(stdout,"Record size:\tpacked %zu B\tlist %zu B\n",sizeof(PackedCmd),sizeof(ListCmd));
+	fprintf(stdout,"Serialize:\tpacked %.2f ns/cmd\tlist %.2f ns/cmd\n",tPackedSer*perCmd,tListSer*perCmd);
+	fprintf(stdout,"Validate:\tpacked %.2f ns/cmd\tlist %.2f ns/cmd\n",tPackedVal*perCmd,tListVal*perCmd);
+
+	/* Parallel serialization: one thread against one per core, on a protocol large enough to split */
+	ScanProt* pLarge = createProtocol();
+	uint32_t i;
+	for(i = 0; i < PAR_CMDS; i++){
+		appendMove(pLarge,(i & 1) ? X : Y,10*i,(int64_t)i*7919 - 150000000);
+	}
+	t0 = now();
+	char* pSerial = ProtToString(pLarge);
+	double tSerial = now() - t0;
+	t0 = now();
+	char* pParallel = ProtToStringParallel(pLarge,0);
+	double tParallel = now() - t0;
+	fprintf(stdout,"Parallel:	1 thread %.2f ns/cmd	per core %.2f ns/cmd	output %s\n",1e9*tSerial/PAR_CMDS,
+			1e9*tParallel/PAR_CMDS,(pSerial != NULL && pParallel != NULL && strcmp(pSerial,pParallel) == 0) ? "identical" : "DIFFERS");
+	free(pSerial);
+	free(pParallel);
+	freeProtocol(pLarge);
+
+	/* Move encoding: absolute moves only vs. compactMoves, checked with the emulator */
+	RigProfile absolute = defaultRigProfile();
+	RigProfile compact = defaultRigProfile();
+	absolute.MoveResync = 0;
+	Coord dims = {GRID_SIDE,GRID_SIDE};
+	Coord start = {412,612};
+	Coord spacing = {5,5};
+	Coord center = {512,512};
+	enum Trigger trig = T_NONE;
+	CoordSource grid;
+	serpentineSource(&grid,&dims,&start,&spacing);
+	char* pAbsolute = buildTargetSourceCycles(&grid,100,50,1,200,1,100,1,GRID_SCALE,&center,&trig,0,&absolute);
+	char* pCompact = buildTargetSourceCycles(&grid,100,50,1,200,1,100,1,GRID_SCALE,&center,&trig,0,&compact);
+	ScanProt* pAbsProt = stringToProt(pAbsolute);
+	ScanProt* pCompactProt = stringToProt(pCompact);
+	EmuResult* pAbsRun = emulateProtocol(pAbsProt,NULL,1);
+	EmuResult* pCompactRun = emulateProtocol(pCompactProt,NULL,1);
+	int identical = pAbsRun->Status == 0 && pCompactRun->Status == 0
+			&& pAbsRun->EndTime == pCompactRun->EndTime
+			&& pAbsRun->NumShots == pCompactRun->NumShots
+			&& memcmp(pAbsRun->Values,pCompactRun->Values,sizeof(pAbsRun->Values)) == 0;
+	for(i = 0; identical && i < pAbsRun->NumShots; i++){
+		EmuShot* pA = &pAbsRun->pShots[i];
+		EmuShot* pC = &pCompactRun->pShots[i];
+		identical = pA->Time == pC->Time && pA->Length == pC->Length && pA->X == pC->X && pA->Y == pC->Y;
+	}
+	fprintf(stdout,"Move encoding:\tabsolute %zu B\tcompact %zu B (MoveResync %" PRIu32 ")\tpositions %s\n",
+			strlen(pAbsolute),strlen(pCompact),compact.MoveResync,identical ? "identical" : "DIFFER");
+	freeEmuResult(pAbsRun);
+	freeEmuResult(pCompactRun);
+	freeProtocol(pAbsProt);
+	freeProtocol(pCompactProt);
+	free(pAbsolute);
+	free(pCompact);
+
+	while(pList != NULL){
+		ListCmd* pNext = pList->pNext;
+		free(pList);
+		pList = pNext;
+	}
+	free(buffer);
+	freeProtocol(pProt);
+	return (int)(sink & 0);
+}
@@ -0,0 +1,1495 @@
+/* ===============================================================================================
+
+	SCCHECK
+	-------
+
+	Regression checks for the scancmdr library.  Each check builds or loads protocols with fixed
+	parameters and compares the result (command order, emulated pulse times, limits, round trips)
+	with the values the library documents.  Prints one line per failed expectation and a summary,
+	and exits non-zero if anything failed, so it can run unattended after every change.
+
+	Dependencies :
+	------------
+
+	sccheck.c : scancmdr.dll : scancmdr.c scstd.c scancmdr.h
+
+  =============================================================================================== */
+
+
+#define _POSIX_C_SOURCE 200809L		//clock_gettime under -std=c11
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "scancmdr.h"
+
+#define CHECK_SCALE 67108864		//ucounts per pixel (2^36 over a 1024-pixel field)
+#define CHECK_LASER_ON 4			//D-OUT bit of the laser shutter channel
+#define CHECK_ABORTED 2				//DSP status reported for an aborted upload
+
+static int NumChecks = 0;
+static int NumFailed = 0;
+
+#define CHECK(cond,...) do{ \
+		NumChecks++; \
+		if(!(cond)){ \
+			NumFailed++; \
+			fprintf(stdout,"FAIL %s:%d: ",__func__,__LINE__); \
+			fprintf(stdout,__VA_ARGS__); \
+			fprintf(stdout,"\n"); \
+		} \
+	}while(0)
+
+static ScanProt* targetProt(const struct Coord* pTargets, uint32_t NumTargets, uint32_t Baseline, uint32_t TimeOn,
+				uint16_t NumPulses, uint32_t ISI, uint32_t Iterations, uint32_t EpisodePeriod, uint16_t Reps,
+				enum Trigger Trig, RigProfile* pRig){
+	//Target protocol from a list of pixel targets, parsed back from its text (NULL on failure)
+	CoordSource source;
+	struct Coord center = {512,512};
+	if(arraySource(&source,pTargets,NumTargets) != 0){
+		return NULL;
+	}
+	char* pText = buildTargetSourceCycles(&source,Baseline,TimeOn,NumPulses,ISI,Iterations,EpisodePeriod,Reps,
+			CHECK_SCALE,&center,&Trig,0,pRig);
+	closeSource(&source);
+	ScanProt* pProt = (pText != NULL) ? stringToProt(pText) : NULL;
+	free(pText);
+	return pProt;
+}
+
+// EDITABLE TARGETS ...............................................................................
+
+static int sameAsRebuild(TargetProt* pEdited, const struct Coord* pTargets, uint32_t NumTargets, enum Trigger Trig,
+				uint32_t Iterations){
+	//The edited protocol's text against a protocol built from scratch on the edited target list
+	CoordSource source;
+	struct Coord center = {512,512};
+	if(arraySource(&source,pTargets,NumTargets) != 0){
+		return 0;
+	}
+	char* pRebuilt = buildTargetSourceCycles(&source,1000,10,3,20,Iterations,0,2,CHECK_SCALE,&center,&Trig,0,NULL);
+	closeSource(&source);
+	char* pText = TargetProtToString(pEdited);
+	int same = (pRebuilt != NULL && pText != NULL && strcmp(pRebuilt,pText) == 0);
+	free(pRebuilt);
+	free(pText);
+	return same;
+}
+
+static void checkTargetEdits(){
+	//Inserting, removing and moving single targets gives the protocol a full rebuild gives, for
+	//free-running and paced blocks (where the settle time before the next block follows the move)
+	struct Coord targets[6] = {{100,100},{900,100},{500,500},{100,900},{900,900},{0,0}};
+	struct Coord center = {512,512};
+	struct Coord far = {1000,20};
+	struct Coord near = {510,505};
+	const enum Trigger trigs[3] = {T_NONE,T_OUT,T_PACED_RISING};
+	const uint32_t iterations[2] = {1,2};
+	int t,n;
+	for(t = 0; t < 3; t++){
+		for(n = 0; n < 2; n++){
+			CoordSource source;
+			enum Trigger trig = trigs[t];
+			arraySource(&source,targets,5);
+			TargetProt* pEdit = buildSourceProt(&source,1000,10,3,20,iterations[n],0,2,CHECK_SCALE,&center,&trig,0,NULL);
+			closeSource(&source);
+			CHECK(pEdit != NULL && sameAsRebuild(pEdit,targets,5,trigs[t],iterations[n]),
+				  "trigger %d, %" PRIu32 " iterations: built protocol differs",(int)trigs[t],iterations[n]);
+			if(pEdit == NULL){
+				continue;
+			}
+
+			struct Coord edited[6] = {{100,100},{900,100},{1000,20},{500,500},{100,900},{900,900}};
+			CHECK(insertTarget(pEdit,2,&far) == 0 && sameAsRebuild(pEdit,edited,6,trigs[t],iterations[n]),
+				  "trigger %d, %" PRIu32 " iterations: insert differs from a rebuild",(int)trigs[t],iterations[n]);
+			edited[4] = near;
+			CHECK(moveTarget(pEdit,4,&near) == 0 && sameAsRebuild(pEdit,edited,6,trigs[t],iterations[n]),
+				  "trigger %d, %" PRIu32 " iterations: move differs from a rebuild",(int)trigs[t],iterations[n]);
+			memmove(&edited[0],&edited[1],5*sizeof(struct Coord));
+			CHECK(removeTarget(pEdit,0) == 0 && sameAsRebuild(pEdit,edited,5,trigs[t],iterations[n]),
+				  "trigger %d, %" PRIu32 " iterations: remove differs from a rebuild",(int)trigs[t],iterations[n]);
+			CHECK(removeTarget(pEdit,5) != 0,"trigger %d: target past the end removed",(int)trigs[t]);
+			freeTargetProt(pEdit);
+		}
+	}
+}
+
+// PROTOCOL DIFF ..................................................................................
+
+static int diffCovers(ProtDiff* pDiff, ScanProt* pOld, ScanProt* pNew){
+	//The edits run through both protocols in order and each relates its commands as its kind says
+	uint32_t o = 0;
+	uint32_t n = 0;
+	uint32_t e,k;
+	for(e = 0; e < pDiff->NumEdits; e++){
+		ProtEdit* pEdit = &pDiff->pEdits[e];
+		if(pEdit->OldStart != o || pEdit->NewStart != n || pEdit->Count == 0){
+			return 0;
+		}
+		for(k = 0; k < pEdit->Count; k++){
+			PackedCmd* pO = (pEdit->Op != D_INSERT) ? &pOld->pCmds[o + k] : NULL;
+			PackedCmd* pN = (pEdit->Op != D_REMOVE) ? &pNew->pCmds[n + k] : NULL;
+			if((pO != NULL && o + k >= pOld->NumCmds) || (pN != NULL && n + k >= pNew->NumCmds)){
+				return 0;
+			}
+			if(pO != NULL && pN != NULL && (cmdScan(pO) != cmdScan(pN) || cmdChannel(pO) != cmdChannel(pN))){
+				return 0;
+			}
+			if((pEdit->Op == D_SAME || pEdit->Op == D_SHIFT)
+					&& ((int64_t)cmdCycle(pN) - cmdCycle(pO) != pEdit->Shift || cmdValue(pN) != cmdValue(pO))){
+				return 0;
+			}
+		}
+		o += (pEdit->Op != D_INSERT) ? pEdit->Count : 0;
+		n += (pEdit->Op != D_REMOVE) ? pEdit->Count : 0;
+	}
+	return (o == pOld->NumCmds && n == pNew->NumCmds);
+}
+
+static void checkDiff(){
+	//A command inserted early shifts everything after it: one insert, then one shifted run rather
+	//than a modify per command; a changed value, a removal, and a moved target of a real protocol
+	ScanProt* pOld = stringToProt("C\nAV,0,4,0\nAV,0,3,0\nAV,100,7,4\nAV,110,7,0\nAV,200,4,5\nAV,300,7,4\nAV,310,7,0\n");
+	ScanProt* pNew = stringToProt("C\nAV,0,4,0\nAV,0,3,0\nAV,50,4,9\nAV,200,7,4\nAV,210,7,0\nAV,300,4,5\nAV,400,7,4\n"
+								  "AV,410,7,0\n");
+	ProtDiff* pDiff = (pOld != NULL && pNew != NULL) ? diffProtocols(pOld,pNew) : NULL;
+	CHECK(pDiff != NULL && pDiff->NumEdits == 3 && pDiff->NumChanged == 2 && diffCovers(pDiff,pOld,pNew)
+		  && pDiff->pEdits[0].Op == D_SAME && pDiff->pEdits[0].Count == 2
+		  && pDiff->pEdits[1].Op == D_INSERT && pDiff->pEdits[1].Count == 1
+		  && pDiff->pEdits[2].Op == D_SHIFT && pDiff->pEdits[2].Count == 5 && pDiff->pEdits[2].Shift == 100,
+		  "insert and shift: %" PRIu32 " edits, %" PRIu32 " changed",(pDiff != NULL) ? pDiff->NumEdits : 0,
+		  (pDiff != NULL) ? pDiff->NumChanged : 0);
+	freeDiff(pDiff);
+	freeProtocol(pNew);
+
+	pNew = stringToProt("C\nAV,0,4,1\nAV,0,3,0\nAV,100,7,4\nAV,110,7,0\nAV,200,4,5\nAV,300,7,4\n");
+	pDiff = (pOld != NULL && pNew != NULL) ? diffProtocols(pOld,pNew) : NULL;
+	CHECK(pDiff != NULL && pDiff->NumEdits == 3 && diffCovers(pDiff,pOld,pNew)
+		  && pDiff->pEdits[0].Op == D_MODIFY && pDiff->pEdits[1].Op == D_SAME && pDiff->pEdits[1].Count == 5
+		  && pDiff->pEdits[2].Op == D_REMOVE && pDiff->pEdits[2].OldStart == 6,
+		  "modify and remove: %" PRIu32 " edits",(pDiff != NULL) ? pDiff->NumEdits : 0);
+	freeDiff(pDiff);
+	pDiff = (pOld != NULL) ? diffProtocols(pOld,pOld) : NULL;
+	CHECK(pDiff != NULL && pDiff->NumEdits == 1 && pDiff->NumChanged == 0 && diffCovers(pDiff,pOld,pOld),
+		  "identical protocols: %" PRIu32 " edits",(pDiff != NULL) ? pDiff->NumEdits : 0);
+	freeDiff(pDiff);
+	freeProtocol(pNew);
+	freeProtocol(pOld);
+
+	struct Coord targets[5] = {{100,100},{900,100},{500,500},{100,900},{900,900}};
+	struct Coord moved[5] = {{100,100},{900,100},{520,480},{100,900},{900,900}};
+	pOld = targetProt(targets,5,1000,10,3,20,2,0,2,T_PACED_RISING,NULL);
+	pNew = targetProt(moved,5,1000,10,3,20,2,0,2,T_PACED_RISING,NULL);
+	pDiff = (pOld != NULL && pNew != NULL) ? diffProtocols(pOld,pNew) : NULL;
+	CHECK(pDiff != NULL && diffCovers(pDiff,pOld,pNew) && pDiff->NumChanged > 0 && pDiff->NumEdits < pNew->NumCmds/4,
+		  "moved target: %" PRIu32 " edits for %" PRIu32 " commands",(pDiff != NULL) ? pDiff->NumEdits : 0,
+		  (pNew != NULL) ? pNew->NumCmds : 0);
+	freeDiff(pDiff);
+	freeProtocol(pNew);
+	freeProtocol(pOld);
+}
+
+// COORDINATE SOURCES .............................................................................
+
+static int sourceIs(CoordSource* pSrc, const struct Coord* pExpected, uint32_t Num){
+	//The source yields exactly the expected coordinates, and again after a reset
+	int pass;
+	for(pass = 0; pass < 2; pass++){
+		struct Coord pos;
+		uint32_t i;
+		for(i = 0; i < Num; i++){
+			if(!nextCoord(pSrc,&pos) || pos.X != pExpected[i].X || pos.Y != pExpected[i].Y){
+				return 0;
+			}
+		}
+		if(pSrc->Count != Num || nextCoord(pSrc,&pos)){
+			return 0;
+		}
+		resetSource(pSrc);
+	}
+	return 1;
+}
+
+static void writeFile(const char* Path, const void* pData, size_t Len){
+	FILE* fp = fopen(Path,"wb");
+	if(fp != NULL){
+		fwrite(pData,1,Len,fp);
+		fclose(fp);
+	}
+}
+
+static void checkSources(){
+	//Each source kind yields its coordinates in scan order, mapped from StartPos and Spacing (rows
+	//step down in Y), and the same ones after a reset
+	CoordSource source;
+	struct Coord dims = {3,2};
+	struct Coord start = {100,500};
+	struct Coord spacing = {10,20};
+	const struct Coord grid[6] = {{100,500},{110,500},{120,500},{100,480},{110,480},{120,480}};
+	const struct Coord serpentine[6] = {{100,500},{110,500},{120,500},{120,480},{110,480},{100,480}};
+	CHECK(gridSource(&source,&dims,&start,&spacing) == 0 && sourceIs(&source,grid,6),"grid source");
+	closeSource(&source);
+	CHECK(serpentineSource(&source,&dims,&start,&spacing) == 0 && sourceIs(&source,serpentine,6),"serpentine source");
+	closeSource(&source);
+
+	const char* pPattern = "3\t4\t4\n1\t1\n4\t2\n2\t4\n";
+	const struct Coord pattern[3] = {{100,500},{130,480},{110,440}};
+	writeFile("sccheck_pattern.txt",pPattern,strlen(pPattern));
+	CHECK(patternSource(&source,"sccheck_pattern.txt",&start,&spacing) == 0 && sourceIs(&source,pattern,3),"pattern source");
+	closeSource(&source);
+	remove("sccheck_pattern.txt");
+
+	/* 4x3 masks, threshold 128: pixels (1,0), (3,1) and (0,2) */
+	const unsigned char binary[] = "P5\n4 3\n255\n\x00\x80\x10\x00\x00\x00\x00\xff\xc8\x7f\x00\x00";
+	const char* pPlain = "P2\n# mask\n4 3\n255\n0 128 16 0\n0 0 0 255\n200 127 0 0\n";
+	const struct Coord image[3] = {{110,500},{130,480},{100,460}};
+	writeFile("sccheck_mask.pgm",binary,sizeof(binary) - 1);
+	CHECK(imageSource(&source,"sccheck_mask.pgm",128,&start,&spacing) == 0 && sourceIs(&source,image,3),"P5 image source");
+	closeSource(&source);
+	writeFile("sccheck_mask.pgm",pPlain,strlen(pPlain));
+	CHECK(imageSource(&source,"sccheck_mask.pgm",128,&start,&spacing) == 0 && sourceIs(&source,image,3),"P2 image source");
+	closeSource(&source);
+	remove("sccheck_mask.pgm");
+
+	/* Interleaved int32 pairs, and float64 columns read backwards through a negative stride */
+	const int32_t pairs[6] = {1,2,3,4,5,6};
+	const struct Coord interleaved[3] = {{1,2},{3,4},{5,6}};
+	CHECK(stridedSource(&source,&pairs[0],&pairs[1],2*sizeof(int32_t),2*sizeof(int32_t),ELEM_INT32,3) == 0
+		  && sourceIs(&source,interleaved,3),"interleaved int32 source");
+	const double columns[2][3] = {{10.4,20.6,-30.5},{7,8,9}};
+	const struct Coord reversed[3] = {{-31,9},{21,8},{10,7}};
+	CHECK(stridedSource(&source,&columns[0][2],&columns[1][2],-(int64_t)sizeof(double),-(int64_t)sizeof(double),
+						ELEM_FLOAT64,3) == 0 && sourceIs(&source,reversed,3),"reversed float64 source");
+}
+
+// MOSAICS ........................................................................................
+
+static int coordOrder(const void* pA, const void* pB){
+	const struct Coord* a = pA;
+	const struct Coord* b = pB;
+	return (a->X != b->X) ? ((a->X > b->X) - (a->X < b->X)) : ((a->Y > b->Y) - (a->Y < b->Y));
+}
+
+static void checkMosaic(){
+	//40 targets over 4000x1500 pixels in 1000-pixel tiles: every target lands in one tile within
+	//half a tile of its centre, each tile's protocol fires at its targets about that centre, the
+	//travel adds up, and the tiles built on four threads match those built on one
+	struct Coord targets[40];
+	struct Coord center = {512,512};
+	struct Coord tileSize = {1000,1000};
+	enum Trigger trig = T_NONE;
+	uint32_t i,t;
+	for(i = 0; i < 40; i++){
+		targets[i].X = (int)((i*937) % 4000);
+		targets[i].Y = (int)((i*611) % 1500);
+	}
+	CoordSource source;
+	arraySource(&source,targets,40);
+	Mosaic* pOne = buildMosaic(&source,&tileSize,1000,10,1,20,1,0,1,CHECK_SCALE/16,&center,&trig,NULL,1);
+	Mosaic* pFour = buildMosaic(&source,&tileSize,1000,10,1,20,1,0,1,CHECK_SCALE/16,&center,&trig,NULL,4);
+	closeSource(&source);
+	CHECK(pOne != NULL && pFour != NULL && pOne->NumTargets == 40 && pOne->NumTiles >= 8,"mosaic: %" PRIu32
+		  " targets in %" PRIu32 " tiles",(pOne != NULL) ? pOne->NumTargets : 0,(pOne != NULL) ? pOne->NumTiles : 0);
+	if(pOne == NULL || pFour == NULL){
+		freeMosaic(pOne);
+		freeMosaic(pFour);
+		return;
+	}
+
+	struct Coord sorted[40];
+	struct Coord grouped[40];
+	memcpy(sorted,targets,sizeof(sorted));
+	memcpy(grouped,pOne->pTargets,sizeof(grouped));
+	qsort(sorted,40,sizeof(struct Coord),coordOrder);
+	qsort(grouped,40,sizeof(struct Coord),coordOrder);
+	CHECK(memcmp(sorted,grouped,sizeof(sorted)) == 0,"mosaic targets are not the input targets");
+
+	uint32_t first = 0;
+	uint32_t outside = 0;
+	uint32_t misplaced = 0;
+	uint32_t different = 0;
+	int64_t travel = 0;
+	for(t = 0; t < pOne->NumTiles; t++){
+		MosaicTile* pTile = &pOne->pTiles[t];
+		CHECK(pTile->FirstTarget == first && pTile->NumTargets > 0,"tile %" PRIu32 " does not follow the last",t);
+		first += pTile->NumTargets;
+		travel += pTile->Travel;
+		ScanProt* pProt = (pTile->Protocol != NULL) ? stringToProt(pTile->Protocol) : NULL;
+		EmuResult* pRun = (pProt != NULL) ? emulateProtocol(pProt,NULL,1) : NULL;
+		CHECK(pRun != NULL && pRun->Status == 0 && pRun->NumShots == pTile->NumTargets,"tile %" PRIu32 ": %" PRIu32
+			  " shots for %" PRIu32 " targets",t,(pRun != NULL) ? pRun->NumShots : 0,pTile->NumTargets);
+		for(i = 0; i < pTile->NumTargets; i++){
+			struct Coord* pTarget = &pOne->pTargets[pTile->FirstTarget + i];
+			gCoord galvo = convertCoord(pTarget,CHECK_SCALE/16,&pTile->Center,0);
+			outside += (abs(pTarget->X - pTile->Center.X) > tileSize.X/2 || abs(pTarget->Y - pTile->Center.Y) > tileSize.Y/2);
+			misplaced += (pRun != NULL && i < pRun->NumShots && (pRun->pShots[i].X != galvo.X || pRun->pShots[i].Y != galvo.Y));
+		}
+		different += (pFour->pTiles[t].Protocol == NULL || pTile->Protocol == NULL
+					  || strcmp(pFour->pTiles[t].Protocol,pTile->Protocol) != 0);
+		freeEmuResult(pRun);
+		freeProtocol(pProt);
+	}
+	CHECK(first == 40 && travel == pOne->Travel,"tiles hold %" PRIu32 " targets, travel %" PRId64 " of %" PRId64,first,
+		  travel,pOne->Travel);
+	CHECK(outside == 0 && misplaced == 0,"%" PRIu32 " targets outside their tile, %" PRIu32 " fired elsewhere",
+		  outside,misplaced);
+	CHECK(pFour->NumTiles == pOne->NumTiles && different == 0,"%" PRIu32 " tiles differ on four threads",different);
+	freeMosaic(pOne);
+	freeMosaic(pFour);
+}
+
+// TARGET PREPROCESSING ...........................................................................
+
+static void checkPrepare(){
+	//Two targets beyond the galvo range, an exact duplicate and a near one 2 pixels off: rejected or
+	//clamped, merged at radius 0 and 3, or clustered at radius 50 onto the centroid
+	const struct Coord targets[6] = {{100,100},{100,100},{2000,100},{300,300},{302,301},{-5000,-5000}};
+	struct Coord center = {512,512};
+	const int merge[4] = {0,3,0,-1};
+	const int cluster[4] = {0,0,0,50};
+	const enum ClipMode clip[4] = {CLIP_REJECT,CLIP_REJECT,CLIP_CLAMP,CLIP_REJECT};
+	const int kept[4] = {3,2,5,2};
+	/* Per case: rejected, clipped, merged, clustered, and clusters formed */
+	const uint32_t counts[4][5] = {{2,0,1,0,0},{2,0,2,0,0},{0,2,1,0,0},{2,0,0,2,2}};
+	const int32_t maps[4][6] = {{0,0,-1,1,2,-1},{0,0,-1,1,1,-1},{0,0,1,2,3,4},{0,0,-1,1,1,-1}};
+	int k,i;
+	for(k = 0; k < 4; k++){
+		CoordSource source;
+		struct Coord out[6];
+		int32_t map[6];
+		PrepReport report;
+		arraySource(&source,targets,6);
+		int n = prepareTargets(&source,out,merge[k],cluster[k],clip[k],CHECK_SCALE,&center,map,&report);
+		closeSource(&source);
+		CHECK(n == kept[k] && report.NumIn == 6 && report.NumOut == (uint32_t)n && report.Rejected == counts[k][0]
+			  && report.Clipped == counts[k][1] && report.Duplicates == counts[k][2] && report.Clustered == counts[k][3]
+			  && report.NumClusters == counts[k][4],
+			  "case %d: %d kept, %" PRIu32 " rejected, %" PRIu32 " clipped, %" PRIu32 " merged, %" PRIu32 " clustered",
+			  k,n,report.Rejected,report.Clipped,report.Duplicates,report.Clustered);
+		CHECK(memcmp(map,maps[k],sizeof(map)) == 0,"case %d: target map differs",k);
+		int outside = 0;
+		for(i = 0; i < n; i++){
+			gCoord galvo = convertCoord(&out[i],CHECK_SCALE,&center,0);
+			outside += (galvo.X < UCOUNT_MIN || galvo.X > UCOUNT_MAX || galvo.Y < UCOUNT_MIN || galvo.Y > UCOUNT_MAX);
+		}
+		CHECK(outside == 0,"case %d: %d targets kept out of range",k,outside);
+		CHECK(k != 3 || (n == 2 && out[1].X == 301 && out[1].Y == 300),"cluster site not at the centroid");
+	}
+}
+
+// TRIGGER STREAMS ................................................................................
+
+static int streamIs(TrigStream* pTrig, const uint64_t* pTimes, uint64_t NumEdges){
+	//The stream yields edges at pTimes, rising first and alternating, then ends; again after a reset
+	int pass;
+	for(pass = 0; pass < 2; pass++){
+		TrigEdge edge;
+		uint64_t i;
+		for(i = 0; i < NumEdges; i++){
+			if(!nextEdge(pTrig,&edge) || edge.Time != pTimes[i] || edge.Edge != ((i & 1) ? FALLING : RISING)){
+				return 0;
+			}
+		}
+		if(nextEdge(pTrig,&edge)){
+			return 0;
+		}
+		resetTrigger(pTrig);
+	}
+	return 1;
+}
+
+static void checkTriggers(){
+	//Logs and generators give the documented edges; paced targets fire a baseline after each rising
+	//edge, edges that come while no wait is pending are missed, and a stream that runs out stalls
+	TrigStream trig;
+	const char* pLog = "# ms\n0.5 U\n0.6, D\n\n2\n2.5\n";
+	const uint64_t logTimes[4] = {50,60,200,250};
+	writeFile("sccheck_trig.txt",pLog,strlen(pLog));
+	CHECK(fileTrigger(&trig,"sccheck_trig.txt",CYCLES_PER_MS) == 0 && streamIs(&trig,logTimes,4),"trigger log");
+	closeTrigger(&trig);
+	writeFile("sccheck_trig.txt","10 U\n5 D\n",9);
+	CHECK(fileTrigger(&trig,"sccheck_trig.txt",1) != 0,"trigger log going back in time accepted");
+	closeTrigger(&trig);
+	remove("sccheck_trig.txt");
+
+	const uint64_t periodicTimes[6] = {1000,1010,1500,1510,2000,2010};
+	CHECK(periodicTrigger(&trig,1000,500,10,3) == 0 && streamIs(&trig,periodicTimes,6),"periodic trigger");
+	closeTrigger(&trig);
+
+	uint64_t poissonTimes[2000];
+	TrigEdge edge;
+	uint64_t i = 0;
+	int ordered = 1;
+	CHECK(poissonTrigger(&trig,100,1000,10,1000,7) == 0,"Poisson trigger not created");
+	while(i < 2000 && nextEdge(&trig,&edge)){
+		poissonTimes[i] = edge.Time;
+		ordered &= (i == 0) ? (edge.Time >= 100) : (edge.Time >= poissonTimes[i-1] + ((i & 1) ? 10 : 1));
+		ordered &= ((i & 1) ? (edge.Time == poissonTimes[i-1] + 10) : 1);
+		i++;
+	}
+	double mean = (i == 2000) ? (double)(poissonTimes[1998] - poissonTimes[0])/999 : 0;
+	CHECK(i == 2000 && ordered && mean > 900 && mean < 1100,"Poisson trigger: %" PRIu64 " edges, mean interval %.0f",i,mean);
+	resetTrigger(&trig);
+	CHECK(streamIs(&trig,poissonTimes,2000),"Poisson trigger does not repeat after a reset");
+	closeTrigger(&trig);
+
+	struct Coord targets[3] = {{100,100},{900,100},{500,500}};
+	ScanProt* pProt = targetProt(targets,3,1000,10,2,20,1,0,1,T_PACED_RISING,NULL);
+	const uint64_t periods[3] = {100000,50,100000};
+	const uint64_t pulses[3] = {3,0,2};
+	int k;
+	for(k = 0; k < 3 && pProt != NULL; k++){
+		periodicTrigger(&trig,5000,periods[k],10,pulses[k]);
+		EmuResult* pRun = emulateTriggered(pProt,NULL,&trig,1);
+		closeTrigger(&trig);
+		uint32_t expected = (k == 2) ? 4 : 6;
+		CHECK(pRun != NULL && pRun->Status == 0 && pRun->Stalled == (k == 2) && pRun->NumWaits == 3
+			  && pRun->NumShots == expected && (k != 1 || pRun->MissedEdges > 0),"stream %d: stalled %d, %" PRIu32
+			  " shots, %" PRIu32 " missed edges",k,(pRun != NULL) ? pRun->Stalled : -1,(pRun != NULL) ? pRun->NumShots : 0,
+			  (pRun != NULL) ? pRun->MissedEdges : 0);
+		uint32_t s;
+		int late = 0;
+		for(s = 0; k != 1 && pRun != NULL && s < pRun->NumShots; s++){
+			late += (pRun->pShots[s].Time != 5000 + (s/2)*periods[k] + 1000 + (s%2)*20);
+		}
+		CHECK(late == 0,"stream %d: %d shots not a baseline after their edge",k,late);
+		freeEmuResult(pRun);
+	}
+	freeProtocol(pProt);
+}
+
+// LIBRARY VALIDATION .............................................................................
+
+static void checkLibrary(){
+	//The standard protocols and three bad ones, eight times over: each summary matches a single
+	//emulation, the bad ones are counted by kind, and eight threads give what one thread gives
+	const char* pBad[3] = {"C\nAV,100,4,0\nAV,50,3,0\n",					//Listed out of cycle order
+						   "C\nAU,0,7,0\nAV,10,7,4\nAV,20,7,0\n",			//Waits in cycle 0
+						   "C\nAV,10,4,30000000000\nAV,10,7,4\nAV,20,7,0\n"};	//Fires before the galvo settles
+	uint32_t numStd = 0;
+	const StdProtocol* pStd = stdProtocols(&numStd);
+	uint32_t numKinds = numStd + 3;
+	uint32_t numProts = 8*numKinds;
+	ScanProt** ppProts = calloc(numProts,sizeof(ScanProt*));
+	uint32_t i;
+	int parsed = (ppProts != NULL);
+	for(i = 0; parsed && i < numProts; i++){
+		uint32_t kind = i % numKinds;
+		ppProts[i] = stringToProt((kind < numStd) ? pStd[kind].Text : pBad[kind - numStd]);
+		parsed = (ppProts[i] != NULL);
+	}
+	CHECK(parsed,"library not parsed");
+	LibraryReport* pOne = parsed ? emulateLibrary(ppProts,numProts,NULL,1) : NULL;
+	LibraryReport* pEight = parsed ? emulateLibrary(ppProts,numProts,NULL,8) : NULL;
+	CHECK(pOne != NULL && pOne->NumProts == numProts && pOne->NumErrors == 8 && pOne->NumStalled == 8,
+		  "library: %" PRIu32 " errors, %" PRIu32 " stalled",(pOne != NULL) ? pOne->NumErrors : 0,
+		  (pOne != NULL) ? pOne->NumStalled : 0);
+	uint32_t mismatched = 0, settle = 0, failed = 0;
+	uint64_t total = 0;
+	for(i = 0; pOne != NULL && i < numProts; i++){
+		EmuSummary* pSum = &pOne->pSummaries[i];
+		//Some standard protocols are paced faster than the default rig settles, so count rather than assume
+		mismatched += (i % numKinds == numKinds - 1 && pSum->SettleViolations == 0);
+		settle += (pSum->SettleViolations > 0);
+		failed += (pSum->Status != 0 || pSum->Stalled || pSum->SettleViolations > 0);
+		EmuResult* pRun = emulateProtocol(ppProts[i],NULL,1);
+		mismatched += (pRun == NULL || pSum->Status != pRun->Status || pSum->Stalled != pRun->Stalled
+					   || pSum->Duration != pRun->EndTime || pSum->NumShots != pRun->NumShots);
+		total += pSum->Duration;
+		mismatched += (pSum->Duration > pOne->MaxDuration);
+		freeEmuResult(pRun);
+	}
+	CHECK(mismatched == 0 && (pOne == NULL || (pOne->TotalDuration == total && pOne->Longest < numProts
+		  && pOne->pSummaries[pOne->Longest].Duration == pOne->MaxDuration)),"%" PRIu32 " summaries differ from single runs",
+		  mismatched);
+	CHECK(pOne != NULL && pOne->NumSettle == settle && pOne->NumFailed == failed && settle >= 8 && failed >= 24,
+		  "library: %" PRIu32 " failed, %" PRIu32 " settle violations",(pOne != NULL) ? pOne->NumFailed : 0,
+		  (pOne != NULL) ? pOne->NumSettle : 0);
+	CHECK(pOne != NULL && pEight != NULL && pEight->NumFailed == pOne->NumFailed && pEight->TotalDuration == pOne->TotalDuration
+		  && memcmp(pEight->pSummaries,pOne->pSummaries,numProts*sizeof(EmuSummary)) == 0,"eight threads differ from one");
+	freeLibraryReport(pOne);
+	freeLibraryReport(pEight);
+	for(i = 0; ppProts != NULL && i < numProts; i++){
+		freeProtocol(ppProts[i]);
+	}
+	free(ppProts);
+}
+
+// SIZE QUERIES ...................................................................................
+
+static void checkSize(const char* Name, char* pText, uint32_t Expected){
+	//The builder's text has Expected commands, and protLength and maxProtLength agree with it
+	ScanProt* pProt = (pText != NULL) ? stringToProt(pText) : NULL;
+	CHECK(pProt != NULL && pProt->NumCmds == Expected,"%s: %" PRIu32 " commands, counted %" PRIu32,Name,
+		  (pProt != NULL) ? pProt->NumCmds : 0,Expected);
+	CHECK(pProt != NULL && protLength(pProt) == strlen(pText) + 1 && protLength(pProt) <= maxProtLength(Expected),
+		  "%s: length %zu, protLength %zu, bound %zu",Name,(pText != NULL) ? strlen(pText) + 1 : 0,
+		  (pProt != NULL) ? protLength(pProt) : 0,maxProtLength(Expected));
+	freeProtocol(pProt);
+	free(pText);
+}
+
+static void checkSizeQueries(){
+	//Every builder against its count, over the trigger modes, single pulses and trains, with and
+	//without iterations and rotation
+	struct Coord center = {512,512};
+	struct Coord pos = {300,400};
+	struct Coord dims = {4,3};
+	struct Coord spacing = {50,50};
+	struct Coord targets[5] = {{100,100},{900,100},{500,500},{100,900},{900,900}};
+	const uint16_t pulses[2] = {1,4};
+	const uint32_t iterations[2] = {1,3};
+	const double angles[2] = {0,0.3};
+	char name[64];
+	int t,p,n,r;
+	for(t = T_NONE; t <= T_PACED_FALLING; t++){
+		enum Trigger trig = (enum Trigger)t;
+		for(p = 0; p < 2; p++){
+			snprintf(name,sizeof(name),"spot, trigger %d, %d pulses",t,pulses[p]);
+			checkSize(name,buildSpotCycles(1000,10,pulses[p],20,0,2,&pos,CHECK_SCALE,&center,&trig,NULL),
+					  countSpotCmds(pulses[p],&trig));
+			for(n = 0; n < 2; n++){
+				for(r = 0; r < 2; r++){
+					snprintf(name,sizeof(name),"grid, trigger %d, %d pulses, %d iterations, angle %.1f",t,pulses[p],
+							 (int)iterations[n],angles[r]);
+					checkSize(name,buildGridCycles(1000,10,pulses[p],20,iterations[n],0,2,&dims,&pos,&spacing,CHECK_SCALE,
+												   &center,&trig,angles[r],NULL),
+							  countGridCmds(pulses[p],iterations[n],&trig,angles[r]));
+				}
+				CoordSource source;
+				arraySource(&source,targets,5);
+				snprintf(name,sizeof(name),"targets, trigger %d, %d pulses, %d iterations",t,pulses[p],(int)iterations[n]);
+				checkSize(name,buildTargetSourceCycles(&source,1000,10,pulses[p],20,iterations[n],0,2,CHECK_SCALE,&center,
+													   &trig,0,NULL),
+						  countTargetCmds(pulses[p],iterations[n],5,&trig));
+				closeSource(&source);
+			}
+		}
+		snprintf(name,sizeof(name),"rapid grid, trigger %d",t);
+		checkSize(name,buildRapidGridCycles(20,10,100,0,2,&dims,&pos,&spacing,CHECK_SCALE,&center,&trig,0,NULL),
+				  countRapidGridCmds(&trig));
+		CoordSource source;
+		arraySource(&source,targets,5);
+		snprintf(name,sizeof(name),"rapid targets, trigger %d",t);
+		checkSize(name,buildRapidTargetSourceCycles(&source,20,10,100,0,2,CHECK_SCALE,&center,&trig,0,NULL),
+				  countRapidTargetCmds(5,&trig));
+		closeSource(&source);
+	}
+}
+
+// LOOP TIMING ....................................................................................
+
+static void checkLoopTiming(){
+	//A loop end is listed one iteration after its start, and later commands at the cycle they run in
+	//once every iteration has passed (scancmdr.h, Loop timing)
+	ScanProt* pProt = stringToProt("C\nAS,0,9,1000\nA0,10,0,0\nAE,10,9,1000\n");
+	CHECK(pProt != NULL && pProt->NumCmds == 3,"header loop example not parsed");
+	EmuResult* pRun = (pProt != NULL) ? emulateProtocol(pProt,NULL,0) : NULL;
+	CHECK(pRun != NULL && pRun->Status == 0,"header loop example: emulator status %d",(pRun != NULL) ? pRun->Status : -1);
+	CHECK(pRun != NULL && pRun->EndTime == 10000,"header loop example ends in cycle %" PRIu64 ", expected 10000",
+		  (pRun != NULL) ? pRun->EndTime : 0);
+	CHECK(pRun != NULL && pRun->NumExecuted == 1 + 2*1000,"header loop example ran %" PRIu64 " commands",
+		  (pRun != NULL) ? pRun->NumExecuted : 0);
+	freeEmuResult(pRun);
+	freeProtocol(pProt);
+
+	/* Sawtooth of the firmware description (Appendix D): the increment is reset 1000 iterations on */
+	pProt = stringToProt("C\nAI,0,3,25196757\nAS,0,0,1000\nAV,0,3,-12598378496\nAE,1000,0,0\nAI,1000000,3,0\n");
+	pRun = (pProt != NULL) ? emulateProtocol(pProt,NULL,0) : NULL;
+	CHECK(pRun != NULL && pRun->Status == 0 && pRun->EndTime == 1000000,"sawtooth example ends in cycle %" PRIu64
+		  ", expected 1000000",(pRun != NULL) ? pRun->EndTime : 0);
+	CHECK(pRun != NULL && pRun->Values[3] == -12598378496LL + 1000*25196757LL,"sawtooth example ends at %" PRId64,
+		  (pRun != NULL) ? pRun->Values[3] : 0);
+	freeEmuResult(pRun);
+	freeProtocol(pProt);
+
+	/* A command listed inside the span the loop ran for is out of order */
+	pProt = stringToProt("C\nAS,10,9,100\nAV,10,7,4\nAV,20,7,0\nAE,30,9,100\nAV,1000,7,0\n");
+	pRun = (pProt != NULL) ? emulateProtocol(pProt,NULL,0) : NULL;
+	CHECK(pRun != NULL && pRun->Status == 11 && pRun->ErrorCmd == 4,"command inside the loop's run not flagged (status %d)",
+		  (pRun != NULL) ? pRun->Status : -1);
+	freeEmuResult(pRun);
+	freeProtocol(pProt);
+
+	/* Pulse trains of a target protocol: 2 targets, 2 iterations of 10 pulses, 10 on every 20 */
+	struct Coord targets[2] = {{256,256},{768,768}};
+	uint32_t baseline = 100;
+	uint32_t isi = 20;
+	uint32_t period = baseline + 10*isi;
+	RigProfile rig = defaultRigProfile();
+	pProt = targetProt(targets,2,baseline,10,10,isi,2,0,1,T_NONE,NULL);
+	pRun = (pProt != NULL) ? emulateProtocol(pProt,NULL,1) : NULL;
+	CHECK(pRun != NULL && pRun->Status == 0,"pulse train: emulator status %d",(pRun != NULL) ? pRun->Status : -1);
+	CHECK(pRun != NULL && pRun->NumShots == 40,"pulse train: %" PRIu32 " pulses, expected 40",(pRun != NULL) ? pRun->NumShots : 0);
+	uint32_t i;
+	for(i = 0; pRun != NULL && i < pRun->NumShots && i < 40; i++){
+		uint32_t target = i/20;
+		uint32_t iteration = (i/10)%2;
+		uint64_t expected = rig.TimeOffset + target*2*period + iteration*period + baseline + (i%10)*isi;
+		CHECK(pRun->pShots[i].Time == expected && pRun->pShots[i].Length == 10,
+			  "pulse %" PRIu32 " at cycle %" PRIu64 " for %" PRIu64 ", expected %" PRIu64 " for 10",
+			  i,pRun->pShots[i].Time,pRun->pShots[i].Length,expected);
+		CHECK(pRun->pShots[i].X == pRun->pShots[target*20].X && pRun->pShots[i].Y == pRun->pShots[target*20].Y,
+			  "pulse %" PRIu32 " away from its target",i);
+	}
+	freeEmuResult(pRun);
+	freeProtocol(pProt);
+}
+
+// EXPOSURE LIMITS ................................................................................
+
+static int64_t windowOnTime(EmuResult* pRun, uint32_t Last, int64_t Window){
+	//Laser-on cycles at the position of pulse Last within the Window cycles up to its end
+	int64_t end = (int64_t)(pRun->pShots[Last].Time + pRun->pShots[Last].Length);
+	int64_t sum = 0;
+	uint32_t i;
+	for(i = 0; i <= Last; i++){
+		EmuShot* pShot = &pRun->pShots[i];
+		int64_t from = (int64_t)pShot->Time;
+		int64_t to = from + (int64_t)pShot->Length;
+		from = (from > end - Window) ? from : end - Window;
+		if(pShot->X == pRun->pShots[Last].X && pShot->Y == pRun->pShots[Last].Y && to > from){
+			sum += to - from;
+		}
+	}
+	return sum;
+}
+
+static void checkExposureLimits(){
+	//A 50% duty train against a 20% cap in 200 cycles: rejected as built, and within the cap when
+	//re-timed, with the loops around it still in order
+	struct Coord targets[2] = {{300,300},{700,700}};
+	RigProfile rig = defaultRigProfile();
+	rig.DutyWindow = 200;
+	rig.MaxDuty = 0.2;
+	int64_t allowed = 40;
+
+	ScanProt* pProt = targetProt(targets,2,100,10,10,20,1,0,1,T_NONE,NULL);
+	ExposureReport report;
+	CHECK(pProt != NULL && limitExposure(pProt,&rig,&report) < 0,"train over the duty cap accepted");
+	CHECK(pProt != NULL && report.DutyViolations > 0 && report.PeakDuty >= 0.5,
+		  "train over the duty cap: %" PRIu32 " violations, peak duty %.3f",report.DutyViolations,report.PeakDuty);
+	freeProtocol(pProt);
+	CHECK(targetProt(targets,2,100,10,10,20,1,0,1,T_NONE,&rig) == NULL,"builder returned a train over the duty cap");
+
+	rig.RetimeExposure = 1;
+	pProt = targetProt(targets,2,100,10,10,20,2,0,1,T_NONE,&rig);
+	CHECK(pProt != NULL,"re-timed train not built");
+	EmuResult* pRun = (pProt != NULL) ? emulateProtocol(pProt,&rig,1) : NULL;
+	CHECK(pProt == NULL || (pRun != NULL && pRun->Status == 0),"re-timed train: emulator status %d",
+		  (pRun != NULL) ? pRun->Status : -1);
+	CHECK(pProt == NULL || (pRun != NULL && pRun->NumShots == 40),"re-timed train: %" PRIu32 " pulses, expected 40",
+		  (pRun != NULL) ? pRun->NumShots : 0);
+	uint32_t i;
+	for(i = 0; pRun != NULL && i < pRun->NumShots; i++){
+		int64_t onTime = windowOnTime(pRun,i,rig.DutyWindow);
+		CHECK(onTime <= allowed,"re-timed pulse %" PRIu32 ": %" PRId64 " cycles on in the window",i,onTime);
+	}
+	freeEmuResult(pRun);
+	freeProtocol(pProt);
+}
+
+static void checkExposureMap(){
+	//A ramp binned one run per bin matches binning it cycle by cycle: X at a constant rate, Y
+	//accelerating back through where it came from
+	const char* pText = "C\nAV,0,4,0\nAV,0,3,2000\nAV,10,7,4\nAI,10,4,250\nAI,10,3,-300\nAJ,10,3,20\nAV,50,7,0\n";
+	ScanProt* pProt = stringToProt(pText);
+	ExposureMap* pMap = createExposureMap(16,16,-4000,-4000,1000);
+	int status = (pProt != NULL && pMap != NULL) ? accumulateExposure(pMap,pProt,NULL,NULL) : -1;
+	CHECK(status == 0,"ramp exposure: status %d",status);
+	double expected[16*16] = {0};
+	int64_t k;
+	for(k = 0; k < 40; k++){
+		int64_t x = 250*k;
+		int64_t y = 2000 - 300*k + 20*(k*(k-1)/2);
+		expected[((y + 4000)/1000)*16 + (x + 4000)/1000] += 1;
+	}
+	uint32_t i;
+	uint32_t wrong = 0;
+	for(i = 0; status == 0 && i < 16*16; i++){
+		wrong += (pMap->pDwell[i] != expected[i]);
+	}
+	CHECK(status == 0 && wrong == 0 && pMap->Total == 40 && pMap->Outside == 0,
+		  "ramp exposure: %" PRIu32 " bins wrong, %" PRIu64 " cycles, %" PRIu64 " outside",wrong,
+		  (status == 0) ? pMap->Total : 0,(status == 0) ? pMap->Outside : 0);
+	freeExposureMap(pMap);
+	freeProtocol(pProt);
+
+	//A ramp stopped by a move spreads its dwell along the ramp, as one stopped by clearing it first
+	const char* pStops[2] = {"C\nAV,0,4,0\nAV,0,3,0\nAV,1,7,4\nAI,1,4,1000\nAV,101,4,0\nAV,101,7,0\n",
+							 "C\nAV,0,4,0\nAV,0,3,0\nAV,1,7,4\nAI,1,4,1000\nAI,101,4,0\nAV,101,4,0\nAV,101,7,0\n"};
+	for(k = 0; k < 2; k++){
+		pProt = stringToProt(pStops[k]);
+		pMap = createExposureMap(128,1,0,0,1000);
+		status = (pProt != NULL && pMap != NULL) ? accumulateExposure(pMap,pProt,NULL,NULL) : -1;
+		uint32_t filled = 0;
+		for(i = 0; status == 0 && i < 128; i++){
+			filled += (pMap->pDwell[i] == 1 && i < 100);
+		}
+		CHECK(status == 0 && filled == 100 && pMap->Total == 100,"ramp stopped by %s: %" PRIu32 " bins of 1 cycle, %" PRIu64
+			  " cycles",(k == 0) ? "a move" : "clearing it",filled,(status == 0) ? pMap->Total : 0);
+		freeExposureMap(pMap);
+		freeProtocol(pProt);
+	}
+}
+
+// PACED TRIGGERING ................................................................................
+
+static void checkPacedOrder(){
+	//Externally paced target protocols: cycles never go back, the master loop ends after the last
+	//target, and every pulse comes after its edge wait with the galvos settled
+	struct Coord targets[3] = {{100,100},{900,100},{900,900}};
+	uint32_t iterations[2] = {1,2};
+	uint16_t pulses[2] = {1,3};
+	int a,b;
+	for(a = 0; a < 2; a++){
+		for(b = 0; b < 2; b++){
+			ScanProt* pProt = targetProt(targets,3,100,10,pulses[b],20,iterations[a],0,2,T_PACED_RISING,NULL);
+			CHECK(pProt != NULL,"paced protocol (iterations %" PRIu32 ", pulses %d) not built",iterations[a],pulses[b]);
+			if(pProt == NULL){
+				continue;
+			}
+			uint32_t i;
+			uint32_t disorder = 0;
+			for(i = 1; i < pProt->NumCmds; i++){
+				disorder += (cmdCycle(&pProt->pCmds[i]) < cmdCycle(&pProt->pCmds[i-1]));
+			}
+			PackedCmd* pLast = &pProt->pCmds[pProt->NumCmds-1];
+			CHECK(disorder == 0,"%" PRIu32 " commands listed before their predecessor",disorder);
+			CHECK(cmdScan(pLast) == END,"protocol does not close the master loop");
+
+			EmuResult* pRun = emulateProtocol(pProt,NULL,1);
+			CHECK(pRun != NULL && pRun->Status == 0,"emulator status %d",(pRun != NULL) ? pRun->Status : -1);
+			if(pRun != NULL){
+				uint32_t expected = 2*3*iterations[a]*pulses[b];
+				CHECK(pRun->NumShots == expected,"%" PRIu32 " pulses emulated, expected %" PRIu32,pRun->NumShots,expected);
+				CHECK(pRun->NumWaits == 2*3*iterations[a],"%" PRIu32 " edge waits emulated",pRun->NumWaits);
+				for(i = 0; i < pRun->NumShots; i++){
+					CHECK(pRun->pShots[i].Slack >= 0,"pulse %" PRIu32 " fired %" PRId64 " cycles before the galvos settled",
+						  i,-pRun->pShots[i].Slack);
+				}
+				freeEmuResult(pRun);
+			}
+			freeProtocol(pProt);
+		}
+	}
+}
+
+// MOVE ENCODING ..................................................................................
+
+static void checkCompactMoves(){
+	//Compacted moves run to the same positions: a move near the last one becomes relative, but not
+	//while a ramp drifts the channel between the two
+	const char* pTexts[2] = {
+		"C\nAV,20,4,12345678901\nAV,30,4,12345678950\nAV,30,7,4\nAV,40,7,0\n",
+		"C\nAI,10,4,100\nAV,20,4,12345678901\nAV,30,4,12345678950\nAV,30,7,4\nAV,40,7,0\n",
+	};
+	int k;
+	for(k = 0; k < 2; k++){
+		ScanProt* pPlain = stringToProt(pTexts[k]);
+		ScanProt* pCompact = stringToProt(pTexts[k]);
+		int rewritten = (pCompact != NULL) ? compactMoves(pCompact,MOVE_RESYNC) : -1;
+		CHECK(rewritten == (k == 0),"case %d: %d moves made relative, expected %d",k,rewritten,k == 0);
+		EmuResult* pPlainRun = (pPlain != NULL) ? emulateProtocol(pPlain,NULL,1) : NULL;
+		EmuResult* pCompactRun = (pCompact != NULL) ? emulateProtocol(pCompact,NULL,1) : NULL;
+		int same = (pPlainRun != NULL && pCompactRun != NULL && pPlainRun->NumShots == 1 && pCompactRun->NumShots == 1
+					&& pPlainRun->pShots[0].X == pCompactRun->pShots[0].X);
+		CHECK(same,"case %d: pulse at X %" PRId64 " after compaction, %" PRId64 " before",k,
+			  (pCompactRun != NULL && pCompactRun->NumShots > 0) ? pCompactRun->pShots[0].X : 0,
+			  (pPlainRun != NULL && pPlainRun->NumShots > 0) ? pPlainRun->pShots[0].X : 0);
+		freeEmuResult(pPlainRun);
+		freeEmuResult(pCompactRun);
+		freeProtocol(pPlain);
+		freeProtocol(pCompact);
+	}
+}
+
+// RIG PROFILES ...................................................................................
+
+static int loadsProfile(const char* Name, const char* Text){
+	//1 if a profile with this text loads (each file name is cached, so every call uses its own)
+	FILE* fp = fopen(Name,"w");
+	if(fp == NULL){
+		return -1;
+	}
+	fputs(Text,fp);
+	fclose(fp);
+	int loaded = (loadRigProfile(Name) != NULL);
+	remove(Name);
+	return loaded;
+}
+
+static void checkRigProfile(){
+	//Galvo channels must be distinct galvo position channels (3-6), never the trigger or loop
+	//channel, on load and on save
+	CHECK(loadsProfile("sccheck_rig1.txt","ChanX\t5\nChanY\t6\n") == 1,"galvo channels 5,6 rejected");
+	CHECK(loadsProfile("sccheck_rig2.txt","ChanX\t7\n") == 0,"trigger channel accepted as ChanX");
+	CHECK(loadsProfile("sccheck_rig3.txt","ChanY\t9\n") == 0,"loop channel accepted as ChanY");
+	CHECK(loadsProfile("sccheck_rig4.txt","ChanX\t3\n") == 0,"ChanX equal to the default ChanY accepted");
+	CHECK(loadsProfile("sccheck_rig5.txt","ChanX\t2\n") == 0,"channel 2 accepted");
+	CHECK(loadsProfile("sccheck_rig6.txt","ChanX\t5.5\n") == 0,"channel 5.5 accepted");
+	RigProfile rig = defaultRigProfile();
+	rig.ChanX = TRIG;
+	CHECK(saveRigProfile("sccheck_rig7.txt",&rig) == -1,"profile with ChanX %d saved",rig.ChanX);
+	remove("sccheck_rig7.txt");
+	rig = defaultRigProfile();
+	CHECK(saveRigProfile("sccheck_rig8.txt",&rig) == 0 && loadRigProfile("sccheck_rig8.txt") != NULL,
+		  "default profile does not round-trip");
+	remove("sccheck_rig8.txt");
+}
+
+// EXPERIMENT LANGUAGE ............................................................................
+
+static EmuResult* runExperiment(const char* Source){
+	//Compiles and emulates an experiment, recording its pulses (NULL if it does not compile)
+	char* pText = compileExperiment(Source,NULL,NULL);
+	ScanProt* pProt = (pText != NULL) ? stringToProt(pText) : NULL;
+	EmuResult* pRun = (pProt != NULL) ? emulateProtocol(pProt,NULL,1) : NULL;
+	freeProtocol(pProt);
+	free(pText);
+	return pRun;
+}
+
+static void checkExperiment(){
+	//Statements after a train or a repeat start once all its iterations have run; seeds keep all
+	//64 bits
+	EmuResult* pRun = runExperiment("scale 67108864; center 512 512; target A 100 100; move A\n"
+									"train 10 x 100 cycles every 500 cycles; pulse 100 cycles\n");
+	CHECK(pRun != NULL && pRun->Status == 0 && pRun->NumShots == 11
+		  && pRun->pShots[10].Time - pRun->pShots[0].Time == 5000,"pulse after a train: status %d, %" PRIu32 " shots",
+		  (pRun != NULL) ? pRun->Status : -1,(pRun != NULL) ? pRun->NumShots : 0);
+	freeEmuResult(pRun);
+
+	pRun = runExperiment("scale 67108864; center 512 512; target A 100 100; move A\n"
+						 "repeat 3 { train 2 x 100 cycles every 500 cycles; wait 1000 cycles }\n"
+						 "pulse 100 cycles\n");
+	CHECK(pRun != NULL && pRun->Status == 0 && pRun->NumShots == 7
+		  && pRun->pShots[6].Time - pRun->pShots[0].Time == 6000,"pulse after a repeat: status %d, %" PRIu32 " shots",
+		  (pRun != NULL) ? pRun->Status : -1,(pRun != NULL) ? pRun->NumShots : 0);
+	freeEmuResult(pRun);
+
+	const char* pRandom = "target A 100 100; target B 140 100; target C 180 100; target D 220 100\n"
+						  "target E 100 140; target F 140 140; target G 180 140; target H 220 140\n"
+						  "scale 67108864; center 512 512; pulse 100 cycles at A-H random\n";
+	char source[512];
+	snprintf(source,sizeof(source),"seed 9007199254740992\n%s",pRandom);
+	char* pEven = compileExperiment(source,NULL,NULL);
+	snprintf(source,sizeof(source),"seed 9007199254740993\n%s",pRandom);
+	char* pOdd = compileExperiment(source,NULL,NULL);
+	CHECK(pEven != NULL && pOdd != NULL && strcmp(pEven,pOdd) != 0,"seeds 2^53 and 2^53+1 give the same order");
+	free(pEven);
+	free(pOdd);
+	snprintf(source,sizeof(source),"seed 18446744073709551615\n%s",pRandom);
+	char* pMax = compileExperiment(source,NULL,NULL);
+	snprintf(source,sizeof(source),"seed 18446744073709551616\n%s",pRandom);
+	char* pOver = compileExperiment(source,NULL,NULL);
+	snprintf(source,sizeof(source),"seed -1\n%s",pRandom);
+	char* pNegative = compileExperiment(source,NULL,NULL);
+	CHECK(pMax != NULL && pOver == NULL && pNegative == NULL,"seed range: 2^64-1 %s, 2^64 %s, -1 %s",
+		  pMax ? "accepted" : "rejected",pOver ? "accepted" : "rejected",pNegative ? "accepted" : "rejected");
+	free(pMax);
+	free(pOver);
+	free(pNegative);
+}
+
+// ARRAY INTERFACE ................................................................................
+
+static void checkArrays(){
+	//Element type and trigger mode arrive as plain ints and are rejected out of range; the arrays of
+	//ProtToArrays are aligned for their element types
+	const int32_t xs[3] = {100,200,300};
+	const int32_t ys[3] = {400,500,600};
+	char out[4096];
+	int64_t len = buildTargetArrays(xs,ys,sizeof(int32_t),sizeof(int32_t),0,3,100,50,1,200,1,1000,1,CHECK_SCALE,512,512,
+									T_OUT,0,NULL,out,sizeof(out));
+	CHECK(len > 0 && (size_t)len == strlen(out),"valid arrays: length %" PRId64,len);
+	CHECK(buildTargetArrays(xs,ys,sizeof(int32_t),sizeof(int32_t),7,3,100,50,1,200,1,1000,1,CHECK_SCALE,512,512,
+							T_OUT,0,NULL,out,sizeof(out)) == -1,"element type 7 accepted");
+	CHECK(buildTargetArrays(xs,ys,sizeof(int32_t),sizeof(int32_t),0,3,100,50,1,200,1,1000,1,CHECK_SCALE,512,512,
+							T_PACED_FALLING+1,0,NULL,out,sizeof(out)) == -1,"trigger mode %d accepted",T_PACED_FALLING+1);
+	CHECK(buildTargetArrays(xs,ys,sizeof(int32_t),sizeof(int32_t),0,3,100,50,1,200,1,1000,1,CHECK_SCALE,512,512,
+							-1,0,NULL,out,sizeof(out)) == -1,"trigger mode -1 accepted");
+
+	ProtArrays* pArrays = stringToArrays(out);
+	ScanProt* pProt = stringToProt(out);
+	int same = (pArrays != NULL && pProt != NULL && pArrays->NumCmds == pProt->NumCmds);
+	uint32_t i;
+	for(i = 0; same && i < pArrays->NumCmds; i++){
+		const PackedCmd* pCmd = &pProt->pCmds[i];
+		same = pArrays->pValue[i] == cmdValue(pCmd) && pArrays->pCycle[i] == cmdCycle(pCmd)
+			&& pArrays->pChannel[i] == cmdChannel(pCmd) && pArrays->pOp[i] == cmdScan(pCmd);
+	}
+	CHECK(same,"arrays differ from the protocol");
+	CHECK(pArrays != NULL && (uintptr_t)pArrays->pValue % sizeof(int64_t) == 0 && (uintptr_t)pArrays->pCycle % sizeof(uint32_t) == 0
+		  && (uintptr_t)pArrays->pChannel % sizeof(int32_t) == 0,"arrays misaligned");
+	freeArrays(pArrays);
+	freeProtocol(pProt);
+}
+
+// PARALLEL SERIALIZATION .........................................................................
+
+static void checkParallel(){
+	//Batches formatted on many threads match ProtToString, including with a thread count no rig has
+	//cores for (the workers are capped, not started one per request)
+	ScanProt* pProts[2];
+	char* pExpect[2];
+	int k;
+	for(k = 0; k < 2; k++){
+		pProts[k] = createProtocol();
+		uint32_t i;
+		for(i = 0; i < 40000; i++){
+			appendMove(pProts[k],(i & 1) ? X : Y,10*i,(int64_t)i*7919*(k+1) - 150000000);
+		}
+		pExpect[k] = ProtToString(pProts[k]);
+	}
+	int counts[3] = {0,4,INT32_MAX};
+	int c;
+	for(c = 0; c < 3; c++){
+		size_t offsets[3];
+		char* pBatch = serializeBatch(pProts,2,counts[c],offsets);
+		CHECK(pBatch != NULL && strcmp(pBatch + offsets[0],pExpect[0]) == 0 && strcmp(pBatch + offsets[1],pExpect[1]) == 0,
+			  "%d threads: batch differs from ProtToString",counts[c]);
+		free(pBatch);
+	}
+	for(k = 0; k < 2; k++){
+		free(pExpect[k]);
+		freeProtocol(pProts[k]);
+	}
+}
+
+// SNAPSHOTS ......................................................................................
+
+typedef struct SnapReaders{			//Readers acquiring from a slot while it is republished
+	ProtSlot Slot;
+	int Stop;
+	uint32_t Bad;					//Snapshots seen with a command count or a last command out of order
+} SnapReaders;
+
+static void* snapReader(void* pArg){
+	SnapReaders* pShared = pArg;
+	uint32_t last = 0;
+	while(!__atomic_load_n(&pShared->Stop,__ATOMIC_ACQUIRE)){
+		ProtSnapshot* pSnap = acquireSnapshot(&pShared->Slot);
+		if(pSnap != NULL){
+			const PackedCmd* pCmd = snapshotCmd(pSnap,pSnap->NumCmds-1);
+			if(pSnap->NumCmds < last || pCmd == NULL || cmdValue(pCmd) != pSnap->NumCmds){
+				__atomic_add_fetch(&pShared->Bad,1,__ATOMIC_RELAXED);
+			}
+			last = pSnap->NumCmds;
+			releaseSnapshot(pSnap);
+		}
+	}
+	return NULL;
+}
+
+static void checkSnapshots(){
+	//Publishes 2000 versions, each one command longer, while readers acquire in a loop: a publish
+	//finishes although the readers never stop, and every reader sees whole, current versions
+	static SnapReaders shared;
+	memset(&shared,0,sizeof(shared));
+	ScanProt* pProt = createProtocol();
+	appendMove(pProt,X,0,1);
+	publishSnapshot(&shared.Slot,snapshotProtocol(pProt));
+	freeProtocol(pProt);
+	pthread_t readers[3];
+	int k;
+	for(k = 0; k < 3; k++){
+		pthread_create(&readers[k],NULL,snapReader,&shared);
+	}
+	uint32_t v;
+	for(v = 2; v <= 2000; v++){
+		ProtSnapshot* pCurrent = acquireSnapshot(&shared.Slot);
+		ProtDraft* pDraft = editSnapshot(pCurrent);
+		releaseSnapshot(pCurrent);
+		draftPushCmd(pDraft,packCmd('V',v,X,v));
+		publishSnapshot(&shared.Slot,commitDraft(pDraft));
+		freeDraft(pDraft);
+	}
+	__atomic_store_n(&shared.Stop,1,__ATOMIC_RELEASE);
+	for(k = 0; k < 3; k++){
+		pthread_join(readers[k],NULL);
+	}
+	CHECK(shared.Bad == 0,"%" PRIu32 " snapshots read out of order",shared.Bad);
+	CHECK(shared.Slot.pCurrent->NumCmds == 2000,"last version holds %" PRIu32 " commands",shared.Slot.pCurrent->NumCmds);
+	publishSnapshot(&shared.Slot,NULL);
+}
+
+// PROTOCOL ARCHIVE ...............................................................................
+
+#define CHECK_ARCHIVE "sccheck_archive"
+
+static long fileSize(const char* Extension){
+	char path[64];
+	snprintf(path,sizeof(path),"%s%s",CHECK_ARCHIVE,Extension);
+	FILE* fp = fopen(path,"rb");
+	if(fp == NULL){
+		return -1;
+	}
+	fseek(fp,0,SEEK_END);
+	long size = ftell(fp);
+	fclose(fp);
+	return size;
+}
+
+static void appendFile(const char* Extension, const void* pData, size_t Len){
+	char path[64];
+	snprintf(path,sizeof(path),"%s%s",CHECK_ARCHIVE,Extension);
+	FILE* fp = fopen(path,"ab");
+	if(fp != NULL){
+		fwrite(pData,1,Len,fp);
+		fclose(fp);
+	}
+}
+
+static void appendObject(uint64_t Key, unsigned char Kind, uint32_t TextLen, const void* pPayload, uint32_t Len){
+	//Object record written directly, as an older or damaged archive may hold it
+	uint32_t lens[2] = {TextLen,Len};
+	appendFile(".obj",&Key,sizeof(Key));
+	appendFile(".obj",lens,sizeof(lens));
+	appendFile(".obj",&Kind,1);
+	appendFile(".obj",pPayload,Len);
+}
+
+static void removeArchive(){
+	remove(CHECK_ARCHIVE ".obj");
+	remove(CHECK_ARCHIVE ".idx");
+}
+
+static void checkProtocolText(){
+	//Protocol text with a field out of range is rejected as malformed instead of being wrapped onto
+	//another cycle or channel or clamped, and so is a command pushed with one
+	const char* pBad[4] = {"C\nAV,4294967396,4,5\n","C\nAV,10,20,5\n","C\nAV,10,4,9223372036854775808\n",
+						   "C\nAV,-1,4,5\n"};
+	int k;
+	for(k = 0; k < 4; k++){
+		ScanProt* pProt = stringToProt(pBad[k]);
+		CHECK(pProt == NULL,"line %d out of range accepted",k);
+		freeProtocol(pProt);
+	}
+	ScanProt* pProt = stringToProt("C\nAV,4294967295,15,-9223372036854775808\n");
+	CHECK(pProt != NULL && pushCmd(pProt,'V',0,16,0) < 0 && pushCmd(pProt,'Q',0,4,0) < 0
+		  && pushCmd(pProt,'\0',0,4,0) < 0,"command with channel 16 or an unknown scan command pushed");
+	CHECK(pProt != NULL && pProt->NumCmds == 1 && cmdCycle(&pProt->pCmds[0]) == UINT32_MAX
+		  && cmdChannel(&pProt->pCmds[0]) == 15 && cmdValue(&pProt->pCmds[0]) == INT64_MIN,"largest fields not kept");
+	freeProtocol(pProt);
+}
+
+static void checkArchive(){
+	//1000 trials cycling through the standard protocols store each once, in a fraction of their
+	//text, and read back byte-exact after reopening; a partial record left by an interrupted write
+	//is cut off; a protocol whose hash matches a stored object of other text is stored apart; a
+	//packed record with an impossible command count is rejected
+	uint32_t numStd = 0;
+	const StdProtocol* pStd = stdProtocols(&numStd);
+	removeArchive();
+	ProtArchive* pArchive = openArchive(CHECK_ARCHIVE);
+	size_t textBytes = 0;
+	int added = 0;
+	int failed = 0;
+	uint64_t t;
+	for(t = 0; t < 1000; t++){
+		const StdProtocol* pProt = &pStd[t % numStd];
+		int status = archiveTrial(pArchive,t,pProt->Text);
+		added += (status == 1);
+		failed += (status < 0 || (status == 1) != (t < numStd));
+		textBytes += (t < numStd) ? pProt->Len : 0;
+	}
+	closeArchive(pArchive);
+	long objectBytes = fileSize(".obj");
+	CHECK(failed == 0 && added == (int)numStd && fileSize(".idx") == 1000*16,"%d trials misfiled, %d objects added, index of %ld bytes",
+		  failed,added,fileSize(".idx"));
+	CHECK(objectBytes > 0 && (size_t)objectBytes < textBytes/2,"%ld bytes of objects for %zu bytes of text",objectBytes,textBytes);
+
+	appendFile(".obj","\x01\x02\x03\x04\x05",5);
+	appendFile(".idx","\x01\x02\x03",3);
+	pArchive = openArchive(CHECK_ARCHIVE);
+	CHECK(pArchive != NULL && pArchive->NumTrials == 1000 && pArchive->NumObjects == numStd,"partial records not cut off");
+	CHECK(fileSize(".obj") == objectBytes && fileSize(".idx") == 1000*16,"archive not truncated to whole records");
+	int exact = 0;
+	for(t = 0; pArchive != NULL && t < 1000; t += 37){
+		char* pText = loadTrial(pArchive,t);
+		exact += (pText != NULL && strcmp(pText,pStd[t % numStd].Text) == 0);
+		free(pText);
+	}
+	CHECK(exact == 28,"%d of 28 reloaded trials byte-exact",exact);
+	closeArchive(pArchive);
+
+	/* An object stored under the hash of another text, as a collision would leave it */
+	const char* pOther = "C\nAV,0,4,1\n";
+	uint64_t key = hashProtocol(pStd[0].Text);
+	removeArchive();
+	appendObject(key,0,(uint32_t)strlen(pOther),pOther,(uint32_t)strlen(pOther));
+	pArchive = openArchive(CHECK_ARCHIVE);
+	int status = (pArchive != NULL) ? archiveTrial(pArchive,1,pStd[0].Text) : -1;
+	char* pText = (status == 1) ? loadTrial(pArchive,1) : NULL;
+	CHECK(status == 1 && pText != NULL && strcmp(pText,pStd[0].Text) == 0,"collision: status %d, protocol %s",status,
+		  (pText != NULL && strcmp(pText,pStd[0].Text) == 0) ? "restored" : "lost");
+	free(pText);
+	pText = (pArchive != NULL) ? loadProtocol(pArchive,key) : NULL;
+	CHECK(pText != NULL && strcmp(pText,pOther) == 0,"collision: first object no longer under its key");
+	free(pText);
+	closeArchive(pArchive);
+
+	/* Packed records claiming 2^62 commands in a 4-byte payload, and holding an op code past the
+	   scan commands */
+	const unsigned char hugeCount[4] = {0x80,0x80,0x80,0x40};
+	const unsigned char badOp[4] = {0x01,0x0F,0x00,0x00};
+	removeArchive();
+	appendObject(1,1,10,hugeCount,sizeof(hugeCount));
+	appendObject(2,1,10,badOp,sizeof(badOp));
+	pArchive = openArchive(CHECK_ARCHIVE);
+	char* pHuge = (pArchive != NULL) ? loadProtocol(pArchive,1) : NULL;
+	char* pBadOp = (pArchive != NULL) ? loadProtocol(pArchive,2) : NULL;
+	CHECK(pArchive != NULL && pHuge == NULL && pBadOp == NULL,"corrupt packed record accepted");
+	free(pHuge);
+	free(pBadOp);
+	closeArchive(pArchive);
+	removeArchive();
+}
+
+// DSP LINK .......................................................................................
+
+#define LOOP_MAX_OUT (1 << 20)		//Reply bytes one loopback holds
+#define LOOP_MAX_LINES 4096			//Lines one loopback acknowledges
+
+typedef struct Loopback{			//DSP stand-in behind callbackLink: echoes each line, then its status
+	pthread_mutex_t Lock;			//The link writes and reads from the uploading and aborting threads
+	pthread_cond_t Wake;
+	char Line[LINK_CMD_LEN];		//Line being received
+	size_t LineLen;
+	char Store[LOOP_MAX_OUT];		//Lines accepted since the last clear
+	size_t StoreLen;
+	char Out[LOOP_MAX_OUT];			//Replies, and how far the link has read them
+	size_t OutLen;
+	size_t OutPos;
+	size_t ReplyEnd[LOOP_MAX_LINES];	//End of each line's status in Out
+	uint32_t Lines;					//Lines received
+	uint32_t Acked;					//Statuses read back by the link
+	uint32_t MaxAhead;				//Most lines received and not yet acknowledged
+	uint32_t GarbleLine;			//Line (from 1) answered with status 18, once; 0: none
+	uint32_t EchoLine;				//Line echoed with a changed character, once; 0: none
+	int EchoAlways;					//Change the echo of every line
+	uint32_t RejectLine;			//Line answered with status 11; 0: none
+	uint32_t StallLine;				//Protocol lines after this one are never answered; 0: none
+	uint32_t StopLine;				//Line that brought the stop character '#'; 0: none
+	uint32_t LinesAfterStop;		//Protocol lines received after it
+	int64_t Values[16];				//Channels set by direct 'V' commands
+	int StuckLaser;					//The laser channel ignores direct commands
+	int StaleReply;					//Read-back of another channel ahead of the replies to '?'
+} Loopback;
+
+static void loopInit(Loopback* pLoop){
+	memset(pLoop,0,sizeof(Loopback));
+	pthread_mutex_init(&pLoop->Lock,NULL);
+	pthread_cond_init(&pLoop->Wake,NULL);
+}
+
+static void loopFree(Loopback* pLoop){
+	pthread_mutex_destroy(&pLoop->Lock);
+	pthread_cond_destroy(&pLoop->Wake);
+}
+
+static void loopLine(Loopback* pLoop){
+	//The DSP's command loop: echo, then status; the protocol is kept unless the line was rejected.
+	//Direct commands: 'V' sets a channel, '?' reads one back
+	char* pLine = pLoop->Line;
+	pLoop->Lines++;
+	if(pLoop->StopLine > 0 && pLine[0] == 'A'){
+		pLoop->LinesAfterStop++;
+	}
+	if(pLine[0] == '?'){
+		int chan = atoi(pLine + 1);
+		if(pLoop->StaleReply){
+			pLoop->OutLen += (size_t)sprintf(pLoop->Out + pLoop->OutLen,"?5\n77\r\n");
+			pLoop->StaleReply = 0;
+		}
+		pLoop->OutLen += (size_t)sprintf(pLoop->Out + pLoop->OutLen,"?%d\n%" PRId64 "\r\n",chan,pLoop->Values[chan & 15]);
+		return;
+	}
+	if(pLine[0] == 'V'){
+		int chan = atoi(pLine + 1);
+		const char* pValue = strchr(pLine,',');
+		if(!(pLoop->StuckLaser && chan == TRIG) && pValue != NULL){
+			pLoop->Values[chan & 15] = strtoll(pValue + 1,NULL,10);
+		}
+	}
+	if(pLoop->StallLine > 0 && pLoop->Lines > pLoop->StallLine && pLine[0] == 'A'){
+		pthread_cond_broadcast(&pLoop->Wake);
+		return;
+	}
+	size_t echo = pLoop->OutLen;
+	memcpy(pLoop->Out + pLoop->OutLen,pLine,pLoop->LineLen);
+	pLoop->OutLen += pLoop->LineLen;
+	int status = 0;
+	if(pLoop->Lines == pLoop->GarbleLine){
+		status = 18;
+		pLoop->GarbleLine = 0;
+	}else if(pLoop->Lines == pLoop->RejectLine){
+		status = 11;
+	}
+	if(pLoop->Lines == pLoop->EchoLine || pLoop->EchoAlways){
+		pLoop->Out[echo] ^= 0x20;
+		pLoop->EchoLine = 0;
+	}
+	pLoop->OutLen += (size_t)sprintf(pLoop->Out + pLoop->OutLen,"%d\r\n",status);
+	if(pLoop->Lines <= LOOP_MAX_LINES){
+		pLoop->ReplyEnd[pLoop->Lines-1] = pLoop->OutLen;
+	}
+	if(pLine[0] == CLEAR[0]){
+		pLoop->StoreLen = 0;
+	}else if(status == 0 && pLine[0] == 'A'){
+		memcpy(pLoop->Store + pLoop->StoreLen,pLine,pLoop->LineLen);
+		pLoop->StoreLen += pLoop->LineLen;
+	}
+	uint32_t ahead = pLoop->Lines - pLoop->Acked;
+	pLoop->MaxAhead = (ahead > pLoop->MaxAhead) ? ahead : pLoop->MaxAhead;
+}
+
+static int loopWrite(void* pCtx, const char* pData, size_t Len){
+	Loopback* pLoop = pCtx;
+	pthread_mutex_lock(&pLoop->Lock);
+	size_t i;
+	for(i = 0; i < Len; i++){
+		if(pData[i] == '#'){						//Stops the protocol, and ends a partial line
+			pLoop->StopLine = pLoop->Lines + 1;
+			pLoop->LineLen = 0;
+		}else if(pData[i] == '\n'){
+			if(pLoop->LineLen > 0){					//Blank lines get no reply
+				pLoop->Line[pLoop->LineLen++] = '\n';
+				loopLine(pLoop);
+			}
+			pLoop->LineLen = 0;
+		}else if(pLoop->LineLen < LINK_CMD_LEN - 1){
+			pLoop->Line[pLoop->LineLen++] = pData[i];
+		}
+	}
+	pthread_cond_broadcast(&pLoop->Wake);
+	pthread_mutex_unlock(&pLoop->Lock);
+	return (int)Len;
+}
+
+static int loopRead(void* pCtx, char* pData, size_t Len, uint32_t TimeoutUs){
+	//Everything written has been answered already, except for a stalled protocol, for which a read
+	//waits out its timeout
+	Loopback* pLoop = pCtx;
+	pthread_mutex_lock(&pLoop->Lock);
+	if(pLoop->OutPos == pLoop->OutLen && TimeoutUs > 0){
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME,&deadline);
+		deadline.tv_sec += TimeoutUs/1000000;
+		deadline.tv_nsec += (long)(TimeoutUs%1000000)*1000L;
+		if(deadline.tv_nsec >= 1000000000L){
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		while(pLoop->OutPos == pLoop->OutLen
+				&& pthread_cond_timedwait(&pLoop->Wake,&pLoop->Lock,&deadline) == 0){
+		}
+	}
+	size_t n = pLoop->OutLen - pLoop->OutPos;
+	n = (n < Len) ? n : Len;
+	memcpy(pData,pLoop->Out + pLoop->OutPos,n);
+	pLoop->OutPos += n;
+	while(pLoop->Acked < pLoop->Lines && pLoop->Acked < LOOP_MAX_LINES && pLoop->ReplyEnd[pLoop->Acked] <= pLoop->OutPos){
+		pLoop->Acked++;
+	}
+	pthread_mutex_unlock(&pLoop->Lock);
+	return (int)n;
+}
+
+static uint64_t metricValue(const char* Name){
+	//Counter Name of the session metrics (JSON snapshot)
+	char* pText = MetricsToString(METRICS_JSON);
+	char key[64];
+	sprintf(key,"\"%s\": ",Name);
+	char* pKey = (pText != NULL) ? strstr(pText,key) : NULL;
+	uint64_t value = (pKey != NULL) ? strtoull(pKey + strlen(key),NULL,10) : UINT64_MAX;
+	free(pText);
+	return value;
+}
+
+static char* linkTestProt(){
+	//About 300 lines of moves and pulses
+	ScanProt* pProt = createProtocol();
+	uint32_t i;
+	appendLoop(pProt,START,0,1);
+	for(i = 0; i < 150; i++){
+		appendMove(pProt,X,10 + i*400,(int64_t)i*1000003 - 75000000);
+		appendTrigOut(pProt,150 + i*400,TL_DH);
+	}
+	appendLoop(pProt,END,100000,1);
+	char* pText = ProtToString(pProt);
+	freeProtocol(pProt);
+	return pText;
+}
+
+static void checkLinkUpload(){
+	//Uploads through callbackLink to a loopback: the window grows on clean lines and never lets more
+	//lines ahead than it allows; a garbled line or a changed echo restarts at the safe rate; a link
+	//that keeps failing is counted as a link error, a rejected line as a device error
+	char* pText = linkTestProt();
+	const char* pBody = strchr(pText,'\n') + 1;
+	static Loopback loop;
+	UploadReport report;
+
+	loopInit(&loop);
+	DSPLink* pLink = callbackLink(loopWrite,loopRead,&loop,10000000);
+	int status = uploadProtocol(pLink,pText,&report);
+	CHECK(status == 0 && report.Status == 0,"clean upload: status %d",status);
+	CHECK(report.Lines == loop.Lines && report.Fallbacks == 0,"clean upload: %" PRIu64 " lines acknowledged of %" PRIu32
+		  ", %" PRIu32 " fallbacks",report.Lines,loop.Lines,report.Fallbacks);
+	CHECK(report.PeakWindow > 1 && report.PeakWindow <= report.MaxWindow,"clean upload: peak window %" PRIu32,report.PeakWindow);
+	CHECK(loop.MaxAhead <= report.PeakWindow,"clean upload: %" PRIu32 " lines ahead with a window of %" PRIu32,
+		  loop.MaxAhead,report.PeakWindow);
+	CHECK(loop.StoreLen == strlen(pBody) && memcmp(loop.Store,pBody,loop.StoreLen) == 0,"clean upload: DSP holds another protocol");
+	closeLink(pLink);
+	loopFree(&loop);
+
+	loopInit(&loop);
+	loop.GarbleLine = 100;
+	pLink = callbackLink(loopWrite,loopRead,&loop,10000000);
+	uint32_t maxWindow = report.MaxWindow;
+	status = uploadProtocol(pLink,pText,&report);
+	CHECK(status == 0 && report.Fallbacks == 1,"garbled line: status %d, %" PRIu32 " fallbacks",status,report.Fallbacks);
+	CHECK(report.MaxWindow < maxWindow,"garbled line: window %" PRIu32 " still probed",report.MaxWindow);
+	CHECK(loop.StoreLen == strlen(pBody) && memcmp(loop.Store,pBody,loop.StoreLen) == 0,"garbled line: DSP holds another protocol");
+	closeLink(pLink);
+	loopFree(&loop);
+
+	loopInit(&loop);
+	loop.EchoLine = 150;
+	pLink = callbackLink(loopWrite,loopRead,&loop,10000000);
+	status = uploadProtocol(pLink,pText,&report);
+	CHECK(status == 0 && report.Fallbacks == 1,"echo mismatch: status %d, %" PRIu32 " fallbacks",status,report.Fallbacks);
+	CHECK(loop.StoreLen == strlen(pBody) && memcmp(loop.Store,pBody,loop.StoreLen) == 0,"echo mismatch: DSP holds another protocol");
+	closeLink(pLink);
+
+	uint64_t linkErrors = metricValue("link_errors_total");
+	uint64_t uploads = metricValue("uploads_total");
+	loopFree(&loop);
+	loopInit(&loop);
+	loop.EchoAlways = 1;
+	pLink = callbackLink(loopWrite,loopRead,&loop,10000000);
+	status = uploadProtocol(pLink,pText,&report);
+	CHECK(status == -1 && report.Fallbacks == 3,"echo always changed: status %d, %" PRIu32 " fallbacks",status,report.Fallbacks);
+	CHECK(metricValue("link_errors_total") == linkErrors + 1 && metricValue("uploads_total") == uploads + 1,
+		  "failed link not counted as a link error");
+	closeLink(pLink);
+	loopFree(&loop);
+
+	loopInit(&loop);
+	loop.RejectLine = 20;
+	linkErrors = metricValue("link_errors_total");
+	pLink = callbackLink(loopWrite,loopRead,&loop,10000000);
+	status = uploadProtocol(pLink,pText,&report);
+	CHECK(status == 11 && report.Status == 11 && report.Lines == 20,"rejected line: status %d after %" PRIu64 " lines",
+		  status,report.Lines);
+	CHECK(metricValue("link_errors_total") == linkErrors,"rejected line counted as a link error");
+	closeLink(pLink);
+	loopFree(&loop);
+	free(pText);
+}
+
+typedef struct UploadJob{			//Upload run on its own thread, to be aborted from the caller's
+	DSPLink* pLink;
+	const char* Text;
+	UploadReport Report;
+	int Status;
+} UploadJob;
+
+static void* uploadThread(void* pArg){
+	UploadJob* pJob = pArg;
+	pJob->Status = uploadProtocol(pJob->pLink,pJob->Text,&pJob->Report);
+	return NULL;
+}
+
+static int abortStalled(Loopback* pLoop, UploadJob* pJob, AbortReport* pReport, int64_t ParkX, int64_t ParkY){
+	//Starts the upload, waits until the loopback has stopped answering it, then aborts
+	DSPLink* pLink = callbackLink(loopWrite,loopRead,pLoop,10000000);
+	setParkPosition(pLink,NULL,ParkX,ParkY);
+	pJob->pLink = pLink;
+	pthread_t thread;
+	pthread_create(&thread,NULL,uploadThread,pJob);
+	pthread_mutex_lock(&pLoop->Lock);
+	while(pLoop->Lines <= pLoop->StallLine){
+		pthread_cond_wait(&pLoop->Wake,&pLoop->Lock);
+	}
+	pthread_mutex_unlock(&pLoop->Lock);
+	int status = abortLink(pLink,pReport);
+	pthread_join(thread,NULL);
+	closeLink(pLink);
+	return status;
+}
+
+static void checkLinkAbort(){
+	//Aborts an upload the DSP has stopped answering: the upload gives up with the abort status, no
+	//protocol line follows the stop character, and the read-back is taken by channel, so a stray
+	//reply to another channel ahead of it is not mistaken for the laser or a galvo
+	char* pText = linkTestProt();
+	static Loopback loop;
+	UploadJob job;
+	AbortReport report;
+	const int64_t parkX = -123456789;
+	const int64_t parkY = 987654321;
+
+	loopInit(&loop);
+	loop.StallLine = 40;
+	loop.StaleReply = 1;
+	loop.Values[TRIG] = CHECK_LASER_ON;
+	memset(&job,0,sizeof(job));
+	job.Text = pText;
+	int status = abortStalled(&loop,&job,&report,parkX,parkY);
+	CHECK(job.Status == -2 && job.Report.Status == CHECK_ABORTED && job.Report.Fallbacks == 0,
+		  "aborted upload: status %d, report status %d, %" PRIu32 " fallbacks",job.Status,job.Report.Status,job.Report.Fallbacks);
+	CHECK(status == 0 && report.Confirmed,"abort: status %d, confirmed %d",status,report.Confirmed);
+	CHECK(report.Values[0] == 0 && report.Values[1] == parkX && report.Values[2] == parkY,
+		  "abort read back %" PRId64 ",%" PRId64 ",%" PRId64,report.Values[0],report.Values[1],report.Values[2]);
+	CHECK(loop.StopLine > 0 && loop.LinesAfterStop == 0,"abort: %" PRIu32 " protocol lines after the stop",
+		  loop.LinesAfterStop);
+	loopFree(&loop);
+
+	loopInit(&loop);
+	loop.StallLine = 40;
+	loop.StuckLaser = 1;
+	loop.Values[TRIG] = CHECK_LASER_ON;
+	memset(&job,0,sizeof(job));
+	job.Text = pText;
+	status = abortStalled(&loop,&job,&report,parkX,parkY);
+	CHECK(status == 1 && !report.Confirmed && report.Values[0] == CHECK_LASER_ON,"laser left on: status %d, laser %" PRId64,
+		  status,report.Values[0]);
+	loopFree(&loop);
+	free(pText);
+}
+
+int main(){
+	checkTargetEdits();
+	checkDiff();
+	checkSources();
+	checkMosaic();
+	checkPrepare();
+	checkTriggers();
+	checkLibrary();
+	checkSizeQueries();
+	checkLoopTiming();
+	checkPacedOrder();
+	checkCompactMoves();
+	checkExposureLimits();
+	checkExposureMap();
+	checkRigProfile();
+	checkExperiment();
+	checkArrays();
+	checkParallel();
+	checkSnapshots();
+	checkProtocolText();
+	checkArchive();
+	checkLinkUpload();
+	checkLinkAbort();
+
+	fprintf(stdout,"%d checks, %d failed\n",NumChecks,NumFailed);
+	return (NumFailed == 0) ? 0 : 1;
+}
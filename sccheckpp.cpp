@@ -0,0 +1,155 @@
+/* ===============================================================================================
+
+	SCCHECKPP
+	---------
+
+	Regression checks for scancmdr.hpp.  buildTargetProtocol repeats the C target block with its
+	branches resolved at compile time; this builds the same targets with both, for every trigger
+	mode and pulse shape, with and without iterations and rotation, and requires the texts to be
+	identical.  Also checks that a moved-from Protocol or Session throws instead of handing the
+	library a NULL handle, and that push throws on a command the library rejects.  Prints one line per failed expectation and a summary, and exits
+	non-zero if anything failed.
+
+	Dependencies :
+	------------
+
+	sccheckpp.cpp : scancmdr.hpp scancmdr.dll (C++20)
+
+  =============================================================================================== */
+
+
+#include <cinttypes>
+#include <cstdio>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "scancmdr.hpp"
+
+static int NumChecks = 0;
+static int NumFailed = 0;
+
+#define CHECK(cond,...) do{ \
+		NumChecks++; \
+		if(!(cond)){ \
+			NumFailed++; \
+			std::fprintf(stdout,"FAIL %s:%d: ",__func__,__LINE__); \
+			std::fprintf(stdout,__VA_ARGS__); \
+			std::fprintf(stdout,"\n"); \
+		} \
+	}while(0)
+
+template<Trigger Trig, scancmdr::Pulse Shape>
+static bool sameAsC(std::vector<Coord>& Targets, const scancmdr::TargetTiming& Timing, RigProfile* Rig){
+	//The template builder's text against buildTargetSourceCycles on the same targets
+	CoordSource source;
+	if(arraySource(&source,Targets.data(),(uint32_t)Targets.size()) != 0){
+		return false;
+	}
+	enum Trigger trig = Trig;
+	Coord center = Timing.CenterOffset;
+	scancmdr::Text expect(buildTargetSourceCycles(&source,Timing.Baseline,Timing.TimeOn,Timing.NumPulses,Timing.ISI,
+			Timing.Iterations,Timing.EpisodePeriod,Timing.Reps,Timing.ScaleFactor,&center,&trig,Timing.RotAngle,Rig));
+	closeSource(&source);
+	scancmdr::Text text = scancmdr::buildTargets<Trig,Shape>(Targets,Timing,Rig);
+	return !expect.empty() && expect.view() == text.view();
+}
+
+template<scancmdr::Pulse Shape>
+static void checkShape(std::vector<Coord>& Targets, scancmdr::TargetTiming Timing, RigProfile* Rig, const char* Name){
+	CHECK((sameAsC<T_NONE,Shape>(Targets,Timing,Rig)),"%s, T_NONE: differs from the C builder",Name);
+	CHECK((sameAsC<T_IN,Shape>(Targets,Timing,Rig)),"%s, T_IN: differs from the C builder",Name);
+	CHECK((sameAsC<T_OUT,Shape>(Targets,Timing,Rig)),"%s, T_OUT: differs from the C builder",Name);
+	CHECK((sameAsC<T_PACED_RISING,Shape>(Targets,Timing,Rig)),"%s, T_PACED_RISING: differs from the C builder",Name);
+	CHECK((sameAsC<T_PACED_FALLING,Shape>(Targets,Timing,Rig)),"%s, T_PACED_FALLING: differs from the C builder",Name);
+}
+
+static void checkTargetBlock(){
+	std::vector<Coord> targets;
+	int i;
+	for(i = 0; i < 300; i++){
+		targets.push_back({100 + (i*37)%800,100 + (i*91)%800});
+	}
+	RigProfile rig = defaultRigProfile();
+	rig.SettleSlope = 1e-9;
+	rig.SettleBase = 20;
+	scancmdr::TargetTiming timing;
+	timing.Baseline = 100;
+	timing.TimeOn = 20;
+	timing.ISI = 60;
+	timing.EpisodePeriod = 500;
+	timing.Reps = 2;
+	timing.ScaleFactor = 67108864;
+	timing.CenterOffset = {512,512};
+	uint32_t iterations;
+	for(iterations = 1; iterations <= 3; iterations += 2){
+		timing.Iterations = iterations;
+		timing.RotAngle = (iterations > 1) ? 0.2 : 0;
+		timing.NumPulses = 1;
+		checkShape<scancmdr::Pulse::Single>(targets,timing,&rig,(iterations > 1) ? "single, 3 iterations" : "single");
+		checkShape<scancmdr::Pulse::Single>(targets,timing,nullptr,(iterations > 1) ? "single, 3 iterations, default rig" : "single, default rig");
+		timing.NumPulses = 4;
+		checkShape<scancmdr::Pulse::Train>(targets,timing,&rig,(iterations > 1) ? "train, 3 iterations" : "train");
+		checkShape<scancmdr::Pulse::Train>(targets,timing,nullptr,(iterations > 1) ? "train, 3 iterations, default rig" : "train, default rig");
+	}
+}
+
+template<typename Call>
+static bool throwsLogicError(Call call){
+	try{
+		call();
+	}catch(const std::logic_error&){
+		return true;
+	}catch(...){
+	}
+	return false;
+}
+
+static int noWrite(void*, const char*, size_t Len){ return (int)Len; }
+static int noRead(void*, char*, size_t, uint32_t){ return 0; }
+
+static void checkMovedFrom(){
+	scancmdr::Protocol prot = scancmdr::Protocol::parse("C\nAS,0,9,1\nAE,10,9,1\n");
+	scancmdr::Protocol taken = std::move(prot);
+	CHECK(prot.size() == 0 && taken.size() == 2,"move left %" PRIu32 " and %" PRIu32 " commands",prot.size(),taken.size());
+	CHECK(throwsLogicError([&]{ prot.text(); }),"text() on a moved-from Protocol");
+	CHECK(throwsLogicError([&]{ prot.finish(); }),"finish() on a moved-from Protocol");
+	CHECK(throwsLogicError([&]{ prot.push('V',0,X,0); }),"push() on a moved-from Protocol");
+	CHECK(throwsLogicError([&]{ prot.reserve(16); }),"reserve() on a moved-from Protocol");
+	prot = scancmdr::Protocol();
+	prot.push('V',0,X,0);
+	CHECK(prot.size() == 1,"Protocol unusable after assignment");
+
+	scancmdr::Session session(noWrite,noRead,nullptr);
+	scancmdr::Session owner = std::move(session);
+	CHECK(throwsLogicError([&]{ session.upload("C\n"); }),"upload() on a moved-from Session");
+	CHECK(throwsLogicError([&]{ session.abort(); }),"abort() on a moved-from Session");
+}
+
+static bool throwsRuntimeError(scancmdr::Protocol& Prot, char ScanCmd, int Channel){
+	try{
+		Prot.push(ScanCmd,0,Channel,0);
+	}catch(const std::runtime_error&){
+		return true;
+	}catch(...){
+	}
+	return false;
+}
+
+static void checkRejected(){
+	//A command the packed record cannot hold throws and leaves the protocol as it was
+	scancmdr::Protocol prot;
+	CHECK(throwsRuntimeError(prot,'V',16),"push() of channel 16 accepted");
+	CHECK(throwsRuntimeError(prot,'V',-1),"push() of channel -1 accepted");
+	CHECK(throwsRuntimeError(prot,'Q',X),"push() of scan command 'Q' accepted");
+	CHECK(prot.size() == 0,"rejected commands stored: %" PRIu32,prot.size());
+}
+
+int main(){
+	checkTargetBlock();
+	checkMovedFrom();
+	checkRejected();
+
+	std::fprintf(stdout,"%d checks, %d failed\n",NumChecks,NumFailed);
+	return (NumFailed == 0) ? 0 : 1;
+}
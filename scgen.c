@@ -0,0 +1,179 @@
+/* ===============================================================================================
+
+	SCGEN
+	-----
+
+	Build-time generator of the standard protocols.  Runs the cycle-resolution builders on each
+	parameter set in StdSpecs below (default rig profile, a fixed 1024-pixel field) and writes a C
+	source file holding every result twice, as const protocol text ready for upload and as const
+	packed command records, with a table looked up by findStdProtocol.  Compiled into the library,
+	the standard protocols cost nothing at startup and live in read-only memory.  To add or change
+	one, edit StdSpecs and rerun:
+
+		gcc -std=gnu99 scgen.c scancmdr.c -o scgen -lm -lpthread && ./scgen scstd.c
+
+	and commit the new scstd.c with the change.  It must also be rerun whenever a builder's output
+	changes (the loop timing, for one).  Every protocol is emulated before it is written, and scgen
+	fails without writing the file if any of them is rejected, so a bad entry cannot reach the
+	library.
+
+	Dependencies :
+	------------
+
+	scgen.c : scancmdr.c scancmdr.h (without scstd.c)
+	scstd.c : scgen
+
+  =============================================================================================== */
+
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scancmdr.h"
+
+#define STD_SCALE 67108864			//ucounts per pixel (2^36 over a 1024-pixel field)
+#define STD_CENTER 512				//Pixel at the center of the field
+
+enum StdKind{ STD_SPOT, STD_GRID, STD_RAPID_GRID };
+
+typedef struct StdSpec{				//One standard protocol: builder and its parameters (cycles)
+	const char* Name;
+	enum StdKind Kind;
+	uint32_t Baseline;
+	uint32_t TimeOn;
+	uint16_t NumPulses;
+	uint32_t ISI;
+	uint32_t Iterations;
+	uint32_t EpisodePeriod;
+	uint16_t Reps;
+	struct Coord Pos;				//Spot position, or grid start (top left: rows step down in Y)
+	struct Coord Dims;
+	struct Coord Spacing;
+	enum Trigger Trig;
+} StdSpec;
+
+static const StdSpec StdSpecs[] = {
+	/* Calibration: the center, then a 3x3 grid spanning the field */
+	{"calib_center",		STD_SPOT,		1000,	100,	10,	10000,	1,	200000,	1,	{512,512},	{1,1},		{0,0},		T_NONE},
+	{"calib_grid_3x3",		STD_GRID,		1000,	100,	5,	10000,	1,	500000,	1,	{112,912},	{3,3},		{400,400},	T_NONE},
+	/* Test: pulse trains, grids and a rapid raster, free running and triggered */
+	{"test_spot_train",		STD_SPOT,		1000,	50,		20,	500,	1,	100000,	10,	{512,512},	{1,1},		{0,0},		T_NONE},
+	{"test_spot_trig_in",	STD_SPOT,		1000,	50,		20,	500,	1,	100000,	10,	{512,512},	{1,1},		{0,0},		T_IN},
+	{"test_grid_5x5",		STD_GRID,		1000,	100,	5,	2000,	1,	200000,	1,	{312,712},	{5,5},		{100,100},	T_NONE},
+	{"test_grid_5x5_out",	STD_GRID,		1000,	100,	5,	2000,	1,	200000,	1,	{312,712},	{5,5},		{100,100},	T_OUT},
+	{"test_rapid_grid_16",	STD_RAPID_GRID,	20,		20,		1,	100,	1,	100000,	1,	{112,912},	{16,16},	{50,50},	T_NONE},
+};
+
+#define NUM_SPECS (sizeof(StdSpecs)/sizeof(StdSpecs[0]))
+
+static char* buildSpec(const StdSpec* pSpec){
+	struct Coord center = {STD_CENTER,STD_CENTER};
+	struct Coord pos = pSpec->Pos;
+	struct Coord dims = pSpec->Dims;
+	struct Coord spacing = pSpec->Spacing;
+	enum Trigger trig = pSpec->Trig;
+	switch(pSpec->Kind){
+		case STD_SPOT:
+			return buildSpotCycles(pSpec->Baseline,pSpec->TimeOn,pSpec->NumPulses,pSpec->ISI,pSpec->EpisodePeriod,
+								   pSpec->Reps,&pos,STD_SCALE,&center,&trig,NULL);
+		case STD_GRID:
+			return buildGridCycles(pSpec->Baseline,pSpec->TimeOn,pSpec->NumPulses,pSpec->ISI,pSpec->Iterations,
+								   pSpec->EpisodePeriod,pSpec->Reps,&dims,&pos,&spacing,STD_SCALE,&center,&trig,0,NULL);
+		case STD_RAPID_GRID:
+			return buildRapidGridCycles(pSpec->Baseline,pSpec->TimeOn,pSpec->ISI,pSpec->EpisodePeriod,pSpec->Reps,
+										&dims,&pos,&spacing,STD_SCALE,&center,&trig,0,NULL);
+	}
+	return NULL;
+}
+
+static void writeText(FILE* fp, const char* Text){
+	//One string literal per protocol line, so the generated file diffs line by line
+	while(*Text != '\0'){
+		const char* pEnd = strchr(Text,'\n');
+		size_t len = (pEnd != NULL) ? (size_t)(pEnd - Text) : strlen(Text);
+		fprintf(fp,"\t\"%.*s%s\"\n",(int)len,Text,(pEnd != NULL) ? "\\n" : "");
+		Text += len + (pEnd != NULL);
+	}
+}
+
+int main(int argc, char** argv){
+	const char* outFile = (argc > 1) ? argv[1] : "scstd.c";
+	FILE* fp = fopen(outFile,"w");
+	if(fp == NULL){
+		fprintf(stderr,"Failed to open output file: %s\n",outFile);
+		return 1;
+	}
+	fprintf(fp,"/* Standard protocols, generated by scgen from its StdSpecs table.  Do not edit: change the\n"
+			   "   table in scgen.c and rerun scgen. */\n\n"
+			   "#include <stdint.h>\n#include <string.h>\n\n#include \"scancmdr.h\"\n\n");
+
+	uint64_t hashes[NUM_SPECS];
+	uint32_t numCmds[NUM_SPECS];
+	size_t lens[NUM_SPECS];
+	size_t k;
+	for(k = 0; k < NUM_SPECS; k++){
+		char* pText = buildSpec(&StdSpecs[k]);
+		ScanProt* pProt = (pText != NULL) ? stringToProt(pText) : NULL;
+		char* pCheck = (pProt != NULL) ? ProtToString(pProt) : NULL;
+		if(pCheck == NULL || strcmp(pCheck,pText) != 0){
+			fprintf(stderr,"Failed to build standard protocol %s.\n",StdSpecs[k].Name);
+			fclose(fp);
+			remove(outFile);
+			return 1;
+		}
+		EmuResult* pRun = emulateProtocol(pProt,NULL,0);
+		if(pRun == NULL || pRun->Status != 0){
+			fprintf(stderr,"Standard protocol %s fails emulation: status %d at command %" PRIu32 ".\n",
+					StdSpecs[k].Name,(pRun != NULL) ? pRun->Status : -1,(pRun != NULL) ? pRun->ErrorCmd : 0);
+			fclose(fp);
+			remove(outFile);
+			return 1;
+		}
+		freeEmuResult(pRun);
+		hashes[k] = hashProtocol(pText);
+		numCmds[k] = pProt->NumCmds;
+		lens[k] = strlen(pText);
+
+		fprintf(fp,"static const char StdText%zu[] =\t\t\t//%s\n",k,StdSpecs[k].Name);
+		writeText(fp,pText);
+		fprintf(fp,";\n\nstatic const PackedCmd StdCmds%zu[%" PRIu32 "] = {\n",k,pProt->NumCmds);
+		uint32_t i;
+		for(i = 0; i < pProt->NumCmds; i++){
+			fprintf(fp,"\t{0x%016" PRIx64 "ULL,%" PRId64 "LL},\n",pProt->pCmds[i].Head,pProt->pCmds[i].Value);
+		}
+		fprintf(fp,"};\n\n");
+		free(pCheck);
+		freeProtocol(pProt);
+		free(pText);
+	}
+
+	fprintf(fp,"static const StdProtocol StdProtocols[%zu] = {\n",(size_t)NUM_SPECS);
+	for(k = 0; k < NUM_SPECS; k++){
+		fprintf(fp,"\t{\"%s\",StdText%zu,%zu,StdCmds%zu,%" PRIu32 ",0x%016" PRIx64 "ULL},\n",
+				StdSpecs[k].Name,k,lens[k],k,numCmds[k],hashes[k]);
+	}
+	fprintf(fp,"};\n\n"
+			   "EXPORT const StdProtocol* stdProtocols(uint32_t* pCount){\n"
+			   "\t*pCount = sizeof(StdProtocols)/sizeof(StdProtocols[0]);\n"
+			   "\treturn StdProtocols;\n"
+			   "}\n\n"
+			   "EXPORT const StdProtocol* findStdProtocol(const char* Name){\n"
+			   "\tsize_t k;\n"
+			   "\tfor(k = 0; k < sizeof(StdProtocols)/sizeof(StdProtocols[0]); k++){\n"
+			   "\t\tif(strcmp(StdProtocols[k].Name,Name) == 0){\n"
+			   "\t\t\treturn &StdProtocols[k];\n"
+			   "\t\t}\n"
+			   "\t}\n"
+			   "\treturn NULL;\n"
+			   "}\n");
+	if(fclose(fp) != 0){
+		fprintf(stderr,"Failed to write output file: %s\n",outFile);
+		remove(outFile);
+		return 1;
+	}
+	fprintf(stdout,"%zu standard protocols written to %s\n",(size_t)NUM_SPECS,outFile);
+	return 0;
+}
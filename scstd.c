@@ -0,0 +1,251 @@
+/* Standard protocols, generated by scgen from its StdSpecs table.  Do not edit: change the
+   table in scgen.c and rerun scgen. */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "scancmdr.h"
+
+static const char StdText0[] =			//calib_center
+	"C\n"
+	"AV,0,4,0\n"
+	"AV,0,3,0\n"
+	"AS,0,9,1\n"
+	"AS,1010,9,10\n"
+	"AV,1010,7,4\n"
+	"AV,1110,7,0\n"
+	"AE,11010,9,10\n"
+	"AE,200060,9,1\n"
+;
+
+static const PackedCmd StdCmds0[8] = {
+	{0x0041000000000000ULL,0LL},
+	{0x0031000000000000ULL,0LL},
+	{0x0096000000000000ULL,1LL},
+	{0x00960000000003f2ULL,10LL},
+	{0x00710000000003f2ULL,4LL},
+	{0x0071000000000456ULL,0LL},
+	{0x0097000000002b02ULL,10LL},
+	{0x0097000000030d7cULL,1LL},
+};
+
+static const char StdText1[] =			//calib_grid_3x3
+	"C\n"
+	"AS,0,9,1\n"
+	"AV,0,4,26843545600\n"
+	"AV,0,3,-26843545600\n"
+	"AS,10,9,3\n"
+	"AS,10,9,3\n"
+	"AS,1010,9,5\n"
+	"AV,1010,7,4\n"
+	"AV,1110,7,0\n"
+	"AE,11010,9,5\n"
+	"AR,500010,4,-26843545600\n"
+	"AE,500010,9,3\n"
+	"AR,1500010,3,26843545600\n"
+	"AR,1500010,4,80530636800\n"
+	"AE,1500010,9,3\n"
+	"AE,4500060,9,1\n"
+;
+
+static const PackedCmd StdCmds1[15] = {
+	{0x0096000000000000ULL,1LL},
+	{0x0041000000000000ULL,26843545600LL},
+	{0x0031000000000000ULL,-26843545600LL},
+	{0x009600000000000aULL,3LL},
+	{0x009600000000000aULL,3LL},
+	{0x00960000000003f2ULL,5LL},
+	{0x00710000000003f2ULL,4LL},
+	{0x0071000000000456ULL,0LL},
+	{0x0097000000002b02ULL,5LL},
+	{0x004200000007a12aULL,-26843545600LL},
+	{0x009700000007a12aULL,3LL},
+	{0x003200000016e36aULL,26843545600LL},
+	{0x004200000016e36aULL,80530636800LL},
+	{0x009700000016e36aULL,3LL},
+	{0x009700000044aa5cULL,1LL},
+};
+
+static const char StdText2[] =			//test_spot_train
+	"C\n"
+	"AV,0,4,0\n"
+	"AV,0,3,0\n"
+	"AS,0,9,10\n"
+	"AS,1010,9,20\n"
+	"AV,1010,7,4\n"
+	"AV,1060,7,0\n"
+	"AE,1510,9,20\n"
+	"AE,100060,9,10\n"
+;
+
+static const PackedCmd StdCmds2[8] = {
+	{0x0041000000000000ULL,0LL},
+	{0x0031000000000000ULL,0LL},
+	{0x0096000000000000ULL,10LL},
+	{0x00960000000003f2ULL,20LL},
+	{0x00710000000003f2ULL,4LL},
+	{0x0071000000000424ULL,0LL},
+	{0x00970000000005e6ULL,20LL},
+	{0x00970000000186dcULL,10LL},
+};
+
+static const char StdText3[] =			//test_spot_trig_in
+	"C\n"
+	"AV,0,4,0\n"
+	"AV,0,3,0\n"
+	"AS,0,9,10\n"
+	"AU,10,7,0\n"
+	"AS,1010,9,20\n"
+	"AV,1010,7,4\n"
+	"AV,1060,7,0\n"
+	"AE,1510,9,20\n"
+	"AE,100060,9,10\n"
+;
+
+static const PackedCmd StdCmds3[9] = {
+	{0x0041000000000000ULL,0LL},
+	{0x0031000000000000ULL,0LL},
+	{0x0096000000000000ULL,10LL},
+	{0x007800000000000aULL,0LL},
+	{0x00960000000003f2ULL,20LL},
+	{0x00710000000003f2ULL,4LL},
+	{0x0071000000000424ULL,0LL},
+	{0x00970000000005e6ULL,20LL},
+	{0x00970000000186dcULL,10LL},
+};
+
+static const char StdText4[] =			//test_grid_5x5
+	"C\n"
+	"AS,0,9,1\n"
+	"AV,0,4,13421772800\n"
+	"AV,0,3,-13421772800\n"
+	"AS,10,9,5\n"
+	"AS,10,9,5\n"
+	"AS,1010,9,5\n"
+	"AV,1010,7,4\n"
+	"AV,1110,7,0\n"
+	"AE,3010,9,5\n"
+	"AR,200010,4,-6710886400\n"
+	"AE,200010,9,5\n"
+	"AR,1000010,3,6710886400\n"
+	"AR,1000010,4,33554432000\n"
+	"AE,1000010,9,5\n"
+	"AE,5000060,9,1\n"
+;
+
+static const PackedCmd StdCmds4[15] = {
+	{0x0096000000000000ULL,1LL},
+	{0x0041000000000000ULL,13421772800LL},
+	{0x0031000000000000ULL,-13421772800LL},
+	{0x009600000000000aULL,5LL},
+	{0x009600000000000aULL,5LL},
+	{0x00960000000003f2ULL,5LL},
+	{0x00710000000003f2ULL,4LL},
+	{0x0071000000000456ULL,0LL},
+	{0x0097000000000bc2ULL,5LL},
+	{0x0042000000030d4aULL,-6710886400LL},
+	{0x0097000000030d4aULL,5LL},
+	{0x00320000000f424aULL,6710886400LL},
+	{0x00420000000f424aULL,33554432000LL},
+	{0x00970000000f424aULL,5LL},
+	{0x00970000004c4b7cULL,1LL},
+};
+
+static const char StdText5[] =			//test_grid_5x5_out
+	"C\n"
+	"AS,0,9,1\n"
+	"AV,0,4,13421772800\n"
+	"AV,0,3,-13421772800\n"
+	"AS,10,9,5\n"
+	"AS,10,9,5\n"
+	"AV,10,7,2\n"
+	"AV,20,7,0\n"
+	"AS,1010,9,5\n"
+	"AV,1010,7,4\n"
+	"AV,1110,7,0\n"
+	"AE,3010,9,5\n"
+	"AR,200010,4,-6710886400\n"
+	"AE,200010,9,5\n"
+	"AR,1000010,3,6710886400\n"
+	"AR,1000010,4,33554432000\n"
+	"AE,1000010,9,5\n"
+	"AE,5000060,9,1\n"
+;
+
+static const PackedCmd StdCmds5[17] = {
+	{0x0096000000000000ULL,1LL},
+	{0x0041000000000000ULL,13421772800LL},
+	{0x0031000000000000ULL,-13421772800LL},
+	{0x009600000000000aULL,5LL},
+	{0x009600000000000aULL,5LL},
+	{0x007100000000000aULL,2LL},
+	{0x0071000000000014ULL,0LL},
+	{0x00960000000003f2ULL,5LL},
+	{0x00710000000003f2ULL,4LL},
+	{0x0071000000000456ULL,0LL},
+	{0x0097000000000bc2ULL,5LL},
+	{0x0042000000030d4aULL,-6710886400LL},
+	{0x0097000000030d4aULL,5LL},
+	{0x00320000000f424aULL,6710886400LL},
+	{0x00420000000f424aULL,33554432000LL},
+	{0x00970000000f424aULL,5LL},
+	{0x00970000004c4b7cULL,1LL},
+};
+
+static const char StdText6[] =			//test_rapid_grid_16
+	"C\n"
+	"AS,0,9,1\n"
+	"AV,0,4,26843545600\n"
+	"AV,0,3,-26843545600\n"
+	"AS,10,9,16\n"
+	"AS,10,9,16\n"
+	"AV,30,7,4\n"
+	"AV,50,7,0\n"
+	"AR,110,4,3355443200\n"
+	"AE,110,9,16\n"
+	"AR,1610,3,-3355443200\n"
+	"AR,1610,4,-53687091200\n"
+	"AE,1610,9,16\n"
+	"AE,100060,9,1\n"
+;
+
+static const PackedCmd StdCmds6[13] = {
+	{0x0096000000000000ULL,1LL},
+	{0x0041000000000000ULL,26843545600LL},
+	{0x0031000000000000ULL,-26843545600LL},
+	{0x009600000000000aULL,16LL},
+	{0x009600000000000aULL,16LL},
+	{0x007100000000001eULL,4LL},
+	{0x0071000000000032ULL,0LL},
+	{0x004200000000006eULL,3355443200LL},
+	{0x009700000000006eULL,16LL},
+	{0x003200000000064aULL,-3355443200LL},
+	{0x004200000000064aULL,-53687091200LL},
+	{0x009700000000064aULL,16LL},
+	{0x00970000000186dcULL,1LL},
+};
+
+static const StdProtocol StdProtocols[7] = {
+	{"calib_center",StdText0,94,StdCmds0,8,0x2d8843b60e010177ULL},
+	{"calib_grid_3x3",StdText1,238,StdCmds1,15,0x832d462e6fa70bd4ULL},
+	{"test_spot_train",StdText2,95,StdCmds2,8,0x6b107a0342247de2ULL},
+	{"test_spot_trig_in",StdText3,105,StdCmds3,9,0x6ad0ce4b567b1a5eULL},
+	{"test_grid_5x5",StdText4,235,StdCmds4,15,0xba72a4986ff54222ULL},
+	{"test_grid_5x5_out",StdText5,255,StdCmds5,17,0xfa649b5ee19cddebULL},
+	{"test_rapid_grid_16",StdText6,196,StdCmds6,13,0xed621e670dd48000ULL},
+};
+
+EXPORT const StdProtocol* stdProtocols(uint32_t* pCount){
+	*pCount = sizeof(StdProtocols)/sizeof(StdProtocols[0]);
+	return StdProtocols;
+}
+
+EXPORT const StdProtocol* findStdProtocol(const char* Name){
+	size_t k;
+	for(k = 0; k < sizeof(StdProtocols)/sizeof(StdProtocols[0]); k++){
+		if(strcmp(StdProtocols[k].Name,Name) == 0){
+			return &StdProtocols[k];
+		}
+	}
+	return NULL;
+}